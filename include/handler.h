@@ -151,6 +151,8 @@ void ndmpd_mover_connect_v4(ndmp_connection_t *connection, void *body);
 void ndmpd_write_eom(int fd);
 int ndmpd_local_write(ndmpd_session_t *session, char *data, u_long length);
 int ndmpd_remote_write(ndmpd_session_t *session, char *data, u_long length);
+long ndmpd_remote_sendfile(ndmpd_session_t *session, int fd, off_t offset,
+    u_long length);
 int ndmpd_local_read(ndmpd_session_t *session, char *data, u_long length);
 int ndmpd_mover_init(ndmpd_session_t *session);
 void ndmpd_mover_shut_down(ndmpd_session_t *session);
@@ -167,5 +169,10 @@ int ndmpd_mover_error_send_v4(ndmpd_session_t *session, ndmp_mover_halt_reason r
 void ndmpd_mover_error(ndmpd_session_t *session, ndmp_mover_halt_reason reason);
 int ndmpd_local_write_v3(ndmpd_session_t *session, char *data, u_long length);
 int ndmpd_local_read_v3(ndmpd_session_t *session, char *data, u_long length);;
+int ndmpd_local_seek_v3(ndmpd_session_t *session, u_longlong_t offset,
+    u_longlong_t length);
+bool_t ndmpd_local_tape_enabled(void);
+int ndmpd_local_tape_open(ndmpd_session_t *session, bool_t write);
+void ndmpd_local_tape_close(ndmpd_session_t *session);
 int ndmpd_remote_read_v3(ndmpd_session_t *session, char *data, u_long length);
 #endif	/* !_HANDLER_H_ */
@@ -84,6 +84,9 @@
 
 #define	INT_MAXCMD	12
 
+#define	NDMPD_MAX_WORKERS	256	/* upper bound of session-workers */
+#define	NDMPD_WORKER_SESSIONS	1000	/* sessions of a worker process */
+
 #define KB	1024
 
 // FIXME: check on this value later.
@@ -309,6 +312,9 @@ typedef struct ndmp_chkpnt_vol {
 extern int ndmp_connect_list_add(ndmp_connection_t *connection, int *id);
 extern int ndmp_connect_list_del(ndmp_connection_t *connection);
 
+/* set once a data thread is started, see ndmpd_session_worker */
+extern bool_t ndmpd_data_started;
+
 /* define a print log function */
 void ndmpd_log(int level, const char *fmt,...);
 
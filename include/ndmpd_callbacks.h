@@ -75,12 +75,14 @@ typedef int ndmpd_file_history_dir_func_t(void *, char *, u_long,	u_long);
 typedef int ndmpd_file_history_node_func_t(void *, u_long, struct stat *,	u_longlong_t);
 typedef int ndmpd_seek_func_t(void *, u_longlong_t, u_longlong_t);
 typedef int ndmpd_read_func_t(void *, char *, u_long);
+typedef long ndmpd_sendfile_func_t(void *, int, off_t, u_long);
 typedef int ndmpd_file_recovered_func_t(void *, char *, int);
 
 void ndmpd_api_done_v3(void *cookie, int err);
 int ndmpd_api_log_v3(void *cookie, ndmp_log_type type, u_long msg_id, char *format, ...);
 int ndmpd_api_write_v3(void *client_data, char *data, u_long length);
 int ndmpd_api_read_v3(void *client_data, char *data, u_long length);
+long ndmpd_api_sendfile_v3(void *client_data, int fd, off_t offset, u_long length);
 void *ndmpd_api_get_name_v3(void *cookie, u_long name_index);
 int ndmpd_api_file_recovered_v3(void *cookie, char *name, int error);
 int ndmpd_api_seek_v3(void *cookie, u_longlong_t offset, u_longlong_t length);
@@ -56,7 +56,8 @@ void ndmpd_file_history_cleanup(ndmpd_session_t *session, bool_t send_flag);
 
 int ndmpd_fhpath_v3_cb(lbr_fhlog_call_backs_t *cbp, char *path,
 	struct stat *stp,u_longlong_t off);
-int ndmpd_fhdir_v3_cb(lbr_fhlog_call_backs_t *cbp, char *dir, struct stat *stp);
+int ndmpd_fhdir_v3_cb(lbr_fhlog_call_backs_t *cbp, char *dir, struct stat *stp,
+	fst_dirent_t *ents, int nents);
 int ndmpd_fhnode_v3_cb(lbr_fhlog_call_backs_t *cbp, char *dir, char *file,
 	struct stat *stp, u_longlong_t off);
 int ndmpd_path_restored_v3(lbr_fhlog_call_backs_t *cbp, char *name,
@@ -60,6 +60,10 @@ int  ndmp_send_request(ndmp_connection_t *connection_handle,
 	ndmp_message message,ndmp_error err, void *request_data, void **reply);
 int  ndmp_send_request_lock(ndmp_connection_t *connection_handle, ndmp_message message,
 	ndmp_error err, void *request_data, void **reply);
+/* record mark and message header in front of a raw request body */
+#define	NDMP_RAW_HDR_SIZE	(4 + 6 * 4)
+int  ndmp_send_request_raw(ndmp_connection_t *connection_handle,
+	ndmp_message message, char *buf, u_int len);
 int  ndmp_recv_msg(ndmp_connection_t *connection);
 int ndmp_process_messages(ndmp_connection_t *connection, bool_t reply_expected);
 void *ndmp_malloc(size_t size);
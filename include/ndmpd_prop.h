@@ -113,6 +113,26 @@ typedef enum {
 	NDMP_BACKUP_QTN,
 	NDMP_RESTORE_QTN,
 	NDMP_OVERWRITE_QTN,
+	/* Number of rotating buffers between the tar and the mover. */
+	NDMP_TAPE_BUFFERS,
+	/* Number of threads scanning the file system during backup. */
+	NDMP_SCAN_THREADS,
+	/* Directory of the file history spill file. */
+	NDMP_FH_SPILL_PATH,
+	/* Number of threads writing the files during restore. */
+	NDMP_RESTORE_THREADS,
+	/* Write the large restored files with O_DIRECT. */
+	NDMP_RESTORE_DIRECT_IO,
+	/* Set the attributes of the restored files after their data. */
+	NDMP_RESTORE_DEFER_ATTRS,
+	/* File holding the tape of the local mover. */
+	NDMP_LOCAL_TAPE,
+	/* Number of pre-forked processes serving the sessions. */
+	NDMP_SESSION_WORKERS,
+	/* Seconds the user and group names stay cached, 0 for ever. */
+	NDMP_ID_CACHE_TTL,
+	/* Send each distinct ACL of a backup once. */
+	NDMP_ACL_DEDUP,
 	NDMP_MAXALL
 } ndmpd_cfg_id_t;
 
@@ -78,6 +78,9 @@ typedef struct {
 	char *bk_dmpnm;
 	char **bk_exl; /* exlude list */
 	char **bk_inc; /* include list */
+	struct tlm_matcher *bk_exl_dirs; /* compiled "d_" exclusions */
+	struct tlm_matcher *bk_exl_files; /* compiled other exclusions */
+	struct tlm_matcher *bk_incm; /* compiled include list */
 } ndmp_backup_params_t;
 
 typedef struct {
@@ -104,6 +107,7 @@ typedef struct ndmpd_file_handler {
 	u_long fh_class;
 	void *fh_cookie;
 	ndmpd_file_handler_func_t *fh_func;
+	bool_t fh_armed;	/* registered with ns_kq */
 	struct ndmpd_file_handler *fh_next;
 } ndmpd_file_handler_t;
 
@@ -149,6 +153,7 @@ typedef struct ndmpd_session_mover_desc {
 	u_long md_r_index;		/* buffer read  index */
 	u_long md_w_index;		/* buffer write index */
 	char *md_buf;		/* data buffer */
+	int md_tape_fd;		/* local mover virtual tape */
 	/*
 	 * V2 fields.
 	 */
@@ -195,6 +200,7 @@ typedef struct ndmpd_module_params {
  	ndmpd_read_func_t *mp_read_func;
  	ndmpd_seek_func_t *mp_seek_func;
  	ndmpd_file_recovered_func_t *mp_file_recovered_func;
+ 	ndmpd_sendfile_func_t *mp_sendfile_func;
  	/*
  	 * NDMP V3 params.
  	 */
@@ -268,21 +274,23 @@ typedef struct ndmpd_session_file_history {
 	u_long fh_dir_name_buf_index;
 } ndmpd_session_file_history_t;
 
+/*
+ * A file history batch being built.  The entries are XDR encoded into
+ * fe_buf as they are added; see ndmpd_fhistory.c.
+ */
+typedef struct ndmpd_fh_enc {
+	char *fe_buf;		/* header room, entry count, entries */
+	u_int fe_size;		/* size of fe_buf */
+	u_int fe_len;		/* bytes used in fe_buf */
+	u_int fe_next;		/* size of the next fe_buf */
+	u_long fe_count;	/* entries in fe_buf */
+} ndmpd_fh_enc_t;
+
 typedef struct ndmpd_session_file_history_v3 {
-	ndmp_file_v3 *fh_files;
-	ndmp_dir_v3 *fh_dirs;
-	ndmp_node_v3 *fh_nodes;
-	ndmp_file_name_v3 *fh_file_names;
-	ndmp_file_name_v3 *fh_dir_names;
-	ndmp_file_stat_v3 *fh_file_stats;
-	ndmp_file_stat_v3 *fh_node_stats;
-	char *fh_file_name_buf;
-	char *fh_dir_name_buf;
-	u_long fh_file_index;
-	u_long fh_dir_index;
-	u_long fh_node_index;
-	u_long fh_file_name_buf_index;
-	u_long fh_dir_name_buf_index;
+	ndmpd_fh_enc_t fh_file;
+	ndmpd_fh_enc_t fh_dir;
+	ndmpd_fh_enc_t fh_node;
+	struct fh_queue *fh_queue;	/* batches waiting to be sent */
 } ndmpd_session_file_history_v3_t;
 
 
@@ -304,6 +312,9 @@ typedef struct ndmp_lbr_params {
 #define	nlp_dmpnm	bk_params.bk_dmpnm
 #define	nlp_exl		bk_params.bk_exl
 #define	nlp_inc		bk_params.bk_inc
+#define	nlp_exl_dirs	bk_params.bk_exl_dirs
+#define	nlp_exl_files	bk_params.bk_exl_files
+#define	nlp_incm	bk_params.bk_incm
 #define	nlp_nfiles	rs_params.rs_nf
 #define	nlp_restore_path	rs_params.rs_path
 #define	nlp_restore_bk_path	rs_params.rs_bkpath
@@ -344,6 +355,7 @@ typedef struct ndmpd_session {
 	ndmpd_session_file_history_t ns_fh;
 
 	ndmpd_file_handler_t *ns_file_handler_list; /* for I/O multiplexing */
+	int ns_kq;		/* kqueue of the file handlers, -1 if none */
 	int ns_nref;
 	ndmp_lbr_params_t *ns_ndmp_lbr_params;
 	mutex_t ns_lock;
@@ -404,9 +416,15 @@ typedef struct {
 #define	MOD_READ(m, b, s) \
 	(*(m)->mp_read_func)((m)->mp_daemon_cookie, b, s)
 
+#define	MOD_SEEK(m, o, l) \
+	(*(m)->mp_seek_func)((m)->mp_daemon_cookie, o, l)
+
 #define	MOD_WRITE(m, b, s) \
 	(*(m)->mp_write_func)((m)->mp_daemon_cookie, b, s)
 
+#define	MOD_SENDFILE(m, f, o, s) \
+	(*(m)->mp_sendfile_func)((m)->mp_daemon_cookie, f, o, s)
+
 #define	MOD_DONE(m, e) \
 	(*(m)->mp_done_func)((m)->mp_daemon_cookie, e)
 
@@ -65,7 +65,4 @@ ndmp_error ndmp_backup_get_params_v3(ndmpd_session_t *session,
 int ndmp_send_recovery_stat_v3(ndmpd_module_params_t *params,
 	ndmp_lbr_params_t *nlp, int idx, int stat);
 
-void setWriteBufDone(tlm_buffers_t *bufs);
-void setReadBufDone(tlm_buffers_t *bufs);
-
 #endif /* _NDMPD_TAR_V3_ */
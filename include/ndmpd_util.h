@@ -71,6 +71,7 @@ extern int ndmp_full_restore_path;
 extern int ndmp_ver;
 
 int ndmpd_select(ndmpd_session_t *session, bool_t block, u_long class_mask);
+void ndmpd_select_cleanup(ndmpd_session_t *session);
 int ndmpd_add_file_handler(ndmpd_session_t *session, void *cookie, int fd,
 		u_long mode, u_long class, ndmpd_file_handler_func_t *func);
 void ndmp_set_socket_nodelay(int);
@@ -106,6 +107,10 @@ void ndmp_session_unref(ndmpd_session_t *session);
 char *ndmp_new_job_name(char *jname);
 int ndmp_get_cur_bk_time(ndmp_lbr_params_t *nlp, time_t *tp, char *jname);
 long ndmp_buffer_get_size(ndmpd_session_t *session);
+int ndmp_buffer_get_count(ndmpd_session_t *session);
+int ndmp_scan_get_threads(ndmpd_session_t *session);
+int ndmp_restore_get_threads(ndmpd_session_t *session);
+int ndmp_session_get_workers(void);
 void ndmpd_get_file_entry_type(int mode, ndmp_file_type *ftype);
 char *ndmp_get_relative_path(char *base, char *fullpath);
 
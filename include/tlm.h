@@ -56,8 +56,10 @@
 #define	IS_SET(f, m) (((f) & (m)) != 0)
 
 #define	TLM_MAX_BACKUP_JOB_NAME	32	/* max size of a job's name */
-//#define	TLM_TAPE_BUFFERS	10	/* number of rotating buffers */
-#define	TLM_TAPE_BUFFERS	1	/* number of rotating buffers */
+#define	TLM_TAPE_BUFFERS	4	/* default number of rotating buffers */
+#define	TLM_MAX_TAPE_BUFFERS	64	/* upper bound of rotating buffers */
+#define	TLM_MAX_SCAN_THREADS	64	/* upper bound of scanner threads */
+#define	TLM_MAX_RESTORE_THREADS	64	/* upper bound of restore writers */
 #define	TLM_LINE_SIZE		128	/* size of text messages */
 
 
@@ -168,6 +170,13 @@ typedef struct	tlm_tar_hdr {
 		} th_dev;
 		char	th_hlink_ino[12];
 	} th_shared;
+	/*
+	 * UFSD_ACL_DEF id of the ACL, if any.  These bytes, at offset
+	 * 345, are the prefix of a POSIX ustar header and the atime of a
+	 * GNU one: other tar readers take a non-zero id for a path prefix
+	 * or an access time.  The field is only set with acl-dedup.
+	 */
+	char	th_aclid[12];
 } tlm_tar_hdr_t;
 
 
@@ -224,6 +233,7 @@ typedef struct	tlm_tar_hdr {
 #define	KILOBYTE	1024
 
 #define	UFSD_ACL	(1)
+#define	UFSD_ACL_DEF	(2)	/* defines the next ACL id, see tlm_acl_intern */
 
 
 /*
@@ -239,6 +249,8 @@ typedef struct sec_attr {
 
 } sec_attr_t;
 
+struct tlm_acl_tab;
+
 typedef struct	tlm_acls {
 	int	acl_checkpointed	: 1,	/* are checkpoints active ? */
 		acl_clear_archive	: 1,	/* clear archive bit ? */
@@ -252,6 +264,10 @@ typedef struct	tlm_acls {
 		 * and reading the file.
 		 */
 	sec_attr_t acl_info;
+	bool_t acl_info_read;		/* acl_info is of this file */
+	int acl_fd;			/* the open file, or -1 */
+	struct tlm_acl_tab *acl_tab;	/* table of acl_id */
+	int acl_id;			/* ACL in acl_tab, 0 if none */
 
 	char acl_root_dir[NAME_MAX]; /* name of root filesystem */
 	fs_fhandle_t acl_dir_fh;		/* parent dir's info */
@@ -289,20 +305,22 @@ typedef struct tm_ops {
 //
 #define	LONGNAME_PREFIX	"././_LoNg_NaMe_"
 /*
- * Node in struct hardlink_q
+ * Slot in struct hardlink_q
  *
- * inode: the inode of the hardlink
+ * dev, inode: the file the hardlink belongs to; dev is 0 during restore
  * path: the name of the hardlink, used during restore
  * offset: tape offset of the data records for the hardlink, used during backup
  * is_tmp: indicate whether the file was created temporarily for restoring
  * other links during a non-DAR partial restore
+ * in_use: the slot holds an entry
  */
 struct hardlink_node {
+	dev_t dev;
 	unsigned long inode;
 	char *path;
 	unsigned long long offset;
 	int is_tmp;
-	SLIST_ENTRY(hardlink_node) next_hardlink;
+	int in_use;
 };
 
 /*
@@ -313,32 +331,44 @@ struct hardlink_node {
  *   (2) data has been backed up
  *
  * When we run into a file with multiple links during backup,
- * we first check the list to see whether a file with the same inode
+ * we first check the table to see whether a file with the same inode
  * has been backed up.  If yes, we backup an empty record, while
  * making the file history of this file contain the data offset
  * of the offset of the file that has been backed up.  If no,
- * we backup this file, and add an entry to the list.
+ * we backup this file, and add an entry to the table.
  *
  * During restore, each node represents an LF_LINK type record whose
  * data has been restored (v.s. a hard link has been created).
  *
  * During restore, when we run into a record of LF_LINK type, we
- * first check the queue to see whether a file with the same inode
+ * first check the table to see whether a file with the same inode
  * has been restored.  If yes, we create a hardlink to it.
- * If no, we restore the data, and add an entry to the list.
+ * If no, we restore the data, and add an entry to the table.
+ *
+ * The nodes live in an open addressing hash table keyed by device
+ * and inode, and the paths are carved out of larger chunks, so that
+ * trees with many multiply linked files do not cost a scan and a
+ * malloc per file.
  */
-/*	we will just create a fake one, we don't need to use this function	*/
+struct hardlink_arena;
+
 struct hardlink_q {
-	struct hardlink_node *slh_first;
+	struct hardlink_node *hq_slots;
+	size_t hq_nslots;		/* a power of 2 */
+	size_t hq_count;		/* slots in use */
+	struct hardlink_arena *hq_arena;	/* path storage */
+	size_t hq_arena_size;		/* bytes allocated for paths */
 };
 
 /* Utility functions from handling hardlink */
 extern struct hardlink_q *hardlink_q_init();
+extern void hardlink_q_reset(struct hardlink_q *qhead);
 extern void hardlink_q_cleanup(struct hardlink_q *qhead);
-extern int hardlink_q_get(struct hardlink_q *qhead, unsigned long inode,
-    unsigned long long *offset, char **path);
-extern int hardlink_q_add(struct hardlink_q *qhead, unsigned long inode,
-    unsigned long long offset, char *path, int is_tmp);
+extern int hardlink_q_get(struct hardlink_q *qhead, dev_t dev,
+    unsigned long inode, unsigned long long *offset, char **path);
+extern int hardlink_q_add(struct hardlink_q *qhead, dev_t dev,
+    unsigned long inode, unsigned long long offset, char *path, int is_tmp);
+extern size_t hardlink_q_memsize(struct hardlink_q *qhead);
 
 /*
  * To prune a directory when traversing it, this return
@@ -401,6 +431,11 @@ typedef void (*ft_log_t)();
  *     logfp	The log function pointer.  This function
  *         	is called to log the messages.
  *         	Default is logf().
+ *
+ *     nthreads	Number of threads reading the directories ahead
+ *         	of the callbacks.  The callbacks are still made
+ *         	from the calling thread, in the same order.
+ *         	0 or 1 means the tree is read by the caller.
  */
 typedef struct fs_traverse {
 	char *ft_path;
@@ -408,17 +443,34 @@ typedef struct fs_traverse {
 	int (*ft_callbk)();
 	void *ft_arg;
 	ft_log_t ft_logfp;
+	int ft_nthreads;
 } fs_traverse_t;
 
 
+/*
+ * A directory entry as read by the walker.  fd_ino is the d_fileno
+ * of the entry, which is what the file history reports.
+ */
+typedef struct fst_dirent {
+	char *fd_name;
+	ino_t fd_ino;
+	unsigned char fd_type;		/* d_type */
+} fst_dirent_t;
+
 /*
  * Traversing Nodes.  For each path and node upon entry this
- * structure is passed to the callback function.
+ * structure is passed to the callback function.  tn_st is the
+ * lstat of the entry taken by the walker; callbacks must use it
+ * rather than stat the path again.  On the path node, tn_ents
+ * holds all the entries of the directory, "." and ".." included,
+ * in readdir order.
  */
 typedef struct fst_node {
 	char *tn_path;
 	fs_fhandle_t *tn_fh;
 	struct stat *tn_st;
+	fst_dirent_t *tn_ents;
+	int tn_nents;
 } fst_node_t;
 
 typedef struct path_list {
@@ -47,6 +47,7 @@
 #include <limits.h>
 #include <sys/stat.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <ndmpd.h>
 #include "tlm.h"
 
@@ -70,12 +71,17 @@ typedef struct	tlm_buffer {
 				/* Header record. */
 	longlong_t tb_file_size;	/* for BACKUP */
 					/* how much of the file is left. */
-	long	tb_full	: 1,
-		tb_eot	: 1,
-		tb_eof	: 1,
-		tb_write_buf_filled,
-		tb_read_buf_read;
+	int	tb_send_fd;		/* for BACKUP */
+	longlong_t tb_send_off;		/* a file section to be sent */
+	longlong_t tb_send_len;		/* after the tb_buffer_spot bytes */
+					/* of this buffer, see */
+					/* tlm_output_file */
+	long	tb_eot	: 1,
+		tb_eof	: 1;
 	int	tb_errno;	/* I/O error values */
+	atomic_int tb_full;	/* handoff between producer and consumer; */
+				/* set last by the producer, cleared last */
+				/* by the consumer */
 } tlm_buffer_t;
 
 /*
@@ -83,19 +89,24 @@ typedef struct	tlm_buffer {
  */
 #define	TLM_BUF_IN_READY	0x00000001
 #define	TLM_BUF_OUT_READY	0x00000002
+#define	TLM_BUF_SHUTDOWN	0x00000004	/* one side has quit */
+#define	TLM_BUF_PAUSE		0x00000008	/* producer asked to pause */
+#define	TLM_BUF_PAUSED		0x00000010	/* producer is paused */
 
 typedef struct	tlm_buffers {
 	int	tbs_ref;	/* number of threads using this */
 	short	tbs_buffer_in;	/* buffer to be filled */
 	short	tbs_buffer_out;	/* buffer to be emptied */
-				/* these are indexes into tlm_buffers */
-	mutex_t	tbs_mtx;
+				/* these are indexes into tlm_buffers, */
+				/* each one owned by a single thread */
+	mutex_t	tbs_mtx;	/* only protects tbs_flags and the cvs */
 	cond_t	tbs_in_cv;
 	cond_t	tbs_out_cv;
 	uint32_t	tbs_flags;
 	long	tbs_data_transfer_size;	/* max size of read/write buffer */
 	longlong_t tbs_offset;
-	tlm_buffer_t tbs_buffer[TLM_TAPE_BUFFERS];
+	int	tbs_count;	/* number of buffers in the ring */
+	tlm_buffer_t *tbs_buffer;	/* ring of tbs_count buffers */
 } tlm_buffers_t;
 
 typedef struct	tlm_cmd {
@@ -108,6 +119,14 @@ typedef struct	tlm_cmd {
 	char	tc_file_name[TLM_MAX_PATH_NAME]; /* name of last file */
 						/* for restore */
 	tlm_buffers_t *tc_buffers; /* reader-writer speedup buffers */
+	/*
+	 * Reads the data stream past the ring while the reader is
+	 * paused, NULL if the restore cannot do that.
+	 */
+	int	(*tc_read_func)(void *, char *, u_long);
+	void	*tc_read_cookie;
+	bool_t	tc_sendfile;	/* backup writer can send file sections */
+	struct tlm_acl_tab *tc_acl_tab;	/* ACLs of the stream, NULL if inline */
 } tlm_cmd_t;
 
 typedef struct	tlm_commands {
@@ -116,6 +135,7 @@ typedef struct	tlm_commands {
 	int	tcs_reader_count;	/* number of active readers */
 	int	tcs_writer_count;	/* number of active writers */
 	int	tcs_error;	/* worker errors */
+	int	tcs_writer_threads;	/* threads writing restored files */
 	char	tcs_message[TLM_LINE_SIZE]; /* worker message back to user */
 	tlm_cmd_t *tcs_command;	/* IPC area between read-write */
 } tlm_commands_t;
@@ -208,7 +228,7 @@ extern tlm_job_stats_t *tlm_ref_job_stats(char *);
 extern void tlm_un_ref_job_stats(char *);
 extern bool_t tlm_is_excluded(char *, char *, char **);
 
-tlm_buffers_t *tlm_allocate_buffers(bool_t, long);
+tlm_buffers_t *tlm_allocate_buffers(bool_t, long, int);
 tlm_buffer_t *tlm_buffer_advance_in_idx(tlm_buffers_t *);
 tlm_buffer_t *tlm_buffer_advance_out_idx(tlm_buffers_t *);
 tlm_buffer_t *tlm_buffer_in_buf(tlm_buffers_t *, int *);
@@ -218,13 +238,18 @@ void tlm_buffer_release_in_buf(tlm_buffers_t *);
 void tlm_buffer_release_out_buf(tlm_buffers_t *);
 void tlm_buffer_in_buf_wait(tlm_buffers_t *);
 void tlm_buffer_out_buf_wait(tlm_buffers_t *);
-void tlm_buffer_in_buf_timed_wait(tlm_buffers_t *, unsigned);
-void tlm_buffer_out_buf_timed_wait(tlm_buffers_t *, unsigned);
+void tlm_buffer_shutdown(tlm_buffers_t *);
+bool_t tlm_buffer_has_data(tlm_buffers_t *);
+void tlm_buffer_pause(tlm_buffers_t *);
+void tlm_buffer_resume(tlm_buffers_t *);
+bool_t tlm_buffer_paused(tlm_buffers_t *);
+bool_t tlm_buffer_pause_wait(tlm_buffers_t *);
+bool_t tlm_buffer_drained(tlm_buffers_t *);
 char *tlm_get_write_buffer(long, long *, tlm_buffers_t *, int);
 char *tlm_get_read_buffer(int, int *, tlm_buffers_t *, int *);
 
 void tlm_release_buffers(tlm_buffers_t *);
-tlm_cmd_t *tlm_create_reader_writer_ipc(bool_t, long);
+tlm_cmd_t *tlm_create_reader_writer_ipc(bool_t, long, int);
 void tlm_release_reader_writer_ipc(tlm_cmd_t *);
 
 void tlm_cmd_wait(tlm_cmd_t *cmd, uint32_t event_type);
@@ -238,7 +263,9 @@ typedef int (*path_hist_func_t)(lbr_fhlog_call_backs_t *,
 
 typedef int (*dir_hist_func_t)(lbr_fhlog_call_backs_t *,
     char *,
-    struct stat *);
+    struct stat *,
+    fst_dirent_t *,
+    int);
 
 typedef int (*node_hist_func_t)(lbr_fhlog_call_backs_t *,
     char *,
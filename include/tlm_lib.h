@@ -48,13 +48,14 @@ void tlm_unget_read_buffer(tlm_buffers_t *buffers, int size);
 void tlm_unget_write_buffer(tlm_buffers_t *buffers, int size);
 void tlm_build_header_checksum(tlm_tar_hdr_t *r);
 int tlm_vfy_tar_checksum(tlm_tar_hdr_t *tar_hdr);
-tlm_cmd_t *tlm_create_reader_writer_ipc(bool_t write, long data_transfer_size);
+tlm_cmd_t *tlm_create_reader_writer_ipc(bool_t write, long data_transfer_size,
+    int count);
 void tlm_release_reader_writer_ipc(tlm_cmd_t *cmd);
 lbr_fhlog_call_backs_t * lbrlog_callbacks_init(void *cookie, 
 		path_hist_func_t log_pname_func, dir_hist_func_t log_dir_func,
 		node_hist_func_t log_node_func);
 void lbrlog_callbacks_done(lbr_fhlog_call_backs_t *p);
-int tlm_log_fhdir(tlm_job_stats_t *job_stats, char *dir, struct stat *stp, fs_fhandle_t *fhp);
+int tlm_log_fhdir(tlm_job_stats_t *job_stats, char *dir, struct stat *stp, fst_dirent_t *ents, int nents);
 int tlm_log_fhnode(tlm_job_stats_t *job_stats, char *dir, char *file,
 		struct stat *stp, u_longlong_t off);
 int tlm_log_fhpath_name(tlm_job_stats_t *job_stats, char *pathname,
@@ -60,6 +60,7 @@ extern "C" {
 #include <ctype.h>
 
 #include <dirent.h>
+#include <sys/acl.h>
 #include <rpc/types.h>
 #include <limits.h>
 
@@ -83,8 +84,40 @@ struct full_dir_info *dup_dir_info(struct full_dir_info *old_dir_info);
 struct full_dir_info *tlm_new_dir_info(struct  fs_fhandle *fhp, char *dir, char *nm);
 int sysattr_rdonly(char *name);
 int sysattr_rw(char *name);
+/*
+ * Entries of one directory, as read by tlm_read_dir.
+ */
+typedef struct tlm_dirbuf {
+	fst_dirent_t *db_ents;
+	int db_nents;
+	int db_max;
+	char *db_names;		/* names of the entries, back to back */
+	size_t db_used;
+	size_t db_size;
+} tlm_dirbuf_t;
+
+#define	TLM_DIRBUF_INIT_ENTS	64
+#define	TLM_DIRBUF_INIT_NAMES	1024
+
+int tlm_read_dir(DIR *, tlm_dirbuf_t *);
+void tlm_free_dirbuf(tlm_dirbuf_t *);
 int traverse_level(fs_traverse_t *ftp, bool_t );
+int traverse_level_mt(fs_traverse_t *ftp, bool_t, int);
 bool_t tlm_is_too_long(int, char *, char *);
+void tlm_id_cache_init(int);
+int tlm_uid_to_name(uid_t, char *, size_t);
+int tlm_gid_to_name(gid_t, char *, size_t);
+int tlm_name_to_uid(const char *, uid_t *);
+int tlm_name_to_gid(const char *, gid_t *);
+struct tlm_acl_tab *tlm_acl_tab_new(void);
+void tlm_acl_tab_free(struct tlm_acl_tab *);
+int tlm_acl_intern(struct tlm_acl_tab *, const char *, int, bool_t *);
+int tlm_acl_define(struct tlm_acl_tab *, int, const char *, int);
+acl_t tlm_acl_get(struct tlm_acl_tab *, int);
+struct tlm_matcher *tlm_matcher_new(void);
+void tlm_matcher_free(struct tlm_matcher *);
+int tlm_matcher_add(struct tlm_matcher *, const char *);
+bool_t tlm_matcher_match(struct tlm_matcher *, const char *);
 
 #ifdef __cplusplus
 }
@@ -55,6 +55,7 @@
 
 #include <signal.h>
 #include <assert.h>
+#include <sys/wait.h>
 
 /* for print log function */
 #include <stdarg.h>
@@ -129,14 +130,141 @@ ndmpd_worker(void *ptarg)
 	(*argp->nw_con_handler_func)(connection);
 
 
+	/* also closes sock */
 	ndmp_destroy_xdr_connection(connection);
 
-	(void) close(sock);
 	free(argp);
-	pthread_exit(NULL);
 	return (NULL);
 }
 
+/*
+ * ndmpd_serve
+ *
+ * Set up an accepted connection and run the handler on it until the
+ * session ends.
+ *
+ * Parameters:
+ *   ns (input) - socket of the connection.
+ *   ipaddr (input) - IP address of the peer.
+ *   con_handler_func (input) - connection handler function.
+ *
+ * Returns:
+ *   void
+ */
+static void
+ndmpd_serve(int ns, unsigned int ipaddr,
+    ndmp_con_handler_func_t con_handler_func)
+{
+	ndmpd_worker_arg_t *argp;
+	int flag = 1;
+
+	ndmpd_log(LOG_DEBUG, "connection fd: %d, got socket, start to process", ns);
+	ndmp_set_socket_nodelay(ns);
+	(void) setsockopt(ns, SOL_SOCKET, SO_KEEPALIVE, &flag,
+	    sizeof (flag));
+
+	if ((argp = ndmp_malloc(sizeof (ndmpd_worker_arg_t))) != NULL) {
+		argp->nw_sock = ns;
+		argp->nw_ipaddr = ipaddr;
+		/*	assign handler function 	*/
+		argp->nw_con_handler_func = con_handler_func;
+		(void) ndmpd_worker(argp);
+	} else
+		(void) close(ns);
+}
+
+/*
+ * ndmpd_session_worker
+ *
+ * Body of a pre-forked worker process.  The workers accept the
+ * connections on the shared listening socket and serve one session
+ * at a time.  The configuration and the caches of the process stay
+ * warm from one session to the next; each session still gets its own
+ * ndmpd_session_t.  A worker exits after NDMPD_WORKER_SESSIONS
+ * sessions and is replaced by the parent.
+ *
+ * Only the sessions that never started a backup or recover are
+ * followed by another one.  The data thread is detached and is not
+ * stopped when the control connection goes: it would keep using the
+ * ndmpd_session_t of connection_handler, which the next session
+ * reuses, and the tar code keeps state in globals and statics
+ * (FORCE_STOP_TRAVEL, hardlink_tmp_idx, the buffers of
+ * is_file_wanted).  So after such a session the worker exits, which
+ * also ends the thread as when a process served a single session.
+ *
+ * Parameters:
+ *   server_socket (input) - listening socket.
+ *   con_handler_func (input) - connection handler function.
+ *
+ * Returns:
+ *   void
+ */
+static void
+ndmpd_session_worker(int server_socket,
+    ndmp_con_handler_func_t con_handler_func)
+{
+	unsigned int ipaddr;
+	int ns, served;
+
+	for (served = 0; served < NDMPD_WORKER_SESSIONS; served++) {
+		if ((ns = tcp_accept(server_socket, &ipaddr)) < 0) {
+			ndmpd_log(LOG_ERR, "tcp_accept error: %m");
+			break;
+		}
+		ndmpd_serve(ns, ipaddr, con_handler_func);
+		if (ndmpd_data_started) {
+			(void) close(server_socket);
+			_exit(0);
+		}
+	}
+
+	(void) close(server_socket);
+	pthread_exit(NULL);
+}
+
+/*
+ * ndmpd_run_workers
+ *
+ * Fork the worker processes and replace the ones that exit.
+ *
+ * Parameters:
+ *   server_socket (input) - listening socket.
+ *   workers (input) - number of worker processes.
+ *   con_handler_func (input) - connection handler function.
+ *
+ * Returns:
+ *   never returns
+ */
+static void
+ndmpd_run_workers(int server_socket, int workers,
+    ndmp_con_handler_func_t con_handler_func)
+{
+	pid_t pid;
+	int alive = 0;
+
+	ndmpd_log(LOG_DEBUG, "starting %d session workers", workers);
+
+	for (;;) {
+		while (alive < workers) {
+			if ((pid = fork()) < 0) {
+				ndmpd_log(LOG_ERR, "fork error: %m");
+				break;
+			}
+			if (pid == 0)
+				ndmpd_session_worker(server_socket,
+				    con_handler_func);
+			alive++;
+		}
+
+		if ((pid = wait(NULL)) > 0)
+			alive--;
+		else if (errno == ECHILD)
+			alive = 0;
+		else if (errno != EINTR)
+			(void) sleep(1);
+	}
+}
+
 
 /*
  * Creates a socket for listening and accepting connections
@@ -156,10 +284,9 @@ ndmp_run(u_long port, ndmp_con_handler_func_t con_handler_func)
 	int ns;
 	int on;
 	int server_socket;
+	int workers;
 	unsigned int ipaddr;
 	struct sockaddr_in sin;
-	int flag = 1;
-	ndmpd_worker_arg_t *argp;
 	char *listenIP;
 
 	(void) memset((void *) &sin, 0, sizeof (sin));
@@ -194,7 +321,10 @@ ndmp_run(u_long port, ndmp_con_handler_func_t con_handler_func)
 		(void) close(server_socket);
 		return (-1);
 	}
-	
+
+	if ((workers = ndmp_session_get_workers()) > 0)
+		ndmpd_run_workers(server_socket, workers, con_handler_func);
+
 	signal(SIGCHLD, SIG_IGN); // <-- ignore child fate, don't let it become zombie
 	pid_t childPID;
 	for (;;) {
@@ -213,22 +343,10 @@ ndmp_run(u_long port, ndmp_con_handler_func_t con_handler_func)
 		{
 			if(childPID == 0) {
 				close(server_socket);
-
-				ndmpd_log(LOG_DEBUG, "connection fd: %d, got socket, start to process", ns);
-				ndmp_set_socket_nodelay(ns);
-				(void) setsockopt(ns, SOL_SOCKET, SO_KEEPALIVE, &flag,
-					sizeof (flag));
-
-				if ((argp = ndmp_malloc(sizeof (ndmpd_worker_arg_t))) != NULL) {
-					argp->nw_sock = ns;
-					argp->nw_ipaddr = ipaddr;
-					/*	assign handler function 	*/
-					argp->nw_con_handler_func = con_handler_func;
-					ndmpd_worker(argp);
-				}
-				else
-					close(ns);
+				ndmpd_serve(ns, ipaddr, con_handler_func);
+				pthread_exit(NULL);
 			}
+			close(ns);
 		}
 	}/* end of listening */
 	return 0;
@@ -267,6 +385,7 @@ connection_handler(ndmp_connection_t *connection)
 	 */
 	session.ns_protocol_version = ndmp_ver;
 	session.ns_file_handler_list = 0;
+	session.ns_kq = -1;
 
 	// no malloc inside
 	(void) ndmpd_data_init(&session);
@@ -350,6 +469,7 @@ connection_handler(ndmp_connection_t *connection)
 	ndmpd_log(LOG_DEBUG, "Connection terminated");
 
 	(void) ndmpd_remove_file_handler(&session, connection_fd);
+	ndmpd_select_cleanup(&session);
 
 	ndmpd_mover_shut_down(&session);
 	ndmp_lbr_cleanup(&session);
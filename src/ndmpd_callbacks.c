@@ -192,6 +192,39 @@ ndmpd_api_write_v3(void *client_data, char *data, u_long length)
 		return (ndmpd_remote_write(session, data, length));
 }
 
+/*
+ * ndmpd_api_sendfile_v3
+ *
+ * Callback function called by the backup/recover module.
+ * Writes a piece of a file to the data connection without copying it
+ * through the module buffers.  Only a remote mover can take it.
+ *
+ * Parameters:
+ *   client_data (input) - session pointer.
+ *   fd         (input) - file to be sent.
+ *   offset     (input) - where in the file to start.
+ *   length     (input) - data length.
+ *
+ * Returns:
+ *   number of bytes sent, less than length if the file got shorter.
+ *  -1 - error.
+ */
+long
+ndmpd_api_sendfile_v3(void *client_data, int fd, off_t offset, u_long length)
+{
+	ndmpd_session_t *session = (ndmpd_session_t *)client_data;
+
+	if (session == NULL) {
+		ndmpd_log(LOG_DEBUG, "ndmpd_api_sendfile_v3 session == NULL");
+		return (-1);
+	}
+
+	if (session->ns_data.dd_data_addr.addr_type != NDMP_ADDR_TCP)
+		return (-1);
+
+	return (ndmpd_remote_sendfile(session, fd, offset, length));
+}
+
 /*
  * ndmpd_api_read_v3
  *
@@ -321,7 +354,39 @@ ndmpd_api_file_recovered_v3(void *cookie, char *name, int error)
 int
 ndmpd_api_seek_v3(void *cookie, u_longlong_t offset, u_longlong_t length)
 {
-	return 0;
+	ndmpd_session_t *session = (ndmpd_session_t *)cookie;
+	ndmp_notify_data_read_request request;
+
+	if (session == NULL)
+		return (-1);
+
+	if (session->ns_data.dd_data_addr.addr_type == NDMP_ADDR_LOCAL)
+		return (ndmpd_local_seek_v3(session, offset, length));
+
+	/*
+	 * What is left of the previous window is still coming, it has to
+	 * be read and thrown away before the data of the new one.
+	 */
+	session->ns_data.dd_discard_length +=
+	    session->ns_data.dd_bytes_left_to_read;
+	session->ns_data.dd_bytes_left_to_read = length;
+	session->ns_data.dd_read_offset = offset;
+	session->ns_data.dd_read_length = length;
+	session->ns_data.dd_position = offset;
+
+	request.offset = long_long_to_quad(offset);
+	request.length = long_long_to_quad(length);
+
+	ndmpd_log(LOG_DEBUG, "to NOTIFY_DATA_READ [%llu, %llu]",
+	    offset, length);
+
+	if (ndmp_send_request_lock(session->ns_connection,
+	    NDMP_NOTIFY_DATA_READ, NDMP_NO_ERR, &request, 0) < 0) {
+		ndmpd_log(LOG_DEBUG, "Sending notify_data_read request");
+		return (-1);
+	}
+
+	return (0);
 }
 
 /*
@@ -49,6 +49,12 @@
 #include <ndmpd_fhistory.h>
 #include <ndmpd_tar_v3.h>
 
+/*
+ * Set once this process has started a backup or recover thread.  The
+ * thread is detached and may outlive the session that started it.
+ */
+bool_t ndmpd_data_started = FALSE;
+
 /*
  * ************************************************************************
  * NDMP V3 HANDLERS
@@ -436,9 +442,16 @@ ndmpd_data_connect_v3(ndmp_connection_t *connection, void *body)
 	case NDMP_ADDR_LOCAL:
 		/*
 		 * Verify that the mover is listening for a
-		 * local connection
+		 * local connection, or that the local mover
+		 * is idle and has a virtual tape to use.
 		 */
-		if (session->ns_mover.md_state != NDMP_MOVER_STATE_LISTEN ||
+		if (ndmpd_local_tape_enabled() &&
+		    session->ns_mover.md_state == NDMP_MOVER_STATE_IDLE) {
+			session->ns_mover.md_state = NDMP_MOVER_STATE_ACTIVE;
+			session->ns_data.dd_data_addr.addr_type =
+			    NDMP_ADDR_LOCAL;
+		} else if (session->ns_mover.md_state !=
+		    NDMP_MOVER_STATE_LISTEN ||
 		    session->ns_mover.md_listen_sock != -1) {
 			reply.error = NDMP_ILLEGAL_STATE_ERR;
 			ndmpd_log(LOG_ERR,
@@ -621,9 +634,16 @@ ndmpd_data_connect_v4(ndmp_connection_t *connection, void *body)
 	case NDMP_ADDR_LOCAL:
 		/*
 		 * Verify that the mover is listening for a
-		 * local connection
+		 * local connection, or that the local mover
+		 * is idle and has a virtual tape to use.
 		 */
-		if (session->ns_mover.md_state != NDMP_MOVER_STATE_LISTEN ||
+		if (ndmpd_local_tape_enabled() &&
+		    session->ns_mover.md_state == NDMP_MOVER_STATE_IDLE) {
+			session->ns_mover.md_state = NDMP_MOVER_STATE_ACTIVE;
+			session->ns_data.dd_data_addr.addr_type =
+			    NDMP_ADDR_LOCAL;
+		} else if (session->ns_mover.md_state !=
+		    NDMP_MOVER_STATE_LISTEN ||
 		    session->ns_mover.md_listen_sock != -1) {
 			reply.error = NDMP_ILLEGAL_STATE_ERR;
 			ndmpd_log(LOG_ERR,
@@ -888,8 +908,10 @@ ndmpd_data_error(ndmpd_session_t *session, ndmp_data_halt_reason reason)
 			(void) close(session->ns_data.dd_listen_sock);
 			session->ns_data.dd_listen_sock = -1;
 		}
-	} else
+	} else {
+		ndmpd_local_tape_close(session);
 		ndmpd_mover_error(session, NDMP_MOVER_HALT_CONNECT_CLOSED);
+	}
 }
 
 /*
@@ -1055,7 +1077,8 @@ start_backup_v3(ndmpd_session_t *session, char *bu_type, ndmp_pval *env_val,
 		return (NDMP_ILLEGAL_STATE_ERR);
 	}
 
-	if (session->ns_data.dd_data_addr.addr_type == NDMP_ADDR_LOCAL) {
+	if (session->ns_data.dd_data_addr.addr_type == NDMP_ADDR_LOCAL &&
+	    ndmpd_local_tape_open(session, TRUE) < 0) {
 		return (NDMP_NO_DEVICE_ERR);
 	}
 
@@ -1095,6 +1118,7 @@ start_backup_v3(ndmpd_session_t *session, char *bu_type, ndmp_pval *env_val,
 	params->mp_add_file_handler_func = ndmpd_api_add_file_handler;
 	params->mp_remove_file_handler_func = ndmpd_api_remove_file_handler;
 	params->mp_write_func = ndmpd_api_write_v3;
+	params->mp_sendfile_func = ndmpd_api_sendfile_v3;
 
 	params->mp_read_func = 0;
 
@@ -1156,6 +1180,7 @@ start_backup_v3(ndmpd_session_t *session, char *bu_type, ndmp_pval *env_val,
 	}
 	pthread_attr_t tattr;
 	pthread_t thread;
+	ndmpd_data_started = TRUE;
 	(void) pthread_attr_init(&tattr);
 	(void) pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
 	err = pthread_create(&thread, &tattr,
@@ -1203,6 +1228,11 @@ start_recover_v3(ndmpd_session_t *session, char *bu_type, ndmp_pval *env_val,
 		return (NDMP_ILLEGAL_STATE_ERR);
 	}
 
+	if (session->ns_data.dd_data_addr.addr_type == NDMP_ADDR_LOCAL &&
+	    ndmpd_local_tape_open(session, FALSE) < 0) {
+		return (NDMP_NO_DEVICE_ERR);
+	}
+
 	if (strcmp(bu_type, NDMP_DUMP_TYPE) != 0 &&
 	    strcmp(bu_type, NDMP_TAR_TYPE) != 0) {
 		ndmpd_log(LOG_ERR, "Invalid backup type: %s.", bu_type);
@@ -1296,6 +1326,7 @@ start_recover_v3(ndmpd_session_t *session, char *bu_type, ndmp_pval *env_val,
 	pthread_attr_t tattr;
 	pthread_t thread;
 
+	ndmpd_data_started = TRUE;
 	(void) pthread_attr_init(&tattr);
 	(void) pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_DETACHED);
 	err = pthread_create(&thread, &tattr,
@@ -1417,6 +1448,7 @@ ndmpd_data_cleanup(ndmpd_session_t *session)
 		session->ns_data.dd_sock = -1;
 	}
 
+	ndmpd_local_tape_close(session);
 	ndmpd_free_tcp(session);
 	ndmpd_free_env(session);
 	ndmpd_free_nlist(session);
@@ -43,8 +43,10 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <ndmpd.h>
 #include <dirent.h>
 
@@ -54,17 +56,37 @@
 #include <ndmpd_util.h>
 #include <ndmpd_func.h>
 #include <ndmpd_fhistory.h>
+#include <ndmpd_prop.h>
 
-#define	N_PATH_ENTRIES	1000
-#define	N_FILE_ENTRIES	N_PATH_ENTRIES
-#define	N_DIR_ENTRIES	1000
-#define	N_NODE_ENTRIES	1000
-
-/* Figure an average of 32 bytes per path name */
-#define	PATH_NAMEBUF_SIZE	(N_PATH_ENTRIES * 32)
-
-/* Figure an average of 16 bytes per file name */
-#define	DIR_NAMEBUF_SIZE	(N_PATH_ENTRIES * 16)
+/*
+ * File history entries are XDR encoded straight into a batch buffer as
+ * they are added, with room left in front for the record mark and the
+ * message header, so a full batch goes to the socket as it is.  The
+ * first batch of each kind is FH_BATCH_MIN bytes long; every time one
+ * fills up the next one is twice as large, up to FH_BATCH_MAX.  Short
+ * backups thus get their history out early and long ones send few,
+ * large messages.
+ */
+#define	FH_BATCH_MIN	(32 * 1024)
+#define	FH_BATCH_MAX	(1024 * 1024)
+
+/* the entries start after the header room and the entry count */
+#define	FH_ENC_START	(NDMP_RAW_HDR_SIZE + BYTES_PER_XDR_UNIT)
+
+/* encoded sizes of the parts of an entry */
+#define	FH_QUAD_SIZE		(2 * BYTES_PER_XDR_UNIT)
+#define	FH_STAT_SIZE		(10 * BYTES_PER_XDR_UNIT + FH_QUAD_SIZE)
+#define	FH_NAME_SIZE(len)	(2 * BYTES_PER_XDR_UNIT + RNDUP(len))
+
+/* ndmp_file_v3: one name, one stat, node and fh_info */
+#define	FH_FILE_SIZE(len)	(2 * BYTES_PER_XDR_UNIT + FH_NAME_SIZE(len) + \
+				    FH_STAT_SIZE + 2 * FH_QUAD_SIZE)
+/* ndmp_dir_v3: one name, node and parent */
+#define	FH_DIR_SIZE(len)	(BYTES_PER_XDR_UNIT + FH_NAME_SIZE(len) + \
+				    2 * FH_QUAD_SIZE)
+/* ndmp_node_v3: one stat, node and fh_info */
+#define	FH_NODE_SIZE		(BYTES_PER_XDR_UNIT + FH_STAT_SIZE + \
+				    2 * FH_QUAD_SIZE)
 
 static void ndmpd_file_history_cleanup_v3(ndmpd_session_t *session,
     bool_t send_flag);
@@ -91,6 +113,528 @@ rootfs_dot_or_dotdot(char *name)
 	return (FALSE);
 }
 
+/*
+ * File history batches are handed to a sender thread instead of being
+ * written to the control connection by the backup thread, so that a
+ * slow DMA does not hold up the data stream.  Up to FH_QUEUE_DEPTH
+ * batches are kept in memory.  Past that, batches are appended to a
+ * spill file, which the sender reads back once the memory queue is
+ * empty, so the batches are sent in the order they were made.
+ */
+#define	FH_QUEUE_DEPTH	32
+
+typedef struct fh_batch {
+	ndmp_message fb_msg;
+	char *fb_buf;		/* NDMP_RAW_HDR_SIZE bytes, then the body */
+	u_int fb_len;		/* length of the encoded body */
+	struct fh_batch *fb_next;
+} fh_batch_t;
+
+/*
+ * Header of a batch in the spill file.
+ */
+typedef struct fh_spill_hdr {
+	uint32_t fs_msg;
+	uint32_t fs_len;
+} fh_spill_hdr_t;
+
+typedef struct fh_queue {
+	ndmpd_session_t *fq_session;
+	mutex_t fq_mtx;
+	cond_t fq_cv;
+	fh_batch_t *fq_head;
+	fh_batch_t *fq_tail;
+	int fq_count;		/* batches in memory */
+	int fq_spill_fd;
+	off_t fq_spill_rd;	/* next batch to be read back */
+	off_t fq_spill_wr;	/* end of the spill file */
+	bool_t fq_done;		/* no more batches will be queued */
+	bool_t fq_discard;	/* drop what is left */
+	bool_t fq_error;	/* sending failed */
+	pthread_t fq_thread;
+} fh_queue_t;
+
+/*
+ * fh_batch_free
+ *
+ * Free a batch and its buffer.
+ */
+static void
+fh_batch_free(fh_batch_t *fbp)
+{
+	free(fbp->fb_buf);
+	free(fbp);
+}
+
+/*
+ * fh_spill_open
+ *
+ * Create the spill file.  It is unlinked right away, so it goes away
+ * with the descriptor.
+ */
+static int
+fh_spill_open(void)
+{
+	char path[PATH_MAX];
+	char *dir;
+	int fd;
+
+	if ((dir = ndmpd_get_prop(NDMP_FH_SPILL_PATH)) == NULL || *dir == '\0')
+		dir = "/var/tmp";
+
+	(void) snprintf(path, sizeof (path), "%s/ndmp_fh.XXXXXX", dir);
+	if ((fd = mkstemp(path)) < 0) {
+		ndmpd_log(LOG_ERR, "Cannot create file history spill file "
+		    "in %s: %m", dir);
+		return (-1);
+	}
+	(void) unlink(path);
+
+	return (fd);
+}
+
+/*
+ * fh_spill_write
+ *
+ * Append a batch to the spill file.  The body is already encoded, so
+ * it is written as it is.  Called with fq_mtx held.
+ */
+static int
+fh_spill_write(fh_queue_t *fqp, fh_batch_t *fbp)
+{
+	fh_spill_hdr_t *hp;
+	size_t len;
+
+	if (fqp->fq_spill_fd < 0 && (fqp->fq_spill_fd = fh_spill_open()) < 0)
+		return (-1);
+
+	/* the spill header goes in the room left for the message header */
+	hp = (fh_spill_hdr_t *)(fbp->fb_buf + NDMP_RAW_HDR_SIZE -
+	    sizeof (fh_spill_hdr_t));
+	hp->fs_msg = fbp->fb_msg;
+	hp->fs_len = fbp->fb_len;
+
+	len = sizeof (fh_spill_hdr_t) + fbp->fb_len;
+	if (pwrite(fqp->fq_spill_fd, hp, len, fqp->fq_spill_wr) != len) {
+		ndmpd_log(LOG_ERR, "Cannot write file history spill file: %m");
+		return (-1);
+	}
+	fqp->fq_spill_wr += len;
+
+	return (0);
+}
+
+/*
+ * fh_spill_read
+ *
+ * Read the batch at 'off' back from the spill file.  The size of the
+ * record is returned in 'lenp'.  Only the sender reads the file and
+ * the records before fq_spill_wr are never written again, so this
+ * is called without fq_mtx held.
+ */
+static fh_batch_t *
+fh_spill_read(fh_queue_t *fqp, off_t off, size_t *lenp)
+{
+	fh_spill_hdr_t hdr;
+	fh_batch_t *fbp;
+
+	if (pread(fqp->fq_spill_fd, &hdr, sizeof (hdr), off) != sizeof (hdr)) {
+		ndmpd_log(LOG_ERR, "Cannot read file history spill file: %m");
+		return (NULL);
+	}
+	*lenp = sizeof (hdr) + hdr.fs_len;
+
+	if ((fbp = ndmp_malloc(sizeof (fh_batch_t))) == NULL)
+		return (NULL);
+	if ((fbp->fb_buf = ndmp_malloc(NDMP_RAW_HDR_SIZE + hdr.fs_len)) ==
+	    NULL) {
+		free(fbp);
+		return (NULL);
+	}
+	if (pread(fqp->fq_spill_fd, fbp->fb_buf + NDMP_RAW_HDR_SIZE,
+	    hdr.fs_len, off + sizeof (hdr)) != hdr.fs_len) {
+		ndmpd_log(LOG_ERR, "Cannot read file history spill file: %m");
+		fh_batch_free(fbp);
+		return (NULL);
+	}
+	fbp->fb_msg = hdr.fs_msg;
+	fbp->fb_len = hdr.fs_len;
+
+	return (fbp);
+}
+
+/*
+ * fh_send
+ *
+ * Send a batch to the DMA.
+ */
+static int
+fh_send(ndmpd_session_t *session, fh_batch_t *fbp)
+{
+	if (ndmp_send_request_raw(session->ns_connection, fbp->fb_msg,
+	    fbp->fb_buf, fbp->fb_len) < 0) {
+		ndmpd_log(LOG_DEBUG, "Sending file history message 0x%x",
+		    fbp->fb_msg);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * fh_sender
+ *
+ * The sender thread.  It sends the batches in memory first and then
+ * the spilled ones, until it is told there will be no more.
+ */
+static void *
+fh_sender(void *arg)
+{
+	fh_queue_t *fqp = arg;
+	fh_batch_t *fbp;
+	off_t off;
+	size_t len;
+	int err;
+
+	(void) mutex_lock(&fqp->fq_mtx);
+	for (;;) {
+		while (!fqp->fq_discard && fqp->fq_head == NULL &&
+		    fqp->fq_spill_rd == fqp->fq_spill_wr && !fqp->fq_done)
+			(void) cond_wait(&fqp->fq_cv, &fqp->fq_mtx);
+
+		if (fqp->fq_discard)
+			break;
+
+		if ((fbp = fqp->fq_head) != NULL) {
+			if ((fqp->fq_head = fbp->fb_next) == NULL)
+				fqp->fq_tail = NULL;
+			fqp->fq_count--;
+			(void) cond_broadcast(&fqp->fq_cv);
+		} else if (fqp->fq_spill_rd < fqp->fq_spill_wr) {
+			off = fqp->fq_spill_rd;
+			(void) mutex_unlock(&fqp->fq_mtx);
+			fbp = fh_spill_read(fqp, off, &len);
+			(void) mutex_lock(&fqp->fq_mtx);
+			if (fbp == NULL) {
+				/* the rest of the file cannot be trusted */
+				fqp->fq_error = TRUE;
+				len = fqp->fq_spill_wr - off;
+			}
+
+			fqp->fq_spill_rd += len;
+			if (fqp->fq_spill_rd == fqp->fq_spill_wr) {
+				/* start over at the beginning of the file */
+				(void) ftruncate(fqp->fq_spill_fd, 0);
+				fqp->fq_spill_rd = fqp->fq_spill_wr = 0;
+				(void) cond_broadcast(&fqp->fq_cv);
+			}
+			if (fbp == NULL)
+				continue;
+		} else {
+			/* fq_done and nothing left */
+			break;
+		}
+
+		if (fqp->fq_error) {
+			fh_batch_free(fbp);
+			continue;
+		}
+
+		(void) mutex_unlock(&fqp->fq_mtx);
+		err = fh_send(fqp->fq_session, fbp);
+		fh_batch_free(fbp);
+		(void) mutex_lock(&fqp->fq_mtx);
+		if (err != 0)
+			fqp->fq_error = TRUE;
+	}
+	(void) mutex_unlock(&fqp->fq_mtx);
+
+	return (NULL);
+}
+
+/*
+ * fh_queue_start
+ *
+ * Set up the queue and start the sender thread of the session.
+ */
+static fh_queue_t *
+fh_queue_start(ndmpd_session_t *session)
+{
+	fh_queue_t *fqp;
+
+	if ((fqp = ndmp_malloc(sizeof (fh_queue_t))) == NULL)
+		return (NULL);
+
+	fqp->fq_session = session;
+	fqp->fq_spill_fd = -1;
+	(void) mutex_init(&fqp->fq_mtx, 0, NULL);
+	(void) cond_init(&fqp->fq_cv, 0, NULL);
+
+	if (pthread_create(&fqp->fq_thread, NULL, fh_sender, fqp) != 0) {
+		ndmpd_log(LOG_ERR, "Cannot start file history sender: %m");
+		(void) cond_destroy(&fqp->fq_cv);
+		(void) mutex_destroy(&fqp->fq_mtx);
+		free(fqp);
+		return (NULL);
+	}
+
+	return (fqp);
+}
+
+/*
+ * fh_queue_stop
+ *
+ * Wait for the sender to send all the queued batches, or to drop them
+ * if 'send_flag' is FALSE, and free the queue.
+ */
+static void
+fh_queue_stop(ndmpd_session_t *session, bool_t send_flag)
+{
+	fh_queue_t *fqp;
+	fh_batch_t *fbp;
+
+	if ((fqp = session->ns_fh_v3.fh_queue) == NULL)
+		return;
+
+	(void) mutex_lock(&fqp->fq_mtx);
+	fqp->fq_done = TRUE;
+	if (send_flag == FALSE)
+		fqp->fq_discard = TRUE;
+	(void) cond_broadcast(&fqp->fq_cv);
+	(void) mutex_unlock(&fqp->fq_mtx);
+
+	(void) pthread_join(fqp->fq_thread, NULL);
+
+	while ((fbp = fqp->fq_head) != NULL) {
+		fqp->fq_head = fbp->fb_next;
+		fh_batch_free(fbp);
+	}
+	if (fqp->fq_spill_fd >= 0)
+		(void) close(fqp->fq_spill_fd);
+	(void) cond_destroy(&fqp->fq_cv);
+	(void) mutex_destroy(&fqp->fq_mtx);
+	free(fqp);
+
+	session->ns_fh_v3.fh_queue = NULL;
+}
+
+/*
+ * fh_queue_batch
+ *
+ * Hand a batch over to the sender thread.  The batch belongs to the
+ * queue from now on, whatever the result.
+ */
+static int
+fh_queue_batch(ndmpd_session_t *session, fh_batch_t *fbp)
+{
+	fh_queue_t *fqp;
+	int rv;
+
+	if ((fqp = session->ns_fh_v3.fh_queue) == NULL &&
+	    (fqp = session->ns_fh_v3.fh_queue =
+	    fh_queue_start(session)) == NULL) {
+		/* no sender, do it the old way */
+		rv = fh_send(session, fbp);
+		fh_batch_free(fbp);
+		return (rv);
+	}
+
+	(void) mutex_lock(&fqp->fq_mtx);
+	if (fqp->fq_error) {
+		(void) mutex_unlock(&fqp->fq_mtx);
+		fh_batch_free(fbp);
+		return (-1);
+	}
+
+	/*
+	 * Once something is spilled, everything goes to the spill file
+	 * until the sender has caught up with it, so that the order is
+	 * kept.  If the batch cannot be spilled, wait for room instead.
+	 */
+	if (fqp->fq_count >= FH_QUEUE_DEPTH ||
+	    fqp->fq_spill_rd != fqp->fq_spill_wr) {
+		if (fh_spill_write(fqp, fbp) == 0) {
+			(void) cond_broadcast(&fqp->fq_cv);
+			(void) mutex_unlock(&fqp->fq_mtx);
+			fh_batch_free(fbp);
+			return (0);
+		}
+		while (!fqp->fq_error && (fqp->fq_count >= FH_QUEUE_DEPTH ||
+		    fqp->fq_spill_rd != fqp->fq_spill_wr))
+			(void) cond_wait(&fqp->fq_cv, &fqp->fq_mtx);
+	}
+
+	fbp->fb_next = NULL;
+	if (fqp->fq_tail != NULL)
+		fqp->fq_tail->fb_next = fbp;
+	else
+		fqp->fq_head = fbp;
+	fqp->fq_tail = fbp;
+	fqp->fq_count++;
+	rv = fqp->fq_error ? -1 : 0;
+	(void) cond_broadcast(&fqp->fq_cv);
+	(void) mutex_unlock(&fqp->fq_mtx);
+
+	return (rv);
+}
+
+/*
+ * fh_put_long
+ *
+ * XDR encode an unsigned long at 'p' and return the position after it.
+ */
+static char *
+fh_put_long(char *p, u_long val)
+{
+	uint32_t v;
+
+	v = htonl((uint32_t)val);
+	(void) memcpy(p, &v, sizeof (v));
+
+	return (p + BYTES_PER_XDR_UNIT);
+}
+
+/*
+ * fh_put_quad
+ *
+ * XDR encode an ndmp_u_quad.
+ */
+static char *
+fh_put_quad(char *p, u_longlong_t val)
+{
+	p = fh_put_long(p, (u_long)(val >> 32));
+
+	return (fh_put_long(p, (u_long)val));
+}
+
+/*
+ * fh_put_name
+ *
+ * XDR encode a UNIX ndmp_file_name_v3.
+ */
+static char *
+fh_put_name(char *p, char *name, u_int len)
+{
+	u_int pad;
+
+	p = fh_put_long(p, NDMP_FS_UNIX);
+	p = fh_put_long(p, len);
+	(void) memcpy(p, name, len);
+	p += len;
+	if ((pad = RNDUP(len) - len) != 0) {
+		(void) memset(p, 0, pad);
+		p += pad;
+	}
+
+	return (p);
+}
+
+/*
+ * fh_put_stat
+ *
+ * XDR encode the ndmp_file_stat_v3 of 'st'.
+ */
+static char *
+fh_put_stat(char *p, struct stat *st, u_long fattr)
+{
+	ndmp_file_type ftype;
+
+	ndmpd_get_file_entry_type(st->st_mode, &ftype);
+
+	p = fh_put_long(p, 0);			/* invalid */
+	p = fh_put_long(p, NDMP_FS_UNIX);
+	p = fh_put_long(p, ftype);
+	p = fh_put_long(p, st->st_mtime);
+	p = fh_put_long(p, st->st_atime);
+	p = fh_put_long(p, st->st_ctime);
+	p = fh_put_long(p, st->st_uid);
+	p = fh_put_long(p, st->st_gid);
+	p = fh_put_long(p, fattr);
+	p = fh_put_quad(p, (u_longlong_t)st->st_size);
+
+	return (fh_put_long(p, st->st_nlink));
+}
+
+/*
+ * fh_enc_flush
+ *
+ * Queue the batch being built in 'fep' to be sent as message 'msg'.
+ * If 'grow' is set the batch is full, and the next one is made larger.
+ */
+static int
+fh_enc_flush(ndmpd_session_t *session, ndmpd_fh_enc_t *fep,
+    ndmp_message msg, bool_t grow)
+{
+	fh_batch_t *fbp;
+
+	if (fep->fe_count == 0)
+		return (0);
+
+	ndmpd_log(LOG_DEBUG, "sending %ld entries", fep->fe_count);
+
+	if ((fbp = ndmp_malloc(sizeof (fh_batch_t))) == NULL)
+		return (-1);
+
+	(void) fh_put_long(fep->fe_buf + NDMP_RAW_HDR_SIZE, fep->fe_count);
+	fbp->fb_msg = msg;
+	fbp->fb_buf = fep->fe_buf;
+	fbp->fb_len = fep->fe_len - NDMP_RAW_HDR_SIZE;
+
+	if (grow && fep->fe_size < FH_BATCH_MAX)
+		fep->fe_next = MIN(fep->fe_size * 2, FH_BATCH_MAX);
+	fep->fe_buf = NULL;
+	fep->fe_size = 0;
+	fep->fe_len = 0;
+	fep->fe_count = 0;
+
+	return (fh_queue_batch(session, fbp));
+}
+
+/*
+ * fh_enc_get
+ *
+ * Return where the next entry, 'len' bytes long, is to be encoded in
+ * 'fep'.  A full batch is queued first and a new buffer allocated.
+ */
+static char *
+fh_enc_get(ndmpd_session_t *session, ndmpd_fh_enc_t *fep,
+    ndmp_message msg, u_int len)
+{
+	u_int size;
+
+	if (fep->fe_buf != NULL && fep->fe_len + len > fep->fe_size &&
+	    fh_enc_flush(session, fep, msg, TRUE) < 0)
+		return (NULL);
+
+	if (fep->fe_buf == NULL) {
+		size = fep->fe_next != 0 ? fep->fe_next : FH_BATCH_MIN;
+		if (size < FH_ENC_START + len)
+			size = FH_ENC_START + len;
+		if ((fep->fe_buf = ndmp_malloc(size)) == NULL)
+			return (NULL);
+		fep->fe_size = size;
+		fep->fe_len = FH_ENC_START;
+	}
+
+	return (fep->fe_buf + fep->fe_len);
+}
+
+/*
+ * fh_enc_free
+ *
+ * Drop the batch being built in 'fep'.
+ */
+static void
+fh_enc_free(ndmpd_fh_enc_t *fep)
+{
+	free(fep->fe_buf);
+	fep->fe_buf = NULL;
+	fep->fe_size = 0;
+	fep->fe_len = 0;
+	fep->fe_next = 0;
+	fep->fe_count = 0;
+}
+
 /*
  * ************************************************************************
  * NDMP V3 HANDLERS
@@ -123,107 +667,36 @@ ndmpd_api_file_history_file_v3(void *cookie, char *name,
 	ndmpd_log(LOG_DEBUG, "ndmpd_api_file_history_file_v3");
 
 	ndmpd_session_t *session = (ndmpd_session_t *)cookie;
-	ndmp_file_v3 *file_entry;
-	ndmp_file_name_v3 *file_name_entry;
-	ndmp_file_stat_v3 *file_stat_entry;
-	ndmp_fh_add_file_request_v3 request;
-
-	if (name == NULL && session->ns_fh_v3.fh_file_index == 0)
-		return (0);
+	ndmpd_fh_enc_t *fep = &session->ns_fh_v3.fh_file;
+	u_int len;
+	char *p;
 
 	/*
-	 * If the buffer does not have space
-	 * for the current entry, send the buffered data to the client.
 	 * A NULL name indicates that any buffered data should be sent.
 	 */
-	if (name == NULL ||
-	    session->ns_fh_v3.fh_file_index == N_FILE_ENTRIES ||
-	    session->ns_fh_v3.fh_file_name_buf_index + strlen(name) + 1 >
-	    PATH_NAMEBUF_SIZE) {
-
-		ndmpd_log(LOG_DEBUG, "sending %ld entries",
-		    session->ns_fh_v3.fh_file_index);
-
-		request.files.files_len = session->ns_fh_v3.fh_file_index;
-		request.files.files_val = session->ns_fh_v3.fh_files;
-
-		if (ndmp_send_request_lock(session->ns_connection,
-		    NDMP_FH_ADD_FILE, NDMP_NO_ERR, (void *) &request, 0) < 0) {
+	if (name == NULL) {
+		if (fh_enc_flush(session, fep, NDMP_FH_ADD_FILE, FALSE) < 0) {
 			ndmpd_log(LOG_DEBUG,
 			    "Sending ndmp_fh_add_file request");
 			return (-1);
 		}
-
-		session->ns_fh_v3.fh_file_index = 0;
-		session->ns_fh_v3.fh_file_name_buf_index = 0;
-	}
-
-	if (name == NULL)
 		return (0);
-
-	if (session->ns_fh_v3.fh_files == 0) {
-		session->ns_fh_v3.fh_files = ndmp_malloc(sizeof (ndmp_file_v3) *
-		    N_FILE_ENTRIES);
-		if (session->ns_fh_v3.fh_files == 0)
-			return (-1);
 	}
 
-	if (session->ns_fh_v3.fh_file_names == 0) {
-		session->ns_fh_v3.fh_file_names =
-		    ndmp_malloc(sizeof (ndmp_file_name_v3) * N_FILE_ENTRIES);
-		if (session->ns_fh_v3.fh_file_names == 0)
-			return (-1);
-	}
-
-	if (session->ns_fh_v3.fh_file_name_buf == 0) {
-		session->ns_fh_v3.fh_file_name_buf =
-		    ndmp_malloc(sizeof (char) * PATH_NAMEBUF_SIZE);
-		if (session->ns_fh_v3.fh_file_name_buf == 0)
-			return (-1);
-	}
+	len = strlen(name);
+	if ((p = fh_enc_get(session, fep, NDMP_FH_ADD_FILE,
+	    FH_FILE_SIZE(len))) == NULL)
+		return (-1);
 
-	if (session->ns_fh_v3.fh_file_stats == 0) {
-		session->ns_fh_v3.fh_file_stats =
-		    ndmp_malloc(sizeof (ndmp_file_stat_v3) * N_FILE_ENTRIES);
-		if (session->ns_fh_v3.fh_file_stats == 0)
-			return (-1);
-	}
+	p = fh_put_long(p, 1);			/* names */
+	p = fh_put_name(p, name, len);
+	p = fh_put_long(p, 1);			/* stats */
+	p = fh_put_stat(p, file_stat, file_stat->st_mode & 0x0fff);
+	p = fh_put_quad(p, (u_longlong_t)file_stat->st_ino);
+	p = fh_put_quad(p, fh_info);
 
-	file_entry =
-	    &session->ns_fh_v3.fh_files[session->ns_fh_v3.fh_file_index];
-	file_name_entry =
-	    &session->ns_fh_v3.fh_file_names[session->ns_fh_v3.fh_file_index];
-	file_stat_entry =
-	    &session->ns_fh_v3.fh_file_stats[session->ns_fh_v3.fh_file_index];
-	file_entry->names.names_len = 1;
-	file_entry->names.names_val = file_name_entry;
-	file_entry->stats.stats_len = 1;
-	file_entry->stats.stats_val = file_stat_entry;
-	file_entry->node = long_long_to_quad(file_stat->st_ino);
-	file_entry->fh_info = long_long_to_quad(fh_info);
-
-	file_name_entry->fs_type = NDMP_FS_UNIX;
-	file_name_entry->ndmp_file_name_v3_u.unix_name =
-	    &session->ns_fh_v3.fh_file_name_buf[session->
-	    ns_fh_v3.fh_file_name_buf_index];
-	(void) strlcpy(&session->ns_fh_v3.fh_file_name_buf[session->
-	    ns_fh_v3.fh_file_name_buf_index], name, PATH_NAMEBUF_SIZE);
-	session->ns_fh_v3.fh_file_name_buf_index += strlen(name) + 1;
-	ndmpd_get_file_entry_type(file_stat->st_mode, &file_stat_entry->ftype);
-
-	file_stat_entry->invalid = 0;
-	file_stat_entry->fs_type = NDMP_FS_UNIX;
-	file_stat_entry->mtime = file_stat->st_mtime;
-	file_stat_entry->atime = file_stat->st_atime;
-	file_stat_entry->ctime = file_stat->st_ctime;
-	file_stat_entry->owner = file_stat->st_uid;
-	file_stat_entry->group = file_stat->st_gid;
-	file_stat_entry->fattr = file_stat->st_mode & 0x0fff;
-	file_stat_entry->size =
-	    long_long_to_quad((u_longlong_t)file_stat->st_size);
-	file_stat_entry->links = file_stat->st_nlink;
-
-	session->ns_fh_v3.fh_file_index++;
+	fep->fe_len = p - fep->fe_buf;
+	fep->fe_count++;
 
 	return (0);
 }
@@ -255,84 +728,34 @@ ndmpd_api_file_history_dir_v3(void *cookie, char *name,
 	ndmpd_log(LOG_DEBUG, "ndmpd_api_file_history_dir_v3");
 
 	ndmpd_session_t *session = (ndmpd_session_t *)cookie;
-	ndmp_dir_v3 *dir_entry;
-	ndmp_file_name_v3 *dir_name_entry;
-	ndmp_fh_add_dir_request_v3 request;
-
-	if (name == NULL && session->ns_fh_v3.fh_dir_index == 0)
-		return (0);
+	ndmpd_fh_enc_t *fep = &session->ns_fh_v3.fh_dir;
+	u_int len;
+	char *p;
 
 	/*
-	 * If the buffer does not have space
-	 * for the current entry, send the buffered data to the client.
 	 * A NULL name indicates that any buffered data should be sent.
 	 */
-	if (name == NULL ||
-	    session->ns_fh_v3.fh_dir_index == N_DIR_ENTRIES ||
-	    session->ns_fh_v3.fh_dir_name_buf_index + strlen(name) + 1 >
-	    DIR_NAMEBUF_SIZE) {
-
-		ndmpd_log(LOG_DEBUG, "sending %ld entries",
-		    session->ns_fh_v3.fh_dir_index);
-
-		request.dirs.dirs_val = session->ns_fh_v3.fh_dirs;
-		request.dirs.dirs_len = session->ns_fh_v3.fh_dir_index;
-
-		if (ndmp_send_request_lock(session->ns_connection,
-		    NDMP_FH_ADD_DIR, NDMP_NO_ERR, (void *) &request, 0) < 0) {
+	if (name == NULL) {
+		if (fh_enc_flush(session, fep, NDMP_FH_ADD_DIR, FALSE) < 0) {
 			ndmpd_log(LOG_DEBUG,
 			    "Sending ndmp_fh_add_dir request");
 			return (-1);
 		}
-
-		session->ns_fh_v3.fh_dir_index = 0;
-		session->ns_fh_v3.fh_dir_name_buf_index = 0;
-	}
-
-	if (name == NULL)
 		return (0);
-
-	if (session->ns_fh_v3.fh_dirs == 0) {
-		session->ns_fh_v3.fh_dirs =
-		    ndmp_malloc(sizeof (ndmp_dir_v3) * N_DIR_ENTRIES);
-		if (session->ns_fh_v3.fh_dirs == 0)
-			return (-1);
-	}
-
-	if (session->ns_fh_v3.fh_dir_names == 0) {
-		session->ns_fh_v3.fh_dir_names =
-		    ndmp_malloc(sizeof (ndmp_file_name_v3) * N_DIR_ENTRIES);
-		if (session->ns_fh_v3.fh_dir_names == 0)
-			return (-1);
 	}
 
-	if (session->ns_fh_v3.fh_dir_name_buf == 0) {
-		session->ns_fh_v3.fh_dir_name_buf =
-		    ndmp_malloc(sizeof (char) * DIR_NAMEBUF_SIZE);
-		if (session->ns_fh_v3.fh_dir_name_buf == 0)
-			return (-1);
-	}
-
-	dir_entry = &session->ns_fh_v3.fh_dirs[session->ns_fh_v3.fh_dir_index];
-	dir_name_entry =
-	    &session->ns_fh_v3.fh_dir_names[session->ns_fh_v3.fh_dir_index];
-
-	dir_name_entry->fs_type = NDMP_FS_UNIX;
-
-	dir_name_entry->ndmp_file_name_v3_u.unix_name =
-		&session->ns_fh_v3.fh_dir_name_buf[session->ns_fh_v3.fh_dir_name_buf_index];
-
-	(void) strlcpy(&session->ns_fh_v3.fh_dir_name_buf[session->ns_fh_v3.fh_dir_name_buf_index],
-		name, PATH_NAMEBUF_SIZE);
-
-	session->ns_fh_v3.fh_dir_name_buf_index += PATH_NAMEBUF_SIZE ;
+	len = strlen(name);
+	if ((p = fh_enc_get(session, fep, NDMP_FH_ADD_DIR,
+	    FH_DIR_SIZE(len))) == NULL)
+		return (-1);
 
-	dir_entry->names.names_len = 1;
-	dir_entry->names.names_val = dir_name_entry;
-	dir_entry->node = long_long_to_quad(node);
-	dir_entry->parent = long_long_to_quad(parent);
+	p = fh_put_long(p, 1);			/* names */
+	p = fh_put_name(p, name, len);
+	p = fh_put_quad(p, (u_longlong_t)node);
+	p = fh_put_quad(p, (u_longlong_t)parent);
 
-	session->ns_fh_v3.fh_dir_index++;
+	fep->fe_len = p - fep->fe_buf;
+	fep->fe_count++;
 
 	return (0);
 }
@@ -364,89 +787,43 @@ ndmpd_api_file_history_node_v3(void *cookie, u_long node,
 {
 	ndmpd_log(LOG_DEBUG, "ndmpd_api_file_history_node_v3 ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~");
 	ndmpd_session_t *session = (ndmpd_session_t *)cookie;
-	ndmp_node_v3 *node_entry;
-	ndmp_file_stat_v3 *file_stat_entry;
-	ndmp_fh_add_node_request_v3 request;
+	ndmpd_fh_enc_t *fep = &session->ns_fh_v3.fh_node;
+	char *p;
 
-	if (file_stat == NULL && session->ns_fh_v3.fh_node_index == 0)
-		return (0);
+	/*
+	 * Need to send Dir entry as well. Since Dir entry is more
+	 * than a Node entry, we may send a Node entry that hasn't
+	 * had its Dir entry sent. Therefore, we need to flush Dir
+	 * entry as well every time the Node entry is sent.
+	 */
+	if (file_stat == NULL || (fep->fe_buf != NULL &&
+	    fep->fe_len + FH_NODE_SIZE > fep->fe_size))
+		(void) ndmpd_api_file_history_dir_v3(session, 0, 0, 0);
 
 	/*
-	 * If the buffer does not have space
-	 * for the current entry, send the buffered data to the client.
 	 * A 0 file_stat pointer indicates that any buffered data should
 	 * be sent.
 	 */
-	if (file_stat == NULL ||
-	    session->ns_fh_v3.fh_node_index == N_NODE_ENTRIES) {
-		ndmpd_log(LOG_DEBUG, "sending %ld entries",
-		    session->ns_fh_v3.fh_node_index);
-
-		/*
-		 * Need to send Dir entry as well. Since Dir entry is more
-		 * than a Node entry, we may send a Node entry that hasn't
-		 * had its Dir entry sent. Therefore, we need to flush Dir
-		 * entry as well every time the Dir entry is sent.
-		 */
-		(void) ndmpd_api_file_history_dir_v3(session, 0, 0, 0);
-
-		request.nodes.nodes_len = session->ns_fh_v3.fh_node_index;
-		request.nodes.nodes_val = session->ns_fh_v3.fh_nodes;
-
-		if (ndmp_send_request_lock(session->ns_connection,
-		    NDMP_FH_ADD_NODE,
-		    NDMP_NO_ERR, (void *) &request, 0) < 0) {
+	if (file_stat == NULL) {
+		if (fh_enc_flush(session, fep, NDMP_FH_ADD_NODE, FALSE) < 0) {
 			ndmpd_log(LOG_DEBUG,
 			    "Sending ndmp_fh_add_node request");
 			return (-1);
 		}
-
-		session->ns_fh_v3.fh_node_index = 0;
-	}
-
-	if (file_stat == NULL)
 		return (0);
-
-	if (session->ns_fh_v3.fh_nodes == 0) {
-		session->ns_fh_v3.fh_nodes =
-		    ndmp_malloc(sizeof (ndmp_node_v3) * N_NODE_ENTRIES);
-		if (session->ns_fh_v3.fh_nodes == 0)
-			return (-1);
-	}
-
-	if (session->ns_fh_v3.fh_node_stats == 0) {
-		session->ns_fh_v3.fh_node_stats =
-		    ndmp_malloc(sizeof (ndmp_file_stat_v3) * N_NODE_ENTRIES);
-		if (session->ns_fh_v3.fh_node_stats == 0)
-			return (-1);
 	}
 
-	node_entry =
-	    &session->ns_fh_v3.fh_nodes[session->ns_fh_v3.fh_node_index];
-
-	file_stat_entry =
-	    &session->ns_fh_v3.fh_node_stats[session->ns_fh_v3.fh_node_index];
-	ndmpd_get_file_entry_type(file_stat->st_mode, &file_stat_entry->ftype);
-
-	file_stat_entry->invalid = 0;
-	file_stat_entry->fs_type = NDMP_FS_UNIX;
-	file_stat_entry->mtime = file_stat->st_mtime;
-	file_stat_entry->atime = file_stat->st_atime;
-	file_stat_entry->ctime = file_stat->st_ctime;
-	file_stat_entry->owner = file_stat->st_uid;
-	file_stat_entry->group = file_stat->st_gid;
-
-	file_stat_entry->fattr = file_stat->st_mode;
-	file_stat_entry->size =
-	    long_long_to_quad((u_longlong_t)file_stat->st_size);
-	file_stat_entry->links = file_stat->st_nlink;
+	if ((p = fh_enc_get(session, fep, NDMP_FH_ADD_NODE,
+	    FH_NODE_SIZE)) == NULL)
+		return (-1);
 
-	node_entry->stats.stats_len = 1;
-	node_entry->stats.stats_val = file_stat_entry;
-	node_entry->node = long_long_to_quad((u_longlong_t)node);
-	node_entry->fh_info = long_long_to_quad(fh_info);
+	p = fh_put_long(p, 1);			/* stats */
+	p = fh_put_stat(p, file_stat, file_stat->st_mode);
+	p = fh_put_quad(p, (u_longlong_t)node);
+	p = fh_put_quad(p, fh_info);
 
-	session->ns_fh_v3.fh_node_index++;
+	fep->fe_len = p - fep->fe_buf;
+	fep->fe_count++;
 
 	return (0);
 }
@@ -520,21 +897,19 @@ ndmpd_fhpath_v3_cb(lbr_fhlog_call_backs_t *cbp, char *path, struct stat *stp,
 /*
  * ndmpd_fhdir_v3_cb
  *
- * Callback function for file history dir information
+ * Callback function for file history dir information.  The entries
+ * of the directory are the ones the traversal has already read, so
+ * the directory is not read again here.
  */
 int
-ndmpd_fhdir_v3_cb(lbr_fhlog_call_backs_t *cbp, char *dir, struct stat *stp)
+ndmpd_fhdir_v3_cb(lbr_fhlog_call_backs_t *cbp, char *dir, struct stat *stp,
+    fst_dirent_t *ents, int nents)
 {
 	int err;
 	u_long ino, pino;
-	u_long pos;
 	ndmp_lbr_params_t *nlp;
 	ndmpd_module_params_t *params;
-	DIR *dirp;
-	char dirpath[PATH_MAX];
-	char path[PATH_MAX];
-	struct dirent *entry;
-	struct stat statbuf;
+	fst_dirent_t *entry, *end;
 
 	ndmpd_log(LOG_DEBUG, "ndmpd_fhdir_v3_cb");
 	if (!cbp) {
@@ -571,31 +946,27 @@ ndmpd_fhdir_v3_cb(lbr_fhlog_call_backs_t *cbp, char *dir, struct stat *stp)
 
 	err = 0;
 
-	dirp = opendir(dir);
-	if (dirp == NULL)
-		return (0);
-
-	while((entry = readdir(dirp)) != NULL) {
-		ino=entry->d_fileno;
+	end = ents + nents;
+	for (entry = ents; entry < end; entry++) {
+		ino = entry->fd_ino;
 
 		if (pino == ROOT_INODE) {
-			if (rootfs_dot_or_dotdot(entry->d_name))
+			if (rootfs_dot_or_dotdot(entry->fd_name))
 				ino = ROOT_INODE;
-		} else if (ino == nlp->nlp_bkdirino && IS_DOTDOT( entry->d_name)) {
-			ndmpd_log(LOG_DEBUG, "entry->d_name(%s): %lu",
-				entry->d_name, ino);
+		} else if (ino == nlp->nlp_bkdirino && IS_DOTDOT(entry->fd_name)) {
+			ndmpd_log(LOG_DEBUG, "entry->fd_name(%s): %lu",
+				entry->fd_name, ino);
 			ino = ROOT_INODE;
 		}
 
 		err = (*params->mp_file_history_dir_func)(cbp->fh_cookie,
-			entry->d_name, ino, pino);
+			entry->fd_name, ino, pino);
 
 		if (err < 0) {
 			ndmpd_log(LOG_DEBUG, "\"%s\": %d", dir, err);
 			break;
 		}
-    }
-	(void) closedir(dirp);
+	}
 	return (err);
 }
 
@@ -789,26 +1160,18 @@ ndmpd_file_history_init(ndmpd_session_t *session)
 	/*
 	 * V3.
 	 */
-	session->ns_fh_v3.fh_files = 0;
-	session->ns_fh_v3.fh_dirs = 0;
-	session->ns_fh_v3.fh_nodes = 0;
-	session->ns_fh_v3.fh_file_names = 0;
-	session->ns_fh_v3.fh_dir_names = 0;
-	session->ns_fh_v3.fh_file_stats = 0;
-	session->ns_fh_v3.fh_node_stats = 0;
-	session->ns_fh_v3.fh_file_name_buf = 0;
-	session->ns_fh_v3.fh_dir_name_buf = 0;
-	session->ns_fh_v3.fh_file_index = 0;
-	session->ns_fh_v3.fh_dir_index = 0;
-	session->ns_fh_v3.fh_node_index = 0;
-	session->ns_fh_v3.fh_file_name_buf_index = 0;
-	session->ns_fh_v3.fh_dir_name_buf_index = 0;
+	(void) memset(&session->ns_fh_v3.fh_file, 0, sizeof (ndmpd_fh_enc_t));
+	(void) memset(&session->ns_fh_v3.fh_dir, 0, sizeof (ndmpd_fh_enc_t));
+	(void) memset(&session->ns_fh_v3.fh_node, 0, sizeof (ndmpd_fh_enc_t));
+	session->ns_fh_v3.fh_queue = NULL;
 }
 
 /*
  * ndmpd_file_history_cleanup_v3
  *
- * Send (or discard) any buffered file history entries.
+ * Send (or discard) any buffered file history entries.  When they are
+ * sent, this waits for the sender thread to have sent all the queued
+ * batches, so nothing is sent after the caller goes on.
  *
  * Parameters:
  *   session  (input) - session pointer.
@@ -826,49 +1189,11 @@ ndmpd_file_history_cleanup_v3(ndmpd_session_t *session, bool_t send_flag)
 		(void) ndmpd_api_file_history_dir_v3(session, 0, 0, 0);
 		(void) ndmpd_api_file_history_node_v3(session, 0, 0, 0);
 	}
+	fh_queue_stop(session, send_flag);
 
-	if (session->ns_fh_v3.fh_files != 0) {
-		free(session->ns_fh_v3.fh_files);
-		session->ns_fh_v3.fh_files = 0;
-	}
-	if (session->ns_fh_v3.fh_dirs != 0) {
-		free(session->ns_fh_v3.fh_dirs);
-		session->ns_fh_v3.fh_dirs = 0;
-	}
-	if (session->ns_fh_v3.fh_nodes != 0) {
-		free(session->ns_fh_v3.fh_nodes);
-		session->ns_fh_v3.fh_nodes = 0;
-	}
-	if (session->ns_fh_v3.fh_file_names != 0) {
-		free(session->ns_fh_v3.fh_file_names);
-		session->ns_fh_v3.fh_file_names = 0;
-	}
-	if (session->ns_fh_v3.fh_dir_names != 0) {
-		free(session->ns_fh_v3.fh_dir_names);
-		session->ns_fh_v3.fh_dir_names = 0;
-	}
-	if (session->ns_fh_v3.fh_file_stats != 0) {
-		free(session->ns_fh_v3.fh_file_stats);
-		session->ns_fh_v3.fh_file_stats = 0;
-	}
-	if (session->ns_fh_v3.fh_node_stats != 0) {
-		free(session->ns_fh_v3.fh_node_stats);
-		session->ns_fh_v3.fh_node_stats = 0;
-	}
-	if (session->ns_fh_v3.fh_file_name_buf != 0) {
-		free(session->ns_fh_v3.fh_file_name_buf);
-		session->ns_fh_v3.fh_file_name_buf = 0;
-	}
-	if (session->ns_fh_v3.fh_dir_name_buf != 0) {
-		free(session->ns_fh_v3.fh_dir_name_buf);
-		session->ns_fh_v3.fh_dir_name_buf = 0;
-	}
-
-	session->ns_fh_v3.fh_file_index = 0;
-	session->ns_fh_v3.fh_dir_index = 0;
-	session->ns_fh_v3.fh_node_index = 0;
-	session->ns_fh_v3.fh_file_name_buf_index = 0;
-	session->ns_fh_v3.fh_dir_name_buf_index = 0;
+	fh_enc_free(&session->ns_fh_v3.fh_file);
+	fh_enc_free(&session->ns_fh_v3.fh_dir);
+	fh_enc_free(&session->ns_fh_v3.fh_node);
 }
 
 /*
@@ -330,6 +330,68 @@ ndmp_send_request_lock(ndmp_connection_t *connection_handle,
 	return (rv);
 }
 
+/*
+ * ndmp_send_request_raw
+ *
+ * Send an NDMP request message whose body is already XDR encoded.
+ * The body starts NDMP_RAW_HDR_SIZE bytes into 'buf'; the record mark
+ * and the message header are put in front of it, and the message is
+ * written to the socket at once, without going through xdrrec.  Only
+ * for requests which have no reply.
+ *
+ * Parameters:
+ *   connection_handle (input) - connection pointer.
+ *   message (input) - message number.
+ *   buf (input) - NDMP_RAW_HDR_SIZE free bytes followed by the body.
+ *   len (input) - length of the body, a multiple of 4.
+ *
+ * Returns:
+ *   0	- successful send.
+ *  -1	- error.
+ */
+int
+ndmp_send_request_raw(ndmp_connection_t *connection_handle,
+    ndmp_message message, char *buf, u_int len)
+{
+	ndmp_connection_t *connection = (ndmp_connection_t *)connection_handle;
+	ndmp_header header;
+	struct timeval time;
+	uint32_t mark;
+	XDR xdrs;
+	int rv;
+
+	(void) gettimeofday(&time, 0);
+
+	(void) pthread_mutex_lock(&connection->conn_lock);
+
+	header.sequence = ++(connection->conn_my_sequence);
+	header.time_stamp = time.tv_sec;
+	header.message_type = NDMP_MESSAGE_REQUEST;
+	header.message = message;
+	header.reply_sequence = 0;
+	header.error = NDMP_NO_ERR;
+
+	xdrmem_create(&xdrs, buf + sizeof (mark),
+	    NDMP_RAW_HDR_SIZE - sizeof (mark), XDR_ENCODE);
+	if (!xdr_ndmp_header(&xdrs, &header)) {
+		ndmpd_log(LOG_DEBUG,
+		    "Sending message 0x%x: encoding request header", message);
+		(void) pthread_mutex_unlock(&connection->conn_lock);
+		return (-1);
+	}
+	xdr_destroy(&xdrs);
+
+	/* a single, last fragment */
+	mark = htonl(0x80000000 | (NDMP_RAW_HDR_SIZE - sizeof (mark) + len));
+	(void) memcpy(buf, &mark, sizeof (mark));
+
+	rv = ndmp_writeit(connection, buf, NDMP_RAW_HDR_SIZE + len);
+
+	(void) pthread_mutex_unlock(&connection->conn_lock);
+
+	return (rv < 0 ? -1 : 0);
+}
+
 /*
  * ndmp_recv_msg
  *
@@ -462,7 +524,7 @@ ndmp_writeit(void *connection_handle, void *buf, int len)
 	register int n;
 	register int cnt;
 	
-	for (cnt = len; cnt > 0; cnt -= n, buf = (int *)buf + n) {
+	for (cnt = len; cnt > 0; cnt -= n, buf = (char *)buf + n) {
 		if ((n = write(connection->conn_sock, buf, cnt)) < 0) {
 			connection->conn_eof = TRUE;
 			return (-1);
@@ -46,10 +46,13 @@
 #include <ndmpd_util.h>
 #include <ndmpd_func.h>
 #include <ndmpd_session.h>
+#include <ndmpd_prop.h>
 
+#include <sys/param.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -65,6 +68,17 @@
 static int discard_data_v3(ndmpd_session_t *session, u_long length);
 int ndmp_max_mover_recsize = MAX_MOVER_RECSIZE; /* patchable */
 
+/*
+ * The local mover keeps its tape in the file named by the local-tape
+ * property.  Each tape record is stored behind a header holding its
+ * length and flags.  All the records of an image have the same size,
+ * the last one is zero filled, and the image ends with a filemark,
+ * which is a header without data.  A stream offset is then found at
+ * offset / record size records from the start.
+ */
+#define	VT_HDR_SIZE	(2 * sizeof (uint32_t))
+#define	VT_FILEMARK	0x00000001
+
 /*
  * ndmpd_local_write
  *
@@ -123,6 +137,51 @@ ndmpd_remote_write(ndmpd_session_t *session, char *data, u_long length)
 	return (0);
 }
 
+/*
+ * ndmpd_remote_sendfile
+ *
+ * Sends a piece of a file to the remote mover with sendfile(2).
+ *
+ * Parameters:
+ *   session    (input) - session pointer.
+ *   fd         (input) - file to be sent.
+ *   offset     (input) - where in the file to start.
+ *   length     (input) - data length.
+ *
+ * Returns:
+ *   number of bytes sent, less than length if the file got shorter.
+ *  -1 - error.
+ */
+long
+ndmpd_remote_sendfile(ndmpd_session_t *session, int fd, off_t offset,
+    u_long length)
+{
+	off_t n;
+	u_long count = 0;
+
+	while (count < length) {
+		if (session->ns_eof == TRUE ||
+		    session->ns_data.dd_abort == TRUE)
+			return (-1);
+
+		n = 0;
+		if (sendfile(fd, session->ns_data.dd_sock, offset + count,
+		    length - count, NULL, &n, 0) < 0) {
+			if (errno != EINTR && errno != EAGAIN &&
+			    errno != EBUSY) {
+				ndmpd_log(LOG_ERR, "Socket sendfile error: %m.");
+				session->ns_data.dd_abort = TRUE;
+				return (-1);
+			}
+		} else if (n == 0) {
+			break;
+		}
+		count += n;
+	}
+
+	return (count);
+}
+
 /*
  * ndmpd_local_read
  *
@@ -183,6 +242,7 @@ ndmpd_mover_init(ndmpd_session_t *session)
 	session->ns_mover.md_sock = -1;
 	session->ns_mover.md_r_index = 0;
 	session->ns_mover.md_w_index = 0;
+	session->ns_mover.md_tape_fd = -1;
 	session->ns_mover.md_buf = ndmp_malloc(MAX_RECORD_SIZE);
 	if (!session->ns_mover.md_buf)
 		return (-1);
@@ -237,6 +297,7 @@ ndmpd_mover_shut_down(ndmpd_session_t *session)
 void
 ndmpd_mover_cleanup(ndmpd_session_t *session)
 {
+	ndmpd_local_tape_close(session);
 	NDMP_FREE(session->ns_mover.md_buf);
 }
 
@@ -340,11 +401,218 @@ ndmpd_mover_error(ndmpd_session_t *session, ndmp_mover_halt_reason reason)
 	session->ns_mover.md_halt_reason = reason;
 }
 
+/*
+ * ndmpd_local_tape_enabled
+ *
+ * Is there a virtual tape for the local mover?
+ */
+bool_t
+ndmpd_local_tape_enabled(void)
+{
+	char *path;
+
+	path = ndmpd_get_prop(NDMP_LOCAL_TAPE);
+	return ((path != NULL && *path != '\0') ? TRUE : FALSE);
+}
+
+/*
+ * ndmpd_local_tape_open
+ *
+ * Open the virtual tape of the local mover, rewound.  A backup
+ * overwrites the tape, a restore reads it from the start.
+ *
+ * Parameters:
+ *   session (input) - session pointer.
+ *   write   (input) - open it for a backup.
+ *
+ * Returns:
+ *   0 - tape opened.
+ *  -1 - error.
+ */
+int
+ndmpd_local_tape_open(ndmpd_session_t *session, bool_t write)
+{
+	ndmpd_session_mover_desc_t *md = &session->ns_mover;
+	char *path;
+	int fd;
+
+	if (!ndmpd_local_tape_enabled()) {
+		ndmpd_log(LOG_DEBUG, "No local tape configured.");
+		return (-1);
+	}
+
+	path = ndmpd_get_prop(NDMP_LOCAL_TAPE);
+	ndmpd_local_tape_close(session);
+	if (write)
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	else
+		fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		ndmpd_log(LOG_ERR, "Could not open the local tape %s: %m.",
+		    path);
+		return (-1);
+	}
+
+	md->md_tape_fd = fd;
+	md->md_r_index = md->md_w_index = 0;
+	md->md_record_num = 0;
+	md->md_position = 0LL;
+	md->md_data_written = 0LL;
+
+	/* a restore takes the record size from the first record */
+	if (!write)
+		md->md_record_size = 0;
+	else if (md->md_record_size == 0 ||
+	    md->md_record_size > MAX_RECORD_SIZE)
+		md->md_record_size = MAX_RECORD_SIZE;
+
+	ndmpd_log(LOG_DEBUG, "local tape %s open for %s, record size %lu",
+	    path, write ? "backup" : "restore", md->md_record_size);
+
+	return (0);
+}
+
+/*
+ * ndmpd_local_tape_close
+ *
+ * Close the virtual tape of the local mover, if open.
+ */
+void
+ndmpd_local_tape_close(ndmpd_session_t *session)
+{
+	if (session->ns_mover.md_tape_fd != -1) {
+		(void) close(session->ns_mover.md_tape_fd);
+		session->ns_mover.md_tape_fd = -1;
+	}
+}
+
+/*
+ * vt_write_record
+ *
+ * Write one record, with its header, to the virtual tape.
+ */
+static int
+vt_write_record(ndmpd_session_t *session, char *data, u_long length,
+    u_long flags)
+{
+	uint32_t hdr[2];
+	struct iovec iov[2];
+	ssize_t n;
+
+	hdr[0] = htonl(length);
+	hdr[1] = htonl(flags);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = VT_HDR_SIZE;
+	iov[1].iov_base = data;
+	iov[1].iov_len = length;
+
+	n = writev(session->ns_mover.md_tape_fd, iov, length ? 2 : 1);
+	if (n != (ssize_t)(VT_HDR_SIZE + length)) {
+		ndmpd_log(LOG_ERR, "Local tape write error: %m.");
+		return (-1);
+	}
+
+	if (length) {
+		session->ns_mover.md_record_num++;
+		session->ns_mover.md_data_written += length;
+	}
+
+	return (0);
+}
+
+/*
+ * vt_read_full
+ *
+ * Read length bytes from the virtual tape.  Returns what was read,
+ * less at the end of the tape, or -1 on error.
+ */
+static ssize_t
+vt_read_full(int fd, char *data, u_long length)
+{
+	ssize_t n;
+	u_long count = 0;
+
+	while (count < length) {
+		if ((n = read(fd, &data[count], length - count)) < 0) {
+			if (errno == EINTR)
+				continue;
+			ndmpd_log(LOG_ERR, "Local tape read error: %m.");
+			return (-1);
+		}
+		if (n == 0)
+			break;
+		count += n;
+	}
+
+	return (count);
+}
+
+/*
+ * vt_read_record
+ *
+ * Read the next record of the virtual tape into the mover buffer.
+ *
+ * Returns:
+ *   1 - a filemark or the end of the tape.
+ *   0 - record read.
+ *  -1 - error.
+ */
+static int
+vt_read_record(ndmpd_session_t *session)
+{
+	ndmpd_session_mover_desc_t *md = &session->ns_mover;
+	uint32_t hdr[2];
+	u_long len;
+	ssize_t n;
+
+	if ((n = vt_read_full(md->md_tape_fd, (char *)hdr,
+	    VT_HDR_SIZE)) < 0)
+		return (-1);
+	if (n == 0) {
+		ndmpd_log(LOG_DEBUG, "end of the local tape");
+		return (1);
+	}
+	if (n != VT_HDR_SIZE) {
+		ndmpd_log(LOG_ERR, "Local tape: truncated record %lu.",
+		    md->md_record_num);
+		return (-1);
+	}
+
+	if (ntohl(hdr[1]) & VT_FILEMARK) {
+		ndmpd_log(LOG_DEBUG, "filemark after record %lu",
+		    md->md_record_num);
+		return (1);
+	}
+
+	len = ntohl(hdr[0]);
+	if (len == 0 || len > MAX_RECORD_SIZE ||
+	    (md->md_record_size != 0 && len != md->md_record_size)) {
+		ndmpd_log(LOG_ERR, "Local tape: bad record %lu of %lu bytes.",
+		    md->md_record_num, len);
+		return (-1);
+	}
+
+	if (vt_read_full(md->md_tape_fd, md->md_buf, len) != (ssize_t)len) {
+		ndmpd_log(LOG_ERR, "Local tape: truncated record %lu.",
+		    md->md_record_num);
+		return (-1);
+	}
+
+	md->md_record_size = len;
+	md->md_record_num++;
+	md->md_r_index = 0;
+	md->md_w_index = len;
+
+	return (0);
+}
+
 /*
  * ndmpd_local_write_v3
  *
  * Buffers and writes data to the tape device.
  * A full tape record is buffered before being written.
+ * A zero length write ends the image: the last record is zero
+ * filled and a filemark is written.
  *
  * Parameters:
  *   session    (input) - session pointer.
@@ -358,6 +626,56 @@ ndmpd_mover_error(ndmpd_session_t *session, ndmp_mover_halt_reason reason)
 int
 ndmpd_local_write_v3(ndmpd_session_t *session, char *data, u_long length)
 {
+	ndmpd_session_mover_desc_t *md = &session->ns_mover;
+	u_long count, n;
+
+	if (md->md_tape_fd == -1) {
+		ndmpd_log(LOG_DEBUG, "local tape is not open");
+		return (-1);
+	}
+
+	if (length == 0) {
+		if (md->md_w_index > 0) {
+			(void) memset(&md->md_buf[md->md_w_index], 0,
+			    md->md_record_size - md->md_w_index);
+			md->md_w_index = 0;
+			if (vt_write_record(session, md->md_buf,
+			    md->md_record_size, 0) < 0)
+				return (-1);
+		}
+		return (vt_write_record(session, NULL, 0, VT_FILEMARK));
+	}
+
+	count = 0;
+	while (count < length) {
+		if (session->ns_eof == TRUE ||
+		    session->ns_data.dd_abort == TRUE)
+			return (-1);
+
+		/* whole records are written without buffering them */
+		if (md->md_w_index == 0 &&
+		    length - count >= md->md_record_size) {
+			if (vt_write_record(session, &data[count],
+			    md->md_record_size, 0) < 0)
+				return (-1);
+			count += md->md_record_size;
+			continue;
+		}
+
+		n = MIN(length - count, md->md_record_size - md->md_w_index);
+		(void) memcpy(&md->md_buf[md->md_w_index], &data[count], n);
+		md->md_w_index += n;
+		count += n;
+
+		if (md->md_w_index == md->md_record_size) {
+			md->md_w_index = 0;
+			if (vt_write_record(session, md->md_buf,
+			    md->md_record_size, 0) < 0)
+				return (-1);
+		}
+	}
+	md->md_position += length;
+
 	return (0);
 }
 
@@ -380,6 +698,96 @@ ndmpd_local_write_v3(ndmpd_session_t *session, char *data, u_long length)
 int
 ndmpd_local_read_v3(ndmpd_session_t *session, char *data, u_long length)
 {
+	ndmpd_session_mover_desc_t *md = &session->ns_mover;
+	u_long count, n;
+	int rv;
+
+	if (md->md_tape_fd == -1) {
+		ndmpd_log(LOG_DEBUG, "local tape is not open");
+		return (-1);
+	}
+
+	count = 0;
+	while (count < length) {
+		if (session->ns_eof == TRUE ||
+		    session->ns_data.dd_abort == TRUE)
+			return (1);
+
+		if (md->md_r_index == md->md_w_index) {
+			if ((rv = vt_read_record(session)) != 0)
+				return (rv);
+			continue;
+		}
+
+		n = MIN(length - count, md->md_w_index - md->md_r_index);
+		(void) memcpy(&data[count], &md->md_buf[md->md_r_index], n);
+		md->md_r_index += n;
+		count += n;
+		md->md_position += n;
+		session->ns_data.dd_position += n;
+	}
+
+	return (0);
+}
+
+/*
+ * ndmpd_local_seek_v3
+ *
+ * Position the virtual tape of the local mover at a data stream
+ * offset.  The local mover has no window, the data is read on from
+ * there until the module seeks again.
+ *
+ * Parameters:
+ *   session (input) - session pointer.
+ *   offset  (input) - data stream offset.
+ *   length  (input) - bytes the module wants from there.
+ *
+ * Returns:
+ *   0 - seek done.
+ *  -1 - error.
+ */
+int
+ndmpd_local_seek_v3(ndmpd_session_t *session, u_longlong_t offset,
+    u_longlong_t length)
+{
+	ndmpd_session_mover_desc_t *md = &session->ns_mover;
+	u_longlong_t rec;
+
+	if (md->md_tape_fd == -1) {
+		ndmpd_log(LOG_DEBUG, "local tape is not open");
+		return (-1);
+	}
+
+	/* learn the record size from the first record */
+	if (md->md_record_size == 0) {
+		if (lseek(md->md_tape_fd, 0, SEEK_SET) == -1 ||
+		    vt_read_record(session) != 0)
+			return (-1);
+	}
+
+	rec = offset / md->md_record_size;
+	if (lseek(md->md_tape_fd, rec * (VT_HDR_SIZE + md->md_record_size),
+	    SEEK_SET) == -1) {
+		ndmpd_log(LOG_ERR, "Local tape seek error: %m.");
+		return (-1);
+	}
+
+	md->md_record_num = rec;
+	if (vt_read_record(session) != 0) {
+		ndmpd_log(LOG_DEBUG, "no data at offset %llu", offset);
+		return (-1);
+	}
+	md->md_r_index = offset % md->md_record_size;
+
+	ndmpd_log(LOG_DEBUG, "local seek [%llu, %llu] record %llu",
+	    offset, length, rec);
+
+	md->md_position = offset;
+	md->md_seek_position = offset;
+	session->ns_data.dd_position = offset;
+	session->ns_data.dd_read_offset = offset;
+	session->ns_data.dd_read_length = length;
+
 	return (0);
 }
 
@@ -90,6 +90,16 @@ ndmpd_cfg_param_t ndmpd_cfg_table[] =
 	{"backup-quarantine", "false"},
 	{"restore-quarantine",	"false"},
 	{"overwrite-quarantine", "false"},
+	{"tape-buffers", "4"},
+	{"scan-threads", "1"},
+	{"fh-spill-path", "/var/tmp"},
+	{"restore-threads", "1"},
+	{"restore-direct-io", "false"},
+	{"restore-defer-attrs", "false"},
+	{"local-tape", ""},
+	{"session-workers", "0"},
+	{"id-cache-ttl", "600"},
+	{"acl-dedup", "true"},
 };
 
 void print_prop(){
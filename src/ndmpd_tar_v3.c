@@ -46,6 +46,7 @@
 #include <ndmpd.h>
 #include <ndmpd_session.h>
 #include <ndmpd_util.h>
+#include <ndmpd_prop.h>
 #include <ndmpd_func.h>
 #include <ndmpd_fhistory.h>
 #include <ndmpd_snapshot.h>
@@ -84,6 +85,9 @@ extern int ndmpd_get_dumptime(char *path, int *level, time_t *ddate);
 /* IS 'Y' OR "T' */
 #define	IS_YORT(c)	(strchr("YT", toupper(c)))
 
+/* fh_info of an entry the DMA has no data stream offset for */
+#define	DAR_INVALID_FH_INFO	0xffffffffffffffffULL
+
 /*
  * If path is defined.
  */
@@ -305,11 +309,14 @@ inlist(char **lpp, char *ent)
  *   FALSE: no match
  */
 static bool_t
-ininc(char **lpp, char *ent)
+ininc(char **lpp, struct tlm_matcher *tm, char *ent)
 {
 	if (!lpp || !ent || !*ent)
 		return (TRUE);
 
+	if (tm != NULL)
+		return (tlm_matcher_match(tm, ent));
+
 	return (inlist(lpp, ent));
 }
 
@@ -811,6 +818,122 @@ get_hist_env_v3(ndmpd_module_params_t *params, ndmp_lbr_params_t *nlp)
 	}
 }
 
+/*
+ * get_direct_env_v3
+ *
+ * Is direct access restore requested?  During backup this makes the
+ * file history carry the data stream offsets of the entries, during
+ * restore it makes the restore seek to them.
+ *
+ * Parameters:
+ *   params (input) - pointer to the parameters structure
+ *   nlp (input) - pointer to the nlp structure
+ *
+ * Returns:
+ *   void
+ */
+static void
+get_direct_env_v3(ndmpd_module_params_t *params, ndmp_lbr_params_t *nlp)
+{
+	char *envp;
+
+	envp = MOD_GETENV(params, "DIRECT");
+	if (!envp) {
+		ndmpd_log(LOG_DEBUG, "env(DIRECT) not defined, default to N");
+		NLP_UNSET(nlp, NLPF_DIRECT);
+	} else {
+		ndmpd_log(LOG_DEBUG, "env(DIRECT): \"%s\"", envp);
+		if (IS_YORT(*envp))
+			NLP_SET(nlp, NLPF_DIRECT);
+		else
+			NLP_UNSET(nlp, NLPF_DIRECT);
+	}
+}
+
+/*
+ * mk_exc_matchers
+ *
+ * Compile the exclusion list once for shouldskip.  The "d_" patterns
+ * are matched against the directory path and the others against the
+ * entry name, each with its two letter prefix removed.  If a matcher
+ * cannot be made, the list is matched pattern by pattern.
+ *
+ * Parameters:
+ *   nlp (input) - pointer to the nlp structure
+ *
+ * Returns:
+ *   void
+ */
+static void
+mk_exc_matchers(ndmp_lbr_params_t *nlp)
+{
+	char **lpp;
+	int rv = 0;
+
+	tlm_matcher_free(nlp->nlp_exl_dirs);
+	tlm_matcher_free(nlp->nlp_exl_files);
+	nlp->nlp_exl_dirs = nlp->nlp_exl_files = NULL;
+	if (nlp->nlp_exl == NULL)
+		return;
+
+	nlp->nlp_exl_dirs = tlm_matcher_new();
+	nlp->nlp_exl_files = tlm_matcher_new();
+	if (nlp->nlp_exl_dirs == NULL || nlp->nlp_exl_files == NULL)
+		rv = -1;
+
+	for (lpp = nlp->nlp_exl; rv == 0 && *lpp != NULL; lpp++) {
+		if (strncmp(*lpp, "d_", 2) == 0)
+			rv = tlm_matcher_add(nlp->nlp_exl_dirs, *lpp + 2);
+		else
+			rv = tlm_matcher_add(nlp->nlp_exl_files, *lpp + 2);
+	}
+
+	if (rv != 0) {
+		ndmpd_log(LOG_DEBUG, "Cannot compile the exclusion list");
+		tlm_matcher_free(nlp->nlp_exl_dirs);
+		tlm_matcher_free(nlp->nlp_exl_files);
+		nlp->nlp_exl_dirs = nlp->nlp_exl_files = NULL;
+	}
+}
+
+/*
+ * mk_inc_matcher
+ *
+ * Compile the inclusion list once for shouldskip, skipping the
+ * leading "./" of the patterns the same way inlist does.
+ *
+ * Parameters:
+ *   nlp (input) - pointer to the nlp structure
+ *
+ * Returns:
+ *   void
+ */
+static void
+mk_inc_matcher(ndmp_lbr_params_t *nlp)
+{
+	char **lpp, *pattern;
+
+	tlm_matcher_free(nlp->nlp_incm);
+	nlp->nlp_incm = NULL;
+	if (nlp->nlp_inc == NULL ||
+	    (nlp->nlp_incm = tlm_matcher_new()) == NULL)
+		return;
+
+	for (lpp = nlp->nlp_inc; *lpp != NULL; lpp++) {
+		pattern = *lpp;
+		if (strncmp(pattern, "./", 2) == 0)
+			pattern += 2;
+
+		if (tlm_matcher_add(nlp->nlp_incm, pattern) != 0) {
+			ndmpd_log(LOG_DEBUG,
+			    "Cannot compile the inclusion list");
+			tlm_matcher_free(nlp->nlp_incm);
+			nlp->nlp_incm = NULL;
+			return;
+		}
+	}
+}
+
 /*
  * get_exc_env_v3
  *
@@ -884,7 +1007,7 @@ get_exc_env_v3(ndmpd_module_params_t *params, ndmp_lbr_params_t *nlp)
         nlp->nlp_exl[exclude_count]=NULL;
         prl(nlp->nlp_exl);
 
-
+	mk_exc_matchers(nlp);
 }
 
 /*
@@ -916,6 +1039,8 @@ get_inc_env_v3(ndmpd_module_params_t *params, ndmp_lbr_params_t *nlp)
 		nlp->nlp_inc = split_env(envp, ',');
 		prl(nlp->nlp_inc);
 	}
+
+	mk_inc_matcher(nlp);
 }
 
 /*
@@ -1143,7 +1268,8 @@ backup_alloc_structs_v3(ndmpd_session_t *session, char *jname)
 		    xfer_size);
 	}
 
-	cmds->tcs_command = tlm_create_reader_writer_ipc(TRUE, xfer_size);
+	cmds->tcs_command = tlm_create_reader_writer_ipc(TRUE, xfer_size,
+	    ndmp_buffer_get_count(session));
 	if (!cmds->tcs_command) {
 		tlm_un_ref_job_stats(jname);
 		return (-1);
@@ -1206,7 +1332,8 @@ restore_alloc_structs_v3(ndmpd_session_t *session, char *jname)
 	(void) memset(cmds, 0, sizeof (*cmds));
 
 	xfer_size = ndmp_buffer_get_size(session);
-	cmds->tcs_command = tlm_create_reader_writer_ipc(FALSE, xfer_size);
+	cmds->tcs_command = tlm_create_reader_writer_ipc(FALSE, xfer_size,
+	    ndmp_buffer_get_count(session));
 	if (!cmds->tcs_command) {
 		tlm_un_ref_job_stats(jname);
 		return (-1);
@@ -1292,6 +1419,109 @@ mem_dump(const char *value, size_t size)
 	printf("\nend\n");
 }
 
+/*
+ * bk_get_acl
+ *
+ * Read the NFSv4 ACL of the entry being backed up into acl_info.  It
+ * is read once per entry: the change check and the LF_ACL record use
+ * the same text.  The descriptor opened by bk_open_file is used if
+ * there is one.
+ *
+ * Parameters:
+ *   tacl (input/output) - ACL and attributes of the entry
+ *   name (input) - path of the entry
+ *
+ * Returns:
+ *   void
+ */
+static void
+bk_get_acl(tlm_acls_t *tacl, char *name)
+{
+	acl_t acl;
+	char *acltp = NULL;
+	int acl_len = 0;
+
+	if (tacl->acl_info_read)
+		return;
+	tacl->acl_info_read = TRUE;
+
+	if (tacl->acl_fd != -1)
+		acl = acl_get_fd_np(tacl->acl_fd, ACL_TYPE_NFS4);
+	else
+		acl = acl_get_file(name, ACL_TYPE_NFS4);
+
+	if (acl && (acltp = acl_to_text(acl, 0)) != NULL)
+		acl_len = strlen(acltp);
+	if (acl != NULL)
+		acl_free(acl);
+
+	tacl->acl_info.attr_len = acl_len;
+	tacl->acl_info.attr_info = NULL;
+	if (acl_len > 0 &&
+	    (tacl->acl_info.attr_info = (char *)malloc(acl_len)) != NULL)
+		(void) strlcpy(tacl->acl_info.attr_info, acltp, acl_len);
+
+	if (acltp != NULL)
+		acl_free(acltp);
+}
+
+/*
+ * bk_open_file
+ *
+ * Open the regular file being backed up, so that its attributes, its
+ * ACL and its data all come from one descriptor.  The file is not
+ * used if it was replaced since the walker lstat'ed it.
+ *
+ * Parameters:
+ *   tacl (output) - acl_fd is set on success
+ *   name (input) - path of the file
+ *   stp (input/output) - attributes from the walker, refreshed
+ *
+ * Returns:
+ *   void
+ */
+static void
+bk_open_file(tlm_acls_t *tacl, char *name, struct stat *stp)
+{
+	struct stat st;
+	int fd;
+
+	if ((fd = open(name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK)) == -1)
+		return;
+
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) ||
+	    st.st_dev != stp->st_dev || st.st_ino != stp->st_ino) {
+		(void) close(fd);
+		return;
+	}
+
+	*stp = st;
+	tacl->acl_fd = fd;
+}
+
+/*
+ * bk_close_file
+ *
+ * Release what bk_open_file and bk_get_acl left behind, if the file
+ * was not backed up.
+ */
+static void
+bk_close_file(tlm_acls_t *tacl)
+{
+	if (tacl->acl_fd != -1) {
+		(void) close(tacl->acl_fd);
+		tacl->acl_fd = -1;
+	}
+
+	if (tacl->acl_info_read) {
+		free(tacl->acl_info.attr_info);
+		tacl->acl_info.attr_info = NULL;
+		tacl->acl_info.attr_len = 0;
+		tacl->acl_info_read = FALSE;
+	}
+	tacl->acl_id = 0;
+}
+
 /*
  * backup_dirv3
  *
@@ -1312,9 +1542,6 @@ backup_dirv3(bk_param_v3_t *bpp, fst_node_t *pnp,
     fst_node_t *enp)
 {
 	longlong_t apos, bpos;
-	acl_t acl = NULL;
-	char *acltp = NULL;
-	struct stat st;
 	char fullpath[TLM_MAX_PATH_NAME];
 	char *p;
 
@@ -1327,33 +1554,8 @@ backup_dirv3(bk_param_v3_t *bpp, fst_node_t *pnp,
 
 	ndmpd_log(LOG_DEBUG, "d(%s)", bpp->bp_tmp);
 
-	if (lstat(bpp->bp_tmp, &st) != 0)
-		return (0);
-
-	acl = acl_get_file(bpp->bp_tmp, ACL_TYPE_NFS4);
-     	int acl_len=0;
-     	int xattr_len=0;
-     	int acl_all_len=0;
-
-	if (acl && (acltp = acl_to_text(acl, 0)) != NULL)
-		acl_len= strlen(acltp);
-	if (acl != NULL)
-		acl_free(acl);
-
-	bpp->bp_tlmacl->acl_info.attr_len = acl_len;
-	bpp->bp_tlmacl->acl_info.attr_info = NULL;
-
-	acl_all_len =acl_len+xattr_len;
-	if (acl_all_len > 0) {
-		bpp->bp_tlmacl->acl_info.attr_info = (char*)malloc(acl_all_len);
-		if (bpp->bp_tlmacl->acl_info.attr_info != NULL) {
-			if (acl_len > 0)
-				(void) strlcpy(bpp->bp_tlmacl->acl_info.attr_info,acltp, acl_len);
-		}
-	}
-
-	if(acltp!=NULL)
-		acl_free(acltp);
+	/* the walker has already lstat'ed the entry, see timebk_v3 */
+	bk_get_acl(bpp->bp_tlmacl, bpp->bp_tmp);
 
 	bpos = tlm_get_data_offset(bpp->bp_lcmd);
 	p = bpp->bp_tmp + strlen(bpp->bp_chkpnm);
@@ -1399,9 +1601,6 @@ backup_filev3(bk_param_v3_t *bpp, fst_node_t *pnp,
 	char *ent;
 	longlong_t rv;
 	longlong_t apos, bpos;
-	acl_t acl = NULL;
-	char *acltp=NULL;
-	struct stat st;
 	char fullpath[TLM_MAX_PATH_NAME];
 	char *p;
 
@@ -1412,39 +1611,8 @@ backup_filev3(bk_param_v3_t *bpp, fst_node_t *pnp,
 
 	ndmpd_log(LOG_DEBUG, "f(%s)", bpp->bp_tmp);
 
-	if (lstat(bpp->bp_tmp, &st) != 0)
-		return (0);
-
-	if (!S_ISLNK(bpp->bp_tlmacl->acl_attr.st_mode)) {
-		acl = acl_get_file(bpp->bp_tmp, ACL_TYPE_NFS4);
-	     	int acl_len=0;
-	     	int xattr_len=0;
-	     	int acl_all_len=0;
-
-		if (acl && (acltp = acl_to_text(acl, 0)) != NULL) {
-			acl_len= strlen(acltp);
-		}
-
-		if (acl != NULL)
-			acl_free(acl);
-
-		bpp->bp_tlmacl->acl_info.attr_len = acl_len;
-		bpp->bp_tlmacl->acl_info.attr_info = NULL;
-
-		acl_all_len =acl_len+xattr_len;
-		if (acl_all_len > 0) {
-			bpp->bp_tlmacl->acl_info.attr_info = (char*)malloc(acl_all_len);
-			if (bpp->bp_tlmacl->acl_info.attr_info != NULL) {
-				if (acl_len > 0) {
-					(void) strlcpy(bpp->bp_tlmacl->acl_info.attr_info,acltp,
-						acl_len);
-				}
-			}
-		}
-	}
-
-	if(acltp!=NULL)
-		acl_free(acltp);
+	if (!S_ISLNK(bpp->bp_tlmacl->acl_attr.st_mode))
+		bk_get_acl(bpp->bp_tlmacl, bpp->bp_tmp);
 
 	bpos = tlm_get_data_offset(bpp->bp_lcmd);
 	ent = enp->tn_path ? enp->tn_path : "";
@@ -1546,7 +1714,7 @@ shouldskip(bk_param_v3_t *bpp, fst_node_t *pnp,
 	ndmpd_log(LOG_DEBUG, "********************shouldskip************************");
 
 	char *ent;
-	bool_t rv;
+	bool_t rv, excl;
 	struct stat *estp;
 
 	if (!bpp || !pnp || !enp || !errp) {
@@ -1564,12 +1732,21 @@ shouldskip(bk_param_v3_t *bpp, fst_node_t *pnp,
 	}
 
 	// exclude from client
-	if (tlm_is_excluded(pnp->tn_path, ent, bpp->bp_nlp->nlp_exl)) {
+	if (bpp->bp_nlp->nlp_exl_files != NULL)
+		excl = pnp->tn_path != NULL &&
+		    (tlm_matcher_match(bpp->bp_nlp->nlp_exl_dirs,
+		    pnp->tn_path) ||
+		    tlm_matcher_match(bpp->bp_nlp->nlp_exl_files, ent));
+	else
+		excl = tlm_is_excluded(pnp->tn_path, ent,
+		    bpp->bp_nlp->nlp_exl);
+
+	if (excl) {
 		rv = TRUE;
 		*errp = S_ISDIR(estp->st_mode) ? FST_SKIP : 0;
 		ndmpd_log(LOG_DEBUG, "excl %d \"%s/%s\"", *errp, pnp->tn_path, ent);
 	} else if (!S_ISDIR(estp->st_mode) &&
-	    !ininc(bpp->bp_nlp->nlp_inc, ent)) {
+	    !ininc(bpp->bp_nlp->nlp_inc, bpp->bp_nlp->nlp_incm, ent)) {
 		rv = TRUE;
 		*errp = 0;
 		ndmpd_log(LOG_DEBUG, "!in \"%s/%s\"", pnp->tn_path, ent);
@@ -1663,40 +1840,14 @@ int iscreated(ndmp_lbr_params_t *nlp, char *name, tlm_acls_t *tacl,
 {
 	ndmpd_log(LOG_DEBUG, "iscreated");
 
-	int ret;
-	acl_t acl = NULL;
-	char *acltp = NULL;
-
 	ndmpd_log(LOG_DEBUG, "flags %x", nlp->nlp_flags);
 
 	if (NLP_INCLMTIME(nlp) == FALSE)
 		return (0);
 
-        acl = acl_get_file(name, ACL_TYPE_NFS4);
-	int acllen= -1;
-	if (acl && (acltp = acl_to_text(acl, 0)) != NULL) {
-		acllen= strlen(acltp);
-	}
-	if (acl != NULL)
-		acl_free(acl);
-
-	ndmpd_log(LOG_DEBUG, "strlen of ACL=%d",acllen);
-
-	if (acllen > 0) {
-		tacl->acl_info.attr_info = (char*)malloc(acllen);
-		if (tacl->acl_info.attr_info != NULL) {
-			tacl->acl_info.attr_len = acllen;
-			(void) strlcpy(tacl->acl_info.attr_info,acltp, acllen);
-		}
-	} else {
-		tacl->acl_info.attr_len = 0;
-		tacl->acl_info.attr_info = NULL;
-	}
-
-	if (acltp != NULL)
-		acl_free(acltp);
+	bk_get_acl(tacl, name);
 
-	ndmpd_log(LOG_DEBUG, "tacl->acl_info.attr_info = %s",tacl->acl_info.attr_info);
+	ndmpd_log(LOG_DEBUG, "strlen of ACL=%d", tacl->acl_info.attr_len);
 
 	return (0);
 }
@@ -1728,6 +1879,7 @@ timebk_v3(void *arg, fst_node_t *pnp, fst_node_t *enp)
 	char *ent;
 	int rv;
 	time_t t;
+	bool_t changed;
 	bk_param_v3_t *bpp;
 	struct stat *stp;
 	fs_fhandle_t *fhp;
@@ -1774,15 +1926,26 @@ timebk_v3(void *arg, fst_node_t *pnp, fst_node_t *enp)
 		bpp->bp_tlmacl->acl_dir_fh = *fhp;
 
 		(void) ndmpd_fhdir_v3_cb(bpp->bp_nlp->nlp_logcallbacks,
-		    bpp->bp_tmp, stp);
+		    bpp->bp_tmp, stp, pnp->tn_ents, pnp->tn_nents);
 
 		if (ischngd(stp, t, bpp->bp_nlp)) {
 			(void) memcpy(&bpp->bp_tlmacl->acl_attr, stp,
 			    sizeof (struct stat));
 			rv = backup_dirv3(bpp, pnp, enp);
 		}
+		bk_close_file(bpp->bp_tlmacl);
 	} else {
-		if (ischngd(stp, t, bpp->bp_nlp) ||
+		changed = ischngd(stp, t, bpp->bp_nlp);
+
+		/*
+		 * Open a regular file once, if its ACL or data will be
+		 * read, instead of resolving its path for each of them.
+		 */
+		if (S_ISREG(stp->st_mode) &&
+		    (changed || NLP_INCLMTIME(bpp->bp_nlp)))
+			bk_open_file(bpp->bp_tlmacl, bpp->bp_tmp, stp);
+
+		if (changed ||
 		    iscreated(bpp->bp_nlp, bpp->bp_tmp, bpp->bp_tlmacl, t)) {
 			rv = 0;
 			(void) memcpy(&bpp->bp_tlmacl->acl_attr, stp, sizeof (struct stat));
@@ -1792,6 +1955,7 @@ timebk_v3(void *arg, fst_node_t *pnp, fst_node_t *enp)
 
 			(void) backup_filev3(bpp, pnp, enp);
 		}
+		bk_close_file(bpp->bp_tlmacl);
 	}
 
 	return (rv);
@@ -1842,6 +2006,7 @@ backup_reader_v3(backup_reader_arg_t *argp)
 	cmds->tcs_reader_count++;
 
 	(void) memset(&tlm_acls, 0, sizeof (tlm_acls));
+	tlm_acls.acl_fd = -1;
 
 	/* NDMP parameters */
 	bp.bp_session = nlp->nlp_session;
@@ -1896,6 +2061,7 @@ backup_reader_v3(backup_reader_arg_t *argp)
 
 	ft.ft_arg = &bp;
 	ft.ft_flags = FST_VERBOSE;	/* Solaris */
+	ft.ft_nthreads = ndmp_scan_get_threads(nlp->nlp_session);
 
 	/* take into account the header written to the stream so far */
 	n = tlm_get_data_offset(lcmd);
@@ -1917,8 +2083,9 @@ backup_reader_v3(backup_reader_arg_t *argp)
 	NDMP_FREE(bp.bp_tmp);
 	NDMP_FREE(bp.bp_excls);
 
-	cmds->tcs_reader_count--;
 	lcmd->tc_writer = TLM_STOP;
+	tlm_buffer_shutdown(lcmd->tc_buffers);
+	cmds->tcs_reader_count--;
 	tlm_release_reader_writer_ipc(lcmd);
 	tlm_un_ref_job_stats(jname);
 
@@ -1976,62 +2143,59 @@ ndmp_tar_reader_v3(ndmp_tar_reader_arg_t *argp)
 	buf = tlm_buffer_in_buf(bufs, &bidx);
 	while (cmds->tcs_reader == TLM_RESTORE_RUN &&
 	    lcmd->tc_reader == TLM_RESTORE_RUN) {
-		(void)pthread_yield();
 		if (buf->tb_full) {
 			/*
 			 * The buffer is still full, wait for the consumer
 			 * thread to use it.
 			 */
-			tlm_buffer_out_buf_timed_wait(bufs, 100);
-			buf = tlm_buffer_in_buf(bufs, NULL);
-		} else {
-
-			if(buf->tb_read_buf_read){
-				(void) mutex_lock(&bufs->tbs_mtx);
-				if ((err = MOD_READ(mod_params, buf->tb_buffer_data,
-						bufs->tbs_data_transfer_size)) != 0){
-					if (err < 0) {
-						ndmpd_log(LOG_DEBUG, 
-							"Reading buffer %d, pos: %lld",
-							bidx, session->ns_mover.md_position);
-
-						/* Force the writer to stop. */
-						buf->tb_eot = buf->tb_eof = TRUE;
-					} else if (err == 1) {
-						ndmpd_log(LOG_DEBUG,
-							"operation aborted or session terminated");
-						err = 0;
-					} else {
-						ndmpd_log(LOG_DEBUG, "force terminated");
-						err = 0;
-					}
-
-					(void) mutex_unlock(&bufs->tbs_mtx);
-
-					MOD_LOGV3(mod_params, NDMP_LOG_ERROR,
-						"Read from remote error. Restore stopped.\n");
-					// gracefully stop
-					cmds->tcs_reader = TLM_STOP;
-					lcmd->tc_reader = TLM_STOP;
-					continue;
-				}
-
-				buf->tb_read_buf_read = FALSE;
+			tlm_buffer_out_buf_wait(bufs);
+			continue;
+		}
 
-				// read buffer success
-				buf->tb_eof = buf->tb_eot = FALSE;
-				buf->tb_errno = 0;
-				buf->tb_buffer_size = bufs->tbs_data_transfer_size;
-				buf->tb_buffer_spot = 0;
-				buf->tb_full = TRUE;
-				(void) mutex_unlock(&bufs->tbs_mtx);
+		/*
+		 * The consumer may read a large file straight from the
+		 * data connection, keep off the stream meanwhile.
+		 */
+		if (tlm_buffer_pause_wait(bufs))
+			continue;
 
-				(void) tlm_buffer_advance_in_idx(bufs);
+		if ((err = MOD_READ(mod_params, buf->tb_buffer_data,
+		    bufs->tbs_data_transfer_size)) != 0) {
+			if (err < 0) {
+				ndmpd_log(LOG_DEBUG,
+				    "Reading buffer %d, pos: %lld",
+				    bidx, session->ns_mover.md_position);
 
-				buf = tlm_buffer_in_buf(bufs, &bidx);
-				tlm_buffer_release_in_buf(bufs);
+				/* Force the writer to stop. */
+				buf->tb_eot = buf->tb_eof = TRUE;
+			} else if (err == 1) {
+				ndmpd_log(LOG_DEBUG,
+				    "operation aborted or session terminated");
+				err = 0;
+			} else {
+				ndmpd_log(LOG_DEBUG, "force terminated");
+				err = 0;
 			}
+
+			MOD_LOGV3(mod_params, NDMP_LOG_ERROR,
+			    "Read from remote error. Restore stopped.\n");
+			// gracefully stop
+			cmds->tcs_reader = TLM_STOP;
+			lcmd->tc_reader = TLM_STOP;
+			continue;
 		}
+
+		// read buffer success
+		buf->tb_eof = buf->tb_eot = FALSE;
+		buf->tb_errno = 0;
+		buf->tb_buffer_size = bufs->tbs_data_transfer_size;
+		buf->tb_buffer_spot = 0;
+		buf->tb_full = TRUE;
+
+		(void) tlm_buffer_advance_in_idx(bufs);
+
+		buf = tlm_buffer_in_buf(bufs, &bidx);
+		tlm_buffer_release_in_buf(bufs);
 	}
 
 	/*
@@ -2039,7 +2203,7 @@ ndmp_tar_reader_v3(ndmp_tar_reader_arg_t *argp)
 	 * we're quiting.
 	 */
 	lcmd->tc_writer = TLM_STOP;
-	tlm_buffer_release_in_buf(bufs);
+	tlm_buffer_shutdown(bufs);
 
 	/*
 	 * Clean up.
@@ -2054,6 +2218,57 @@ ndmp_tar_reader_v3(ndmp_tar_reader_arg_t *argp)
 
 // control the reader thread.
 int FORCE_STOP_TRAVEL;
+
+/*
+ * ndmp_send_section_v3
+ *
+ * Send a buffer that ends with the header of a file section, then the
+ * section straight from the file, then its padding to a whole record.
+ * If the file got shorter the rest is zero filled, as the header has
+ * been sent already.  The file is closed.
+ *
+ * Returns:
+ *   0: on success
+ *   -1: otherwise
+ */
+static int
+ndmp_send_section_v3(ndmpd_module_params_t *mod_params, tlm_buffer_t *buf)
+{
+	static char zero[RECORDSIZE];
+	longlong_t len;
+	long n;
+	int err;
+
+	err = 0;
+	if (buf->tb_buffer_spot > 0 && MOD_WRITE(mod_params,
+	    buf->tb_buffer_data, buf->tb_buffer_spot) != 0)
+		err = -1;
+
+	len = buf->tb_send_len;
+	if (err == 0) {
+		n = MOD_SENDFILE(mod_params, buf->tb_send_fd,
+		    buf->tb_send_off, len);
+		if (n < 0)
+			err = -1;
+		else
+			len -= n;
+	}
+	if (err == 0 && len > 0)
+		ndmpd_log(LOG_DEBUG, "file got shorter by %lld bytes", len);
+
+	len += -buf->tb_send_len & (RECORDSIZE - 1);
+	for (; err == 0 && len > 0; len -= n) {
+		n = llmin(len, RECORDSIZE);
+		if (MOD_WRITE(mod_params, zero, n) != 0)
+			err = -1;
+	}
+
+	(void) close(buf->tb_send_fd);
+	buf->tb_send_len = 0;
+
+	return (err);
+}
+
 /*
  * ndmpd_tar_write_v3
  *
@@ -2105,69 +2320,57 @@ ndmp_tar_writer_v3(ndmpd_session_t *session,
 
 	while (cmds->tcs_writer != (int)TLM_ABORT &&
 	    lcmd->tc_writer != (int)TLM_ABORT) {
-		(void)pthread_yield();
-		if (buf->tb_full) {
-			// we will only do really write if the content of buffer is filled.
-			if (buf->tb_write_buf_filled) {
-				(void) mutex_lock(&bufs->tbs_mtx);
-				if (MOD_WRITE(mod_params, buf->tb_buffer_data,
-					buf->tb_buffer_size) != 0) {
-					ndmpd_log(LOG_DEBUG,
-						"Writing buffer %d, pos: %lld",
-						bidx, session->ns_mover.md_position);
-					err = -1;
-
-					(void) mutex_unlock(&bufs->tbs_mtx);
-					// gracefully stop,
-					cmds->tcs_writer = (int)TLM_ABORT;
-					lcmd->tc_writer = (int)TLM_ABORT;
-					MOD_LOGV3(mod_params, NDMP_LOG_ERROR,
-						"Write to remote error. Backup stopped.\n");
-					continue;
-				}
-
-				buf->tb_write_buf_filled = FALSE;
-				buf->tb_full = buf->tb_eof = buf->tb_eot = FALSE;
-				buf->tb_errno = 0;
-
-				(void) mutex_unlock(&bufs->tbs_mtx);
-
-				(void) tlm_buffer_advance_out_idx(bufs);
-				buf = tlm_buffer_out_buf(bufs, &bidx);
-
-				tlm_buffer_release_out_buf(bufs);
-				nw++;
-			}
-		} else {
+		if (!buf->tb_full) {
 			if (lcmd->tc_writer != TLM_BACKUP_RUN) {
+				/*
+				 * The reader fills its last buffer before
+				 * it stops, so look once more.
+				 */
+				if (buf->tb_full)
+					continue;
 				ndmpd_log(LOG_DEBUG,
 				    "tc_writer!=TLM_BACKUP_RUN; time to exit");
 				break;
-			} else {
+			}
 
-				tlm_buffer_in_buf_timed_wait(bufs, 100);
+			tlm_buffer_in_buf_wait(bufs);
+			continue;
+		}
 
-			}
+		if (buf->tb_send_len > 0)
+			err = ndmp_send_section_v3(mod_params, buf);
+		else
+			err = MOD_WRITE(mod_params, buf->tb_buffer_data,
+			    buf->tb_buffer_size);
+		if (err != 0) {
+			ndmpd_log(LOG_DEBUG,
+			    "Writing buffer %d, pos: %lld",
+			    bidx, session->ns_mover.md_position);
+			err = -1;
+
+			// gracefully stop,
+			cmds->tcs_writer = (int)TLM_ABORT;
+			lcmd->tc_writer = (int)TLM_ABORT;
+			MOD_LOGV3(mod_params, NDMP_LOG_ERROR,
+			    "Write to remote error. Backup stopped.\n");
+			continue;
 		}
+
+		tlm_buffer_mark_empty(buf);
+
+		(void) tlm_buffer_advance_out_idx(bufs);
+		buf = tlm_buffer_out_buf(bufs, &bidx);
+
+		tlm_buffer_release_out_buf(bufs);
+		nw++;
 	}
-	cmds->tcs_writer_count--;
 	lcmd->tc_reader = TLM_STOP;
+	tlm_buffer_shutdown(bufs);
+	cmds->tcs_writer_count--;
 	lcmd->tc_ref--;
 	return (err);
 }
 
-void setWriteBufDone(tlm_buffers_t *bufs){
-	(void) mutex_lock(&bufs->tbs_mtx);
-	bufs->tbs_buffer[bufs->tbs_buffer_out ].tb_write_buf_filled = TRUE;
-	(void) mutex_unlock(&bufs->tbs_mtx);
-}
-
-void setReadBufDone(tlm_buffers_t *bufs){
-	(void) mutex_lock(&bufs->tbs_mtx);
-	bufs->tbs_buffer[bufs->tbs_buffer_in].tb_read_buf_read = TRUE;
-	(void) mutex_unlock(&bufs->tbs_mtx);
-}
-
 /*
  * ndmp_write_utf8magic_v3
  *
@@ -2187,8 +2390,6 @@ ndmp_write_utf8magic_v3(tlm_cmd_t *cmd)
 		return (-1);
 	}
 
-	setWriteBufDone(cmd->tc_buffers);
-
 	cp = tlm_get_write_buffer(RECORDSIZE, &actual_size,
 	    cmd->tc_buffers, TRUE);
 	if (actual_size < RECORDSIZE) {
@@ -2199,8 +2400,6 @@ ndmp_write_utf8magic_v3(tlm_cmd_t *cmd)
 
 	(void) strlcpy(cp, NDMPUTF8MAGIC, RECORDSIZE);
 
-	setWriteBufDone(cmd->tc_buffers);
-
 	return (0);
 }
 
@@ -2259,6 +2458,16 @@ tar_backup_v3(ndmpd_session_t *session, ndmpd_module_params_t *params,
 		cmds->tcs_reader = cmds->tcs_writer = TLM_BACKUP_RUN;
 		cmds->tcs_command->tc_reader = TLM_BACKUP_RUN;
 		cmds->tcs_command->tc_writer = TLM_BACKUP_RUN;
+		cmds->tcs_command->tc_sendfile =
+		    (params->mp_sendfile_func != NULL &&
+		    session->ns_data.dd_data_addr.addr_type == NDMP_ADDR_TCP);
+		/*
+		 * A DAR seeks past the ACL definitions before the entry,
+		 * so the backups that allow it write each ACL in full.
+		 */
+		if (ndmpd_get_prop_yorn(NDMP_ACL_DEDUP) &&
+		    !NLP_ISSET(nlp, NLPF_DIRECT))
+			cmds->tcs_command->tc_acl_tab = tlm_acl_tab_new();
 
 		if (ndmp_write_utf8magic_v3(cmds->tcs_command) < 0) {
 			free_structs_v3(session, jname);
@@ -2682,7 +2891,8 @@ restore_dar_alloc_structs_v3(ndmpd_session_t *session, char *jname)
 	(void) memset(cmds, 0, sizeof (*cmds));
 
 	xfer_size = ndmp_buffer_get_size(session);
-	cmds->tcs_command = tlm_create_reader_writer_ipc(FALSE, xfer_size);
+	cmds->tcs_command = tlm_create_reader_writer_ipc(FALSE, xfer_size,
+	    ndmp_buffer_get_count(session));
 	if (!cmds->tcs_command) {
 		tlm_un_ref_job_stats(jname);
 		return (-1);
@@ -2743,8 +2953,11 @@ ndmpd_rs_sar_tar_v3(ndmpd_session_t *session, ndmpd_module_params_t *params,
 	if (!session->ns_data.dd_abort && !session->ns_data.dd_abort) {
 		cmds = &nlp->nlp_cmds;
 		cmds->tcs_reader = cmds->tcs_writer = TLM_RESTORE_RUN;
+		cmds->tcs_writer_threads = ndmp_restore_get_threads(session);
 		cmds->tcs_command->tc_reader = TLM_RESTORE_RUN;
 		cmds->tcs_command->tc_writer = TLM_RESTORE_RUN;
+		cmds->tcs_command->tc_read_func = params->mp_read_func;
+		cmds->tcs_command->tc_read_cookie = params->mp_daemon_cookie;
 
 		ndmpd_log(LOG_DEBUG, "Restoring to \"%s\" started.",
 		    (nlp->nlp_restore_path) ? nlp->nlp_restore_path : "NULL");
@@ -2780,6 +2993,10 @@ ndmpd_rs_sar_tar_v3(ndmpd_session_t *session, ndmpd_module_params_t *params,
 			    nlp->nlp_jstat, &rn, 1, 1, sels, &excl, flags, 0,
 			    session->hardlink_q);
 
+		/* Tell the reader we do not need any more data. */
+		cmds->tcs_command->tc_reader = TLM_STOP;
+		tlm_buffer_shutdown(cmds->tcs_command->tc_buffers);
+
 		cmds->tcs_writer_count--;
 		cmds->tcs_command->tc_ref--;
 
@@ -2831,12 +3048,154 @@ ndmpd_rs_sar_tar_v3(ndmpd_session_t *session, ndmpd_module_params_t *params,
 	return (err);
 }
 
+/*
+ * The DAR entries in the order of their position in the backup image.
+ */
+typedef struct dar_ent {
+	u_longlong_t de_fh_info;
+	int de_idx;
+} dar_ent_t;
+
+static int
+dar_ent_cmp(const void *p1, const void *p2)
+{
+	const dar_ent_t *e1 = p1;
+	const dar_ent_t *e2 = p2;
+
+	if (e1->de_fh_info != e2->de_fh_info)
+		return ((e1->de_fh_info < e2->de_fh_info) ? -1 : 1);
+
+	return (e1->de_idx - e2->de_idx);
+}
+
+/*
+ * ndmpd_dar_tar_v3
+ *
+ * Restore one entry of the restore list.  The mover is asked for the
+ * data starting at the fh_info of the entry, and tar_getdir returns as
+ * soon as the entry has been restored.  A directory is read on to the
+ * end of the image since its children follow it.
+ *
+ * Parameters:
+ *   session (input) - pointer to the session
+ *   params (input) - pointer to the parameters structure
+ *   nlp (input) - pointer to the nlp structure
+ *   jname (input) - job name
+ *   dar_index (input) - index of the entry in the restore list
+ *
+ * Returns:
+ *   0: on success
+ *   -1: on error
+ */
+static int
+ndmpd_dar_tar_v3(ndmpd_session_t *session, ndmpd_module_params_t *params,
+    ndmp_lbr_params_t *nlp, char *jname, int dar_index)
+{
+	char *excl;
+	char **sels;
+	int flags;
+	int err;
+	tlm_commands_t *cmds;
+	struct rs_name_maker rn;
+	ndmp_tar_reader_arg_t arg;
+	pthread_t rdtp;
+	mem_ndmp_name_v3_t *ep;
+
+	ep = (mem_ndmp_name_v3_t *)MOD_GETNAME(params, dar_index);
+	if (!ep) {
+		ndmpd_log(LOG_DEBUG, "Can't get entry %d", dar_index);
+		return (-1);
+	}
+
+	ndmpd_log(LOG_DEBUG, "DAR entry %d [%s] fh_info %llu", dar_index,
+	    ep->nm3_opath, ep->nm3_fh_info);
+
+	sels = setupsels(session, params, nlp, dar_index + 1);
+	if (!sels)
+		return (-1);
+	excl = NULL;
+	flags = RSFLG_OVR_ALWAYS;
+	rn.rn_nlp = nlp;
+	rn.rn_fp = mknewname;
+
+	if (restore_dar_alloc_structs_v3(session, jname) < 0) {
+		NDMP_FREE(sels);
+		return (-1);
+	}
+
+	/*
+	 * Start with one buffer worth of data, the reader asks for the
+	 * rest of a file based on its size once the header is parsed.
+	 */
+	if (MOD_SEEK(params, ep->nm3_fh_info,
+	    ndmp_buffer_get_size(session)) < 0) {
+		ndmpd_log(LOG_DEBUG, "Seeking to %llu", ep->nm3_fh_info);
+		tlm_release_reader_writer_ipc(nlp->nlp_cmds.tcs_command);
+		nlp->nlp_cmds.tcs_command = NULL;
+		NDMP_FREE(sels);
+		return (-1);
+	}
+
+	cmds = &nlp->nlp_cmds;
+	cmds->tcs_reader = cmds->tcs_writer = TLM_RESTORE_RUN;
+	cmds->tcs_writer_threads = ndmp_restore_get_threads(session);
+	cmds->tcs_command->tc_reader = TLM_RESTORE_RUN;
+	cmds->tcs_command->tc_writer = TLM_RESTORE_RUN;
+	cmds->tcs_command->tc_read_func = params->mp_read_func;
+	cmds->tcs_command->tc_read_cookie = params->mp_daemon_cookie;
+
+	arg.tr_session = session;
+	arg.tr_mod_params = params;
+	arg.tr_cmds = cmds;
+
+	(void) pthread_barrier_init(&arg.br_barrier, 0, 2);
+
+	err = pthread_create(&rdtp, NULL, (funct_t)ndmp_tar_reader_v3,
+	    (void *)&arg);
+	if (err == 0) {
+		(void) pthread_barrier_wait(&arg.br_barrier);
+	} else {
+		(void) pthread_barrier_destroy(&arg.br_barrier);
+		ndmpd_log(LOG_DEBUG, "Launch ndmp_tar_reader_v3: %m");
+		tlm_release_reader_writer_ipc(cmds->tcs_command);
+		cmds->tcs_command = NULL;
+		NDMP_FREE(sels);
+		return (-1);
+	}
+
+	cmds->tcs_command->tc_ref++;
+	cmds->tcs_writer_count++;
+
+	if (tm_tar_ops.tm_getdir != NULL)
+		err = (tm_tar_ops.tm_getdir)(cmds, cmds->tcs_command,
+		    nlp->nlp_jstat, &rn, 1, 1, sels, &excl, flags,
+		    dar_index + 1, session->hardlink_q);
+
+	/* Tell the reader we do not need any more data. */
+	cmds->tcs_command->tc_reader = TLM_STOP;
+	tlm_buffer_shutdown(cmds->tcs_command->tc_buffers);
+
+	cmds->tcs_writer_count--;
+	cmds->tcs_command->tc_ref--;
+
+	ndmp_stop_local_reader(session, cmds);
+
+	(void) pthread_join(rdtp, NULL);
+	(void) pthread_barrier_destroy(&arg.br_barrier);
+
+	tlm_release_reader_writer_ipc(cmds->tcs_command);
+	cmds->tcs_command = NULL;
+	NDMP_FREE(sels);
+
+	return (err);
+}
+
 /*
  * ndmpd_rs_dar_tar_v3
  *
- * Main DAR function. It calls the constructor, then for each entry it
- * calls the locate_window_v3 to find the exact position of the file. Then
- * it restores the file.
+ * Main DAR function. It sorts the restore list by the position of the
+ * entries in the backup image, so that the mover only moves forward, and
+ * restores each entry from its own seek window.
  * When all restore requests are done it calls the deconstructor to clean
  * everything up.
  *
@@ -2853,7 +3212,79 @@ static int
 ndmpd_rs_dar_tar_v3(ndmpd_session_t *session, ndmpd_module_params_t *params,
     ndmp_lbr_params_t *nlp)
 {
-	return ndmpd_rs_sar_tar_v3(session, params,nlp);
+	char jname[MAX_BACKUP_JOB_NAME];
+	dar_ent_t *ents;
+	mem_ndmp_name_v3_t *ep;
+	int i, n;
+	int err;
+
+	ndmpd_log(LOG_DEBUG, "++++++++ndmpd_rs_dar_tar_v3++++++++");
+	err = 0;
+	(void) ndmp_new_job_name(jname);
+	if (restore_alloc_structs_v3(session, jname) < 0)
+		return (-1);
+
+	/* Each entry gets its own reader writer IPC. */
+	tlm_release_reader_writer_ipc(nlp->nlp_cmds.tcs_command);
+	nlp->nlp_cmds.tcs_command = NULL;
+
+	n = session->ns_data.dd_nlist_len;
+	ents = ndmp_malloc(sizeof (dar_ent_t) * (n + 1));
+	if (!ents) {
+		MOD_LOGV3(params, NDMP_LOG_ERROR, "Insufficient memory.\n");
+		free_structs_v3(session, jname);
+		return (-1);
+	}
+	for (i = 0; i < n; i++) {
+		ep = (mem_ndmp_name_v3_t *)MOD_GETNAME(params, i);
+		ents[i].de_fh_info = ep ? ep->nm3_fh_info : 0;
+		ents[i].de_idx = i;
+	}
+	qsort(ents, n, sizeof (dar_ent_t), dar_ent_cmp);
+
+	nlp->nlp_jstat->js_start_ltime = time(NULL);
+	nlp->nlp_jstat->js_start_time = nlp->nlp_jstat->js_start_ltime;
+
+	ndmpd_log(LOG_DEBUG, "Restoring %d entries to \"%s\" started.", n,
+	    (nlp->nlp_restore_path) ? nlp->nlp_restore_path : "NULL");
+
+	for (i = 0; i < n; i++) {
+		if (session->ns_data.dd_abort || session->ns_eof)
+			break;
+
+		err = ndmpd_dar_tar_v3(session, params, nlp, jname,
+		    ents[i].de_idx);
+		if (err != 0) {
+			ndmpd_log(LOG_DEBUG, "DAR entry %d failed",
+			    ents[i].de_idx);
+			break;
+		}
+	}
+
+	nlp->nlp_jstat->js_stop_time = time(NULL);
+
+	/* Send the list of un-recovered files/dirs to the client.  */
+	(void) send_unrecovered_list_v3(params, nlp);
+
+	ndmp_stop_remote_reader(session);
+
+	if (session->ns_eof)
+		err = -1;
+
+	if (session->ns_data.dd_abort) {
+		ndmpd_log(LOG_DEBUG, "Restoring to \"%s\" aborted.",
+		    (nlp->nlp_restore_path) ? nlp->nlp_restore_path : "NULL");
+		err = -1;
+	} else {
+		ndmpd_log(LOG_DEBUG, "Restoring to \"%s\" finished. (%d)",
+		    (nlp->nlp_restore_path) ? nlp->nlp_restore_path : "NULL",
+		    err);
+	}
+
+	free(ents);
+	free_structs_v3(session, jname);
+	ndmpd_log(LOG_DEBUG, "--------ndmpd_rs_dar_tar_v3--------");
+	return (err);
 }
 
 
@@ -2916,6 +3347,7 @@ ndmp_backup_get_params_v3(ndmpd_session_t *session,
 	ndmpd_log(LOG_DEBUG, "flags %x", nlp->nlp_flags);
 
 	get_hist_env_v3(params, nlp);
+	get_direct_env_v3(params, nlp);
 	get_exc_env_v3(params, nlp);
 	get_inc_env_v3(params, nlp);
 	get_snap_env_v3(params, nlp);
@@ -2983,6 +3415,9 @@ ndmpd_tar_backup_starter_v3(ndmpd_module_params_t *params)
 	if (err == 0)
 		save_backup_date_v3(params, nlp);
 
+	/* the hardlinks of this job mean nothing to the next one */
+	hardlink_q_reset(session->hardlink_q);
+
 	/* call finish up function	*/
 	MOD_DONE(params, err);
 	/* nlp_params is allocated in start_backup_v3() */
@@ -3024,6 +3459,55 @@ ndmpd_tar_backup_abort_v3(void *module_cookie)
 	return (0);
 }
 
+/*
+ * dar_possible_v3
+ *
+ * Direct access restore needs a mover that can position the data
+ * stream: either a remote mover, which can be asked for a window of
+ * it, or an open local virtual tape that ndmpd_local_seek_v3 can seek
+ * in.  It also needs a valid data stream offset for every entry of
+ * the restore list.
+ *
+ * Parameters:
+ *   session (input) - pointer to the session
+ *   params (input) - pointer to the parameters structure
+ *
+ * Returns:
+ *   TRUE: if DAR can be done
+ *   FALSE: otherwise
+ */
+static bool_t
+dar_possible_v3(ndmpd_session_t *session, ndmpd_module_params_t *params)
+{
+	mem_ndmp_name_v3_t *ep;
+	int i;
+
+	switch (session->ns_data.dd_data_addr.addr_type) {
+	case NDMP_ADDR_TCP:
+		break;
+	case NDMP_ADDR_LOCAL:
+		if (session->ns_mover.md_tape_fd == -1 ||
+		    lseek(session->ns_mover.md_tape_fd, 0, SEEK_CUR) == -1) {
+			ndmpd_log(LOG_DEBUG, "local tape can't be positioned");
+			return (FALSE);
+		}
+		break;
+	default:
+		ndmpd_log(LOG_DEBUG, "DAR needs a seekable mover");
+		return (FALSE);
+	}
+
+	for (i = 0; i < session->ns_data.dd_nlist_len; i++) {
+		ep = (mem_ndmp_name_v3_t *)MOD_GETNAME(params, i);
+		if (!ep || ep->nm3_fh_info == DAR_INVALID_FH_INFO) {
+			ndmpd_log(LOG_DEBUG, "No fh_info for nlist[%d]", i);
+			return (FALSE);
+		}
+	}
+
+	return (TRUE);
+}
+
 /*
  * ndmp_restore_get_params_v3
  *
@@ -3059,6 +3543,14 @@ ndmp_restore_get_params_v3(ndmpd_session_t *session,
 		ndmpd_log(LOG_DEBUG, "fix_nlist_v3: %d", rv);
 	} else {
 		rv = NDMP_NO_ERR;
+		get_direct_env_v3(params, nlp);
+		if (NLP_ISSET(nlp, NLPF_DIRECT) && !dar_possible_v3(session,
+		    params)) {
+			MOD_LOGV3(params, NDMP_LOG_WARNING,
+			    "Direct access restore is not possible, "
+			    "restoring the whole image.\n");
+			NLP_UNSET(nlp, NLPF_DIRECT);
+		}
 		log_rs_params_v3(session, params, nlp);
 	}
 	ndmpd_log(LOG_DEBUG, "--------ndmp_restore_get_params_v3--------");
@@ -3095,6 +3587,9 @@ ndmpd_tar_restore_starter_v3(ndmpd_module_params_t *params)
 	else
 		err = ndmpd_rs_sar_tar_v3(session, params, nlp);
 
+	/* the hardlinks of this job mean nothing to the next one */
+	hardlink_q_reset(session->hardlink_q);
+
 	MOD_DONE(params, err);
 	/* nlp_params is allocated in start_recover() */
 	NDMP_FREE(nlp->nlp_params);
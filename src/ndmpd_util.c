@@ -51,6 +51,8 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/event.h>
+#include <poll.h>
 
 /*	snprintf	*/
 #include <stdio.h>
@@ -85,6 +87,8 @@ static bool_t ndmp_dump_path_node = FALSE;
  */
 static bool_t ndmp_tar_path_node = FALSE;
 
+static void ndmpd_kq_disarm(ndmpd_session_t *, ndmpd_file_handler_t *);
+
 
 /*
  * Should the 'st_ctime' be ignored during incremental level backup?
@@ -115,6 +119,31 @@ static bool_t ndmp_fhinode = FALSE;
 extern int ndmp_force_bk_dirs;
 int ndmp_force_bk_dirs  = 1;
 
+/*
+ * Number of rotating buffers used between the tar reader/writer and
+ * the mover.  It can be overridden per session by the TAPE_BUFFERS
+ * environment variable.
+ */
+static int ndmp_tape_buffers = TLM_TAPE_BUFFERS;
+
+/*
+ * Number of threads scanning the file system during a backup.  It can
+ * be overridden per session by the SCAN_THREADS environment variable.
+ */
+static int ndmp_scan_threads = 1;
+
+/*
+ * Number of threads writing the files during a restore.  It can be
+ * overridden per session by the RESTORE_THREADS environment variable.
+ */
+static int ndmp_restore_threads = 1;
+
+/*
+ * Number of pre-forked processes accepting the connections, 0 if a
+ * process is forked for each connection.
+ */
+static int ndmp_session_workers = 0;
+
 /*
  * List of things to be exluded from backup.
  */
@@ -164,6 +193,7 @@ ndmpd_add_file_handler(ndmpd_session_t *session, void *cookie, int fd,
 	new->fh_mode = mode;
 	new->fh_class = class;
 	new->fh_func = func;
+	new->fh_armed = FALSE;	/* see ndmpd_select */
 	new->fh_next = session->ns_file_handler_list;
 	session->ns_file_handler_list = new;
 
@@ -194,6 +224,8 @@ ndmpd_remove_file_handler(ndmpd_session_t *session, int fd)
 		handler = *last;
 		if (handler->fh_fd == fd) {
 			*last = handler->fh_next;
+			if (handler->fh_armed)
+				ndmpd_kq_disarm(session, handler);
 			(void) free(handler);
 			return (1);
 		}
@@ -219,21 +251,19 @@ ndmpd_remove_file_handler(ndmpd_session_t *session, int fd)
 int
 ndmp_connection_closed(int fd)
 {
-	fd_set fds;
+	struct pollfd pfd;
 	int closed, ret;
-	struct timeval timeout;
 
 	if (fd < 0) /* We are not using the mover */
 		return (-1);
 
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 1000;
-
-	FD_ZERO(&fds);
-	FD_SET(fd, &fds);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
 
-	ret = select(FD_SETSIZE, &fds, NULL, NULL, &timeout);
-	closed = (ret == -1 && errno == EBADF);
+	ret = poll(&pfd, 1, 1);
+	closed = ((ret == -1 && errno == EBADF) ||
+	    (ret > 0 && (pfd.revents & POLLNVAL)));
 
 	return (closed);
 }
@@ -284,10 +314,133 @@ ndmp_check_mover_state(ndmpd_session_t *session)
 	}
 }
 
+/*
+ * The file handlers of a session are watched with a kqueue.  Each pass
+ * of ndmpd_select registers the handlers of the classes it examines
+ * that are not yet, and unregisters those of the other classes, so
+ * that a ready descriptor nobody is going to serve does not wake it up
+ * again and again.  A handler is also unregistered when it is removed.
+ * A periodic timer wakes a blocked ndmpd_select up for the mover and
+ * idle checks, so nothing runs while the session is idle and the
+ * requests are served as soon as they come.
+ */
+#define	NDMPD_KQ_TIMER		0	/* ident of the timer */
+#define	NDMPD_KQ_EVENTS		16
+#define	NDMPD_CHECK_SECS	10	/* mover state check period */
+#define	NDMPD_IDLE_SECS		90	/* give up a blocked session */
+
+/*
+ * ndmpd_kq_disarm
+ *
+ * Stop watching the file descriptor of a handler.  It fails
+ * harmlessly if the descriptor has been closed already.
+ */
+static void
+ndmpd_kq_disarm(ndmpd_session_t *session, ndmpd_file_handler_t *handler)
+{
+	struct kevent kev[2];
+	int n = 0;
+
+	if (session->ns_kq == -1)
+		return;
+
+	if (handler->fh_mode & NDMPD_SELECT_MODE_WRITE)
+		EV_SET(&kev[n++], handler->fh_fd, EVFILT_WRITE, EV_DELETE,
+		    0, 0, NULL);
+	if (handler->fh_mode &
+	    (NDMPD_SELECT_MODE_READ | NDMPD_SELECT_MODE_EXCEPTION))
+		EV_SET(&kev[n++], handler->fh_fd, EVFILT_READ, EV_DELETE,
+		    0, 0, NULL);
+
+	if (n > 0)
+		(void) kevent(session->ns_kq, kev, n, NULL, 0, NULL);
+	handler->fh_armed = FALSE;
+}
+
+/*
+ * ndmpd_kq_arm
+ *
+ * Create the kqueue of the session if needed, register the handlers
+ * of class_mask that are not yet and unregister the others.  An
+ * exception on the descriptor is reported by the read filter.
+ */
+static int
+ndmpd_kq_arm(ndmpd_session_t *session, u_long class_mask)
+{
+	ndmpd_file_handler_t *handler;
+	struct kevent kev[2];
+	int n;
+
+	if (session->ns_kq == -1) {
+		if ((session->ns_kq = kqueue()) == -1) {
+			ndmpd_log(LOG_ERR, "kqueue: %m");
+			return (-1);
+		}
+
+		EV_SET(&kev[0], NDMPD_KQ_TIMER, EVFILT_TIMER, EV_ADD, 0,
+		    NDMPD_CHECK_SECS * 1000, NULL);
+		if (kevent(session->ns_kq, kev, 1, NULL, 0, NULL) == -1) {
+			ndmpd_log(LOG_ERR, "kevent timer: %m");
+			ndmpd_select_cleanup(session);
+			return (-1);
+		}
+	}
+
+	for (handler = session->ns_file_handler_list; handler != 0;
+	    handler = handler->fh_next) {
+		if ((handler->fh_class & class_mask) == 0) {
+			if (handler->fh_armed)
+				ndmpd_kq_disarm(session, handler);
+			continue;
+		}
+		if (handler->fh_armed)
+			continue;
+
+		n = 0;
+		if (handler->fh_mode &
+		    (NDMPD_SELECT_MODE_READ | NDMPD_SELECT_MODE_EXCEPTION))
+			EV_SET(&kev[n++], handler->fh_fd, EVFILT_READ,
+			    EV_ADD, 0, 0, NULL);
+		if (handler->fh_mode & NDMPD_SELECT_MODE_WRITE)
+			EV_SET(&kev[n++], handler->fh_fd, EVFILT_WRITE,
+			    EV_ADD, 0, 0, NULL);
+
+		if (n > 0 &&
+		    kevent(session->ns_kq, kev, n, NULL, 0, NULL) == -1) {
+			ndmpd_log(LOG_DEBUG, "kevent add fd=%d: %m",
+			    handler->fh_fd);
+			return (-1);
+		}
+		handler->fh_armed = TRUE;
+	}
+
+	return (0);
+}
+
+/*
+ * ndmpd_select_cleanup
+ *
+ * Close the kqueue of the session.
+ */
+void
+ndmpd_select_cleanup(ndmpd_session_t *session)
+{
+	ndmpd_file_handler_t *handler;
+
+	if (session->ns_kq != -1) {
+		(void) close(session->ns_kq);
+		session->ns_kq = -1;
+	}
+
+	for (handler = session->ns_file_handler_list; handler != 0;
+	    handler = handler->fh_next)
+		handler->fh_armed = FALSE;
+}
+
 /*
  * ndmpd_select
  *
- * Calls select on the the set of file descriptors from the
+ * Waits on the set of file descriptors from the
  * file handler list masked by the fd_class argument.
  * Calls the file handler function for each
  * file descriptor that is ready for I/O.
@@ -310,159 +463,119 @@ ndmp_check_mover_state(ndmpd_session_t *session)
 int
 ndmpd_select(ndmpd_session_t *session, bool_t block, u_long class_mask)
 {
-	fd_set rfds;
-	fd_set wfds;
-	fd_set efds;
-	int n;
+	struct kevent kev[NDMPD_KQ_EVENTS];
+	bool_t done[NDMPD_KQ_EVENTS];
+	struct timespec zero;
+	time_t time_base;
 	ndmpd_file_handler_t *handler;
-	struct timeval timeout;
-	struct timeval time_base,time_exit;
+	u_long mode;
+	int i, j, n, called;
 
 	nlp_event_rv_set(session, 0);
 
 	if (session->ns_file_handler_list == 0)
 		return (0);
 
-	/*
-	 * If select should be blocked, then we poll every ten seconds.
-	 * The reason is in case of three-way restore we should be able
-	 * to detect if the other end closed the connection or not.
-	 * NDMP client(DMA) does not send any information about the connection
-	 * that was closed in the other end.
-	 */
+	zero.tv_sec = 0;
+	zero.tv_nsec = 0;
 
-	if (block == TRUE)
-		timeout.tv_sec = 10;
-	else
-		timeout.tv_sec = 0;
-	timeout.tv_usec = 0;
 	/*
 	 *	when process lost its session. The process will not exit()
 	 *	In block mode, we will set a total 90 seconds timeout
 	 *	to exist before session lost.
 	 */
-	if(block==TRUE)
-		gettimeofday(&time_base,NULL);
+	time_base = time(NULL);
 
+	called = 0;
 	do {
-		/* Create the fd_sets for select. */
-		FD_ZERO(&rfds);
-		FD_ZERO(&wfds);
-		FD_ZERO(&efds);
-
-		for (handler = session->ns_file_handler_list; handler != 0;
-		    handler = handler->fh_next) {
-			if ((handler->fh_class & class_mask) == 0)
-				continue;
-			if (handler->fh_mode & NDMPD_SELECT_MODE_READ)
-				FD_SET(handler->fh_fd, &rfds);
-			if (handler->fh_mode & NDMPD_SELECT_MODE_WRITE)
-				FD_SET(handler->fh_fd, &wfds);
-			if (handler->fh_mode & NDMPD_SELECT_MODE_EXCEPTION)
-				FD_SET(handler->fh_fd, &efds);
-		}
-		ndmp_check_mover_state(session);
-
-		// if n == 0, means no data with in the timeout.
-		n = select(FD_SETSIZE, &rfds, &wfds, &efds, &timeout);
-		if(block){
-			gettimeofday(&time_exit,NULL);
-			if(time_exit.tv_sec - time_base.tv_sec>=90)
-				return (-1);
+		/* the handlers may have changed in the last pass */
+		if (ndmpd_kq_arm(session, class_mask) < 0) {
+			nlp_event_rv_set(session, -1);
+			return (-1);
 		}
 
-	} while (n == 0 && block == TRUE);
+		n = kevent(session->ns_kq, NULL, 0, kev, NDMPD_KQ_EVENTS,
+		    block ? NULL : &zero);
+		if (n < 0) {
+			if (errno == EINTR)
+				return (0);
 
-	if (n < 0) {
-		int connection_fd = ndmp_get_fd(session->ns_connection);
-		ndmpd_log(LOG_DEBUG, "Select error: %m");
-		if (errno == EINTR)
-			return (0);
+			ndmpd_log(LOG_DEBUG, "kevent error: %m");
+			nlp_event_rv_set(session, -1);
+			return (-1);
+		}
 
-		ndmpd_log(LOG_DEBUG, "Select error: %m");
+		for (i = 0; i < n; i++) {
+			if (kev[i].filter != EVFILT_TIMER)
+				continue;
 
-		for (handler = session->ns_file_handler_list; handler != 0;
-		    handler = handler->fh_next) {
-			ndmpd_log(LOG_DEBUG, "handler = next handler");
+			/*
+			 * In case of three-way restore we should be able
+			 * to detect if the other end closed the connection
+			 * or not.  NDMP client(DMA) does not send any
+			 * information about the connection that was closed
+			 * in the other end.
+			 */
+			ndmp_check_mover_state(session);
+			if (block &&
+			    time(NULL) - time_base >= NDMPD_IDLE_SECS)
+				return (-1);
+		}
 
-			if ((handler->fh_class & class_mask) == 0)
+		(void) memset(done, 0, sizeof (done));
+		for (i = 0; i < n; i++) {
+			if (kev[i].filter == EVFILT_TIMER || done[i])
 				continue;
-			if (handler->fh_mode & NDMPD_SELECT_MODE_READ) {
-				if (FD_ISSET(handler->fh_fd, &rfds) &&
-				    connection_fd == handler->fh_fd)
-					session->ns_eof = TRUE;
-			}
-			if (handler->fh_mode & NDMPD_SELECT_MODE_WRITE) {
-				if (FD_ISSET(handler->fh_fd, &wfds) &&
-				    connection_fd == handler->fh_fd)
-					session->ns_eof = TRUE;
-			}
-			if (handler->fh_mode & NDMPD_SELECT_MODE_EXCEPTION) {
-				if (FD_ISSET(handler->fh_fd, &efds) &&
-				    connection_fd == handler->fh_fd)
-					session->ns_eof = TRUE;
-			}
-		}
 
-		nlp_event_rv_set(session, -1);
-		return (-1);
-	}
-	if (n == 0)
-		return (0);
+			/* merge the read and write events of the descriptor */
+			mode = 0;
+			for (j = i; j < n; j++) {
+				if (kev[j].filter == EVFILT_TIMER ||
+				    kev[j].ident != kev[i].ident)
+					continue;
+				if (kev[j].filter == EVFILT_READ)
+					mode |= NDMPD_SELECT_MODE_READ;
+				else if (kev[j].filter == EVFILT_WRITE)
+					mode |= NDMPD_SELECT_MODE_WRITE;
+				if (kev[j].flags & (EV_EOF | EV_ERROR))
+					mode |= NDMPD_SELECT_MODE_EXCEPTION;
+				done[j] = TRUE;
+			}
 
-	/*	got some data here.	Iterate handler to handle the data.	*/
-	handler = session->ns_file_handler_list;
-	u_long mode = 0;
-	while (handler != 0) {
-		mode = 0;
+			/*
+			 * The list can be modified during the execution of a
+			 * handler, so it is looked up for each descriptor.
+			 */
+			for (handler = session->ns_file_handler_list;
+			    handler != 0; handler = handler->fh_next)
+				if (handler->fh_fd == (int)kev[i].ident)
+					break;
+			if (handler == 0 ||
+			    (handler->fh_class & class_mask) == 0)
+				continue;
 
-		if ((handler->fh_class & class_mask) == 0) {
-			handler = handler->fh_next;
-			continue;
-		}
-		if (handler->fh_mode & NDMPD_SELECT_MODE_READ) {
-			if (FD_ISSET(handler->fh_fd, &rfds)) {
-				mode |= NDMPD_SELECT_MODE_READ;
-				FD_CLR(handler->fh_fd, &rfds);
-			}
-		}
-		if (handler->fh_mode & NDMPD_SELECT_MODE_WRITE) {
-			if (FD_ISSET(handler->fh_fd, &wfds)) {
-				mode |= NDMPD_SELECT_MODE_WRITE;
-				FD_CLR(handler->fh_fd, &wfds);
-			}
-		}
-		if (handler->fh_mode & NDMPD_SELECT_MODE_EXCEPTION) {
-			if (FD_ISSET(handler->fh_fd, &efds)) {
-				mode |= NDMPD_SELECT_MODE_EXCEPTION;
-				FD_CLR(handler->fh_fd, &efds);
-			}
-		}
+			mode &= handler->fh_mode;
+			if (mode == 0)
+				continue;
 
-		if (mode) {
 			ndmpd_log(LOG_DEBUG, "pass to handler - start");
 
-			(*handler->fh_func) (handler->fh_cookie, handler->fh_fd, mode);
+			(*handler->fh_func) (handler->fh_cookie, handler->fh_fd,
+			    mode);
 
 			ndmpd_log(LOG_DEBUG, "pass to handler - done");
-
-
-			/*
-			 * K.L. The list can be modified during the execution
-			 * of handler->fh_func. Therefore, handler will start
-			 * from the beginning of the handler list after
-			 * each execution.
-			 */
-			handler = session->ns_file_handler_list;
+			called++;
 
 			/*
 			 * Release the thread which is waiting for a request
 			 * to be proccessed.
 			 */
 			nlp_event_nw(session);
-		} else
-			handler = handler->fh_next;
-	}
+		}
+	} while (called == 0 && block == TRUE);
+
+	if (called == 0)
+		return (0);
 
 	nlp_event_rv_set(session, 1);
 
@@ -911,6 +1024,137 @@ ndmp_buffer_get_size(ndmpd_session_t *session)
 	return (xfer_size);
 }
 
+/*
+ * ndmp_prop_count
+ *
+ * Parse a count property.
+ *
+ * Parameters:
+ *   id (input) - the property.
+ *   def (input) - value used if the property is not a positive number.
+ *   max (input) - upper bound of the value.
+ *
+ * Returns:
+ *   the count, between def and max
+ */
+static int
+ndmp_prop_count(ndmpd_cfg_id_t id, int def, int max)
+{
+	int count;
+
+	if ((count = atoi(ndmpd_get_prop(id))) <= 0)
+		return (def);
+
+	return (count > max ? max : count);
+}
+
+/*
+ * ndmp_env_count
+ *
+ * Return the count set by an environment variable of the session, or
+ * the value of the matching property if the variable is not set.
+ *
+ * Parameters:
+ *   session (input) - session pointer.
+ *   env (input) - name of the environment variable.
+ *   count (input) - value of the property.
+ *   max (input) - upper bound of the value.
+ *
+ * Returns:
+ *   the count, between 1 and max
+ */
+static int
+ndmp_env_count(ndmpd_session_t *session, char *env, int count, int max)
+{
+	char *envp;
+
+	if (session != NULL &&
+	    (envp = ndmpd_api_get_env(session, env)) != NULL &&
+	    atoi(envp) > 0)
+		count = atoi(envp);
+
+	if (count > max)
+		count = max;
+
+	ndmpd_log(LOG_DEBUG, "%s: %d", env, count);
+
+	return (count);
+}
+
+/*
+ * ndmp_buffer_get_count
+ *
+ * Return the number of rotating buffers to be used for the data
+ * transfer of this session.  The TAPE_BUFFERS environment variable
+ * takes precedence over the tape-buffers property.
+ *
+ * Parameters:
+ *   session (input) - session pointer.
+ *
+ * Returns:
+ *   number of buffers, between 1 and TLM_MAX_TAPE_BUFFERS
+ */
+int
+ndmp_buffer_get_count(ndmpd_session_t *session)
+{
+	return (ndmp_env_count(session, "TAPE_BUFFERS", ndmp_tape_buffers,
+	    TLM_MAX_TAPE_BUFFERS));
+}
+
+/*
+ * ndmp_scan_get_threads
+ *
+ * Return the number of threads scanning the file system for the
+ * backup of this session.  The SCAN_THREADS environment variable
+ * takes precedence over the scan-threads property.
+ *
+ * Parameters:
+ *   session (input) - session pointer.
+ *
+ * Returns:
+ *   number of threads, between 1 and TLM_MAX_SCAN_THREADS
+ */
+int
+ndmp_scan_get_threads(ndmpd_session_t *session)
+{
+	return (ndmp_env_count(session, "SCAN_THREADS", ndmp_scan_threads,
+	    TLM_MAX_SCAN_THREADS));
+}
+
+/*
+ * ndmp_session_get_workers
+ *
+ * Return the number of pre-forked processes serving the sessions.
+ *
+ * Returns:
+ *   number of processes, 0 if a process is forked per connection
+ */
+int
+ndmp_session_get_workers(void)
+{
+	return (ndmp_session_workers);
+}
+
+/*
+ * ndmp_restore_get_threads
+ *
+ * Return the number of threads writing the restored files of this
+ * session.  The RESTORE_THREADS environment variable takes precedence
+ * over the restore-threads property.
+ *
+ * Parameters:
+ *   session (input) - session pointer.
+ *
+ * Returns:
+ *   number of threads, between 1 and TLM_MAX_RESTORE_THREADS
+ */
+int
+ndmp_restore_get_threads(ndmpd_session_t *session)
+{
+	return (ndmp_env_count(session, "RESTORE_THREADS",
+	    ndmp_restore_threads, TLM_MAX_RESTORE_THREADS));
+}
+
 /*
  * ndmp_lbr_init
  *
@@ -977,6 +1221,9 @@ ndmp_lbr_cleanup(ndmpd_session_t *session)
 	if (session->ns_ndmp_lbr_params) {
 		tlm_release_list(session->ns_ndmp_lbr_params->nlp_exl);
 		tlm_release_list(session->ns_ndmp_lbr_params->nlp_inc);
+		tlm_matcher_free(session->ns_ndmp_lbr_params->nlp_exl_dirs);
+		tlm_matcher_free(session->ns_ndmp_lbr_params->nlp_exl_files);
+		tlm_matcher_free(session->ns_ndmp_lbr_params->nlp_incm);
 		(void) cond_destroy(&session->ns_ndmp_lbr_params->nlp_cv);
 		(void) mutex_destroy(&session->ns_lock);
 	}
@@ -1228,6 +1475,7 @@ ndmp_stop_buffer_worker(ndmpd_session_t *session)
 			cmds->tcs_reader = cmds->tcs_writer = TLM_ABORT;
 			cmds->tcs_command->tc_reader = TLM_ABORT;
 			cmds->tcs_command->tc_writer = TLM_ABORT;
+			tlm_buffer_shutdown(cmds->tcs_command->tc_buffers);
 			while (cmds->tcs_reader_count > 0 ||
 			    cmds->tcs_writer_count > 0) {
 				(void)pthread_yield();
@@ -1262,6 +1510,7 @@ ndmp_stop_reader_thread(ndmpd_session_t *session)
 		} else {
 			cmds->tcs_reader = TLM_ABORT;
 			cmds->tcs_command->tc_reader = TLM_ABORT;
+			tlm_buffer_shutdown(cmds->tcs_command->tc_buffers);
 			while (cmds->tcs_reader_count > 0) {
 				(void)pthread_yield();
 //				ndmpd_log(LOG_DEBUG,
@@ -1298,6 +1547,7 @@ ndmp_stop_writer_thread(ndmpd_session_t *session)
 		else {
 			cmds->tcs_writer = TLM_ABORT;
 			cmds->tcs_command->tc_writer = TLM_ABORT;
+			tlm_buffer_shutdown(cmds->tcs_command->tc_buffers);
 			while (cmds->tcs_writer_count > 0) {
 				(void)pthread_yield();
 			}
@@ -1896,25 +2146,20 @@ ndmp_check_utf8magic(tlm_cmd_t *cmd)
 
 	err = actual_size = 0;
 
-	setReadBufDone(cmd->tc_buffers);
-
 	cp = tlm_get_read_buffer(RECORDSIZE, &err, cmd->tc_buffers,
 	    &actual_size);
 
 	if (cp == NULL) {
-		setReadBufDone(cmd->tc_buffers);
 		ndmpd_log(LOG_DEBUG, "Can't read from buffers, err: %d", err);
 		return (FALSE);
 	}
 	len = strlen(NDMPUTF8MAGIC);
 	if (actual_size < len) {
-		setReadBufDone(cmd->tc_buffers);
 		ndmpd_log(LOG_DEBUG, "Not enough data in the buffers");
 		return (FALSE);
 	}
 
 	bool_t bt = ((strncmp(cp, NDMPUTF8MAGIC, len) == 0) ? TRUE : FALSE);
-	setReadBufDone(cmd->tc_buffers);
 
 	return bt;
 }
@@ -2020,6 +2265,21 @@ ndmp_load_params(void)
 
 	if ((ndmp_ver = atoi(ndmpd_get_prop(NDMP_VERSION_ENV))) == 0)
 		ndmp_ver = NDMPVER;
+
+	ndmp_tape_buffers = ndmp_prop_count(NDMP_TAPE_BUFFERS, TLM_TAPE_BUFFERS,
+	    TLM_MAX_TAPE_BUFFERS);
+	ndmp_scan_threads = ndmp_prop_count(NDMP_SCAN_THREADS, 1,
+	    TLM_MAX_SCAN_THREADS);
+	ndmp_restore_threads = ndmp_prop_count(NDMP_RESTORE_THREADS, 1,
+	    TLM_MAX_RESTORE_THREADS);
+
+	if ((ndmp_session_workers =
+	    atoi(ndmpd_get_prop(NDMP_SESSION_WORKERS))) < 0)
+		ndmp_session_workers = 0;
+	else if (ndmp_session_workers > NDMPD_MAX_WORKERS)
+		ndmp_session_workers = NDMPD_MAX_WORKERS;
+
+	tlm_id_cache_init(atoi(ndmpd_get_prop(NDMP_ID_CACHE_TTL)));
 }
 
 /*
@@ -0,0 +1,220 @@
+/*
+ * Micro-benchmark of the tar header formatting of tlm_backup_reader.c.
+ *
+ * The template helpers (hdr_init, hdr_octal, hdr_string, hdr_owner and
+ * hdr_finish) are taken from tlm/tlm_backup_reader.c by hdr_bench.sh,
+ * which builds and runs this program.  They are compared with the
+ * snprintf code they replaced: first on random entries, where both must
+ * give the same record byte for byte, then on a fixed entry, where each
+ * is timed.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <tlm.h>
+
+typedef unsigned long long u_longlong_t;	/* as in ndmpd.h */
+
+#include "hdr_helpers.c"
+
+#define	CHECK_RUNS	300000
+#define	TIME_RUNS	2000000
+
+typedef struct bench_ent {
+	char be_name[128];
+	char be_uname[64];
+	char be_gname[64];
+	u_longlong_t be_ino;
+	long be_size;
+	mode_t be_mode;
+	uid_t be_uid;
+	gid_t be_gid;
+	time_t be_mtime;
+	int be_aclid;
+	bool_t be_link;
+} bench_ent_t;
+
+/*
+ * tlm_build_header_checksum, as in tlm/tlm_lib.c.
+ */
+static void
+old_checksum(tlm_tar_hdr_t *r)
+{
+	int i;
+	unsigned int sum = 0;
+	char *c = (char *)r;
+
+	(void) memcpy(r->th_chksum, CHKBLANKS, strlen(CHKBLANKS));
+	for (i = 0; i < RECORDSIZE; i++)
+		sum += c[i] & 0xFF;
+	(void) snprintf(r->th_chksum, sizeof (r->th_chksum), "%6o", sum);
+}
+
+/*
+ * The header of a file as output_file_header built it before the
+ * templates.
+ */
+static void
+old_header(char *rec, bench_ent_t *be)
+{
+	tlm_tar_hdr_t *hdr = (tlm_tar_hdr_t *)rec;
+
+	(void) memset(rec, 0, RECORDSIZE);
+	(void) strlcpy(hdr->th_name, be->be_name, TLM_NAME_SIZE);
+	if (be->be_link) {
+		hdr->th_linkflag = LF_LINK;
+		(void) snprintf(hdr->th_shared.th_hlink_ino,
+		    sizeof (hdr->th_shared.th_hlink_ino), "%011o ",
+		    (u_int)be->be_ino);
+	} else {
+		hdr->th_linkflag = LF_NORMAL;
+	}
+	(void) snprintf(hdr->th_size, sizeof (hdr->th_size), "%011lo ",
+	    be->be_size);
+	(void) snprintf(hdr->th_mode, sizeof (hdr->th_mode), "%06o ",
+	    be->be_mode);
+	(void) snprintf(hdr->th_uid, sizeof (hdr->th_uid), "%06o ",
+	    be->be_uid);
+	(void) snprintf(hdr->th_gid, sizeof (hdr->th_gid), "%06o ",
+	    be->be_gid);
+	(void) snprintf(hdr->th_uname, sizeof (hdr->th_uname), "%.31s",
+	    be->be_uname);
+	(void) snprintf(hdr->th_gname, sizeof (hdr->th_gname), "%.31s",
+	    be->be_gname);
+	(void) snprintf(hdr->th_mtime, sizeof (hdr->th_mtime), "%011lo ",
+	    (long)be->be_mtime);
+	(void) strlcpy(hdr->th_magic, TLM_MAGIC, sizeof (hdr->th_magic));
+	if (be->be_aclid != 0)
+		(void) snprintf(hdr->th_aclid, sizeof (hdr->th_aclid),
+		    "%011o", be->be_aclid);
+	old_checksum(hdr);
+}
+
+/*
+ * The same header built from the template.
+ */
+static void
+new_header(char *rec, bench_ent_t *be)
+{
+	tlm_tar_hdr_t *hdr = (tlm_tar_hdr_t *)rec;
+	u_int sum;
+
+	sum = hdr_init(hdr, HDR_USTAR);
+	hdr_string(hdr->th_name, TLM_NAME_SIZE, be->be_name, &sum);
+	if (be->be_link) {
+		hdr->th_linkflag = LF_LINK;
+		hdr_octal(hdr->th_shared.th_hlink_ino,
+		    sizeof (hdr->th_shared.th_hlink_ino), 11,
+		    (u_int)be->be_ino, TRUE, &sum);
+	} else {
+		hdr->th_linkflag = LF_NORMAL;
+	}
+	sum += (u_char)hdr->th_linkflag;
+	hdr_octal(hdr->th_size, sizeof (hdr->th_size), 11,
+	    (u_long)be->be_size, TRUE, &sum);
+	hdr_owner(hdr, be->be_mode, be->be_uid, be->be_gid, be->be_uname,
+	    be->be_gname, be->be_mtime, &sum);
+	if (be->be_aclid != 0)
+		hdr_octal(hdr->th_aclid, sizeof (hdr->th_aclid), 11,
+		    be->be_aclid, FALSE, &sum);
+	hdr_finish(hdr, sum);
+}
+
+static u_longlong_t
+rand64(void)
+{
+	u_longlong_t v;
+
+	v = ((u_longlong_t)random() << 33) ^ ((u_longlong_t)random() << 10) ^
+	    random();
+	return (v >> (random() % 64));
+}
+
+static void
+rand_string(char *buf, int max)
+{
+	int i, len;
+
+	len = random() % max;
+	for (i = 0; i < len; i++)
+		buf[i] = 1 + random() % 255;
+	buf[len] = '\0';
+}
+
+static double
+time_header(void (*fn)(char *, bench_ent_t *), bench_ent_t *be)
+{
+	struct timespec t0, t1;
+	char rec[RECORDSIZE];
+	int i;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < TIME_RUNS; i++) {
+		be->be_ino = i;
+		be->be_size = i * 7L;
+		be->be_mtime = 1700000000 + i;
+		be->be_aclid = i & 1 ? i : 0;
+		fn(rec, be);
+	}
+	(void) clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	return (((t1.tv_sec - t0.tv_sec) * 1e9 +
+	    (t1.tv_nsec - t0.tv_nsec)) / TIME_RUNS);
+}
+
+int
+main(void)
+{
+	bench_ent_t be;
+	char a[RECORDSIZE], b[RECORDSIZE];
+	double o, n;
+	int i, j;
+
+	srandom(1);
+	for (i = 0; i < CHECK_RUNS; i++) {
+		rand_string(be.be_name, sizeof (be.be_name) - 1);
+		rand_string(be.be_uname, sizeof (be.be_uname) - 1);
+		rand_string(be.be_gname, sizeof (be.be_gname) - 1);
+		be.be_ino = rand64();
+		be.be_size = (long)rand64();
+		be.be_mode = rand64() & 07777;
+		be.be_uid = rand64() & 07777777;
+		be.be_gid = random() % 3 ? rand64() : 7;
+		be.be_mtime = (time_t)rand64();
+		be.be_aclid = random() % 2 ? random() % 100000 : 0;
+		be.be_link = random() % 2;
+
+		(void) memset(b, 0x5a, sizeof (b));
+		old_header(a, &be);
+		new_header(b, &be);
+		if (memcmp(a, b, RECORDSIZE) == 0)
+			continue;
+		for (j = 0; a[j] == b[j]; j++)
+			;
+		(void) printf("header %d differs at byte %d: "
+		    "old 0x%02x new 0x%02x\n", i, j, (u_char)a[j],
+		    (u_char)b[j]);
+		return (1);
+	}
+	(void) printf("%d random headers are the same\n", CHECK_RUNS);
+
+	(void) memset(&be, 0, sizeof (be));
+	(void) strlcpy(be.be_name, "dir/some/file.txt", sizeof (be.be_name));
+	(void) strlcpy(be.be_uname, "operator", sizeof (be.be_uname));
+	(void) strlcpy(be.be_gname, "wheel", sizeof (be.be_gname));
+	be.be_mode = 0644;
+	be.be_uid = 1001;
+	be.be_gid = 1001;
+
+	o = time_header(old_header, &be);
+	n = time_header(new_header, &be);
+	(void) printf("snprintf: %.0f ns/header, template: %.0f ns/header "
+	    "(%.1fx)\n", o, n, o / n);
+
+	return (0);
+}
@@ -0,0 +1,21 @@
+#!/bin/sh
+#
+# Build and run the tar header micro-benchmark, test/hdr_bench.c,
+# against the header helpers of tlm/tlm_backup_reader.c.
+#
+# usage: test/hdr_bench.sh [cc flags]
+#
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d /tmp/hdr_bench.XXXXXX) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+# The helpers run from the HDR_BARE define to the end of hdr_finish.
+awk '/^#define[ \t]+HDR_BARE/ { p = 1 }
+    p { print }
+    p && /^hdr_finish/ { f = 1 }
+    f && /^}/ { exit }' "$top/tlm/tlm_backup_reader.c" > "$tmp/hdr_helpers.c"
+
+${CC:-cc} -O2 -I"$tmp" -I"$top" -I"$top/include" "$@" \
+    -o "$tmp/hdr_bench" "$top/test/hdr_bench.c" -lpthread || exit 1
+"$tmp/hdr_bench"
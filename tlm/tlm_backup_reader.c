@@ -69,7 +69,7 @@ static char *get_write_buffer(long size,
     long *actual_size,
     bool_t zero,
     tlm_cmd_t *);
-static int output_acl_header(sec_attr_t *,
+static int output_acl_header(tlm_acls_t *,
     tlm_cmd_t *);
 static int output_file_header(char *name,
     char *link,
@@ -96,14 +96,169 @@ output_mem(tlm_cmd_t *local_commands, char *mem,
 		    FALSE, local_commands);
 		rec_size = min(actual_size, len);
 		(void) memcpy(rec, mem, rec_size);
-		// the buffer is filled.
-		setWriteBufDone(local_commands->tc_buffers);
 
 		mem += rec_size;
 		len -= rec_size;
 	}
 }
 
+/*
+ * The tar headers are copied from a template record that has the blank
+ * checksum, and the magic if it is a ustar one, in place.  Only the
+ * fields of the entry are written over it, as snprintf would put them,
+ * and the checksum is kept up to date as they are: it starts as the
+ * sum of the template and each field adds its characters.
+ */
+#define	HDR_BARE	0
+#define	HDR_USTAR	1
+
+static pthread_once_t hdr_once = PTHREAD_ONCE_INIT;
+static char hdr_template[2][RECORDSIZE];
+static u_int hdr_template_sum[2];
+
+/*
+ * The two octal digits of each 6-bit value.
+ */
+static const char hdr_oct2[] =
+	"0001020304050607" "1011121314151617"
+	"2021222324252627" "3031323334353637"
+	"4041424344454647" "5051525354555657"
+	"6061626364656667" "7071727374757677";
+
+static void
+hdr_template_init(void)
+{
+	tlm_tar_hdr_t *hdr;
+	int i, t;
+
+	for (t = HDR_BARE; t <= HDR_USTAR; t++) {
+		hdr = (tlm_tar_hdr_t *)hdr_template[t];
+		(void) memcpy(hdr->th_chksum, CHKBLANKS, strlen(CHKBLANKS));
+		if (t == HDR_USTAR)
+			(void) strlcpy(hdr->th_magic, TLM_MAGIC,
+			    sizeof (hdr->th_magic));
+		for (i = 0; i < RECORDSIZE; i++)
+			hdr_template_sum[t] += hdr_template[t][i] & 0xFF;
+	}
+}
+
+/*
+ * hdr_init
+ *
+ * Start a header record from a template, return the checksum so far.
+ */
+static u_int
+hdr_init(tlm_tar_hdr_t *hdr, int t)
+{
+	(void) pthread_once(&hdr_once, hdr_template_init);
+	(void) memcpy(hdr, hdr_template[t], RECORDSIZE);
+
+	return (hdr_template_sum[t]);
+}
+
+/*
+ * hdr_octal
+ *
+ * Put val in a zero field the way snprintf(field, size, "%0*llo ",
+ * ndig, val) does, leaving out the blank if blank is not set.  The
+ * ndig digits are copied two at a time from hdr_oct2, from the last
+ * pair; only a val too big for them goes through snprintf.
+ */
+static void
+hdr_octal(char *field, int size, int ndig, u_longlong_t val,
+    bool_t blank, u_int *sum)
+{
+	char buf[24];
+	u_int d, s;
+	int i, n;
+
+	if ((val >> (3 * ndig)) != 0) {
+		n = snprintf(buf, sizeof (buf), blank ? "%0*llo " : "%0*llo",
+		    ndig, val);
+		n = MIN(n, size - 1);
+		for (i = 0; i < n; i++) {
+			field[i] = buf[i];
+			*sum += (u_char)buf[i];
+		}
+		return;
+	}
+
+	s = '0' * ndig;
+	for (i = ndig - 2; i >= 0; i -= 2) {
+		d = val & 077;
+		field[i] = hdr_oct2[2 * d];
+		field[i + 1] = hdr_oct2[2 * d + 1];
+		s += (d >> 3) + (d & 7);
+		val >>= 6;
+	}
+	if (i == -1) {
+		field[0] = '0' + val;
+		s += val;
+	}
+	if (blank && ndig < size - 1) {
+		field[ndig] = ' ';
+		s += ' ';
+	}
+	*sum += s;
+}
+
+/*
+ * hdr_string
+ *
+ * Put str in a zero field, as strlcpy does.
+ */
+static void
+hdr_string(char *field, int size, const char *str, u_int *sum)
+{
+	int i;
+
+	for (i = 0; i < size - 1 && str[i] != '\0'; i++) {
+		field[i] = str[i];
+		*sum += (u_char)str[i];
+	}
+}
+
+/*
+ * hdr_owner
+ *
+ * Put the mode, owner and mtime of an entry in its header records.
+ */
+static void
+hdr_owner(tlm_tar_hdr_t *hdr, mode_t mode, uid_t uid, gid_t gid,
+    char *uname, char *gname, time_t mtime, u_int *sum)
+{
+	hdr_octal(hdr->th_mode, sizeof (hdr->th_mode), 6, mode, TRUE, sum);
+	hdr_octal(hdr->th_uid, sizeof (hdr->th_uid), 6, uid, TRUE, sum);
+	hdr_octal(hdr->th_gid, sizeof (hdr->th_gid), 6, gid, TRUE, sum);
+	hdr_string(hdr->th_uname, sizeof (hdr->th_uname), uname, sum);
+	hdr_string(hdr->th_gname, sizeof (hdr->th_gname), gname, sum);
+	hdr_octal(hdr->th_mtime, sizeof (hdr->th_mtime), 11, mtime, TRUE,
+	    sum);
+}
+
+/*
+ * hdr_finish
+ *
+ * Write the checksum, as tlm_build_header_checksum does: "%6o" and a
+ * null, the last byte stays blank.  A record sums to less than 0777777,
+ * so the six digits always hold it; the leading zeros are blanked.
+ */
+static void
+hdr_finish(tlm_tar_hdr_t *hdr, u_int sum)
+{
+	char *cp = hdr->th_chksum;
+
+	cp[0] = hdr_oct2[2 * ((sum >> 12) & 077)];
+	cp[1] = hdr_oct2[2 * ((sum >> 12) & 077) + 1];
+	cp[2] = hdr_oct2[2 * ((sum >> 6) & 077)];
+	cp[3] = hdr_oct2[2 * ((sum >> 6) & 077) + 1];
+	cp[4] = hdr_oct2[2 * (sum & 077)];
+	cp[5] = hdr_oct2[2 * (sum & 077) + 1];
+	cp[6] = '\0';
+	(void) memset(cp, ' ', (sum < 010) + (sum < 0100) + (sum < 01000) +
+	    (sum < 010000) + (sum < 0100000));
+}
+
 /*
  * tlm_output_dir
  *
@@ -124,8 +279,7 @@ tlm_output_dir(char *name, tlm_acls_t *tlm_acls,
 	(void) tlm_log_fhpath_name(job_stats, name, &tlm_acls->acl_attr, pos);
 	/* fhdir_cb is handled in ndmpd_tar3.c */
 
-	(void) output_acl_header(&tlm_acls->acl_info,
-	    local_commands);
+	(void) output_acl_header(tlm_acls, local_commands);
 	(void) output_file_header(name, "", tlm_acls, 0,
 	    local_commands);
 
@@ -151,45 +305,60 @@ tar_putdir(char *name, tlm_acls_t *tlm_acls,
  * output_acl_header
  *
  * output the ACL header record and data
+ *
+ * With an ACL table, an ACL that went out already is not sent again:
+ * the file only names it by the acl_id that output_file_header puts
+ * in th_aclid.  The definition carries the id in its own th_aclid.
  */
 static int
-output_acl_header(sec_attr_t *acl_info,
+output_acl_header(tlm_acls_t *tlm_acls,
     tlm_cmd_t *local_commands)
 {
 
+	sec_attr_t *acl_info = &tlm_acls->acl_info;
 	long	actual_size;
 	tlm_tar_hdr_t *tar_hdr;
 	long	acl_size;
+	bool_t	new = TRUE;
+	u_int	sum;
 
-	if ((acl_info == NULL) ||
+	tlm_acls->acl_id = 0;
+	if (
 			// following should never happen, we always support ACL.(Just in case.)
 			(acl_info->attr_info == NULL) ||
 			(*acl_info->attr_info == '\0'))
 		return (0);
 
+	if (local_commands->tc_acl_tab != NULL &&
+	    (tlm_acls->acl_id = tlm_acl_intern(local_commands->tc_acl_tab,
+	    acl_info->attr_info, acl_info->attr_len, &new)) != 0 && !new) {
+		free(acl_info->attr_info);
+		acl_info->attr_info = NULL;
+		return (0);
+	}
+
 	tar_hdr = (tlm_tar_hdr_t *)get_write_buffer(RECORDSIZE,
-	    &actual_size, TRUE, local_commands);
+	    &actual_size, FALSE, local_commands);
 	if (!tar_hdr)
 		return (0);
 
+	sum = hdr_init(tar_hdr, HDR_USTAR);
 	tar_hdr->th_linkflag = LF_ACL;
-	acl_info->attr_type = UFSD_ACL;
+	sum += LF_ACL;
+	acl_info->attr_type = tlm_acls->acl_id != 0 ? UFSD_ACL_DEF : UFSD_ACL;
 
 
 	acl_size = sizeof (*acl_info)+acl_info->attr_len;
 
-	(void) strlcpy(tar_hdr->th_name, "UFSACL", TLM_NAME_SIZE);
-	(void) snprintf(tar_hdr->th_size, sizeof (tar_hdr->th_size), "%011lo ", acl_size);
-	(void) snprintf(tar_hdr->th_mode, sizeof (tar_hdr->th_mode), "%06o ", 0444);
-	(void) snprintf(tar_hdr->th_uid, sizeof (tar_hdr->th_uid), "%06o ", 0);
-	(void) snprintf(tar_hdr->th_gid, sizeof (tar_hdr->th_gid), "%06o ", 0);
-	(void) snprintf(tar_hdr->th_mtime, sizeof (tar_hdr->th_mtime), "%011o ", 0);
-	(void) strlcpy(tar_hdr->th_magic, TLM_MAGIC, sizeof (tar_hdr->th_magic));
+	hdr_string(tar_hdr->th_name, TLM_NAME_SIZE, "UFSACL", &sum);
+	hdr_octal(tar_hdr->th_size, sizeof (tar_hdr->th_size), 11, acl_size,
+	    TRUE, &sum);
+	hdr_owner(tar_hdr, 0444, 0, 0, "", "", 0, &sum);
+	if (tlm_acls->acl_id != 0)
+		hdr_octal(tar_hdr->th_aclid, sizeof (tar_hdr->th_aclid), 11,
+		    tlm_acls->acl_id, FALSE, &sum);
 
-	tlm_build_header_checksum(tar_hdr);
-
-	// header output done.
-	setWriteBufDone(local_commands->tc_buffers);
+	hdr_finish(tar_hdr, sum);
 
 	char *tmpbuf = (char*)malloc(acl_size);
 
@@ -200,6 +369,7 @@ output_acl_header(sec_attr_t *acl_info,
 
 	free(tmpbuf);
 	free(acl_info->attr_info);
+	acl_info->attr_info = NULL;
 
 
 	return (0);
@@ -220,6 +390,7 @@ output_humongus_header(char *fullname, longlong_t file_size,
 	int	len;
 	long	actual_size;
 	tlm_tar_hdr_t *tar_hdr;
+	u_int	sum;
 
 	/*
 	 * buf will contain: "%llu %s":
@@ -235,19 +406,18 @@ output_humongus_header(char *fullname, longlong_t file_size,
 
 
 	tar_hdr = (tlm_tar_hdr_t *)get_write_buffer(RECORDSIZE,
-	    &actual_size, TRUE, local_commands);
+	    &actual_size, FALSE, local_commands);
 	if (!tar_hdr) {
 		free(buf);
 		return (0);
 	}
 
+	sum = hdr_init(tar_hdr, HDR_BARE);
 	tar_hdr->th_linkflag = LF_HUMONGUS;
-	(void) snprintf(tar_hdr->th_size, sizeof (tar_hdr->th_size), "%011o ",
-	    len);
-	tlm_build_header_checksum(tar_hdr);
-
-	// header output done.
-	setWriteBufDone(local_commands->tc_buffers);
+	sum += LF_HUMONGUS;
+	hdr_octal(tar_hdr->th_size, sizeof (tar_hdr->th_size), 11, len, TRUE,
+	    &sum);
+	hdr_finish(tar_hdr, sum);
 
 
 	(void) snprintf(buf, len, "%lld %s", file_size, fullname);
@@ -285,10 +455,10 @@ output_file_header(char *name, char *link,
 	int	nmlen, lnklen;
 	uid_t uid;
 	gid_t gid;
-	char *uname = "";
-	char *gname = "";
-	struct passwd *pwd;
-	struct group *grp;
+	char uname[32];
+	char gname[32];
+	char lname[TLM_NAME_SIZE];
+	u_int sum;
 
 
 	/*
@@ -302,10 +472,8 @@ output_file_header(char *name, char *link,
 		    TLM_MAX_PATH_NAME, "%s.%03d", name, section);
 	}
 
-	if ((pwd = getpwuid(attr->st_uid)) != NULL)
-		uname = pwd->pw_name;
-	if ((grp = getgrgid(attr->st_gid)) != NULL)
-		gname = grp->gr_name;
+	(void) tlm_uid_to_name(attr->st_uid, uname, sizeof (uname));
+	(void) tlm_gid_to_name(attr->st_gid, gname, sizeof (gname));
 
 	if ((u_long)(uid = attr->st_uid) > (u_long)OCTAL7CHAR)
 		uid = UID_NOBODY;
@@ -327,37 +495,24 @@ output_file_header(char *name, char *link,
 		 */
 
 		tar_hdr = (tlm_tar_hdr_t *)get_write_buffer(RECORDSIZE,
-		    &actual_size, TRUE, local_commands);
+		    &actual_size, FALSE, local_commands);
 		if (!tar_hdr) {
 			return (0);
 		}
-		(void) snprintf(tar_hdr->th_name,
-		    sizeof (tar_hdr->th_name),
-		    "%s%08qd.fil",
-		    LONGNAME_PREFIX,
-		    file_count++);
+		sum = hdr_init(tar_hdr, HDR_USTAR);
+		(void) snprintf(lname, sizeof (lname), "%s%08qd.fil",
+		    LONGNAME_PREFIX, file_count++);
+		hdr_string(tar_hdr->th_name, sizeof (tar_hdr->th_name), lname,
+		    &sum);
 
 		tar_hdr->th_linkflag = LF_LONGNAME;
-		(void) snprintf(tar_hdr->th_size, sizeof (tar_hdr->th_size),
-		    "%011o ", nmlen);
-		(void) snprintf(tar_hdr->th_mode, sizeof (tar_hdr->th_mode),
-		    "%06o ", attr->st_mode & 07777);
-		(void) snprintf(tar_hdr->th_uid, sizeof (tar_hdr->th_uid),
-		    "%06o ", uid);
-		(void) snprintf(tar_hdr->th_gid, sizeof (tar_hdr->th_gid),
-		    "%06o ", gid);
-		(void) snprintf(tar_hdr->th_uname, sizeof (tar_hdr->th_uname),
-		    "%.31s", uname);
-		(void) snprintf(tar_hdr->th_gname, sizeof (tar_hdr->th_gname),
-		    "%.31s", gname);
-		(void) snprintf(tar_hdr->th_mtime, sizeof (tar_hdr->th_mtime),
-		    "%011lo ", attr->st_mtime);
-		(void) strlcpy(tar_hdr->th_magic, TLM_MAGIC,
-		    sizeof (tar_hdr->th_magic));
-
-		tlm_build_header_checksum(tar_hdr);
-		// header output done.
-		setWriteBufDone(local_commands->tc_buffers);
+		sum += LF_LONGNAME;
+		hdr_octal(tar_hdr->th_size, sizeof (tar_hdr->th_size), 11,
+		    nmlen, TRUE, &sum);
+		hdr_owner(tar_hdr, attr->st_mode & 07777, uid, gid, uname,
+		    gname, attr->st_mtime, &sum);
+
+		hdr_finish(tar_hdr, sum);
 
 		(void) output_mem(local_commands,
 		    (void *)section_name, nmlen);
@@ -372,39 +527,25 @@ output_file_header(char *name, char *link,
 		 */
 
 		tar_hdr = (tlm_tar_hdr_t *)get_write_buffer(RECORDSIZE,
-		    &actual_size, TRUE, local_commands);
+		    &actual_size, FALSE, local_commands);
 		if (!tar_hdr) {
 
 			return (0);
 		}
-		(void) snprintf(tar_hdr->th_linkname,
-		    sizeof (tar_hdr->th_name),
-		    "%s%08qd.slk",
-		    LONGNAME_PREFIX,
-		    file_count++);
+		sum = hdr_init(tar_hdr, HDR_USTAR);
+		(void) snprintf(lname, sizeof (lname), "%s%08qd.slk",
+		    LONGNAME_PREFIX, file_count++);
+		hdr_string(tar_hdr->th_linkname, sizeof (tar_hdr->th_linkname),
+		    lname, &sum);
 
 		tar_hdr->th_linkflag = LF_LONGLINK;
-		(void) snprintf(tar_hdr->th_size, sizeof (tar_hdr->th_size),
-		    "%011o ", lnklen);
-		(void) snprintf(tar_hdr->th_mode, sizeof (tar_hdr->th_mode),
-		    "%06o ", attr->st_mode & 07777);
-		(void) snprintf(tar_hdr->th_uid, sizeof (tar_hdr->th_uid),
-		    "%06o ", uid);
-		(void) snprintf(tar_hdr->th_gid, sizeof (tar_hdr->th_gid),
-		    "%06o ", gid);
-		(void) snprintf(tar_hdr->th_uname, sizeof (tar_hdr->th_uname),
-		    "%.31s", uname);
-		(void) snprintf(tar_hdr->th_gname, sizeof (tar_hdr->th_gname),
-		    "%.31s", gname);
-		(void) snprintf(tar_hdr->th_mtime, sizeof (tar_hdr->th_mtime),
-		    "%011lo ", attr->st_mtime);
-		(void) strlcpy(tar_hdr->th_magic, TLM_MAGIC,
-		    sizeof (tar_hdr->th_magic));
-
-		tlm_build_header_checksum(tar_hdr);
-
-		// header output done.
-		setWriteBufDone(local_commands->tc_buffers);
+		sum += LF_LONGLINK;
+		hdr_octal(tar_hdr->th_size, sizeof (tar_hdr->th_size), 11,
+		    lnklen, TRUE, &sum);
+		hdr_owner(tar_hdr, attr->st_mode & 07777, uid, gid, uname,
+		    gname, attr->st_mtime, &sum);
+
+		hdr_finish(tar_hdr, sum);
 
 		(void) output_mem(local_commands, (void *)link,
 		    lnklen);
@@ -412,31 +553,31 @@ output_file_header(char *name, char *link,
 	}
 
 	tar_hdr = (tlm_tar_hdr_t *)get_write_buffer(RECORDSIZE,
-	    &actual_size, TRUE, local_commands);
+	    &actual_size, FALSE, local_commands);
 	if (!tar_hdr) {
 		return (0);
 	}
+	sum = hdr_init(tar_hdr, HDR_USTAR);
 	if (long_name) {
-		(void) snprintf(tar_hdr->th_name,
-		    sizeof (tar_hdr->th_name),
-		    "%s%08qd.fil",
-		    LONGNAME_PREFIX,
-		    file_count++);
+		(void) snprintf(lname, sizeof (lname), "%s%08qd.fil",
+		    LONGNAME_PREFIX, file_count++);
+		hdr_string(tar_hdr->th_name, sizeof (tar_hdr->th_name), lname,
+		    &sum);
 	} else {
-		(void) strlcpy(tar_hdr->th_name, section_name, TLM_NAME_SIZE);
+		hdr_string(tar_hdr->th_name, TLM_NAME_SIZE, section_name,
+		    &sum);
 	}
 
 	ndmpd_log(LOG_DEBUG, "long_link: %s [%s]", long_link ? "TRUE" : "FALSE",
 	    link);
 
 	if (long_link) {
-		(void) snprintf(tar_hdr->th_linkname,
-		    sizeof (tar_hdr->th_name),
-		    "%s%08qd.slk",
-		    LONGNAME_PREFIX,
-		    file_count++);
+		(void) snprintf(lname, sizeof (lname), "%s%08qd.slk",
+		    LONGNAME_PREFIX, file_count++);
+		hdr_string(tar_hdr->th_linkname, sizeof (tar_hdr->th_linkname),
+		    lname, &sum);
 	} else {
-		(void) strlcpy(tar_hdr->th_linkname, link, TLM_NAME_SIZE);
+		hdr_string(tar_hdr->th_linkname, TLM_NAME_SIZE, link, &sum);
 	}
 	if (S_ISDIR(attr->st_mode)) {
 		tar_hdr->th_linkflag = LF_DIR;
@@ -445,34 +586,23 @@ output_file_header(char *name, char *link,
 	} else if (attr->st_nlink > 1) {
 		/* mark file with hardlink LF_LINK */
 		tar_hdr->th_linkflag = LF_LINK;
-		(void) snprintf(tar_hdr->th_shared.th_hlink_ino,
-		    sizeof (tar_hdr->th_shared.th_hlink_ino),
-		    "%011o ", attr->st_ino);
+		hdr_octal(tar_hdr->th_shared.th_hlink_ino,
+		    sizeof (tar_hdr->th_shared.th_hlink_ino), 11,
+		    (u_int)attr->st_ino, TRUE, &sum);
 	} else {
 		tar_hdr->th_linkflag = *link == 0 ? LF_NORMAL : LF_SYMLINK;
 		ndmpd_log(LOG_DEBUG, "linkflag: '%c'", tar_hdr->th_linkflag);
 	}
-	(void) snprintf(tar_hdr->th_size, sizeof (tar_hdr->th_size), "%011lo ",
-	    (long)attr->st_size);
-	(void) snprintf(tar_hdr->th_mode, sizeof (tar_hdr->th_mode), "%06o ",
-	    attr->st_mode & 07777);
-	(void) snprintf(tar_hdr->th_uid, sizeof (tar_hdr->th_uid), "%06o ",
-	    uid);
-	(void) snprintf(tar_hdr->th_gid, sizeof (tar_hdr->th_gid), "%06o ",
-	    gid);
-	(void) snprintf(tar_hdr->th_uname, sizeof (tar_hdr->th_uname), "%.31s",
-	    uname);
-	(void) snprintf(tar_hdr->th_gname, sizeof (tar_hdr->th_gname), "%.31s",
-	    gname);
-	(void) snprintf(tar_hdr->th_mtime, sizeof (tar_hdr->th_mtime), "%011lo ",
-	    attr->st_mtime);
-	(void) strlcpy(tar_hdr->th_magic, TLM_MAGIC,
-	    sizeof (tar_hdr->th_magic));
-
-	tlm_build_header_checksum(tar_hdr);
-
-	// header output done.
-	setWriteBufDone(local_commands->tc_buffers);
+	sum += (u_char)tar_hdr->th_linkflag;
+	hdr_octal(tar_hdr->th_size, sizeof (tar_hdr->th_size), 11,
+	    (u_long)attr->st_size, TRUE, &sum);
+	hdr_owner(tar_hdr, attr->st_mode & 07777, uid, gid, uname, gname,
+	    attr->st_mtime, &sum);
+	if (tlm_acls->acl_id != 0)
+		hdr_octal(tar_hdr->th_aclid, sizeof (tar_hdr->th_aclid), 11,
+		    tlm_acls->acl_id, FALSE, &sum);
+
+	hdr_finish(tar_hdr, sum);
 
 
 	if (long_name || long_link) {
@@ -516,6 +646,56 @@ tlm_readlink(char *nm, char *snap, char *buf, int bufsize)
 }
 
 #include <assert.h>
+
+/*
+ * File sections of BK_SENDFILE_MIN bytes or more are sent by the
+ * writer thread straight from the file, see send_file_section.
+ */
+#define	BK_SENDFILE_MIN		(1024 * 1024)
+
+/*
+ * send_file_section
+ *
+ * Hand the ring buffer holding the header of a file section over to
+ * the writer, along with the section itself.  The writer sends the
+ * buffer up to tb_buffer_spot, then the section from its own copy of
+ * the file descriptor, then the padding.  Returns FALSE if that is not
+ * possible, the section has to go through the buffers then.
+ */
+static bool_t
+send_file_section(int fd, longlong_t offset, longlong_t size,
+    tlm_cmd_t *local_commands)
+{
+	tlm_buffers_t *bufs;
+	tlm_buffer_t *buf;
+	int sfd;
+
+	bufs = local_commands->tc_buffers;
+	buf = tlm_buffer_in_buf(bufs, NULL);
+	if (buf->tb_full)
+		return (FALSE);
+
+	if ((sfd = dup(fd)) == -1) {
+		ndmpd_log(LOG_DEBUG, "dup failed(%d)", errno);
+		return (FALSE);
+	}
+
+	buf->tb_file_size = size;
+	buf->tb_seek_spot = offset;
+	buf->tb_send_fd = sfd;
+	buf->tb_send_off = offset;
+	buf->tb_send_len = size;
+	buf->tb_full = TRUE;
+
+	(void) tlm_buffer_advance_in_idx(bufs);
+	tlm_buffer_release_in_buf(bufs);
+
+	/* the section is padded to a whole record */
+	bufs->tbs_offset += (size + RECORDSIZE - 1) & ~(RECORDSIZE - 1);
+
+	return (TRUE);
+}
+
 /*
  * tlm_output_file
  *
@@ -601,13 +781,18 @@ tlm_output_file(char *dir, char *name, char *chkdir,
 	 */
 	if (tlm_acls->acl_attr.st_nlink > 1) {
 		hardlink_done = !hardlink_q_get(hardlink_q,
-		    tlm_acls->acl_attr.st_ino, &hardlink_pos, NULL);
+		    tlm_acls->acl_attr.st_dev, tlm_acls->acl_attr.st_ino,
+		    &hardlink_pos, NULL);
 	}
 
 
 
 	if (!hardlink_done) {
-		fd = open(fnamep, O_RDONLY);
+		/* the backup reader may have opened it already */
+		if ((fd = tlm_acls->acl_fd) != -1)
+			tlm_acls->acl_fd = -1;
+		else
+			fd = open(fnamep, O_RDONLY);
 		if (fd == -1) {
 			ndmpd_log(LOG_DEBUG,
 			    "BACKUP> Can't open file [%s][%s] err(%d)",
@@ -630,8 +815,7 @@ tlm_output_file(char *dir, char *name, char *chkdir,
 	real_size = tlm_acls->acl_attr.st_size;
 
 
-	(void) output_acl_header(&tlm_acls->acl_info,
-	    local_commands);
+	(void) output_acl_header(tlm_acls, local_commands);
 
 	/*
 	 * section = 0: file is small enough for TAR
@@ -689,6 +873,16 @@ tlm_output_file(char *dir, char *name, char *chkdir,
 		    section,
 		    local_commands);
 
+		if (local_commands->tc_sendfile &&
+		    section_size >= BK_SENDFILE_MIN &&
+		    commands->tcs_reader == TLM_BACKUP_RUN &&
+		    send_file_section(fd, seek_spot, section_size,
+		    local_commands)) {
+			seek_spot += section_size;
+			file_size -= section_size;
+			section_size = 0;
+		}
+
 		while (section_size > 0) {
 			char	*buf;
 			long	actual_size;
@@ -723,7 +917,7 @@ tlm_output_file(char *dir, char *name, char *chkdir,
 
 
 			read_size = min(section_size, actual_size);
-			actual_size = read(fd, buf, read_size);
+			actual_size = pread(fd, buf, read_size, seek_spot);
 
 			if (actual_size == 0)
 				break;
@@ -734,9 +928,6 @@ tlm_output_file(char *dir, char *name, char *chkdir,
 				assert(0);
 			}
 
-			// read the data to output buffer.
-			setWriteBufDone(local_commands->tc_buffers);
-
 			seek_spot += actual_size;
 			file_size -= actual_size;
 			section_size -= actual_size;
@@ -750,8 +941,8 @@ tlm_output_file(char *dir, char *name, char *chkdir,
 	 * to hardlink queue.
 	 */
 	if (tlm_acls->acl_attr.st_nlink > 1 && !hardlink_done) {
-		(void) hardlink_q_add(hardlink_q, tlm_acls->acl_attr.st_ino,
-		    pos, NULL, 0);
+		(void) hardlink_q_add(hardlink_q, tlm_acls->acl_attr.st_dev,
+		    tlm_acls->acl_attr.st_ino, pos, NULL, 0);
 		ndmpd_log(LOG_DEBUG,
 		    "backed up hardlink file %s, inode = %u, pos = %llu ",
 		    fullname, tlm_acls->acl_attr.st_ino, pos);
@@ -777,9 +968,6 @@ tlm_output_file(char *dir, char *name, char *chkdir,
 
 tear_down:
 
-	// flush the output
-	setWriteBufDone(local_commands->tc_buffers);
-
 	/*
 	 * tell writer to abort.
 	 * this is used to handle when the backup target host is disconnect.
@@ -830,8 +1018,6 @@ get_write_buffer(long size, long *actual_size,
     bool_t zero, tlm_cmd_t *local_commands)
 {
 
-	// before get write buffer. need to flush the write buffer
-	setWriteBufDone(local_commands->tc_buffers);
 	while (local_commands->tc_reader == TLM_BACKUP_RUN) {
 
 		char *rec = tlm_get_write_buffer(size, actual_size,
@@ -840,8 +1026,6 @@ get_write_buffer(long size, long *actual_size,
 			return (rec);
 		}
 	}
-	// flush the write buffer.
-	setWriteBufDone(local_commands->tc_buffers);
 
 	return (NULL);
 }
@@ -863,24 +1047,30 @@ write_tar_eof(tlm_cmd_t *local_commands)
 	int i;
 	long actual_size;
 	tlm_buffers_t *bufs;
+	tlm_buffer_t *buf;
 
 	/*
 	 * output 2 zero filled records,
 	 * TAR wants this.
 	 */
-
+	for (i = 0; i < 2; i++)
+		(void) get_write_buffer(RECORDSIZE, &actual_size, TRUE,
+		    local_commands);
 
 	/*
-	 * NDMP: Clear the rest of the buffer and write two more buffers
-	 * to the tape.
+	 * NDMP: Clear the rest of the buffer so that no stale data of a
+	 * previous round is sent, then hand it to the writer.
 	 */
 	bufs = local_commands->tc_buffers;
+	buf = tlm_buffer_in_buf(bufs, NULL);
+	if (buf->tb_full)
+		return;
 
+	if (buf->tb_buffer_spot < buf->tb_buffer_size)
+		(void) memset(&buf->tb_buffer_data[buf->tb_buffer_spot], 0,
+		    buf->tb_buffer_size - buf->tb_buffer_spot);
+	buf->tb_full = TRUE;
 
-
-	bufs->tbs_buffer[bufs->tbs_buffer_in].tb_write_buf_filled = TRUE;
-	bufs->tbs_buffer[bufs->tbs_buffer_in].tb_full = TRUE;
-
-
+	(void) tlm_buffer_advance_in_idx(bufs);
 	tlm_buffer_release_in_buf(bufs);
 }
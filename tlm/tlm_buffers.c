@@ -59,10 +59,11 @@
 /*
  * tlm_allocate_buffers, shared memory for IPC
  *
- * build a set of buffers
+ * build a set of buffers.  The number of buffers in the ring is
+ * clamped to [1, TLM_MAX_TAPE_BUFFERS].
  */
 tlm_buffers_t *
-tlm_allocate_buffers(bool_t write, long xfer_size)
+tlm_allocate_buffers(bool_t write, long xfer_size, int count)
 {
 	tlm_buffers_t *buffers = ndmp_malloc(sizeof (tlm_buffers_t));
 	int	buf;
@@ -70,7 +71,19 @@ tlm_allocate_buffers(bool_t write, long xfer_size)
 	if (buffers == 0)
 		return (0);
 
-	for (buf = 0; buf < TLM_TAPE_BUFFERS; buf++) {
+	if (count < 1)
+		count = 1;
+	else if (count > TLM_MAX_TAPE_BUFFERS)
+		count = TLM_MAX_TAPE_BUFFERS;
+
+	buffers->tbs_buffer = ndmp_malloc(count * sizeof (tlm_buffer_t));
+	if (buffers->tbs_buffer == NULL) {
+		free(buffers);
+		return (0);
+	}
+	buffers->tbs_count = count;
+
+	for (buf = 0; buf < count; buf++) {
 
 		buffers->tbs_buffer[buf].tb_buffer_data =
 		    ndmp_malloc(xfer_size);
@@ -81,6 +94,7 @@ tlm_allocate_buffers(bool_t write, long xfer_size)
 			for (i = 0; i < buf; i++)
 				free(buffers->tbs_buffer[i].tb_buffer_data);
 
+			free(buffers->tbs_buffer);
 			free(buffers);
 			return (0);
 		} else {
@@ -89,8 +103,6 @@ tlm_allocate_buffers(bool_t write, long xfer_size)
 			buffers->tbs_buffer[buf].tb_full = FALSE;
 			buffers->tbs_buffer[buf].tb_eof = FALSE;
 			buffers->tbs_buffer[buf].tb_eot = FALSE;
-			buffers->tbs_buffer[buf].tb_write_buf_filled = TRUE;
-			buffers->tbs_buffer[buf].tb_read_buf_read = TRUE;
 			buffers->tbs_buffer[buf].tb_errno = 0;
 			buffers->tbs_buffer[buf].tb_buffer_spot = 0;
 		}
@@ -123,9 +135,14 @@ tlm_release_buffers(tlm_buffers_t *buffers)
 		(void) mutex_lock(&buffers->tbs_mtx);
 
 		if (--buffers->tbs_ref <= 0) {
-			for (i = 0; i < TLM_TAPE_BUFFERS; i++)
+			for (i = 0; i < buffers->tbs_count; i++) {
+				/* a file section that was never sent */
+				if (buffers->tbs_buffer[i].tb_send_len > 0)
+					(void) close(
+					    buffers->tbs_buffer[i].tb_send_fd);
 				free(buffers->tbs_buffer[i].tb_buffer_data);
-
+			}
+			free(buffers->tbs_buffer);
 		}
 
 		(void) cond_destroy(&buffers->tbs_in_cv);
@@ -141,7 +158,8 @@ tlm_release_buffers(tlm_buffers_t *buffers)
  *
  * Mark a buffer empty and clear its flags. No lock is take here:
  * the buffer should be marked empty before it is released for use
- * by another thread.
+ * by another thread.  tb_full is cleared last so that the producer
+ * never sees a free buffer with stale state.
  */
 void
 tlm_buffer_mark_empty(tlm_buffer_t *buf)
@@ -149,8 +167,11 @@ tlm_buffer_mark_empty(tlm_buffer_t *buf)
 	if (buf == NULL)
 		return;
 
-	buf->tb_full = buf->tb_eof = buf->tb_eot = FALSE;
+	buf->tb_buffer_spot = 0;
+	buf->tb_send_len = 0;
 	buf->tb_errno = 0;
+	buf->tb_eof = buf->tb_eot = FALSE;
+	buf->tb_full = FALSE;
 }
 
 
@@ -158,7 +179,8 @@ tlm_buffer_mark_empty(tlm_buffer_t *buf)
  * tlm_buffer_advance_in_idx
  *
  * Advance the input index of the buffers(round-robin) and return pointer
- * to the next buffer in the buffer pool.
+ * to the next buffer in the buffer pool.  The input index is only
+ * touched by the producer, so no lock is needed.
  */
 tlm_buffer_t *
 tlm_buffer_advance_in_idx(tlm_buffers_t *bufs)
@@ -166,11 +188,9 @@ tlm_buffer_advance_in_idx(tlm_buffers_t *bufs)
 	if (bufs == NULL)
 		return (NULL);
 
-	(void) mutex_lock(&bufs->tbs_mtx);
-	if (++bufs->tbs_buffer_in >= TLM_TAPE_BUFFERS)
+	if (++bufs->tbs_buffer_in >= bufs->tbs_count)
 		bufs->tbs_buffer_in = 0;
 
-	(void) mutex_unlock(&bufs->tbs_mtx);
 	return (&bufs->tbs_buffer[bufs->tbs_buffer_in]);
 }
 
@@ -179,7 +199,8 @@ tlm_buffer_advance_in_idx(tlm_buffers_t *bufs)
  * tlm_buffer_advance_out_idx
  *
  * Advance the output index of the buffers(round-robin) and return pointer
- * to the next buffer in the buffer pool.
+ * to the next buffer in the buffer pool.  The output index is only
+ * touched by the consumer, so no lock is needed.
  */
 tlm_buffer_t *
 tlm_buffer_advance_out_idx(tlm_buffers_t *bufs)
@@ -187,11 +208,9 @@ tlm_buffer_advance_out_idx(tlm_buffers_t *bufs)
 	if (bufs == NULL)
 		return (NULL);
 
-	(void) mutex_lock(&bufs->tbs_mtx);
-	if (++bufs->tbs_buffer_out >= TLM_TAPE_BUFFERS)
+	if (++bufs->tbs_buffer_out >= bufs->tbs_count)
 		bufs->tbs_buffer_out = 0;
 
-	(void) mutex_unlock(&bufs->tbs_mtx);
 	return (&bufs->tbs_buffer[bufs->tbs_buffer_out]);
 }
 
@@ -204,17 +223,12 @@ tlm_buffer_advance_out_idx(tlm_buffers_t *bufs)
 tlm_buffer_t *
 tlm_buffer_in_buf(tlm_buffers_t *bufs, int *idx)
 {
-	tlm_buffer_t *ret;
-
 	if (bufs == NULL)
 		return (NULL);
 
-	(void) mutex_lock(&bufs->tbs_mtx);
-	ret = &bufs->tbs_buffer[bufs->tbs_buffer_in];
 	if (idx)
 		*idx = bufs->tbs_buffer_in;
-	(void) mutex_unlock(&bufs->tbs_mtx);
-	return (ret);
+	return (&bufs->tbs_buffer[bufs->tbs_buffer_in]);
 }
 
 
@@ -226,18 +240,27 @@ tlm_buffer_in_buf(tlm_buffers_t *bufs, int *idx)
 tlm_buffer_t *
 tlm_buffer_out_buf(tlm_buffers_t *bufs, int *idx)
 {
-	tlm_buffer_t *ret;
-
-
 	if (bufs == NULL)
 		return (NULL);
 
-	(void) mutex_lock(&bufs->tbs_mtx);
-	ret = &bufs->tbs_buffer[bufs->tbs_buffer_out];
 	if (idx)
 		*idx = bufs->tbs_buffer_out;
-	(void) mutex_unlock(&bufs->tbs_mtx);
-	return (ret);
+	return (&bufs->tbs_buffer[bufs->tbs_buffer_out]);
+}
+
+
+/*
+ * tlm_buffer_has_data
+ *
+ * Return TRUE if the consumer still has a full buffer to work on.
+ */
+bool_t
+tlm_buffer_has_data(tlm_buffers_t *bufs)
+{
+	if (bufs == NULL)
+		return (FALSE);
+
+	return (bufs->tbs_buffer[bufs->tbs_buffer_out].tb_full ? TRUE : FALSE);
 }
 
 
@@ -271,70 +294,144 @@ tlm_buffer_release_out_buf(tlm_buffers_t *bufs)
 	(void) mutex_unlock(&bufs->tbs_mtx);
 }
 
+
 /*
- * tlm_buffer_in_buf_wait
+ * tlm_buffer_shutdown
  *
- * Wait for the input buffer to get available.
+ * One side of the ring has quit or has been told to quit. Wake up
+ * everybody and do not let anyone block on the ring any more.
  */
 void
-tlm_buffer_in_buf_wait(tlm_buffers_t *bufs)
+tlm_buffer_shutdown(tlm_buffers_t *bufs)
+{
+	if (bufs == NULL)
+		return;
+
+	(void) mutex_lock(&bufs->tbs_mtx);
+	bufs->tbs_flags |= TLM_BUF_SHUTDOWN;
+	(void) cond_broadcast(&bufs->tbs_in_cv);
+	(void) cond_broadcast(&bufs->tbs_out_cv);
+	(void) mutex_unlock(&bufs->tbs_mtx);
+}
+
 
+/*
+ * tlm_buffer_pause
+ *
+ * Ask the producer to stop filling the ring.  It pauses before the
+ * next buffer it would fill, see tlm_buffer_pause_wait.
+ */
+void
+tlm_buffer_pause(tlm_buffers_t *bufs)
 {
 	(void) mutex_lock(&bufs->tbs_mtx);
+	bufs->tbs_flags |= TLM_BUF_PAUSE;
+	(void) mutex_unlock(&bufs->tbs_mtx);
+}
 
-	while ((bufs->tbs_flags & TLM_BUF_IN_READY) == 0){
 
-		(void) cond_wait(&bufs->tbs_in_cv, &bufs->tbs_mtx);
-	}
+/*
+ * tlm_buffer_resume
+ *
+ * Let the producer go on filling the ring.
+ */
+void
+tlm_buffer_resume(tlm_buffers_t *bufs)
+{
+	(void) mutex_lock(&bufs->tbs_mtx);
+	bufs->tbs_flags &= ~(TLM_BUF_PAUSE | TLM_BUF_PAUSED);
+	(void) cond_broadcast(&bufs->tbs_out_cv);
+	(void) mutex_unlock(&bufs->tbs_mtx);
+}
 
-	bufs->tbs_flags &= ~TLM_BUF_IN_READY;
 
+/*
+ * tlm_buffer_paused
+ *
+ * Is the producer paused?
+ */
+bool_t
+tlm_buffer_paused(tlm_buffers_t *bufs)
+{
+	bool_t rv;
+
+	(void) mutex_lock(&bufs->tbs_mtx);
+	rv = (bufs->tbs_flags & TLM_BUF_PAUSED) ? TRUE : FALSE;
 	(void) mutex_unlock(&bufs->tbs_mtx);
+
+	return (rv);
 }
 
+
 /*
- * tlm_buffer_setup_timer
+ * tlm_buffer_pause_wait
  *
- * Set up the time out value.
+ * Called by the producer before it fills a buffer.  If it has been
+ * asked to pause, wake up the consumer, which may be waiting for that
+ * buffer, and wait to be resumed.  Returns TRUE if it did pause.
  */
-static inline void
-tlm_buffer_setup_timer(struct timespec *timo, unsigned int milli_timo)
+bool_t
+tlm_buffer_pause_wait(tlm_buffers_t *bufs)
 {
-	if (milli_timo == 0)
-		milli_timo = 1;
+	(void) mutex_lock(&bufs->tbs_mtx);
+	if ((bufs->tbs_flags & TLM_BUF_PAUSE) == 0) {
+		(void) mutex_unlock(&bufs->tbs_mtx);
+		return (FALSE);
+	}
 
-	clock_gettime(CLOCK_REALTIME, timo);
+	bufs->tbs_flags |= TLM_BUF_PAUSED;
+	(void) cond_broadcast(&bufs->tbs_in_cv);
 
-	if (milli_timo / 1000)
-		timo->tv_sec += (milli_timo / 1000);
+	while ((bufs->tbs_flags & TLM_BUF_PAUSE) &&
+	    (bufs->tbs_flags & TLM_BUF_SHUTDOWN) == 0)
+		(void) cond_wait(&bufs->tbs_out_cv, &bufs->tbs_mtx);
 
-	timo->tv_nsec += (milli_timo % 1000) * 1000000L;
+	bufs->tbs_flags &= ~TLM_BUF_PAUSED;
+	(void) mutex_unlock(&bufs->tbs_mtx);
+
+	return (TRUE);
 }
 
 
 /*
- * tlm_buffer_in_buf_timed_wait
+ * tlm_buffer_drained
  *
- * Wait for the input buffer to get ready with a time out.
+ * The consumer has used all the data in the ring.  Only meaningful
+ * while the producer is paused.
  */
-void
-tlm_buffer_in_buf_timed_wait(tlm_buffers_t *bufs, unsigned int milli_timo)
-
+bool_t
+tlm_buffer_drained(tlm_buffers_t *bufs)
 {
-	struct timespec timo;
+	tlm_buffer_t *buf;
 
+	buf = &bufs->tbs_buffer[bufs->tbs_buffer_out];
+	if (!buf->tb_full)
+		return (TRUE);
+	if (buf->tb_buffer_spot < buf->tb_buffer_size)
+		return (FALSE);
 
+	/* this one is used up, it is released on the next read */
+	buf = &bufs->tbs_buffer[(bufs->tbs_buffer_out + 1) % bufs->tbs_count];
 
-	(void) mutex_lock(&bufs->tbs_mtx);
+	return ((bufs->tbs_count > 1 && buf->tb_full) ? FALSE : TRUE);
+}
 
-	tlm_buffer_setup_timer(&timo, milli_timo);
 
-	(void) pthread_cond_timedwait(&bufs->tbs_in_cv, &bufs->tbs_mtx, &timo);
+/*
+ * tlm_buffer_in_buf_wait
+ *
+ * Wait for the producer to release a buffer.  The ready flag latches
+ * the wakeup, so a release that happens before we get here is not lost.
+ */
+void
+tlm_buffer_in_buf_wait(tlm_buffers_t *bufs)
+{
+	(void) mutex_lock(&bufs->tbs_mtx);
+
+	while ((bufs->tbs_flags &
+	    (TLM_BUF_IN_READY | TLM_BUF_SHUTDOWN | TLM_BUF_PAUSED)) == 0)
+		(void) cond_wait(&bufs->tbs_in_cv, &bufs->tbs_mtx);
 
-	/*
-	 * TLM_BUF_IN_READY doesn't matter for timedwait but clear
-	 * it here so that cond_wait doesn't get the wrong result.
-	 */
 	bufs->tbs_flags &= ~TLM_BUF_IN_READY;
 
 	(void) mutex_unlock(&bufs->tbs_mtx);
@@ -342,25 +439,22 @@ tlm_buffer_in_buf_timed_wait(tlm_buffers_t *bufs, unsigned int milli_timo)
 
 
 /*
- * tlm_buffer_out_buf_timed_wait
+ * tlm_buffer_out_buf_wait
  *
- * Wait for the output buffer to get ready with a time out.
+ * Wait for the consumer to release a buffer.
  */
 void
-tlm_buffer_out_buf_timed_wait(tlm_buffers_t *bufs, unsigned int milli_timo)
+tlm_buffer_out_buf_wait(tlm_buffers_t *bufs)
 {
-	struct timespec timo;
-
 	(void) mutex_lock(&bufs->tbs_mtx);
-	tlm_buffer_setup_timer(&timo, milli_timo);
-	(void) pthread_cond_timedwait(&bufs->tbs_out_cv, &bufs->tbs_mtx, &timo);
-	/*
-	 * TLM_BUF_OUT_READY doesn't matter for timedwait but clear
-	 * it here so that cond_wait doesn't get the wrong result.
-	 */
+
+	while ((bufs->tbs_flags &
+	    (TLM_BUF_OUT_READY | TLM_BUF_SHUTDOWN)) == 0)
+		(void) cond_wait(&bufs->tbs_out_cv, &bufs->tbs_mtx);
+
 	bufs->tbs_flags &= ~TLM_BUF_OUT_READY;
-	(void) mutex_unlock(&bufs->tbs_mtx);
 
+	(void) mutex_unlock(&bufs->tbs_mtx);
 }
 
 
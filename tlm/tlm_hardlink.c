@@ -42,7 +42,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/queue.h>
+#include <sys/types.h>
 
 #include "tlm.h"
 #include "tlm_proto.h"
@@ -52,17 +52,124 @@
 #define	HL_DBG_GET	0x0004
 #define	HL_DBG_ADD	0x0008
 
+/* initial number of slots; the table is doubled when half full */
+#define	HL_INIT_SLOTS	1024
+
+/* size of the chunks the paths are stored in */
+#define	HL_ARENA_SIZE	(64 * 1024)
+
+struct hardlink_arena {
+	struct hardlink_arena *ha_next;
+	size_t ha_size;
+	size_t ha_used;
+	char ha_data[];
+};
+
 static int hardlink_q_dbg = -1;
 
+/*
+ * Hash a (device, inode) pair into the slot table.
+ */
+static size_t
+hardlink_hash(dev_t dev, unsigned long inode, size_t nslots)
+{
+	unsigned long long h;
+
+	h = ((unsigned long long)dev << 32) ^ inode;
+	h *= 0x9e3779b97f4a7c15ULL;
+
+	return ((size_t)(h >> 32) & (nslots - 1));
+}
+
+/*
+ * Return the slot of (dev, inode), or the empty slot where it goes.
+ */
+static struct hardlink_node *
+hardlink_slot(struct hardlink_node *slots, size_t nslots, dev_t dev,
+    unsigned long inode)
+{
+	struct hardlink_node *hl;
+	size_t i;
+
+	for (i = hardlink_hash(dev, inode, nslots); ; i = (i + 1) & (nslots - 1)) {
+		hl = &slots[i];
+		if (!hl->in_use || (hl->inode == inode && hl->dev == dev))
+			return (hl);
+	}
+}
+
+/*
+ * Double the table.
+ */
+static int
+hardlink_grow(struct hardlink_q *hl_q)
+{
+	struct hardlink_node *slots, *hl, *end;
+	size_t nslots;
+
+	nslots = hl_q->hq_nslots * 2;
+	slots = calloc(nslots, sizeof (struct hardlink_node));
+	if (!slots)
+		return (-1);
+
+	end = hl_q->hq_slots + hl_q->hq_nslots;
+	for (hl = hl_q->hq_slots; hl < end; hl++)
+		if (hl->in_use)
+			*hardlink_slot(slots, nslots, hl->dev, hl->inode) = *hl;
+
+	free(hl_q->hq_slots);
+	hl_q->hq_slots = slots;
+	hl_q->hq_nslots = nslots;
+
+	return (0);
+}
+
+/*
+ * Copy a path into the arena.
+ */
+static char *
+hardlink_strdup(struct hardlink_q *hl_q, char *path)
+{
+	struct hardlink_arena *ap;
+	size_t len, size;
+	char *p;
+
+	len = strlen(path) + 1;
+	ap = hl_q->hq_arena;
+	if (!ap || ap->ha_size - ap->ha_used < len) {
+		size = len > HL_ARENA_SIZE ? len : HL_ARENA_SIZE;
+		ap = malloc(sizeof (struct hardlink_arena) + size);
+		if (!ap)
+			return (NULL);
+		ap->ha_size = size;
+		ap->ha_used = 0;
+		ap->ha_next = hl_q->hq_arena;
+		hl_q->hq_arena = ap;
+		hl_q->hq_arena_size += size;
+	}
+
+	p = ap->ha_data + ap->ha_used;
+	(void) memcpy(p, path, len);
+	ap->ha_used += len;
+
+	return (p);
+}
 
 struct hardlink_q *
 hardlink_q_init()
 {
 	struct hardlink_q *qhead;
 
-	qhead = (struct hardlink_q *)malloc(sizeof (struct hardlink_q));
+	qhead = (struct hardlink_q *)calloc(1, sizeof (struct hardlink_q));
 	if (qhead) {
-		SLIST_INIT(qhead);
+		qhead->hq_slots = calloc(HL_INIT_SLOTS,
+		    sizeof (struct hardlink_node));
+		if (!qhead->hq_slots) {
+			free(qhead);
+			qhead = NULL;
+		} else {
+			qhead->hq_nslots = HL_INIT_SLOTS;
+		}
 	}
 
 	if (hardlink_q_dbg & HL_DBG_INIT)
@@ -71,10 +178,15 @@ hardlink_q_init()
 	return (qhead);
 }
 
+/*
+ * Forget all the entries, so that the table can be used for another
+ * job of the session.  Temporary files are removed.
+ */
 void
-hardlink_q_cleanup(struct hardlink_q *hl_q)
+hardlink_q_reset(struct hardlink_q *hl_q)
 {
-	struct hardlink_node *hl;
+	struct hardlink_node *hl, *end, *slots;
+	struct hardlink_arena *ap;
 
 	if (hardlink_q_dbg & HL_DBG_CLEANUP)
 		ndmpd_log(LOG_DEBUG, "(1): qhead = %p", hl_q);
@@ -82,15 +194,19 @@ hardlink_q_cleanup(struct hardlink_q *hl_q)
 	if (!hl_q)
 		return;
 
-	while (!SLIST_EMPTY(hl_q)) {
-		hl = SLIST_FIRST(hl_q);
+	ndmpd_log(LOG_DEBUG,
+	    "hardlink_q: %zu entries, %zu slots, %zu bytes in use",
+	    hl_q->hq_count, hl_q->hq_nslots, hardlink_q_memsize(hl_q));
+
+	end = hl_q->hq_slots + hl_q->hq_nslots;
+	for (hl = hl_q->hq_slots; hl < end; hl++) {
+		if (!hl->in_use)
+			continue;
 
 		if (hardlink_q_dbg & HL_DBG_CLEANUP)
 			ndmpd_log(LOG_DEBUG, "(2): remove node, inode = %lu",
 			    hl->inode);
 
-		SLIST_REMOVE_HEAD(hl_q, next_hardlink);
-
 		/* remove the temporary file */
 		if (hl->is_tmp) {
 			if (hl->path) {
@@ -105,22 +221,60 @@ hardlink_q_cleanup(struct hardlink_q *hl_q)
 				    hl->inode);
 			}
 		}
+	}
 
-		if (hl->path)
-			free(hl->path);
-		free(hl);
+	while ((ap = hl_q->hq_arena) != NULL) {
+		hl_q->hq_arena = ap->ha_next;
+		free(ap);
+	}
+	hl_q->hq_arena_size = 0;
+
+	/* give back the memory of a large table */
+	if (hl_q->hq_nslots > HL_INIT_SLOTS &&
+	    (slots = calloc(HL_INIT_SLOTS,
+	    sizeof (struct hardlink_node))) != NULL) {
+		free(hl_q->hq_slots);
+		hl_q->hq_slots = slots;
+		hl_q->hq_nslots = HL_INIT_SLOTS;
+	} else {
+		(void) memset(hl_q->hq_slots, 0,
+		    hl_q->hq_nslots * sizeof (struct hardlink_node));
 	}
+	hl_q->hq_count = 0;
+}
+
+void
+hardlink_q_cleanup(struct hardlink_q *hl_q)
+{
+	if (!hl_q)
+		return;
 
+	hardlink_q_reset(hl_q);
+	free(hl_q->hq_slots);
 	free(hl_q);
 }
 
 /*
- * Return 0 if a list node has the same inode, and initialize offset and path
- * with the information in the list node.
- * Return -1 if no matching node is found.
+ * Return the memory used by the table and the paths.
+ */
+size_t
+hardlink_q_memsize(struct hardlink_q *hl_q)
+{
+	if (!hl_q)
+		return (0);
+
+	return (sizeof (struct hardlink_q) +
+	    hl_q->hq_nslots * sizeof (struct hardlink_node) +
+	    hl_q->hq_arena_size);
+}
+
+/*
+ * Return 0 if an entry has the same device and inode, and initialize
+ * offset and path with the information in the entry.
+ * Return -1 if no matching entry is found.
  */
 int
-hardlink_q_get(struct hardlink_q *hl_q, unsigned long inode,
+hardlink_q_get(struct hardlink_q *hl_q, dev_t dev, unsigned long inode,
     unsigned long long *offset, char **path)
 {
 	struct hardlink_node *hl;
@@ -132,33 +286,26 @@ hardlink_q_get(struct hardlink_q *hl_q, unsigned long inode,
 	if (!hl_q)
 		return (-1);
 
-	SLIST_FOREACH(hl, hl_q, next_hardlink) {
-		if (hardlink_q_dbg & HL_DBG_GET)
-			ndmpd_log(LOG_DEBUG, "(2): checking, inode = %lu",
-			    hl->inode);
-
-		if (hl->inode != inode)
-			continue;
-
-		if (offset)
-			*offset = hl->offset;
+	hl = hardlink_slot(hl_q->hq_slots, hl_q->hq_nslots, dev, inode);
+	if (!hl->in_use)
+		return (-1);
 
-		if (path)
-			*path = hl->path;
+	if (offset)
+		*offset = hl->offset;
 
-		return (0);
-	}
+	if (path)
+		*path = hl->path;
 
-	return (-1);
+	return (0);
 }
 
 /*
- * Add a node to hardlink_q.  Reject a duplicated entry.
+ * Add an entry to hardlink_q.  Reject a duplicated entry.
  *
  * Return 0 if successful, and -1 if failed.
  */
 int
-hardlink_q_add(struct hardlink_q *hl_q, unsigned long inode,
+hardlink_q_add(struct hardlink_q *hl_q, dev_t dev, unsigned long inode,
     unsigned long long offset, char *path, int is_tmp_file)
 {
 	struct hardlink_node *hl;
@@ -171,49 +318,55 @@ hardlink_q_add(struct hardlink_q *hl_q, unsigned long inode,
 	if (!hl_q)
 		return (-1);
 
-	if (!hardlink_q_get(hl_q, inode, 0, 0)) {
+	if ((hl_q->hq_count + 1) * 2 > hl_q->hq_nslots &&
+	    hardlink_grow(hl_q) != 0)
+		return (-1);
+
+	hl = hardlink_slot(hl_q->hq_slots, hl_q->hq_nslots, dev, inode);
+	if (hl->in_use) {
 		ndmpd_log(LOG_DEBUG, "hardlink (inode = %lu) exists in queue %p",
 		    inode, hl_q);
 		return (-1);
 	}
 
-	hl = (struct hardlink_node *)malloc(sizeof (struct hardlink_node));
-	if (!hl)
-		return (-1);
+	if (path) {
+		if ((hl->path = hardlink_strdup(hl_q, path)) == NULL)
+			return (-1);
+	} else
+		hl->path = NULL;
 
+	hl->dev = dev;
 	hl->inode = inode;
 	hl->offset = offset;
 	hl->is_tmp = is_tmp_file;
-	if (path)
-		hl->path = strdup(path);
-	else
-		hl->path = NULL;
+	hl->in_use = 1;
+	hl_q->hq_count++;
 
 	if (hardlink_q_dbg & HL_DBG_ADD)
 		ndmpd_log(LOG_DEBUG,
 		    "(2): added node, inode = %lu, path = %p (%s)",
 		    hl->inode, hl->path, hl->path? hl->path : "(--)");
 
-	SLIST_INSERT_HEAD(hl_q, hl, next_hardlink);
-
 	return (0);
 }
 
 int
 hardlink_q_dump(struct hardlink_q *hl_q)
 {
-	struct hardlink_node *hl;
+	struct hardlink_node *hl, *end;
 
 	if (!hl_q)
 		return (0);
 
 	(void) printf("Dumping hardlink_q, head = %p:\n", (void *) hl_q);
 
-	SLIST_FOREACH(hl, hl_q, next_hardlink)
-		(void) printf(
-		    "\t node = %lu, offset = %llu, path = %s, is_tmp = %d\n",
-		    hl->inode, hl->offset, hl->path? hl->path : "--",
-		    hl->is_tmp);
+	end = hl_q->hq_slots + hl_q->hq_nslots;
+	for (hl = hl_q->hq_slots; hl < end; hl++)
+		if (hl->in_use)
+			(void) printf(
+			    "\t node = %lu, offset = %llu, path = %s, is_tmp = %d\n",
+			    hl->inode, hl->offset, hl->path? hl->path : "--",
+			    hl->is_tmp);
 
 	return (0);
 }
@@ -75,7 +75,8 @@ int tlm_log_fhnode(tlm_job_stats_t *,
 int tlm_log_fhdir(tlm_job_stats_t *,
     char *,
     struct stat *,
-    struct fs_fhandle *);
+    fst_dirent_t *,
+    int);
 
 int tlm_log_fhpath_name(tlm_job_stats_t *,
     char *,
@@ -196,7 +197,7 @@ tlm_get_write_buffer(long want, long *actual_size,
 			/*
 			 * wait for the writer to free up a buffer
 			 */
-			tlm_buffer_out_buf_timed_wait(buffers, 500);
+			tlm_buffer_out_buf_wait(buffers);
 		}
 
 		buffer = tlm_buffer_in_buf(buffers, NULL);
@@ -273,7 +274,7 @@ tlm_get_read_buffer(int want, int *error,
 		 * next buffer is not full yet.
 		 * wait for the reader.
 		 */
-		tlm_buffer_in_buf_timed_wait(buffers, 500);
+		tlm_buffer_in_buf_wait(buffers);
 
 		buffer = tlm_buffer_out_buf(buffers, NULL);
 		if (!buffer->tb_full) {
@@ -418,10 +419,11 @@ tlm_vfy_tar_checksum(tlm_tar_hdr_t *tar_hdr)
 
 
 /*
- * create the IPC area between the reader and writer
+ * create the IPC area between the reader and writer, with a ring of
+ * 'count' buffers of 'data_transfer_size' bytes each
  */
 tlm_cmd_t *
-tlm_create_reader_writer_ipc(bool_t write, long data_transfer_size)
+tlm_create_reader_writer_ipc(bool_t write, long data_transfer_size, int count)
 {
 	tlm_cmd_t *cmd;
 	ndmpd_log(LOG_DEBUG, "tlm_create_reader_writer_ipc");
@@ -433,7 +435,8 @@ tlm_create_reader_writer_ipc(bool_t write, long data_transfer_size)
 	cmd->tc_writer = TLM_BACKUP_RUN;
 	cmd->tc_ref = 1;
 
-	cmd->tc_buffers = tlm_allocate_buffers(write, data_transfer_size);
+	cmd->tc_buffers = tlm_allocate_buffers(write, data_transfer_size,
+	    count);
 	if (cmd->tc_buffers == NULL) {
 		free(cmd);
 		return (NULL);
@@ -455,6 +458,7 @@ tlm_release_reader_writer_ipc(tlm_cmd_t *cmd)
 	if (--cmd->tc_ref <= 0) {
 		(void) mutex_lock(&cmd->tc_mtx);
 		tlm_release_buffers(cmd->tc_buffers);
+		tlm_acl_tab_free(cmd->tc_acl_tab);
 		(void) cond_destroy(&cmd->tc_cv);
 		(void) mutex_unlock(&cmd->tc_mtx);
 		(void) mutex_destroy(&cmd->tc_mtx);
@@ -502,7 +506,7 @@ lbrlog_callbacks_done(lbr_fhlog_call_backs_t *p)
  */
 int
 tlm_log_fhdir(tlm_job_stats_t *job_stats, char *dir, struct stat *stp,
-    fs_fhandle_t *fhp)
+    fst_dirent_t *ents, int nents)
 {
 	ndmpd_log(LOG_DEBUG, "tlm_log_fhdir");
 	int rv;
@@ -521,7 +525,7 @@ tlm_log_fhdir(tlm_job_stats_t *job_stats, char *dir, struct stat *stp,
 	} else if (cbp->fh_log_dir == NULL) {
 		ndmpd_log(LOG_DEBUG, "log_fhdir: callback is NULL");
 	} else
-		rv = (*cbp->fh_log_dir)(cbp, dir, stp, fhp);
+		rv = (*cbp->fh_log_dir)(cbp, dir, stp, ents, nents);
 
 	return (rv);
 }
@@ -67,7 +67,8 @@ extern int tlm_log_fhnode(tlm_job_stats_t *,
 extern int tlm_log_fhdir(tlm_job_stats_t *,
     char *,
     struct stat *,
-    struct fs_fhandle *);
+    fst_dirent_t *,
+    int);
 
 extern int tlm_log_fhpath_name(tlm_job_stats_t *,
     char *,
@@ -61,6 +61,7 @@
 #include <ndmpd_prop.h>
 
 #include <cstack.h>
+#include <tlm_util.h>
 
 #include <ndmpd_func.h>
 #include <ndmpd_tar_v3.h>
@@ -76,7 +77,136 @@ typedef bool_t name_match_fp_t(char *s, char *t);
 
 static void set_acl(char *name,
     tlm_acls_t *acls);
-static long restore_file(int *fp,
+static void set_acl_text(char *name,
+    char *acl_txt);
+static int set_acl_id(char *name,
+    struct tlm_acl_tab *tab,
+    int id);
+static void rs_owner(tlm_acls_t *acls,
+    uid_t *uidp,
+    gid_t *gidp);
+
+/*
+ * The directories of a restore, each with an open descriptor, so that
+ * the entries are made with the *at calls instead of looking up every
+ * component of their path each time.  The table is direct mapped on
+ * the hash of the path; a slot is only reused when no descriptor of
+ * it is given out.
+ */
+#define	RS_DIRCACHE_SLOTS	256
+
+typedef struct rs_dirent {
+	char *de_path;
+	int de_fd;
+	int de_ref;		/* descriptors given out */
+} rs_dirent_t;
+
+/*
+ * The attributes of the restored entries, when they are set once the
+ * data is restored.  They are applied sorted by directory, from a
+ * descriptor of the directory.  The file entries are applied whenever
+ * RS_META_MAX entries are logged; the directories wait for the end of
+ * the restore, as the entries made under them change their mtime.
+ * They are kept at the start of the log, out of the later sorts, with
+ * their paths in an arena of their own.
+ */
+#define	RS_META_MAX		(256 * 1024)
+#define	RS_META_CHUNK		(64 * 1024)	/* path arena chunk */
+
+#define	RM_DIR		0x1
+#define	RM_SYMLINK	0x2
+
+typedef struct rs_meta {
+	char *rm_path;
+	char *rm_acl;		/* ACL text, NULL if trivial */
+	struct tlm_acl_tab *rm_acltab;
+	int rm_aclid;		/* ACL in rm_acltab, 0 if none */
+	int rm_base;		/* offset of the last component */
+	int rm_flags;		/* RM_* */
+	mode_t rm_mode;
+	uid_t rm_uid;
+	gid_t rm_gid;
+	time_t rm_mtime;
+	time_t rm_atime;
+} rs_meta_t;
+
+typedef struct rs_meta_chunk {
+	struct rs_meta_chunk *mc_next;
+	int mc_used;
+	char mc_data[RS_META_CHUNK];
+} rs_meta_chunk_t;
+
+typedef struct rs_metalog {
+	pthread_mutex_t ml_mtx;
+	rs_meta_t *ml_ents;
+	int ml_count;
+	int ml_size;
+	int ml_kept;		/* directories kept for the end */
+	rs_meta_chunk_t *ml_chunks;
+	rs_meta_chunk_t *ml_dchunks;	/* paths of the kept directories */
+} rs_metalog_t;
+
+typedef struct rs_dircache {
+	pthread_mutex_t dc_mtx;
+	rs_dirent_t dc_slots[RS_DIRCACHE_SLOTS];
+	rs_metalog_t *dc_meta;	/* the deferred attributes, or NULL */
+} rs_dircache_t;
+
+/*
+ * The selections of a restore without wildcards, for is_file_wanted.
+ * The path of each selection, and each of its prefixes that ends in
+ * '/', is a node of a trie kept in a hash table by its path.  A node
+ * has the first selection that is the path and the first one under
+ * it, so that a name is checked against all the selections with a
+ * lookup for each of its components.
+ */
+#define	RS_SELS_SLOTS	1024	/* initial, a power of 2 */
+#define	RS_SEL_NONE	INT_MAX
+
+typedef struct rs_selnode {
+	char *sn_path;		/* in the selection, not terminated */
+	int sn_len;
+	u_int sn_hash;
+	int sn_exact;		/* first selection equal to the path */
+	int sn_below;		/* first selection under the path */
+} rs_selnode_t;
+
+typedef struct rs_sels {
+	rs_selnode_t *rs_slots;
+	int rs_nslots;
+	int rs_count;
+	struct tlm_matcher *rs_exl;	/* the exclusions, NULL if none */
+} rs_sels_t;
+
+static rs_sels_t *rs_sels_new(char **sels,
+    char **exls,
+    int flags);
+static void rs_sels_free(rs_sels_t *rsp);
+
+static rs_dircache_t *rs_dircache_new(void);
+static void rs_dircache_free(rs_dircache_t *dc);
+static int rs_dir_get(rs_dircache_t *dc,
+    char *dir,
+    int len,
+    int *slotp);
+static int rs_dir_open(rs_dircache_t *dc,
+    char *path,
+    char **basep,
+    int *slotp);
+static void rs_dir_close(rs_dircache_t *dc,
+    int fd,
+    int slot);
+static rs_metalog_t *rs_meta_new(void);
+static void rs_meta_apply(rs_dircache_t *dc,
+    bool_t all);
+static void rs_meta_free(rs_metalog_t *ml);
+static void rs_set_acl(rs_dircache_t *dc,
+    char *name,
+    tlm_acls_t *acls,
+    int flags);
+
+static long restore_file(rs_dircache_t *dc,
+    int *fp,
     char *real_name,
     long size,
     longlong_t huge_size,
@@ -97,32 +227,41 @@ static int get_humongus_file_header(int lib,
     longlong_t *size,
     char *name,
     tlm_cmd_t *);
-static int create_directory(char *dir,
+static int create_directory(rs_dircache_t *dc,
+    char *dir,
     tlm_job_stats_t *);
-static int create_hard_link(char *name,
+static int create_hard_link(rs_dircache_t *dc,
+    char *name,
     char *link,
     tlm_acls_t *,
     tlm_job_stats_t *);
-static int create_sym_link(char *dst,
+static int create_sym_link(rs_dircache_t *dc,
+    char *dst,
     char *target,
     tlm_acls_t *,
     tlm_job_stats_t *);
-static int create_fifo(char *name,
+static int create_fifo(rs_dircache_t *dc,
+    char *name,
     tlm_acls_t *);
 static long load_acl_info(int lib,
     int	drv,
     long size,
+    int aclid,
     tlm_acls_t *,
     long *acl_spot,
     tlm_cmd_t *);
+static bool_t rs_has_input(tlm_cmd_t *local_commands);
 static char *get_read_buffer(int want,
     int	*error,
     int	*actual_size,
     tlm_cmd_t *);
 static bool_t wildcard_enabled(void);
+static bool_t direct_io_enabled(void);
+static bool_t defer_attrs_enabled(void);
 static bool_t is_file_wanted(char *name,
     char **sels,
     char **exls,
+    rs_sels_t *rsp,
     int	flags,
     int	*mchtype,
     int	*pos);
@@ -141,6 +280,78 @@ typedef struct stack_ent {
 	tlm_acls_t se_acls;
 } stack_ent_t;
 
+/*
+ * Files up to RS_POOL_FILE_MAX bytes are read off the stream by
+ * tar_getdir and handed over to the writer threads.  Larger ones are
+ * written by tar_getdir itself while it reads them.
+ */
+#define	RS_POOL_FILE_MAX	(1024 * 1024)
+#define	RS_POOL_BYTES		(32 * 1024 * 1024)	/* data queued */
+#define	RS_POOL_DIRS		1024	/* directories waiting for attrs */
+
+typedef struct rs_job {
+	struct rs_job *rj_next;
+	char *rj_name;
+	char *rj_data;
+	long rj_size;
+	tlm_acls_t rj_acls;
+} rs_job_t;
+
+/*
+ * The restore writer pool.  The directories popped off the dtree
+ * stack keep their attributes until the files queued so far have
+ * been written, or writing the files would change their mtime.
+ */
+typedef struct rs_pool {
+	pthread_mutex_t rp_mtx;
+	pthread_cond_t rp_work_cv;	/* a job was queued */
+	pthread_cond_t rp_done_cv;	/* a job was written */
+	rs_job_t *rp_head;
+	rs_job_t *rp_tail;
+	int rp_njobs;		/* jobs queued or being written */
+	long rp_bytes;		/* data of these jobs */
+	int rp_stop;
+	int rp_errors;		/* added to js_errors at the end */
+	int rp_nthreads;
+	pthread_t *rp_threads;
+	rs_dircache_t *rp_dc;
+	stack_ent_t **rp_dirs;	/* popped, attributes not set yet */
+	int rp_ndirs;
+} rs_pool_t;
+
+static rs_pool_t *rs_pool_new(int nthreads, rs_dircache_t *dc);
+static void rs_pool_wait(rs_pool_t *pool);
+static void rs_pool_destroy(rs_pool_t *pool, bool_t discard,
+    tlm_job_stats_t *job_stats);
+static long rs_pool_file(rs_pool_t *pool,
+    int *fp,
+    char *real_name,
+    long size,
+    tlm_acls_t *acls,
+    tlm_cmd_t *local_commands,
+    tlm_job_stats_t *job_stats);
+static int rs_dtree_pop(cstack_t *stp, rs_pool_t *pool);
+
+/*
+ * Files of RS_STAGE_MIN bytes or more are preallocated and written
+ * from an aligned staging buffer in RS_STAGE_SIZE pieces, instead of
+ * in whatever the ring hands out.  From RS_DIRECT_MIN bytes on they
+ * are opened with O_DIRECT if restore-direct-io is set.
+ */
+#define	RS_STAGE_MIN		(256 * 1024)
+#define	RS_STAGE_SIZE		(1024 * 1024)
+#define	RS_STAGE_ALIGN		4096
+#define	RS_DIRECT_MIN		(8 * 1024 * 1024)
+
+/*
+ * The body of a file of more than RS_DIRECT_READ bytes is read from
+ * the data connection straight into the staging buffer, once the
+ * reader thread is paused and the ring is used up.
+ */
+#define	RS_DIRECT_READ		(4 * 1024 * 1024)
+
+static void rs_unalloc(int fd);
+
 
 /*
  * dtree_push
@@ -298,7 +509,16 @@ tar_getdir(tlm_commands_t *commands,
 	 * It is not initialized for now.   We keep it here for future use.
 	 */
 	char *tmplink_dir = NULL;
+	/*
+	 * During a DAR the entry asked for is set here once it has been
+	 * restored, and the rest of the data stream is left alone.  A
+	 * directory does not count: what is under it comes after it.
+	 */
 	int dar_recovered = 0;
+	/* the writer threads, NULL if the files are written here */
+	rs_pool_t *pool = NULL;
+	rs_dircache_t *dc;
+	rs_sels_t *rsp;
 
 	/*
 	 * startup
@@ -306,10 +526,14 @@ tar_getdir(tlm_commands_t *commands,
 
 	acls = ndmp_malloc(sizeof (tlm_acls_t));
 	stp = cstack_new();
+	dc = rs_dircache_new();
 	if (longname == NULL || longlink == NULL || hugename == NULL ||
-	    name == NULL || acls == NULL || stp == NULL || parentlnk == NULL) {
+	    name == NULL || acls == NULL || stp == NULL || parentlnk == NULL ||
+	    dc == NULL) {
 		cstack_delete(stp);
 		free(acls);
+		if (dc)
+			rs_dircache_free(dc);
 		return (-TLM_NO_SCRATCH_SPACE);
 	}
 
@@ -329,6 +553,12 @@ tar_getdir(tlm_commands_t *commands,
 		ndmpd_log(LOG_DEBUG, "RSFLG_OVR_UPDATE");
 	}
 
+	if (defer_attrs_enabled())
+		dc->dc_meta = rs_meta_new();
+	if (commands->tcs_writer_threads > 1)
+		pool = rs_pool_new(commands->tcs_writer_threads, dc);
+	rsp = rs_sels_new(sels, exls, flags);
+
 	/*
 	 * work
 	 */
@@ -344,6 +574,7 @@ tar_getdir(tlm_commands_t *commands,
 	int	actual_size;
 	bool_t want_this_file;
 	int	want = sizeof (tlm_tar_hdr_t);
+	int	aclid;
 	tlm_tar_hdr_t *tar_hdr;
 	/* The inode of an LF_LINK type. */
 	unsigned long hardlink_inode = 0;
@@ -364,8 +595,8 @@ tar_getdir(tlm_commands_t *commands,
 	char *hardlink_tmp_name = ".tmphlrsnondar";
 
 	while (commands->tcs_writer != TLM_ABORT &&
-	    local_commands->tc_writer != TLM_STOP) {
-		(void)pthread_yield();
+	    (local_commands->tc_writer != TLM_STOP ||
+	    tlm_buffer_has_data(local_commands->tc_buffers))) {
 		hardlink_inode = 0;
 		hardlink_done = 0;
 		is_hardlink = 0;
@@ -380,6 +611,11 @@ tar_getdir(tlm_commands_t *commands,
 			break;
 		}
 
+		if (DAR && dar_recovered) {
+			ndmpd_log(LOG_DEBUG, "DAR entry %d restored", DAR);
+			break;
+		}
+
 		if (multi_volume) {
 			ndmpd_log(LOG_DEBUG, "multi_volume %c %ld", last_action, size_left);
 
@@ -461,6 +697,17 @@ tar_getdir(tlm_commands_t *commands,
 						(void) strlcpy(acls->gname,
 							tar_hdr->th_gname,
 							sizeof (acls->gname));
+						/* see output_acl_header */
+						acls->acl_id = 0;
+						if (local_commands->tc_acl_tab &&
+						    (aclid = oct_atoi(
+						    tar_hdr->th_aclid)) > 0) {
+							acls->acl_tab =
+							    local_commands->tc_acl_tab;
+							acls->acl_id = aclid;
+							acls->acl_non_trivial =
+							    TRUE;
+						}
 					}
 					file_size = oct_atoi(tar_hdr->th_size);
 					acl_spot = 0;
@@ -491,7 +738,7 @@ tar_getdir(tlm_commands_t *commands,
 			 * regular file.
 			 */
 			if (hardlink_inode) {
-				hardlink_done = !hardlink_q_get(hardlink_q,
+				hardlink_done = !hardlink_q_get(hardlink_q, 0,
 				    hardlink_inode, 0, &hardlink_target);
 			}
 
@@ -504,7 +751,7 @@ tar_getdir(tlm_commands_t *commands,
 				/* create a hardlink to hardlink_target */
 				file_name = (*longname == 0) ?
 				    tar_hdr->th_name : longname;
-				if (!is_file_wanted(file_name, sels, exls,
+				if (!is_file_wanted(file_name, sels, exls, rsp,
 				    flags, &mchtype, &pos)) {
 					nmp = NULL;
 					/*
@@ -531,8 +778,11 @@ tar_getdir(tlm_commands_t *commands,
 				}
 
 				if (nmp) {
+					/* the target may still be queued */
+					if (pool)
+						rs_pool_wait(pool);
 					if (hardlink_target) {
-						erc = create_hard_link(
+						erc = create_hard_link(dc,
 						    hardlink_target, nmp,
 						    acls, job_stats);
 						if (erc == 0) {
@@ -540,6 +790,9 @@ tar_getdir(tlm_commands_t *commands,
 							    tlm_entry_restored(
 							    job_stats,
 							    file_name, pos);
+							if (DAR)
+								dar_recovered =
+								    1;
 							ndmpd_log(LOG_DEBUG,
 							    "restored %s -> %s",
 							    nmp,
@@ -602,10 +855,22 @@ tar_getdir(tlm_commands_t *commands,
 			}
 
 			want_this_file = is_file_wanted(longname, sels, exls,
-			    flags, &mchtype, &pos);
+			    rsp, flags, &mchtype, &pos);
 
 			ndmpd_log(LOG_DEBUG, "longname = %s",longname);
-			if (!want_this_file) {
+			if (!want_this_file && is_hardlink && DAR) {
+				/*
+				 * The data of a hardlink is under the name
+				 * of the first link, whichever link was
+				 * asked for.
+				 */
+				nmp = rs_darhl_new_name(rnp, name, sels, &pos,
+				    longname);
+				if (nmp) {
+					want_this_file = TRUE;
+					mchtype = PM_EXACT;
+				}
+			} else if (!want_this_file) {
 				ndmpd_log(LOG_DEBUG, "do not want this file");
 				nmp = NULL;
 			} else {
@@ -656,9 +921,15 @@ tar_getdir(tlm_commands_t *commands,
 				}
 			}
 
-			size_left = restore_file(&fp, nmp, file_size,
-			    huge_size, acls, want_this_file, local_commands,
-			    job_stats);
+			if (pool && fp == 0 && huge_size == 0 &&
+			    want_this_file && file_size <= RS_POOL_FILE_MAX)
+				size_left = rs_pool_file(pool, &fp, nmp,
+				    file_size, acls, local_commands,
+				    job_stats);
+			else
+				size_left = restore_file(dc, &fp, nmp,
+				    file_size, huge_size, acls, want_this_file,
+				    local_commands, job_stats);
 
 			/*
 			 * In the case of non-DAR, we have to record the first
@@ -671,8 +942,8 @@ tar_getdir(tlm_commands_t *commands,
 			 * to locate the data records.
 			 */
 			if (is_hardlink && !DAR) {
-				if (hardlink_q_add(hardlink_q, hardlink_inode,
-				    0, nmp, hardlink_tmp_file))
+				if (hardlink_q_add(hardlink_q, 0,
+				    hardlink_inode, 0, nmp, hardlink_tmp_file))
 					ndmpd_log(LOG_DEBUG,
 					    "failed to add (%lu, %s) to HL q",
 					    hardlink_inode, nmp);
@@ -693,7 +964,7 @@ tar_getdir(tlm_commands_t *commands,
 				if (strstr(nmp, bkpath))
 					break;
 
-				(void) dtree_pop(stp);
+				(void) rs_dtree_pop(stp, pool);
 			}
 
 			ndmpd_log(LOG_DEBUG, "sizeleft %s %ld, %lld", longname,
@@ -721,6 +992,8 @@ tar_getdir(tlm_commands_t *commands,
 				if (PM_EXACT_OR_CHILD(mchtype)) {
 					(void) tlm_entry_restored(job_stats,
 					    longname, pos);
+					if (DAR && mchtype == PM_EXACT)
+						dar_recovered = 1;
 
 					/*
 					 * Add an entry to hardlink_q to record
@@ -733,7 +1006,7 @@ tar_getdir(tlm_commands_t *commands,
 
 						if (DAR) {
 							(void) hardlink_q_add(
-							    hardlink_q,
+							    hardlink_q, 0,
 							    hardlink_inode, 0,
 							    nmp, 0);
 						}
@@ -766,16 +1039,18 @@ tar_getdir(tlm_commands_t *commands,
 			    tar_hdr->th_linkname : longlink;
 			ndmpd_log(LOG_DEBUG, "file_name[%s]", file_name);
 			ndmpd_log(LOG_DEBUG, "link_name[%s]", link_name);
-			if (is_file_wanted(file_name, sels, exls, flags,
+			if (is_file_wanted(file_name, sels, exls, rsp, flags,
 			    &mchtype, &pos)) {
 				nmp = rs_new_name(rnp, name, pos, file_name);
 				if (nmp) {
-					erc = create_sym_link(nmp, link_name,
+					erc = create_sym_link(dc, nmp, link_name,
 					    acls, job_stats);
 					if (erc == 0 &&
 					    PM_EXACT_OR_CHILD(mchtype))
 						(void) tlm_entry_restored(
 						    job_stats, file_name, pos);
+					if (DAR && mchtype == PM_EXACT)
+						dar_recovered = 1;
 					name[0] = 0;
 				}
 			}
@@ -787,14 +1062,15 @@ tar_getdir(tlm_commands_t *commands,
 		case LF_DIR:
 			file_name = *longname == 0 ? tar_hdr->th_name :
 			    longname;
-			if (is_file_wanted(file_name, sels, exls, flags,
+			if (is_file_wanted(file_name, sels, exls, rsp, flags,
 			    &mchtype, &pos)) {
 				nmp = rs_new_name(rnp, name, pos, file_name);
 				if (nmp && mchtype != PM_PARENT) {
 
 					(void) strlcpy(parentlnk, nmp, sizeof(parentlnk));
 
-					erc = create_directory(nmp, job_stats);
+					erc = create_directory(dc, nmp,
+					    job_stats);
 					if (erc == 0 &&
 					    PM_EXACT_OR_CHILD(mchtype))
 						(void) tlm_entry_restored(
@@ -808,10 +1084,16 @@ tar_getdir(tlm_commands_t *commands,
 					    != NULL) {
 						if (strstr(nmp, bkpath))
 							break;
-						(void) dtree_pop(stp);
+						(void) rs_dtree_pop(stp, pool);
 					}
 
-					(void) dtree_push(stp, nmp, acls);
+					/* logged now, set at the end */
+					if (dc->dc_meta)
+						rs_set_acl(dc, nmp, acls,
+						    RM_DIR);
+					else
+						(void) dtree_push(stp, nmp,
+						    acls);
 					name[0] = 0;
 				}
 			}
@@ -823,15 +1105,17 @@ tar_getdir(tlm_commands_t *commands,
 		case LF_FIFO:
 			file_name = *longname == 0 ? tar_hdr->th_name :
 			    longname;
-			if (is_file_wanted(file_name, sels, exls, flags,
+			if (is_file_wanted(file_name, sels, exls, rsp, flags,
 			    &mchtype, &pos)) {
 				nmp = rs_new_name(rnp, name, pos, file_name);
 				if (nmp) {
-					erc = create_fifo(nmp, acls);
+					erc = create_fifo(dc, nmp, acls);
 					if (erc == 0 &&
 					    PM_EXACT_OR_CHILD(mchtype))
 						(void) tlm_entry_restored(
 						    job_stats, file_name, pos);
+					if (DAR && mchtype == PM_EXACT)
+						dar_recovered = 1;
 					name[0] = 0;
 				}
 			}
@@ -861,8 +1145,9 @@ tar_getdir(tlm_commands_t *commands,
 			is_long_name = TRUE;
 			break;
 		case LF_ACL:
-			size_left = load_acl_info(lib, drv, file_size, acls,
-			    &acl_spot, local_commands);
+			size_left = load_acl_info(lib, drv, file_size,
+			    oct_atoi(tar_hdr->th_aclid), acls, &acl_spot,
+			    local_commands);
 
 			break;
 		case LF_VOLHDR:
@@ -887,11 +1172,21 @@ tar_getdir(tlm_commands_t *commands,
 	 * tear down
 	 */
 	if (fp != 0) {
+		rs_unalloc(fp);
 		(void) close(fp);
 	}
+	if (pool)
+		rs_pool_destroy(pool, commands->tcs_writer == TLM_ABORT,
+		    job_stats);
 	while (dtree_pop(stp) != -1)
 		;
 	cstack_delete(stp);
+	if (dc->dc_meta) {
+		rs_meta_apply(dc, TRUE);
+		rs_meta_free(dc->dc_meta);
+	}
+	rs_dircache_free(dc);
+	rs_sels_free(rsp);
 
 	free(acls);
 
@@ -941,6 +1236,7 @@ tar_getfile(tlm_backup_restore_arg_t *argp)
 	if (*job == '\0') {
 		ndmpd_log(LOG_DEBUG, "No job defined");
 		lcmd->tc_reader = TLM_STOP;
+		tlm_buffer_shutdown(lcmd->tc_buffers);
 		(void) pthread_barrier_wait(&argp->ba_barrier);
 		return (-1);
 	}
@@ -948,6 +1244,7 @@ tar_getfile(tlm_backup_restore_arg_t *argp)
 	sels = argp->ba_sels;
 	if (sels == NULL) {
 		lcmd->tc_reader = TLM_STOP;
+		tlm_buffer_shutdown(lcmd->tc_buffers);
 		(void) pthread_barrier_wait(&argp->ba_barrier);
 		return (-1);
 	}
@@ -989,8 +1286,9 @@ tar_getfile(tlm_backup_restore_arg_t *argp)
 	tlm_release_list(sels);
 	tlm_release_list(exls);
 
-	commands->tcs_writer_count--;
 	lcmd->tc_reader = TLM_STOP;
+	tlm_buffer_shutdown(lcmd->tc_buffers);
+	commands->tcs_writer_count--;
 	tlm_release_reader_writer_ipc(lcmd);
 
 	ndmpd_log(LOG_DEBUG, "--------tar_getfile--------");
@@ -1017,7 +1315,8 @@ make_dirs(char *dir)
 			c = *cp;
 			*cp = '\0';
 			if (lstat(dir, &st) < 0)
-				if (mkdir(dir, 0777) < 0) {
+				/* a writer thread may have just made it */
+				if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
 					ndmpd_log(LOG_DEBUG, "Error %d"
 					    " creating directory %s",
 					    errno, dir);
@@ -1059,236 +1358,1436 @@ mkbasedir(char *path)
 	return (rv);
 }
 
-
 /*
- * read the file off the tape back onto disk
+ * rs_dircache_new
  */
-static long
-restore_file(int *fp,
-    char *real_name,
-    long size,
-    longlong_t huge_size,
-    tlm_acls_t *acls,
-    bool_t want_this_file,
-    tlm_cmd_t *local_commands,
-    tlm_job_stats_t *job_stats)
+static rs_dircache_t *
+rs_dircache_new(void)
 {
+	rs_dircache_t *dc;
 
-	ndmpd_log(LOG_DEBUG, "restore_file");
-	struct stat	attr;
-
-	if (!real_name) {
-		if (want_this_file) {
-			ndmpd_log(LOG_DEBUG, "No file name but wanted!");
-			want_this_file = FALSE;
-		}
-	} else
-		ndmpd_log(LOG_DEBUG, "new file[%s]", real_name);
-
-	/*
-	 * OK, some FM is creeping in here ...
-	 * int *fp is used to keep the
-	 * backup file channel open through
-	 * the interruption of EOT and
-	 * processing the headers of the
-	 * next tape.  So, if *fp is zero
-	 * then no file is open yet and all
-	 * is normal.  If *fp has a number
-	 * then we are returning after an
-	 * EOT break.
-	 *
-	 * *fp is now also open for HUGE files
-	 * that are put back in sections.
-	 */
+	if ((dc = ndmp_malloc(sizeof (rs_dircache_t))) == NULL)
+		return (NULL);
 
-	if (*fp == 0 && want_this_file) {
-		int	erc_stat;
+	(void) pthread_mutex_init(&dc->dc_mtx, NULL);
 
-		if (mkbasedir(real_name) < 0)
-			job_stats->js_errors++;
+	return (dc);
+}
 
-		erc_stat = stat(real_name, (struct stat *)&attr);
-		if (erc_stat < 0) {
-			ndmpd_log(LOG_DEBUG, "erc_stat < 0");
-			/*EMPTY*/
-			/* new file */
-		} else if (acls->acl_overwrite) {
-			ndmpd_log(LOG_DEBUG, "acls->acl_overwrite");
-			/*EMPTY*/
-			/* take this file no matter what */
-		} else if (acls->acl_update) {
-			if (attr.st_mtime < acls->acl_attr.st_mtime) {
-				ndmpd_log(LOG_DEBUG, "acls->acl_update attr.st_mtime < acls->acl_attr.st_mtime ");
-				/*EMPTY*/
-				/* tape is newer */
-			} else {
-				ndmpd_log(LOG_DEBUG, "acls->acl_update else");
-				/* disk file is newer */
-				want_this_file = FALSE;
-			}
-		} else {
-			ndmpd_log(LOG_DEBUG, "erc_stat < 0 else");
-			/*
-			 * no overwrite, no update,
-			 * do not ever replace old files.
-			 */
-			want_this_file = TRUE;
-		}
-		ndmpd_log(LOG_DEBUG, "want_this_file:%s yes/no:%d",real_name,want_this_file);
-		if (want_this_file) {
-			ndmpd_log(LOG_DEBUG, "creating:%s",real_name);
+/*
+ * rs_dircache_free
+ */
+static void
+rs_dircache_free(rs_dircache_t *dc)
+{
+	rs_dirent_t *ep;
+	int i;
 
-			*fp = open(real_name, O_CREAT | O_WRONLY,
-			    S_IRUSR | S_IWUSR);
-			if (*fp == -1) {
-				ndmpd_log(LOG_ERR,
-				    "Could not open %s for restore.",
-				    real_name);
-				ndmpd_log(LOG_DEBUG,
-				    "fp=%d err=%d ", *fp, errno);
-				job_stats->js_errors++;
-				want_this_file = FALSE;
-				/*
-				 * we cannot return here,
-				 * the file is still on
-				 * the tape and must be
-				 * skipped over.
-				 */
-			}
+	for (i = 0; i < RS_DIRCACHE_SLOTS; i++) {
+		ep = &dc->dc_slots[i];
+		if (ep->de_path) {
+			(void) close(ep->de_fd);
+			free(ep->de_path);
 		}
-		(void) strlcpy(local_commands->tc_file_name, real_name,
-		    TLM_MAX_PATH_NAME);
 	}
 
-	/*
-	 * this is the size left in the next segment
-	 */
-	huge_size -= size;
+	(void) pthread_mutex_destroy(&dc->dc_mtx);
+	free(dc);
+}
 
-	/*
-	 * work
-	 */
-	int	actual_size;
-	int	error;
-	char	*rec;
-	int	write_size;
+/*
+ * rs_dir_get
+ *
+ * Return a descriptor of the directory named by the first len bytes
+ * of dir, creating it if needed.  The slot it is cached in, or -1,
+ * is returned in *slotp for rs_dir_close.
+ */
+static int
+rs_dir_get(rs_dircache_t *dc, char *dir, int len, int *slotp)
+{
+	char buf[TLM_MAX_PATH_NAME];
+	rs_dirent_t *ep;
+	unsigned int h;
+	char *np;
+	int fd;
+	int i;
 
-	while (size > 0 && local_commands->tc_writer == TLM_RESTORE_RUN) {
+	*slotp = -1;
+	while (len > 1 && dir[len - 1] == '/')
+		len--;
+	if (len <= 0 || len >= TLM_MAX_PATH_NAME) {
+		ndmpd_log(LOG_DEBUG, "Invalid argument");
+		return (-1);
+	}
+	(void) memcpy(buf, dir, len);
+	buf[len] = '\0';
+
+	for (h = 2166136261U, i = 0; i < len; i++)
+		h = (h ^ (unsigned char)buf[i]) * 16777619U;
+	h %= RS_DIRCACHE_SLOTS;
+	ep = &dc->dc_slots[h];
+
+	(void) pthread_mutex_lock(&dc->dc_mtx);
+	if (ep->de_path && strcmp(ep->de_path, buf) == 0) {
+		ep->de_ref++;
+		*slotp = h;
+		fd = ep->de_fd;
+		(void) pthread_mutex_unlock(&dc->dc_mtx);
+		return (fd);
+	}
+	(void) pthread_mutex_unlock(&dc->dc_mtx);
+
+	fd = open(buf, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 && errno == ENOENT && make_dirs(buf) == 0)
+		fd = open(buf, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		ndmpd_log(LOG_DEBUG, "Error %d opening directory %s",
+		    errno, buf);
+		return (-1);
+	}
 
-		(void)pthread_yield();
-		/*
-		 * Use bytes_in_file field to tell reader the amount
-		 * of data still need to be read for this file.
-		 */
-		job_stats->js_bytes_in_file = size;
+	(void) pthread_mutex_lock(&dc->dc_mtx);
+	if (ep->de_path && strcmp(ep->de_path, buf) == 0) {
+		/* another thread got here first */
+		(void) close(fd);
+		ep->de_ref++;
+		*slotp = h;
+		fd = ep->de_fd;
+	} else if (ep->de_ref == 0 && (np = strdup(buf)) != NULL) {
+		if (ep->de_path) {
+			(void) close(ep->de_fd);
+			free(ep->de_path);
+		}
+		ep->de_path = np;
+		ep->de_fd = fd;
+		ep->de_ref = 1;
+		*slotp = h;
+	}
+	(void) pthread_mutex_unlock(&dc->dc_mtx);
 
-		error = 0;
-		rec = get_read_buffer(size, &error, &actual_size,
-		    local_commands);
-		if (actual_size <= 0) {
-			ndmpd_log(LOG_DEBUG,
-			    "RESTORE WRITER> error %d, actual_size %d",
-			    error, actual_size);
+	return (fd);
+}
 
-			/* no more data for this file for now */
-			job_stats->js_bytes_in_file = 0;
+/*
+ * rs_dir_open
+ *
+ * Return a descriptor of the directory the path is in, creating the
+ * directories leading to it if needed.  *basep is set to the last
+ * component of the path.
+ */
+static int
+rs_dir_open(rs_dircache_t *dc, char *path, char **basep, int *slotp)
+{
+	char *cp;
 
-			setReadBufDone(local_commands->tc_buffers);
+	*slotp = -1;
+	if ((cp = strrchr(path, '/')) == NULL) {
+		*basep = path;
+		return (AT_FDCWD);
+	}
 
-			return (size);
-		} else if (error) {
-			ndmpd_log(LOG_DEBUG, "Error %d in file [%s]",
-			    error, local_commands->tc_file_name);
-			break;
-		} else {
-			write_size = min(size, actual_size);
-			if (want_this_file) {
-				write_size = write(*fp, rec, write_size);
-			}
+	*basep = cp + 1;
+	return (rs_dir_get(dc, path, (cp == path) ? 1 : cp - path, slotp));
+}
 
-			size -= write_size;
-		}
+/*
+ * rs_dir_close
+ */
+static void
+rs_dir_close(rs_dircache_t *dc, int fd, int slot)
+{
+	if (slot >= 0) {
+		(void) pthread_mutex_lock(&dc->dc_mtx);
+		dc->dc_slots[slot].de_ref--;
+		(void) pthread_mutex_unlock(&dc->dc_mtx);
+	} else if (fd >= 0) {
+		(void) close(fd);
 	}
-	setReadBufDone(local_commands->tc_buffers);
+}
 
-	/* no more data for this file for now */
-	job_stats->js_bytes_in_file = 0;
+/*
+ * rs_meta_new
+ */
+static rs_metalog_t *
+rs_meta_new(void)
+{
+	rs_metalog_t *ml;
 
+	if ((ml = ndmp_malloc(sizeof (rs_metalog_t))) == NULL)
+		return (NULL);
 
+	(void) pthread_mutex_init(&ml->ml_mtx, NULL);
 
-	/*
-	 * teardown
-	 */
-	if (*fp != 0 && huge_size <= 0) {
-		(void) close(*fp);
-		*fp = 0;
-		set_acl(real_name, acls);
-	}
-	return (0);
+	return (ml);
 }
 
+/*
+ * rs_meta_chunks_free
+ */
+static void
+rs_meta_chunks_free(rs_meta_chunk_t **chunks)
+{
+	rs_meta_chunk_t *cp;
 
-
+	while ((cp = *chunks) != NULL) {
+		*chunks = cp->mc_next;
+		free(cp);
+	}
+}
 
 /*
- * Match the name with the list
+ * rs_meta_free
  */
-static int
-exact_find(char *name, char **list)
+static void
+rs_meta_free(rs_metalog_t *ml)
 {
-	bool_t found;
 	int i;
-	char *cp;
 
-	found = FALSE;
-	for (i = 0; *list != NULL; list++, i++) {
-		cp = *list + strspn(*list, "/");
-		if (match(cp, name)) {
-			found = TRUE;
-			ndmpd_log(LOG_DEBUG, "exact_find> found[%s]", cp);
-			break;
-		}
-	}
+	for (i = 0; i < ml->ml_count; i++)
+		free(ml->ml_ents[i].rm_acl);
+	rs_meta_chunks_free(&ml->ml_chunks);
+	rs_meta_chunks_free(&ml->ml_dchunks);
 
-	return (found);
+	(void) pthread_mutex_destroy(&ml->ml_mtx);
+	free(ml->ml_ents);
+	free(ml);
 }
 
 /*
- * On error, return FALSE and prevent restoring(probably) unwanted data.
+ * rs_meta_path
+ *
+ * Copy a path into an arena of the log.
  */
-static int
-is_parent(char *parent, char *child, int flags)
+static char *
+rs_meta_path(rs_meta_chunk_t **chunks, char *path, int len)
 {
-	char tmp[TLM_MAX_PATH_NAME];
-	bool_t rv;
-
-	if (IS_SET(flags, RSFLG_MATCH_WCARD)) {
-		if (!tlm_cat_path(tmp, parent, "*")) {
-			ndmpd_log(LOG_DEBUG,
-			    "is_parent> path too long [%s]", parent);
-			rv = FALSE;
-		} else
-			rv = (match(tmp, child) != 0) ? TRUE : FALSE;
-	} else {
-		if (!tlm_cat_path(tmp, parent, "/")) {
-			ndmpd_log(LOG_DEBUG,
-			    "is_parent> path too long [%s]", parent);
-			rv = FALSE;
-		} else
-			rv = (strncmp(tmp, child, strlen(tmp)) == 0) ?
-			    TRUE : FALSE;
+	rs_meta_chunk_t *cp;
+	char *np;
+
+	cp = *chunks;
+	if (cp == NULL || cp->mc_used + len + 1 > RS_META_CHUNK) {
+		if (len + 1 > RS_META_CHUNK)
+			return (NULL);
+		if ((cp = malloc(sizeof (rs_meta_chunk_t))) == NULL)
+			return (NULL);
+		cp->mc_used = 0;
+		cp->mc_next = *chunks;
+		*chunks = cp;
 	}
 
-	return (rv);
+	np = cp->mc_data + cp->mc_used;
+	(void) memcpy(np, path, len);
+	np[len] = '\0';
+	cp->mc_used += len + 1;
+
+	return (np);
 }
 
 /*
- * Used to match the filename inside the list
+ * Sort by the directory, then by name.
  */
-static bool_t
-strexactcmp(char *s, char *t)
+static int
+rs_meta_cmp(const void *p1, const void *p2)
 {
-	return ((strcmp(s, t) == 0) ? TRUE : FALSE);
+	const rs_meta_t *m1 = p1;
+	const rs_meta_t *m2 = p2;
+	int rv;
+
+	rv = memcmp(m1->rm_path, m2->rm_path, min(m1->rm_base, m2->rm_base));
+	if (rv == 0)
+		rv = m1->rm_base - m2->rm_base;
+	if (rv == 0)
+		rv = strcmp(m1->rm_path + m1->rm_base,
+		    m2->rm_path + m2->rm_base);
+
+	return (rv);
+}
+
+/*
+ * rs_meta_set
+ *
+ * Set the attributes of one entry from a descriptor of its directory.
+ */
+static void
+rs_meta_set(int dfd, rs_meta_t *mp)
+{
+	struct timespec ts[2];
+	char *base;
+
+	base = mp->rm_path + mp->rm_base;
+
+	if (fchownat(dfd, base, mp->rm_uid, mp->rm_gid, AT_SYMLINK_NOFOLLOW))
+		ndmpd_log(LOG_ERR,
+		    "Could not set uid or/and gid for file %s.", mp->rm_path);
+
+	if (!(mp->rm_flags & RM_SYMLINK) &&
+	    fchmodat(dfd, base, mp->rm_mode, 0))
+		ndmpd_log(LOG_ERR,
+		    "Could not set correct file permission for file %s.",
+		    mp->rm_path);
+
+	ts[0].tv_sec = mp->rm_atime;
+	ts[0].tv_nsec = 0;
+	ts[1].tv_sec = mp->rm_mtime;
+	ts[1].tv_nsec = 0;
+	(void) utimensat(dfd, base, ts, AT_SYMLINK_NOFOLLOW);
+
+	if (mp->rm_aclid != 0 &&
+	    set_acl_id(mp->rm_path, mp->rm_acltab, mp->rm_aclid) == 0)
+		return;
+	if (mp->rm_acl)
+		set_acl_text(mp->rm_path, mp->rm_acl);
+}
+
+/*
+ * rs_meta_apply
+ *
+ * Apply the logged attributes.  Unless all is set, the directories
+ * are kept for later.  Called with ml_mtx held or with no writer
+ * threads around.
+ */
+static void
+rs_meta_apply(rs_dircache_t *dc, bool_t all)
+{
+	rs_metalog_t *ml = dc->dc_meta;
+	rs_meta_t *mp;
+	char *path, *dir;
+	int i, n, dirlen;
+	int dfd, slot;
+
+	/* the directories kept before wait for the last call */
+	i = all ? 0 : ml->ml_kept;
+	if (ml->ml_count == i)
+		return;
+
+	ndmpd_log(LOG_DEBUG, "applying %d deferred attributes",
+	    ml->ml_count - i);
+
+	qsort(ml->ml_ents + i, ml->ml_count - i, sizeof (rs_meta_t),
+	    rs_meta_cmp);
+
+	dfd = -1;
+	slot = -1;
+	dir = NULL;
+	dirlen = 0;
+	for (n = i; i < ml->ml_count; i++) {
+		mp = &ml->ml_ents[i];
+		if (!all && (mp->rm_flags & RM_DIR)) {
+			path = rs_meta_path(&ml->ml_dchunks, mp->rm_path,
+			    strlen(mp->rm_path));
+			if (path != NULL) {
+				mp->rm_path = path;
+				ml->ml_ents[n++] = *mp;
+				continue;
+			}
+			/* no room to keep it, set it now */
+		}
+
+		/*
+		 * The directory goes by its path, the slots of the entries
+		 * set are reused by the ones kept.
+		 */
+		if (dir == NULL || dirlen != mp->rm_base ||
+		    memcmp(dir, mp->rm_path, dirlen) != 0) {
+			rs_dir_close(dc, dfd, slot);
+			if (mp->rm_base == 0) {
+				dfd = AT_FDCWD;
+				slot = -1;
+			} else {
+				dfd = rs_dir_get(dc, mp->rm_path,
+				    (mp->rm_base == 1) ? 1 : mp->rm_base - 1,
+				    &slot);
+			}
+			dir = mp->rm_path;
+			dirlen = mp->rm_base;
+		}
+
+		if (dfd != -1)
+			rs_meta_set(dfd, mp);
+		free(mp->rm_acl);
+		mp->rm_acl = NULL;
+	}
+	rs_dir_close(dc, dfd, slot);
+	ml->ml_count = ml->ml_kept = n;
+
+	/* the paths of the entries set go, and the directories at the end */
+	rs_meta_chunks_free(&ml->ml_chunks);
+	if (all)
+		rs_meta_chunks_free(&ml->ml_dchunks);
+}
+
+/*
+ * rs_set_acl
+ *
+ * set_acl for the restored entries: the attributes are logged if they
+ * are deferred.  Like set_acl, the ACLs are used up.
+ */
+static void
+rs_set_acl(rs_dircache_t *dc, char *name, tlm_acls_t *acls, int flags)
+{
+	rs_metalog_t *ml;
+	rs_meta_t *mp, *ents;
+	char *cp;
+	int len;
+
+	if (dc == NULL || (ml = dc->dc_meta) == NULL || name == NULL) {
+		set_acl(name, acls);
+		return;
+	}
+
+	len = strlen(name);
+	while (len > 1 && name[len - 1] == '/')
+		len--;
+
+	(void) pthread_mutex_lock(&ml->ml_mtx);
+	if (ml->ml_count == ml->ml_size) {
+		ents = realloc(ml->ml_ents, sizeof (rs_meta_t) *
+		    (ml->ml_size ? ml->ml_size * 2 : 1024));
+		if (ents == NULL) {
+			(void) pthread_mutex_unlock(&ml->ml_mtx);
+			set_acl(name, acls);
+			return;
+		}
+		ml->ml_ents = ents;
+		ml->ml_size = ml->ml_size ? ml->ml_size * 2 : 1024;
+	}
+
+	mp = &ml->ml_ents[ml->ml_count];
+	if ((mp->rm_path = rs_meta_path(&ml->ml_chunks, name, len)) == NULL) {
+		(void) pthread_mutex_unlock(&ml->ml_mtx);
+		set_acl(name, acls);
+		return;
+	}
+	ml->ml_count++;
+
+	cp = strrchr(mp->rm_path, '/');
+	mp->rm_base = cp ? cp - mp->rm_path + 1 : 0;
+	mp->rm_flags = flags;
+	mp->rm_mode = acls->acl_attr.st_mode;
+	mp->rm_mtime = acls->acl_attr.st_mtime;
+	mp->rm_atime = acls->acl_attr.st_atime;
+	rs_owner(acls, &mp->rm_uid, &mp->rm_gid);
+	mp->rm_acl = NULL;
+	mp->rm_acltab = acls->acl_tab;
+	mp->rm_aclid = acls->acl_non_trivial ? acls->acl_id : 0;
+	if (acls->acl_non_trivial)
+		mp->rm_acl = acls->acl_info.attr_info;
+	else
+		free(acls->acl_info.attr_info);
+	(void) memset(acls, 0, sizeof (tlm_acls_t));
+
+	if (ml->ml_count - ml->ml_kept >= RS_META_MAX)
+		rs_meta_apply(dc, FALSE);
+	(void) pthread_mutex_unlock(&ml->ml_mtx);
+}
+
+
+/*
+ * Apply the overwrite policy to an existing file.
+ */
+static bool_t
+rs_overwrite_ok(int dfd, char *name, tlm_acls_t *acls)
+{
+	struct stat attr;
+
+	if (fstatat(dfd, name, &attr, 0) < 0) {
+		ndmpd_log(LOG_DEBUG, "erc_stat < 0");
+		/* new file */
+		return (TRUE);
+	}
+
+	if (acls->acl_overwrite) {
+		ndmpd_log(LOG_DEBUG, "acls->acl_overwrite");
+		/* take this file no matter what */
+		return (TRUE);
+	}
+
+	if (acls->acl_update) {
+		if (attr.st_mtime < acls->acl_attr.st_mtime) {
+			ndmpd_log(LOG_DEBUG, "acls->acl_update attr.st_mtime < acls->acl_attr.st_mtime ");
+			/* tape is newer */
+			return (TRUE);
+		}
+		ndmpd_log(LOG_DEBUG, "acls->acl_update else");
+		/* disk file is newer */
+		return (FALSE);
+	}
+
+	ndmpd_log(LOG_DEBUG, "erc_stat < 0 else");
+	/*
+	 * no overwrite, no update,
+	 * do not ever replace old files.
+	 */
+	return (TRUE);
+}
+
+/*
+ * Write it all.  If the file system does not take O_DIRECT for an
+ * unaligned piece, the rest is written through the buffer cache.
+ */
+static int
+rs_write_full(int fd, char *buf, long len)
+{
+	long n;
+
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) < 0 && errno == EINVAL &&
+		    (fcntl(fd, F_GETFL) & O_DIRECT)) {
+			(void) fcntl(fd, F_SETFL,
+			    fcntl(fd, F_GETFL) & ~O_DIRECT);
+			continue;
+		}
+		if (n <= 0)
+			return (-1);
+		buf += n;
+		len -= n;
+	}
+
+	return (0);
+}
+
+/*
+ * Write a piece of the file, through the staging buffer if there is
+ * one.
+ */
+static int
+rs_write_data(int fd, char *rec, long len, char *stage, long *staged)
+{
+	long n;
+
+	if (stage == NULL)
+		return (rs_write_full(fd, rec, len));
+
+	while (len > 0) {
+		n = min(len, RS_STAGE_SIZE - *staged);
+		(void) memcpy(stage + *staged, rec, n);
+		*staged += n;
+		rec += n;
+		len -= n;
+		if (*staged == RS_STAGE_SIZE) {
+			*staged = 0;
+			if (rs_write_full(fd, stage, RS_STAGE_SIZE) < 0)
+				return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Reserve the blocks of the file up front so that it is laid out in
+ * one piece.  Not all file systems can, ZFS for one.
+ */
+static void
+rs_prealloc(int fd, longlong_t size, char *name)
+{
+	int err;
+
+	if ((err = posix_fallocate(fd, 0, size)) != 0)
+		ndmpd_log(LOG_DEBUG, "no preallocation of %s: %d", name,
+		    err);
+}
+
+/*
+ * Drop what was preallocated past the data written so far.
+ */
+static void
+rs_unalloc(int fd)
+{
+	if (fd > 0)
+		(void) ftruncate(fd, lseek(fd, 0, SEEK_CUR));
+}
+
+/*
+ * Read the rest of the file body, and its padding, from the data
+ * connection into the stage and write it out.  The reader thread is
+ * paused and the ring is used up, so this is the next data in the
+ * stream.  A read error stops the restore.  Returns the bytes of the
+ * body not read.
+ */
+static long
+rs_read_direct(int fd, long size, char *stage, bool_t *want,
+    tlm_cmd_t *local_commands, tlm_job_stats_t *job_stats)
+{
+	long len, n;
+
+	while (size > 0) {
+		job_stats->js_bytes_in_file = size;
+
+		len = llmin(size + RECORDSIZE - 1, RS_STAGE_SIZE);
+		len &= ~(RECORDSIZE - 1);
+		if ((*local_commands->tc_read_func)(
+		    local_commands->tc_read_cookie, stage, len) != 0) {
+			ndmpd_log(LOG_ERR, "Could not read %s from the data "
+			    "connection.", local_commands->tc_file_name);
+			job_stats->js_errors++;
+			local_commands->tc_reader = TLM_STOP;
+			local_commands->tc_writer = TLM_STOP;
+			break;
+		}
+
+		n = llmin(size, len);
+		if (*want && rs_write_full(fd, stage, n) < 0) {
+			ndmpd_log(LOG_ERR, "Could not write %s: %m.",
+			    local_commands->tc_file_name);
+			job_stats->js_errors++;
+			*want = FALSE;
+		}
+		size -= n;
+	}
+
+	return (size);
+}
+
+/*
+ * read the file off the tape back onto disk
+ */
+static long
+restore_file(rs_dircache_t *dc,
+    int *fp,
+    char *real_name,
+    long size,
+    longlong_t huge_size,
+    tlm_acls_t *acls,
+    bool_t want_this_file,
+    tlm_cmd_t *local_commands,
+    tlm_job_stats_t *job_stats)
+{
+
+	ndmpd_log(LOG_DEBUG, "restore_file");
+	char	*base;
+	int	dfd, slot;
+	int	oflags;
+	longlong_t total;
+	char	*stage = NULL;	/* see RS_STAGE_MIN */
+	long	staged = 0;
+
+	if (!real_name) {
+		if (want_this_file) {
+			ndmpd_log(LOG_DEBUG, "No file name but wanted!");
+			want_this_file = FALSE;
+		}
+	} else
+		ndmpd_log(LOG_DEBUG, "new file[%s]", real_name);
+
+	/*
+	 * OK, some FM is creeping in here ...
+	 * int *fp is used to keep the
+	 * backup file channel open through
+	 * the interruption of EOT and
+	 * processing the headers of the
+	 * next tape.  So, if *fp is zero
+	 * then no file is open yet and all
+	 * is normal.  If *fp has a number
+	 * then we are returning after an
+	 * EOT break.
+	 *
+	 * *fp is now also open for HUGE files
+	 * that are put back in sections.
+	 */
+
+	if (*fp == 0 && want_this_file) {
+		dfd = rs_dir_open(dc, real_name, &base, &slot);
+		if (dfd == -1) {
+			job_stats->js_errors++;
+			want_this_file = FALSE;
+		} else {
+			want_this_file = rs_overwrite_ok(dfd, base, acls);
+		}
+		ndmpd_log(LOG_DEBUG, "want_this_file:%s yes/no:%d",real_name,want_this_file);
+		/* a HUGE file is given in pieces, size is just this one */
+		total = max(size, huge_size);
+		oflags = O_CREAT | O_WRONLY | O_TRUNC;
+		if (total >= RS_DIRECT_MIN && direct_io_enabled())
+			oflags |= O_DIRECT;
+		if (want_this_file) {
+			ndmpd_log(LOG_DEBUG, "creating:%s",real_name);
+
+			*fp = openat(dfd, base, oflags, S_IRUSR | S_IWUSR);
+			if (*fp == -1) {
+				ndmpd_log(LOG_ERR,
+				    "Could not open %s for restore.",
+				    real_name);
+				ndmpd_log(LOG_DEBUG,
+				    "fp=%d err=%d ", *fp, errno);
+				job_stats->js_errors++;
+				want_this_file = FALSE;
+				/*
+				 * we cannot return here,
+				 * the file is still on
+				 * the tape and must be
+				 * skipped over.
+				 */
+			} else if (total >= RS_STAGE_MIN) {
+				rs_prealloc(*fp, total, real_name);
+			}
+		}
+		if (dfd != -1)
+			rs_dir_close(dc, dfd, slot);
+		(void) strlcpy(local_commands->tc_file_name, real_name,
+		    TLM_MAX_PATH_NAME);
+	}
+
+	/*
+	 * this is the size left in the next segment
+	 */
+	huge_size -= size;
+
+	/*
+	 * work
+	 */
+	int	actual_size;
+	int	error;
+	char	*rec;
+	int	write_size;
+	tlm_buffers_t *bufs;
+	bool_t	direct;
+
+	if (want_this_file && *fp > 0 && size >= RS_STAGE_MIN &&
+	    posix_memalign((void **)&stage, RS_STAGE_ALIGN,
+	    RS_STAGE_SIZE) != 0)
+		stage = NULL;
+
+	bufs = local_commands->tc_buffers;
+	direct = (stage != NULL && size > RS_DIRECT_READ &&
+	    local_commands->tc_read_func != NULL);
+	if (direct)
+		tlm_buffer_pause(bufs);
+
+	while (size > 0 && rs_has_input(local_commands)) {
+		/*
+		 * Use bytes_in_file field to tell reader the amount
+		 * of data still need to be read for this file.
+		 */
+		job_stats->js_bytes_in_file = size;
+
+		if (direct && tlm_buffer_paused(bufs) &&
+		    tlm_buffer_drained(bufs)) {
+			if (staged > 0) {
+				if (want_this_file &&
+				    rs_write_full(*fp, stage, staged) < 0) {
+					ndmpd_log(LOG_ERR,
+					    "Could not write %s: %m.",
+					    local_commands->tc_file_name);
+					job_stats->js_errors++;
+					want_this_file = FALSE;
+				}
+				staged = 0;
+			}
+			size = rs_read_direct(*fp, size, stage,
+			    &want_this_file, local_commands, job_stats);
+			break;
+		}
+
+		error = 0;
+		rec = get_read_buffer(size, &error, &actual_size,
+		    local_commands);
+		if (actual_size <= 0 && direct && tlm_buffer_paused(bufs))
+			continue;
+		if (actual_size <= 0) {
+			ndmpd_log(LOG_DEBUG,
+			    "RESTORE WRITER> error %d, actual_size %d",
+			    error, actual_size);
+
+			/* no more data for this file for now */
+			job_stats->js_bytes_in_file = 0;
+
+			if (direct)
+				tlm_buffer_resume(bufs);
+			if (stage) {
+				if (want_this_file && staged > 0)
+					(void) rs_write_full(*fp, stage,
+					    staged);
+				free(stage);
+			}
+			/* the rest may never come */
+			rs_unalloc(*fp);
+			return (size);
+		} else if (error) {
+			ndmpd_log(LOG_DEBUG, "Error %d in file [%s]",
+			    error, local_commands->tc_file_name);
+			break;
+		} else {
+			write_size = min(size, actual_size);
+			if (want_this_file && rs_write_data(*fp, rec,
+			    write_size, stage, &staged) < 0) {
+				ndmpd_log(LOG_ERR, "Could not write %s: %m.",
+				    local_commands->tc_file_name);
+				job_stats->js_errors++;
+				want_this_file = FALSE;
+			}
+
+			size -= write_size;
+		}
+	}
+
+	/* no more data for this file for now */
+	job_stats->js_bytes_in_file = 0;
+
+	if (direct)
+		tlm_buffer_resume(bufs);
+	if (stage) {
+		if (want_this_file && staged > 0 &&
+		    rs_write_full(*fp, stage, staged) < 0) {
+			ndmpd_log(LOG_ERR, "Could not write %s: %m.",
+			    local_commands->tc_file_name);
+			job_stats->js_errors++;
+		}
+		free(stage);
+	}
+
+
+	/*
+	 * teardown
+	 */
+	if (*fp != 0 && huge_size <= 0) {
+		rs_unalloc(*fp);
+		(void) close(*fp);
+		*fp = 0;
+		rs_set_acl(dc, real_name, acls, 0);
+	}
+	return (0);
+}
+
+
+
+/*
+ * rs_job_open
+ *
+ * Create the file of a job and write the data it holds.
+ *
+ * Returns:
+ *   the descriptor of the file
+ *   0: the file is not to be overwritten
+ *  -1: error
+ */
+static int
+rs_job_open(rs_dircache_t *dc, rs_job_t *jp)
+{
+	int fd, dfd, slot;
+	long n, left;
+	char *p, *base;
+
+	if ((dfd = rs_dir_open(dc, jp->rj_name, &base, &slot)) == -1)
+		return (-1);
+
+	if (!rs_overwrite_ok(dfd, base, &jp->rj_acls)) {
+		rs_dir_close(dc, dfd, slot);
+		return (0);
+	}
+
+	fd = openat(dfd, base, O_CREAT | O_WRONLY | O_TRUNC,
+	    S_IRUSR | S_IWUSR);
+	rs_dir_close(dc, dfd, slot);
+	if (fd == -1) {
+		ndmpd_log(LOG_ERR, "Could not open %s for restore.",
+		    jp->rj_name);
+		return (-1);
+	}
+
+	for (p = jp->rj_data, left = jp->rj_size; left > 0;
+	    p += n, left -= n) {
+		if ((n = write(fd, p, left)) <= 0) {
+			ndmpd_log(LOG_ERR, "Could not write %s: %m.",
+			    jp->rj_name);
+			(void) close(fd);
+			return (-1);
+		}
+	}
+
+	return (fd);
+}
+
+/*
+ * rs_write_job
+ *
+ * Write a file handed over by tar_getdir and set its attributes.
+ * Returns the number of errors.
+ */
+static int
+rs_write_job(rs_dircache_t *dc, rs_job_t *jp)
+{
+	int fd;
+
+	if ((fd = rs_job_open(dc, jp)) <= 0) {
+		free(jp->rj_acls.acl_info.attr_info);
+		return (fd == -1 ? 1 : 0);
+	}
+
+	(void) close(fd);
+	rs_set_acl(dc, jp->rj_name, &jp->rj_acls, 0);
+
+	return (0);
+}
+
+/*
+ * rs_worker
+ *
+ * Writer thread of the restore pool.
+ */
+static void *
+rs_worker(void *arg)
+{
+	rs_pool_t *pool = arg;
+	rs_job_t *jp;
+	int err;
+
+	(void) pthread_mutex_lock(&pool->rp_mtx);
+	for (;;) {
+		while (pool->rp_head == NULL && !pool->rp_stop)
+			(void) pthread_cond_wait(&pool->rp_work_cv,
+			    &pool->rp_mtx);
+		if ((jp = pool->rp_head) == NULL)
+			break;
+		if ((pool->rp_head = jp->rj_next) == NULL)
+			pool->rp_tail = NULL;
+		(void) pthread_mutex_unlock(&pool->rp_mtx);
+
+		err = rs_write_job(pool->rp_dc, jp);
+
+		(void) pthread_mutex_lock(&pool->rp_mtx);
+		pool->rp_errors += err;
+		pool->rp_bytes -= jp->rj_size;
+		pool->rp_njobs--;
+		(void) pthread_cond_broadcast(&pool->rp_done_cv);
+		free(jp);
+	}
+	(void) pthread_mutex_unlock(&pool->rp_mtx);
+
+	return (NULL);
+}
+
+/*
+ * rs_pool_new
+ *
+ * Start the writer threads.  NULL is returned if there is no point
+ * in having them or they cannot be started, the files are then
+ * written by tar_getdir.
+ */
+static rs_pool_t *
+rs_pool_new(int nthreads, rs_dircache_t *dc)
+{
+	rs_pool_t *pool;
+
+	if (nthreads <= 1)
+		return (NULL);
+
+	pool = ndmp_malloc(sizeof (rs_pool_t));
+	if (pool == NULL)
+		return (NULL);
+
+	pool->rp_threads = ndmp_malloc(sizeof (pthread_t) * nthreads);
+	pool->rp_dirs = ndmp_malloc(sizeof (stack_ent_t *) * RS_POOL_DIRS);
+	if (pool->rp_threads == NULL || pool->rp_dirs == NULL) {
+		free(pool->rp_threads);
+		free(pool->rp_dirs);
+		free(pool);
+		return (NULL);
+	}
+
+	pool->rp_dc = dc;
+	(void) pthread_mutex_init(&pool->rp_mtx, NULL);
+	(void) pthread_cond_init(&pool->rp_work_cv, NULL);
+	(void) pthread_cond_init(&pool->rp_done_cv, NULL);
+
+	for (pool->rp_nthreads = 0; pool->rp_nthreads < nthreads;
+	    pool->rp_nthreads++) {
+		if (pthread_create(&pool->rp_threads[pool->rp_nthreads], NULL,
+		    rs_worker, pool) != 0) {
+			ndmpd_log(LOG_DEBUG, "Launch rs_worker: %m");
+			break;
+		}
+	}
+
+	if (pool->rp_nthreads == 0) {
+		rs_pool_destroy(pool, TRUE, NULL);
+		return (NULL);
+	}
+
+	ndmpd_log(LOG_DEBUG, "%d restore writer threads", pool->rp_nthreads);
+
+	return (pool);
+}
+
+/*
+ * rs_pool_wait
+ *
+ * Wait for the queued files to be written, then set the attributes
+ * of the directories left behind so far.
+ */
+static void
+rs_pool_wait(rs_pool_t *pool)
+{
+	stack_ent_t *sp;
+	int i;
+
+	(void) pthread_mutex_lock(&pool->rp_mtx);
+	while (pool->rp_njobs > 0)
+		(void) pthread_cond_wait(&pool->rp_done_cv, &pool->rp_mtx);
+	(void) pthread_mutex_unlock(&pool->rp_mtx);
+
+	for (i = 0; i < pool->rp_ndirs; i++) {
+		sp = pool->rp_dirs[i];
+		rs_set_acl(pool->rp_dc, sp->se_name, &sp->se_acls, RM_DIR);
+		free(sp->se_name);
+		free(sp);
+	}
+	pool->rp_ndirs = 0;
+}
+
+/*
+ * rs_pool_destroy
+ *
+ * Stop the writer threads.  The files still queued are dropped if
+ * discard is set, written otherwise.
+ */
+static void
+rs_pool_destroy(rs_pool_t *pool, bool_t discard, tlm_job_stats_t *job_stats)
+{
+	rs_job_t *jp;
+	int i;
+
+	(void) pthread_mutex_lock(&pool->rp_mtx);
+	while (discard && (jp = pool->rp_head) != NULL) {
+		pool->rp_head = jp->rj_next;
+		pool->rp_bytes -= jp->rj_size;
+		pool->rp_njobs--;
+		free(jp->rj_acls.acl_info.attr_info);
+		free(jp);
+	}
+	pool->rp_tail = pool->rp_head;
+	(void) pthread_mutex_unlock(&pool->rp_mtx);
+
+	rs_pool_wait(pool);
+
+	(void) pthread_mutex_lock(&pool->rp_mtx);
+	pool->rp_stop = TRUE;
+	(void) pthread_cond_broadcast(&pool->rp_work_cv);
+	(void) pthread_mutex_unlock(&pool->rp_mtx);
+
+	for (i = 0; i < pool->rp_nthreads; i++)
+		(void) pthread_join(pool->rp_threads[i], NULL);
+
+	if (job_stats)
+		job_stats->js_errors += pool->rp_errors;
+
+	(void) pthread_cond_destroy(&pool->rp_work_cv);
+	(void) pthread_cond_destroy(&pool->rp_done_cv);
+	(void) pthread_mutex_destroy(&pool->rp_mtx);
+	free(pool->rp_threads);
+	free(pool->rp_dirs);
+	free(pool);
+}
+
+/*
+ * rs_pool_file
+ *
+ * Read a file off the tape and queue it for the writer threads.
+ * The ACLs go with the file, as restore_file would use them up.
+ *
+ * If the file goes on in the next volume, what was read is written
+ * here instead, and the file is handed back open in *fp so that
+ * restore_file adds the rest to it.
+ */
+static long
+rs_pool_file(rs_pool_t *pool,
+    int *fp,
+    char *real_name,
+    long size,
+    tlm_acls_t *acls,
+    tlm_cmd_t *local_commands,
+    tlm_job_stats_t *job_stats)
+{
+	rs_job_t *jp;
+	int len;
+	int error;
+	int actual_size;
+	long left, n, rv;
+	char *rec, *p;
+
+	ndmpd_log(LOG_DEBUG, "queue file[%s]", real_name);
+
+	/* keep the data held by the queue within bounds */
+	(void) pthread_mutex_lock(&pool->rp_mtx);
+	while (pool->rp_njobs > 0 && pool->rp_bytes + size > RS_POOL_BYTES)
+		(void) pthread_cond_wait(&pool->rp_done_cv, &pool->rp_mtx);
+	(void) pthread_mutex_unlock(&pool->rp_mtx);
+
+	len = strlen(real_name) + 1;
+	jp = ndmp_malloc(sizeof (rs_job_t) + len + size);
+	if (jp == NULL) {
+		/* write it here then */
+		return (restore_file(pool->rp_dc, fp, real_name, size, 0,
+		    acls, TRUE, local_commands, job_stats));
+	}
+
+	jp->rj_next = NULL;
+	jp->rj_name = (char *)(jp + 1);
+	jp->rj_data = jp->rj_name + len;
+	(void) strlcpy(jp->rj_name, real_name, len);
+	(void) memcpy(&jp->rj_acls, acls, sizeof (*acls));
+	(void) memset(acls, 0, sizeof (*acls));
+	(void) strlcpy(local_commands->tc_file_name, real_name,
+	    TLM_MAX_PATH_NAME);
+
+	rv = 0;
+	p = jp->rj_data;
+	left = size;
+	while (left > 0 && rs_has_input(local_commands)) {
+		/*
+		 * Use bytes_in_file field to tell reader the amount
+		 * of data still need to be read for this file.
+		 */
+		job_stats->js_bytes_in_file = left;
+
+		error = 0;
+		rec = get_read_buffer(left, &error, &actual_size,
+		    local_commands);
+		if (actual_size <= 0 || rec == NULL) {
+			ndmpd_log(LOG_DEBUG,
+			    "RESTORE WRITER> error %d, actual_size %d",
+			    error, actual_size);
+			rv = left;
+			break;
+		} else if (error) {
+			ndmpd_log(LOG_DEBUG, "Error %d in file [%s]",
+			    error, real_name);
+			break;
+		}
+
+		n = min(left, actual_size);
+		(void) memcpy(p, rec, n);
+		p += n;
+		left -= n;
+	}
+
+	/* no more data for this file for now */
+	job_stats->js_bytes_in_file = 0;
+
+	jp->rj_size = size - left;
+
+	if (rv > 0) {
+		(void) memcpy(acls, &jp->rj_acls, sizeof (*acls));
+		if ((*fp = rs_job_open(pool->rp_dc, jp)) == -1)
+			job_stats->js_errors++;
+		free(jp);
+		return (rv);
+	}
+
+	(void) pthread_mutex_lock(&pool->rp_mtx);
+	if (pool->rp_tail)
+		pool->rp_tail->rj_next = jp;
+	else
+		pool->rp_head = jp;
+	pool->rp_tail = jp;
+	pool->rp_njobs++;
+	pool->rp_bytes += jp->rj_size;
+	(void) pthread_cond_signal(&pool->rp_work_cv);
+	(void) pthread_mutex_unlock(&pool->rp_mtx);
+
+	return (rv);
+}
+
+/*
+ * rs_dtree_pop
+ *
+ * dtree_pop for tar_getdir.  With writer threads, the attributes of
+ * the directory are set once the files queued so far are written.
+ */
+static int
+rs_dtree_pop(cstack_t *stp, rs_pool_t *pool)
+{
+	stack_ent_t *sp;
+
+	if (pool == NULL)
+		return (dtree_pop(stp));
+
+	if (cstack_pop(stp, (void **)&sp, (void *)NULL))
+		return (-1);
+
+	if (pool->rp_ndirs == RS_POOL_DIRS)
+		rs_pool_wait(pool);
+	pool->rp_dirs[pool->rp_ndirs++] = sp;
+
+	return (0);
+}
+
+
+#define	RS_HASH_INIT		2166136261U
+#define	RS_HASH_STEP(h, c) (((h) ^ (unsigned char)(c)) * 16777619U)
+#define	RS_SEL_EXACT(np) ((np)->sn_path ? (np)->sn_exact : RS_SEL_NONE)
+#define	RS_SEL_BELOW(np) ((np)->sn_path ? (np)->sn_below : RS_SEL_NONE)
+
+/*
+ * rs_sel_find
+ *
+ * Look up the node of the first len characters of str, followed by a
+ * '/' if slash is set.  Returns the empty slot it would go in if there
+ * is no such node.
+ */
+static rs_selnode_t *
+rs_sel_find(rs_sels_t *rsp, u_int h, char *str, int len, bool_t slash)
+{
+	rs_selnode_t *np;
+	int i, n;
+
+	n = slash ? len + 1 : len;
+	for (i = h & (rsp->rs_nslots - 1); ;
+	    i = (i + 1) & (rsp->rs_nslots - 1)) {
+		np = &rsp->rs_slots[i];
+		if (np->sn_path == NULL)
+			return (np);
+		if (np->sn_hash == h && np->sn_len == n &&
+		    memcmp(np->sn_path, str, len) == 0 &&
+		    (!slash || np->sn_path[len] == '/'))
+			return (np);
+	}
+}
+
+/*
+ * rs_sel_node
+ *
+ * Get the node of the first len characters of str, adding it if
+ * needed.  The table is kept at most half full.
+ */
+static rs_selnode_t *
+rs_sel_node(rs_sels_t *rsp, u_int h, char *str, int len)
+{
+	rs_selnode_t *np, *slots;
+	int i, n;
+
+	if ((rsp->rs_count + 1) * 2 > rsp->rs_nslots) {
+		n = rsp->rs_nslots * 2;
+		if ((slots = ndmp_malloc(sizeof (rs_selnode_t) * n)) == NULL)
+			return (NULL);
+		np = rsp->rs_slots;
+		rsp->rs_slots = slots;
+		rsp->rs_nslots = n;
+		for (i = 0; i < n / 2; i++) {
+			if (np[i].sn_path == NULL)
+				continue;
+			*rs_sel_find(rsp, np[i].sn_hash, np[i].sn_path,
+			    np[i].sn_len, FALSE) = np[i];
+		}
+		free(np);
+	}
+
+	np = rs_sel_find(rsp, h, str, len, FALSE);
+	if (np->sn_path == NULL) {
+		np->sn_path = str;
+		np->sn_len = len;
+		np->sn_hash = h;
+		np->sn_exact = np->sn_below = RS_SEL_NONE;
+		rsp->rs_count++;
+	}
+
+	return (np);
+}
+
+/*
+ * rs_sels_new
+ *
+ * Build the trie of the selections, and compile the exclusions.  The
+ * strings of the lists are not copied.
+ *
+ * Returns:
+ *   the trie, or NULL if the selections have wildcards, if everything
+ *   is restored or on error; is_file_wanted then goes through the lists
+ */
+static rs_sels_t *
+rs_sels_new(char **sels, char **exls, int flags)
+{
+	rs_sels_t *rsp;
+	rs_selnode_t *np;
+	char *p;
+	u_int h;
+	int i, len;
+
+	if (IS_SET(flags, RSFLG_MATCH_WCARD) || sels == NULL ||
+	    *sels == NULL || **sels == '\0')
+		return (NULL);
+
+	if ((rsp = ndmp_malloc(sizeof (rs_sels_t))) == NULL)
+		return (NULL);
+	rsp->rs_nslots = RS_SELS_SLOTS;
+	if ((rsp->rs_slots = ndmp_malloc(sizeof (rs_selnode_t) *
+	    rsp->rs_nslots)) == NULL) {
+		free(rsp);
+		return (NULL);
+	}
+
+	for (i = 0; sels[i] != NULL; i++) {
+		/* the DAR lists repeat the same blank entry */
+		if (i > 0 && sels[i] == sels[i - 1])
+			continue;
+
+		p = sels[i] + strspn(sels[i], "/");
+		h = RS_HASH_INIT;
+		for (len = 0; p[len] != '\0'; len++) {
+			h = RS_HASH_STEP(h, p[len]);
+			if (p[len] != '/')
+				continue;
+			if ((np = rs_sel_node(rsp, h, p, len + 1)) == NULL)
+				goto fail;
+			if (np->sn_below == RS_SEL_NONE)
+				np->sn_below = i;
+		}
+		if ((np = rs_sel_node(rsp, h, p, len)) == NULL)
+			goto fail;
+		if (np->sn_exact == RS_SEL_NONE)
+			np->sn_exact = i;
+	}
+
+	if (exls != NULL && *exls != NULL) {
+		if ((rsp->rs_exl = tlm_matcher_new()) == NULL)
+			goto fail;
+		for (; *exls != NULL; exls++)
+			if (tlm_matcher_add(rsp->rs_exl,
+			    *exls + strspn(*exls, "/")) != 0)
+				goto fail;
+	}
+
+	ndmpd_log(LOG_DEBUG, "rs_sels_new> %d selections, %d nodes",
+	    i, rsp->rs_count);
+	return (rsp);
+
+fail:
+	ndmpd_log(LOG_DEBUG, "rs_sels_new> out of memory");
+	rs_sels_free(rsp);
+	return (NULL);
+}
+
+static void
+rs_sels_free(rs_sels_t *rsp)
+{
+	if (rsp == NULL)
+		return;
+
+	tlm_matcher_free(rsp->rs_exl);
+	free(rsp->rs_slots);
+	free(rsp);
+}
+
+/*
+ * rs_sels_match
+ *
+ * Find the first selection that matches the name the way the checks
+ * of is_file_wanted do without wildcards: the selection is the name,
+ * with or without a trailing '/' (PM_EXACT), the name is under the
+ * selection (PM_CHILD) or the selection is under the name (PM_PARENT).
+ * If one selection is both, PM_EXACT is reported.
+ */
+static bool_t
+rs_sels_match(rs_sels_t *rsp, char *namep, int *posp, int *typep)
+{
+	rs_selnode_t *np;
+	int exact, child, parent, len;
+	u_int h;
+
+	/* a selection that the name is under, "dir" or "dir/" */
+	child = RS_SEL_NONE;
+	h = RS_HASH_INIT;
+	for (len = 0; namep[len] != '\0'; len++) {
+		if (namep[len] == '/') {
+			if (len > 0 && namep[len - 1] != '/') {
+				np = rs_sel_find(rsp, h, namep, len, FALSE);
+				child = MIN(child, RS_SEL_EXACT(np));
+			}
+			np = rs_sel_find(rsp, RS_HASH_STEP(h, '/'), namep,
+			    len + 1, FALSE);
+			child = MIN(child, RS_SEL_EXACT(np));
+		}
+		h = RS_HASH_STEP(h, namep[len]);
+	}
+
+	np = rs_sel_find(rsp, h, namep, len, FALSE);
+	exact = RS_SEL_EXACT(np);
+	if (len > 0 && namep[len - 1] == '/') {
+		parent = RS_SEL_BELOW(np);
+	} else {
+		np = rs_sel_find(rsp, RS_HASH_STEP(h, '/'), namep, len, TRUE);
+		exact = MIN(exact, RS_SEL_EXACT(np));
+		parent = RS_SEL_BELOW(np);
+	}
+
+	*typep = PM_EXACT;
+	*posp = exact;
+	if (child < *posp) {
+		*typep = PM_CHILD;
+		*posp = child;
+	}
+	if (parent < *posp) {
+		*typep = PM_PARENT;
+		*posp = parent;
+	}
+	if (*posp == RS_SEL_NONE) {
+		*typep = PM_NONE;
+		*posp = 0;
+		return (FALSE);
+	}
+
+	return (TRUE);
+}
+
+/*
+ * Match the name with the list
+ */
+static int
+exact_find(char *name, char **list)
+{
+	bool_t found;
+	int i;
+	char *cp;
+
+	found = FALSE;
+	for (i = 0; *list != NULL; list++, i++) {
+		cp = *list + strspn(*list, "/");
+		if (match(cp, name)) {
+			found = TRUE;
+			ndmpd_log(LOG_DEBUG, "exact_find> found[%s]", cp);
+			break;
+		}
+	}
+
+	return (found);
+}
+
+/*
+ * On error, return FALSE and prevent restoring(probably) unwanted data.
+ */
+static int
+is_parent(char *parent, char *child, int flags)
+{
+	char tmp[TLM_MAX_PATH_NAME];
+	bool_t rv;
+
+	if (IS_SET(flags, RSFLG_MATCH_WCARD)) {
+		if (!tlm_cat_path(tmp, parent, "*")) {
+			ndmpd_log(LOG_DEBUG,
+			    "is_parent> path too long [%s]", parent);
+			rv = FALSE;
+		} else
+			rv = (match(tmp, child) != 0) ? TRUE : FALSE;
+	} else {
+		if (!tlm_cat_path(tmp, parent, "/")) {
+			ndmpd_log(LOG_DEBUG,
+			    "is_parent> path too long [%s]", parent);
+			rv = FALSE;
+		} else
+			rv = (strncmp(tmp, child, strlen(tmp)) == 0) ?
+			    TRUE : FALSE;
+	}
+
+	return (rv);
+}
+
+/*
+ * Used to match the filename inside the list
+ */
+static bool_t
+strexactcmp(char *s, char *t)
+{
+	return ((strcmp(s, t) == 0) ? TRUE : FALSE);
 }
 
 /*
@@ -1298,6 +2797,7 @@ static bool_t
 is_file_wanted(char *name,
     char **sels,
     char **exls,
+    rs_sels_t *rsp,
     int flags,
     int *mchtype,
     int *pos)
@@ -1307,7 +2807,7 @@ is_file_wanted(char *name,
 	static char retry[TLM_MAX_PATH_NAME];
 	char *namep;
 	bool_t found;
-	int i;
+	int i, type;
 	name_match_fp_t *cmp_fp;
 
 	if (name == NULL || sels == NULL || exls == NULL)
@@ -1342,6 +2842,19 @@ is_file_wanted(char *name,
 	ndmpd_log(LOG_DEBUG, "is_file_wanted> flg: 0x%x name: [%s]",
 	    flags, name);
 
+	if (rsp != NULL) {
+		found = rs_sels_match(rsp, namep, &i, &type);
+		if (found && tlm_matcher_match(rsp->rs_exl, namep))
+			found = FALSE;
+		ndmpd_log(LOG_DEBUG, "is_file_wanted> found %d pos %d type %d",
+		    found, i, type);
+		if (found && mchtype != NULL)
+			*mchtype = type;
+		if (found && pos != NULL)
+			*pos = i;
+		return (found);
+	}
+
 	for (i = 0; *sels != NULL; sels++, i++) {
 		p_sel = *sels + strspn(*sels, "/");
 
@@ -1446,7 +2959,6 @@ input_mem(int l,
 
 			ndmpd_log(LOG_DEBUG, "error %d reading data", err);
 
-			setReadBufDone(lcmds->tc_buffers);
 			return (-1);
 		}
 		rec_size = min(actual_size, toread);
@@ -1455,8 +2967,6 @@ input_mem(int l,
 		toread -= rec_size;
 	}
 
-	setReadBufDone(lcmds->tc_buffers);
-
 	return (len - toread);
 }
 
@@ -1556,66 +3066,53 @@ get_long_name(int lib,
  * create a new directory
  */
 static	int
-create_directory(char *dir, tlm_job_stats_t *job_stats)
+create_directory(rs_dircache_t *dc, char *dir, tlm_job_stats_t *job_stats)
 {
-	struct stat attr;
-	char	*p;
-	char	temp;
-	int	erc;
+	int	fd, slot;
 
 	/*
 	 * Make sure all directories in this path exist, create them if
-	 * needed.
+	 * needed.  The directory is kept open for the files under it.
 	 */
 	ndmpd_log(LOG_DEBUG, "new dir[%s]", dir);
 
-	erc = 0;
-	p = &dir[1];
-	do {
-		temp = *p;
-		if (temp == '/' || temp == 0) {
-			*p = 0;
-			if (stat(dir, &attr) < 0) {
-				erc = mkdir(dir, 0777);
-				if (erc < 0) {
-					job_stats->js_errors++;
-					ndmpd_log(LOG_DEBUG,
-					    "Could not create directory %s",
-					    dir);
-					break;
-				}
-			}
-			*p = temp;
-		}
-		p++;
-	} while (temp != 0);
+	fd = rs_dir_get(dc, dir, strlen(dir), &slot);
+	if (fd == -1) {
+		job_stats->js_errors++;
+		ndmpd_log(LOG_DEBUG, "Could not create directory %s", dir);
+		return (-1);
+	}
+	rs_dir_close(dc, fd, slot);
 
-	return (erc);
+	return (0);
 }
 
 /*
  * create a new hardlink
  */
 static int
-create_hard_link(char *name_old, char *name_new,
+create_hard_link(rs_dircache_t *dc, char *name_old, char *name_new,
     tlm_acls_t *acls, tlm_job_stats_t *job_stats)
 {
 	int erc;
+	int dfd, slot;
+	char *base;
 
-	if (mkbasedir(name_new)) {
+	if ((dfd = rs_dir_open(dc, name_new, &base, &slot)) == -1) {
 		ndmpd_log(LOG_DEBUG, "faile to make base dir for [%s]",
 		    name_new);
 
 		return (-1);
 	}
 
-	erc = link(name_old, name_new);
+	erc = linkat(AT_FDCWD, name_old, dfd, base, 0);
+	rs_dir_close(dc, dfd, slot);
 	if (erc) {
 		job_stats->js_errors++;
 		ndmpd_log(LOG_DEBUG, "error %d (errno %d) hardlink [%s] to [%s]",
 		    erc, errno, name_new, name_old);
 	} else {
-		set_acl(name_new, acls);
+		rs_set_acl(dc, name_new, acls, 0);
 	}
 	return (erc);
 }
@@ -1625,21 +3122,24 @@ create_hard_link(char *name_old, char *name_new,
  */
 /*ARGSUSED*/
 static int
-create_sym_link(char *dst, char *target, tlm_acls_t *acls,
+create_sym_link(rs_dircache_t *dc, char *dst, char *target, tlm_acls_t *acls,
     tlm_job_stats_t *job_satats)
 {
 	int erc;
+	int dfd, slot;
+	char *base;
 
-	if (mkbasedir(dst) < 0)
+	if ((dfd = rs_dir_open(dc, dst, &base, &slot)) == -1)
 		return (-1);
 
-	erc = symlink(target, dst);
+	erc = symlinkat(target, dfd, base);
+	rs_dir_close(dc, dfd, slot);
 	if (erc) {
 		job_satats->js_errors++;
 		ndmpd_log(LOG_DEBUG, "error %d (errno %d) softlink [%s] to [%s]",
 		    erc, errno, dst, target);
 	} else {
-		set_acl(dst, acls);
+		rs_set_acl(dc, dst, acls, RM_SYMLINK);
 	}
 
 	return (erc);
@@ -1649,10 +3149,10 @@ create_sym_link(char *dst, char *target, tlm_acls_t *acls,
  * create a new FIFO
  */
 static int
-create_fifo(char *name, tlm_acls_t *acls)
+create_fifo(rs_dircache_t *dc, char *name, tlm_acls_t *acls)
 {
 	(void) mknod(name, 0777 + S_IFIFO, 0);
-	set_acl(name, acls);
+	rs_set_acl(dc, name, acls, 0);
 	return (0);
 }
 
@@ -1663,6 +3163,7 @@ static long
 load_acl_info(int lib,
     int drv,
     long file_size,
+    int aclid,
     tlm_acls_t *acls,
     long *acl_spot,
     tlm_cmd_t *local_commands)
@@ -1714,11 +3215,53 @@ load_acl_info(int lib,
 	*acl_spot += nread;
 	acls->acl_non_trivial = TRUE;
 
+	/*
+	 * A definition goes in the ACL table under the id of its header,
+	 * for the files that name it in th_aclid.  The text stays with
+	 * the next file too, in case the table cannot take it.
+	 */
+	if (file_size == nread && aclid > 0 &&
+	    acls->acl_info.attr_type == UFSD_ACL_DEF) {
+		if (local_commands->tc_acl_tab == NULL)
+			local_commands->tc_acl_tab = tlm_acl_tab_new();
+		if (tlm_acl_define(local_commands->tc_acl_tab, aclid,
+		    acls->acl_info.attr_info, acl_all_len) != 0)
+			ndmpd_log(LOG_DEBUG, "ACL %d not kept", aclid);
+	}
+
 	return (file_size - nread);
 }
 
 
 
+/*
+ * The owner of the file: the user and group names if they are known
+ * here, the ids otherwise.
+ */
+static void
+rs_owner(tlm_acls_t *acls, uid_t *uidp, gid_t *gidp)
+{
+	struct stat *st;
+	uid_t uid;
+	gid_t gid;
+
+	st = &acls->acl_attr;
+
+	*uidp = st->st_uid;
+	if (tlm_name_to_uid(acls->uname, &uid) == 0) {
+		ndmpd_log(LOG_DEBUG, "set_attr: new uid %d old %d",
+		    uid, *uidp);
+		*uidp = uid;
+	}
+
+	*gidp = st->st_gid;
+	if (tlm_name_to_gid(acls->gname, &gid) == 0) {
+		ndmpd_log(LOG_DEBUG, "set_attr: new gid %d old %d",
+		    gid, *gidp);
+		*gidp = gid;
+	}
+}
+
 /*
  * Set the standard attributes of the file
  */
@@ -1727,12 +3270,9 @@ set_attr(char *name, tlm_acls_t *acls)
 {
 	ndmpd_log(LOG_DEBUG, "set_attr");
 	struct utimbuf tbuf;
-	bool_t priv_all = FALSE;
 	struct stat *st;
 	uid_t uid;
 	gid_t gid;
-	struct passwd *pwd;
-	struct group *grp;
 
 
 	if (!name || !acls)
@@ -1744,22 +3284,7 @@ set_attr(char *name, tlm_acls_t *acls)
 	    "mode %o", name, st->st_uid, st->st_gid, acls->uname, acls->gname,
 	    st->st_mode);
 
-
-	uid = st->st_uid;
-	if ((pwd = getpwnam(acls->uname)) != NULL) {
-		ndmpd_log(LOG_DEBUG, "set_attr: new uid %d old %d",
-		    pwd->pw_uid, uid);
-		uid = pwd->pw_uid;
-	}
-
-
-
-	gid = st->st_gid;
-	if ((grp = getgrnam(acls->gname)) != NULL) {
-		ndmpd_log(LOG_DEBUG, "set_attr: new gid %d old %d",
-		    grp->gr_gid, gid);
-		gid = grp->gr_gid;
-	}
+	rs_owner(acls, &uid, &gid);
 
 	if (lchown(name, uid, gid)){
 		ndmpd_log(LOG_ERR,
@@ -1785,9 +3310,6 @@ static void
 set_acl(char *name, tlm_acls_t *acls)
 {
 	ndmpd_log(LOG_DEBUG, "set_acl");
-	int erc;
-
-	acl_t acl = NULL;
 
 	if (name)
 		ndmpd_log(LOG_DEBUG, "set_acl: %s", name);
@@ -1804,33 +3326,91 @@ set_acl(char *name, tlm_acls_t *acls)
 			return;
 		}
 
+		/* an id not defined falls back to the ACL text, if any */
+		if (acls->acl_id != 0 &&
+		    set_acl_id(name, acls->acl_tab, acls->acl_id) == 0) {
+			free(acls->acl_info.attr_info);
+			(void) memset(acls, 0, sizeof (tlm_acls_t));
+			return;
+		}
+
 		char *acl_txt = acls->acl_info.attr_info;
 		if(acl_txt==NULL)
 			return ; // ACL not support in this volume.
 
-		ndmpd_log(LOG_DEBUG, "set_acl with text:\n%s\n",acl_txt);
+		set_acl_text(name, acl_txt);
+
+		free(acls->acl_info.attr_info);
 
-		acl = acl_from_text(acl_txt);
+		(void) memset(acls, 0, sizeof (tlm_acls_t));
 
-		if (acl!=NULL) {
-			erc = acl_set_file(name, ACL_TYPE_NFS4, acl);
-			if (erc < 0) {
-				ndmpd_log(LOG_DEBUG, "RESTORE> acl_set errno %d!!!", errno);
-				// if the volume does not support ACL, this will fail.
-			}
-			acl_free(acl);
+	}
+}
+
+/*
+ * Set the NFSv4 ACL of the file from its text form
+ */
+static void
+set_acl_text(char *name, char *acl_txt)
+{
+	int erc;
+	acl_t acl;
+
+	ndmpd_log(LOG_DEBUG, "set_acl with text:\n%s\n",acl_txt);
 
+	acl = acl_from_text(acl_txt);
 
-		}else{
-			ndmpd_log(LOG_DEBUG,"RESTORE> acl_from_text error on file:%s",name);
-			fprintf(stderr, "RESTORE> acl_from_text error on file:%s",name);
+	if (acl!=NULL) {
+		erc = acl_set_file(name, ACL_TYPE_NFS4, acl);
+		if (erc < 0) {
+			ndmpd_log(LOG_DEBUG, "RESTORE> acl_set errno %d!!!", errno);
+			// if the volume does not support ACL, this will fail.
 		}
+		acl_free(acl);
 
-		free(acls->acl_info.attr_info);
 
-		(void) memset(acls, 0, sizeof (tlm_acls_t));
+	}else{
+		ndmpd_log(LOG_DEBUG,"RESTORE> acl_from_text error on file:%s",name);
+		fprintf(stderr, "RESTORE> acl_from_text error on file:%s",name);
+	}
+}
 
+/*
+ * Set the NFSv4 ACL of the file from the ACL table of the stream.
+ * Returns -1 if the id was not defined, for the caller to fall back
+ * to the ACL that came with the file, if any.
+ */
+static int
+set_acl_id(char *name, struct tlm_acl_tab *tab, int id)
+{
+	acl_t acl;
+
+	if ((acl = tlm_acl_get(tab, id)) == NULL) {
+		ndmpd_log(LOG_DEBUG, "RESTORE> no ACL %d for file:%s", id,
+		    name);
+		return (-1);
 	}
+
+	if (acl_set_file(name, ACL_TYPE_NFS4, acl) < 0)
+		ndmpd_log(LOG_DEBUG, "RESTORE> acl_set errno %d!!!", errno);
+	acl_free(acl);
+	return (0);
+}
+
+/*
+ * rs_has_input
+ *
+ * There is more input for the writer: either the reader is still
+ * running, or it has stopped but left full buffers behind.
+ */
+static bool_t
+rs_has_input(tlm_cmd_t *local_commands)
+{
+	if (local_commands->tc_writer == TLM_RESTORE_RUN)
+		return (TRUE);
+
+	return (local_commands->tc_writer == TLM_STOP &&
+	    tlm_buffer_has_data(local_commands->tc_buffers));
 }
 
 /*
@@ -1846,20 +3426,23 @@ get_read_buffer(int want,
     tlm_cmd_t *local_commands)
 {
 
-	setReadBufDone(local_commands->tc_buffers);
-
 	char	*rec;
-	while (local_commands->tc_writer == TLM_RESTORE_RUN) {
+	while (rs_has_input(local_commands)) {
 
 		rec = tlm_get_read_buffer(want, error,
 		    local_commands->tc_buffers, actual_size);
 		if (rec != 0) {
 			return (rec);
 		}
+
+		/* the reader is paused, nothing more will come for now */
+		if (tlm_buffer_paused(local_commands->tc_buffers)) {
+			*actual_size = 0;
+			return (NULL);
+		}
 	}
 
 
-	setReadBufDone(local_commands->tc_buffers);
 	/*
 	 * the job is ending, give Writer a buffer that will never be read ...
 	 * it does not matter anyhow, we are aborting.
@@ -1868,6 +3451,24 @@ get_read_buffer(int want,
 	return (NULL);
 }
 
+/*
+ * Write the large files with O_DIRECT
+ */
+static bool_t
+direct_io_enabled(void)
+{
+	return (ndmpd_get_prop_yorn(NDMP_RESTORE_DIRECT_IO) ? TRUE : FALSE);
+}
+
+/*
+ * Set the attributes once all the data is restored
+ */
+static bool_t
+defer_attrs_enabled(void)
+{
+	return (ndmpd_get_prop_yorn(NDMP_RESTORE_DEFER_ATTRS) ? TRUE : FALSE);
+}
+
 /*
  * Enable wildcard for restore options
  */
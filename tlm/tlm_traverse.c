@@ -0,0 +1,612 @@
+/*
+ * BSD 3 Clause License
+ *
+ * Copyright (c) 2007, The Storage Networking Industry Association.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *      - Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above copyright
+ *        notice, this list of conditions and the following disclaimer in
+ *        the documentation and/or other materials provided with the
+ *        distribution.
+ *
+ *      - Neither the name of The Storage Networking Industry Association (SNIA)
+ *        nor the names of its contributors may be used to endorse or promote
+ *        products derived from this software without specific prior written
+ *        permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Parallel version of traverse_level.
+ *
+ * A pool of scanner threads reads the directories ahead of time:
+ * each directory is read once with readdir and its entries are
+ * stat'ed relative to the directory descriptor, and the result is
+ * kept as a batch hanging off the directory node.  Sub-directories
+ * found by a scanner are pushed on its own deque, from which it takes
+ * the most recent one, while idle scanners steal the oldest ones from
+ * the other deques.
+ *
+ * The calling thread is the only one which runs the callbacks.  It
+ * walks the batches in exactly the same order as traverse_level, so
+ * the tar stream and the file history do not depend on the number of
+ * scanners.  When the batch it needs has not been read yet, it reads
+ * it itself rather than waiting for a scanner.
+ *
+ * The number of entries read but not yet consumed is bounded by
+ * TW_MAX_BUFFERED, so the scanners cannot run away from the emitter
+ * on large trees.
+ */
+
+#include <tlm_util.h>
+
+#include <fcntl.h>
+#include <stdatomic.h>
+
+#include <ndmpd_func.h>
+
+#define	CALLBACK(pp, ep)	\
+	(*(ftp)->ft_callbk)((ftp)->ft_arg, pp, ep)
+
+#define	TW_MAX_BUFFERED		(256 * 1024)	/* entries read ahead */
+
+extern int FORCE_STOP_TRAVEL;
+
+/*
+ * States of a directory node.
+ */
+#define	TW_PENDING	0	/* not read yet */
+#define	TW_SCANNING	1	/* being read */
+#define	TW_DONE		2	/* batch is ready */
+
+struct tw_dir;
+
+/*
+ * What the scanner found out about an entry of td_db.
+ */
+typedef struct tw_ent {
+	bool_t	te_valid;		/* to be called back or walked */
+	struct stat te_st;		/* not set for directories */
+	struct tw_dir *te_dir;		/* sub-directory node or NULL */
+} tw_ent_t;
+
+typedef struct tw_dir {
+	char	*td_path;		/* full path of the directory */
+	atomic_int td_state;		/* TW_* above */
+	atomic_int td_ref;		/* tree and deque references */
+	atomic_int td_skip;		/* do not call back, just free */
+	bool_t	td_error;		/* could not be opened */
+	tlm_dirbuf_t td_db;		/* entries in readdir order */
+	tw_ent_t *td_ents;		/* one per entry of td_db */
+	struct tw_dir *td_next;		/* deque link */
+	struct tw_dir *td_prev;
+	struct tw_dir *td_up;		/* emitter stack link */
+} tw_dir_t;
+
+/*
+ * A work deque.  The owner pushes and pops at the tail, thieves take
+ * from the head.
+ */
+typedef struct tw_deque {
+	mutex_t	tq_mtx;
+	tw_dir_t *tq_head;
+	tw_dir_t *tq_tail;
+} tw_deque_t;
+
+typedef struct tw_walk {
+	int	tw_nscan;		/* number of scanners */
+	tw_deque_t *tw_deques;		/* tw_nscan + 1, last one for */
+					/* the emitter */
+	atomic_int tw_pending;		/* nodes sitting in the deques */
+	atomic_long tw_buffered;	/* entries read, not consumed */
+	atomic_int tw_stop;
+	mutex_t	tw_mtx;
+	cond_t	tw_work_cv;		/* scanners wait for work */
+	cond_t	tw_done_cv;		/* emitter waits for a batch */
+} tw_walk_t;
+
+typedef struct tw_scanner {
+	tw_walk_t *ts_walk;
+	int	ts_id;
+	pthread_t ts_tid;
+} tw_scanner_t;
+
+
+/*
+ * tw_dir_new
+ *
+ * Allocate a pending directory node.  It starts with two references:
+ * one for the tree and one for the deque it is about to be put on.
+ */
+static tw_dir_t *
+tw_dir_new(const char *path, size_t len)
+{
+	tw_dir_t *dp;
+
+	if ((dp = ndmp_malloc(sizeof (tw_dir_t))) == NULL)
+		return (NULL);
+	if ((dp->td_path = malloc(len + 1)) == NULL) {
+		free(dp);
+		return (NULL);
+	}
+	(void) memcpy(dp->td_path, path, len);
+	dp->td_path[len] = '\0';
+	atomic_init(&dp->td_state, TW_PENDING);
+	atomic_init(&dp->td_ref, 2);
+	return (dp);
+}
+
+/*
+ * tw_dir_rele
+ *
+ * Drop a reference to a directory node and free it with the last one.
+ */
+static void
+tw_dir_rele(tw_dir_t *dp)
+{
+	if (atomic_fetch_sub(&dp->td_ref, 1) != 1)
+		return;
+
+	tlm_free_dirbuf(&dp->td_db);
+	free(dp->td_ents);
+	free(dp->td_path);
+	free(dp);
+}
+
+/*
+ * tw_push
+ *
+ * Put a directory on the tail of a deque and wake up a scanner.
+ */
+static void
+tw_push(tw_walk_t *twp, int id, tw_dir_t *dp)
+{
+	tw_deque_t *tqp = &twp->tw_deques[id];
+
+	(void) mutex_lock(&tqp->tq_mtx);
+	dp->td_next = NULL;
+	dp->td_prev = tqp->tq_tail;
+	if (tqp->tq_tail)
+		tqp->tq_tail->td_next = dp;
+	else
+		tqp->tq_head = dp;
+	tqp->tq_tail = dp;
+	(void) mutex_unlock(&tqp->tq_mtx);
+
+	(void) atomic_fetch_add(&twp->tw_pending, 1);
+	(void) mutex_lock(&twp->tw_mtx);
+	(void) cond_signal(&twp->tw_work_cv);
+	(void) mutex_unlock(&twp->tw_mtx);
+}
+
+/*
+ * tw_take
+ *
+ * Take a directory from the tail (own deque) or the head (steal) of
+ * a deque.
+ */
+static tw_dir_t *
+tw_take(tw_walk_t *twp, int id, bool_t steal)
+{
+	tw_deque_t *tqp = &twp->tw_deques[id];
+	tw_dir_t *dp;
+
+	(void) mutex_lock(&tqp->tq_mtx);
+	if (steal) {
+		if ((dp = tqp->tq_head) != NULL) {
+			tqp->tq_head = dp->td_next;
+			if (tqp->tq_head)
+				tqp->tq_head->td_prev = NULL;
+			else
+				tqp->tq_tail = NULL;
+		}
+	} else {
+		if ((dp = tqp->tq_tail) != NULL) {
+			tqp->tq_tail = dp->td_prev;
+			if (tqp->tq_tail)
+				tqp->tq_tail->td_next = NULL;
+			else
+				tqp->tq_head = NULL;
+		}
+	}
+	(void) mutex_unlock(&tqp->tq_mtx);
+
+	if (dp != NULL)
+		(void) atomic_fetch_sub(&twp->tw_pending, 1);
+	return (dp);
+}
+
+/*
+ * tw_scan
+ *
+ * Read a directory which has been claimed by the caller and build its
+ * batch.  The sub-directories are queued on the deque 'id'.
+ */
+static void
+tw_scan(tw_walk_t *twp, tw_dir_t *dp, int id)
+{
+	DIR *dirp;
+	fst_dirent_t *entry;
+	tw_ent_t *ep;
+	char path[PATH_MAX + 1];
+	size_t dlen, nlen;
+	int dfd, i, n;
+
+	n = 0;
+	if (dp->td_skip)
+		goto out;
+
+	if ((dirp = opendir(*dp->td_path ? dp->td_path : "/")) == NULL) {
+		ndmpd_log(LOG_DEBUG, "Cannot open directory %s: %m",
+		    dp->td_path);
+		dp->td_error = TRUE;
+		goto out;
+	}
+
+	if (tlm_read_dir(dirp, &dp->td_db) != 0)
+		ndmpd_log(LOG_ERR, "Out of memory, %s is incomplete.",
+		    dp->td_path);
+	if (dp->td_db.db_nents > 0 && (dp->td_ents =
+	    ndmp_malloc(dp->td_db.db_nents * sizeof (tw_ent_t))) == NULL) {
+		ndmpd_log(LOG_ERR, "Out of memory, skipping %s.",
+		    dp->td_path);
+		(void) closedir(dirp);
+		goto out;
+	}
+	n = dp->td_db.db_nents;
+	dfd = dirfd(dirp);
+
+	dlen = strlen(dp->td_path);
+	(void) memcpy(path, dp->td_path, dlen);
+	path[dlen] = '/';
+
+	for (i = 0; i < n; i++) {
+		if (FORCE_STOP_TRAVEL || atomic_load(&twp->tw_stop))
+			break;
+
+		entry = &dp->td_db.db_ents[i];
+		ep = &dp->td_ents[i];
+
+		if (strcmp("..", entry->fd_name) == 0)
+			continue;
+
+		if (strcmp(".", entry->fd_name) == 0) {
+			if (fstat(dfd, &ep->te_st) != 0) {
+				ndmpd_log(LOG_DEBUG, "fstat(%s): %m",
+				    dp->td_path);
+				continue;
+			}
+			ep->te_valid = TRUE;
+			continue;
+		}
+
+		nlen = strlen(entry->fd_name);
+		if (dlen + 1 + nlen > PATH_MAX) {
+			ndmpd_log(LOG_DEBUG, "Path too long %s/%s.",
+			    dp->td_path, entry->fd_name);
+			continue;
+		}
+
+		if (entry->fd_type != DT_DIR &&
+		    fstatat(dfd, entry->fd_name, &ep->te_st,
+		    AT_SYMLINK_NOFOLLOW) != 0) {
+			ndmpd_log(LOG_DEBUG, "lstat(%s/%s): %m",
+			    dp->td_path, entry->fd_name);
+			continue;
+		}
+
+		if (entry->fd_type == DT_DIR || S_ISDIR(ep->te_st.st_mode)) {
+			(void) memcpy(path + dlen + 1, entry->fd_name, nlen);
+			ep->te_dir = tw_dir_new(path, dlen + 1 + nlen);
+			if (ep->te_dir == NULL) {
+				ndmpd_log(LOG_ERR,
+				    "Out of memory, skipping %s/%s.",
+				    dp->td_path, entry->fd_name);
+				continue;
+			}
+		}
+		ep->te_valid = TRUE;
+	}
+	(void) closedir(dirp);
+
+	/*
+	 * Queue the sub-directories in readdir order, so that the one
+	 * found last, which is the one the emitter needs first, is on
+	 * the tail.
+	 */
+	for (ep = dp->td_ents; ep < dp->td_ents + n; ep++)
+		if (ep->te_dir != NULL)
+			tw_push(twp, id, ep->te_dir);
+
+out:
+	if (dp->td_ents == NULL)
+		dp->td_db.db_nents = 0;
+	(void) atomic_fetch_add(&twp->tw_buffered, dp->td_db.db_nents);
+	atomic_store(&dp->td_state, TW_DONE);
+
+	(void) mutex_lock(&twp->tw_mtx);
+	(void) cond_broadcast(&twp->tw_done_cv);
+	(void) mutex_unlock(&twp->tw_mtx);
+}
+
+/*
+ * tw_claim
+ *
+ * Try to become the thread which reads the directory.
+ */
+static bool_t
+tw_claim(tw_dir_t *dp)
+{
+	int state = TW_PENDING;
+
+	return (atomic_compare_exchange_strong(&dp->td_state, &state,
+	    TW_SCANNING) ? TRUE : FALSE);
+}
+
+/*
+ * tw_scanner
+ *
+ * Scanner thread: read the directories of its own deque, newest
+ * first, and steal the oldest ones from the others when it runs dry.
+ */
+static void *
+tw_scanner(void *arg)
+{
+	tw_scanner_t *tsp = arg;
+	tw_walk_t *twp = tsp->ts_walk;
+	tw_dir_t *dp;
+	int i, n;
+
+	n = twp->tw_nscan + 1;
+	for (;;) {
+		(void) mutex_lock(&twp->tw_mtx);
+		while (!atomic_load(&twp->tw_stop) &&
+		    (atomic_load(&twp->tw_pending) == 0 ||
+		    atomic_load(&twp->tw_buffered) >= TW_MAX_BUFFERED))
+			(void) cond_wait(&twp->tw_work_cv, &twp->tw_mtx);
+		(void) mutex_unlock(&twp->tw_mtx);
+
+		if (atomic_load(&twp->tw_stop))
+			break;
+
+		dp = tw_take(twp, tsp->ts_id, FALSE);
+		for (i = 1; dp == NULL && i < n; i++)
+			dp = tw_take(twp, (tsp->ts_id + i) % n, TRUE);
+		if (dp == NULL)
+			continue;
+
+		if (tw_claim(dp))
+			tw_scan(twp, dp, tsp->ts_id);
+		tw_dir_rele(dp);
+	}
+
+	return (NULL);
+}
+
+/*
+ * tw_wait
+ *
+ * Get the batch of a directory, reading it in the calling thread if
+ * no scanner has started on it yet.
+ */
+static void
+tw_wait(tw_walk_t *twp, tw_dir_t *dp)
+{
+	if (tw_claim(dp)) {
+		tw_scan(twp, dp, twp->tw_nscan);
+		return;
+	}
+
+	(void) mutex_lock(&twp->tw_mtx);
+	while (atomic_load(&dp->td_state) != TW_DONE)
+		(void) cond_wait(&twp->tw_done_cv, &twp->tw_mtx);
+	(void) mutex_unlock(&twp->tw_mtx);
+}
+
+/*
+ * tw_consumed
+ *
+ * The emitter is done with a batch: give back its room to the
+ * scanners and drop the tree reference.
+ */
+static void
+tw_consumed(tw_walk_t *twp, tw_dir_t *dp)
+{
+	long before;
+
+	before = atomic_fetch_sub(&twp->tw_buffered, dp->td_db.db_nents);
+	if (before >= TW_MAX_BUFFERED &&
+	    before - dp->td_db.db_nents < TW_MAX_BUFFERED) {
+		(void) mutex_lock(&twp->tw_mtx);
+		(void) cond_broadcast(&twp->tw_work_cv);
+		(void) mutex_unlock(&twp->tw_mtx);
+	}
+	tw_dir_rele(dp);
+}
+
+/*
+ * traverse_level_mt
+ *
+ * Same as traverse_level, with 'nthreads' scanner threads reading the
+ * directories ahead of the callbacks.
+ */
+int
+traverse_level_mt(fs_traverse_t *ftp, bool_t stopOnError, int nthreads)
+{
+	tw_walk_t tw;
+	tw_scanner_t *scanners;
+	tw_dir_t *root, *dp, *sub, *stack;
+	tw_ent_t *ep, *end;
+	fs_fhandle_t fh;
+	struct fst_node pn, en;
+	char *path;
+	size_t dlen, nlen;
+	int itr, i, nstarted, error, rv;
+
+	if (FORCE_STOP_TRAVEL)
+		return (-1);
+
+	(void) memset(&tw, 0, sizeof (tw));
+	tw.tw_nscan = nthreads;
+	atomic_init(&tw.tw_pending, 0);
+	atomic_init(&tw.tw_buffered, 0);
+	atomic_init(&tw.tw_stop, 0);
+	(void) mutex_init(&tw.tw_mtx, 0, NULL);
+	(void) cond_init(&tw.tw_work_cv, 0, NULL);
+	(void) cond_init(&tw.tw_done_cv, 0, NULL);
+
+	/* trim the trailing '/' */
+	for (itr = strlen(ftp->ft_path) - 1; itr >= 0; itr--)
+		if (ftp->ft_path[itr] == '/')
+			ftp->ft_path[itr] = '\0';
+		else
+			break;
+
+	path = malloc(PATH_MAX + 1);
+	tw.tw_deques = ndmp_malloc((nthreads + 1) * sizeof (tw_deque_t));
+	scanners = ndmp_malloc(nthreads * sizeof (tw_scanner_t));
+	root = tw_dir_new(ftp->ft_path, strlen(ftp->ft_path));
+	if (path == NULL || tw.tw_deques == NULL || scanners == NULL ||
+	    root == NULL) {
+		ndmpd_log(LOG_ERR, "Out of memory.");
+		free(path);
+		free(tw.tw_deques);
+		free(scanners);
+		if (root != NULL) {
+			free(root->td_path);
+			free(root);
+		}
+		return (-1);
+	}
+	for (i = 0; i <= nthreads; i++)
+		(void) mutex_init(&tw.tw_deques[i].tq_mtx, 0, NULL);
+
+	/* the root is read by the emitter, it has no deque reference */
+	atomic_store(&root->td_ref, 1);
+	atomic_store(&root->td_state, TW_SCANNING);
+	tw_scan(&tw, root, nthreads);
+	if (root->td_error) {
+		tw_consumed(&tw, root);
+		rv = -1;
+		goto teardown;
+	}
+
+	for (nstarted = 0; nstarted < nthreads; nstarted++) {
+		scanners[nstarted].ts_walk = &tw;
+		scanners[nstarted].ts_id = nstarted;
+		if (pthread_create(&scanners[nstarted].ts_tid, NULL,
+		    tw_scanner, &scanners[nstarted]) != 0) {
+			ndmpd_log(LOG_DEBUG, "Cannot start scanner %d: %m",
+			    nstarted);
+			break;
+		}
+	}
+	ndmpd_log(LOG_DEBUG, "%d scanner threads for %s", nstarted,
+	    root->td_path);
+
+	/*
+	 * The sub-directories are stacked in readdir order and visited
+	 * last one first, as traverse_level does.  The ones which are not
+	 * to be walked are still visited to free them.
+	 */
+	root->td_up = NULL;
+	stack = root;
+	while ((dp = stack) != NULL) {
+		stack = dp->td_up;
+		tw_wait(&tw, dp);
+
+		if (FORCE_STOP_TRAVEL)
+			dp->td_skip = TRUE;
+
+		dlen = strlen(dp->td_path);
+		(void) memcpy(path, dp->td_path, dlen);
+		path[dlen] = '/';
+
+		pn.tn_path = dp->td_path;
+		pn.tn_fh = &fh;
+		pn.tn_ents = dp->td_db.db_ents;
+		pn.tn_nents = dp->td_db.db_nents;
+		en.tn_fh = &fh;
+		en.tn_ents = NULL;
+		en.tn_nents = 0;
+
+		error = 0;
+		end = dp->td_ents + dp->td_db.db_nents;
+		for (ep = dp->td_ents; ep < end; ep++) {
+			if (!ep->te_valid)
+				continue;
+
+			sub = ep->te_dir;
+			if (dp->td_skip || FORCE_STOP_TRAVEL ||
+			    (stopOnError && error)) {
+				if (sub != NULL)
+					sub->td_skip = TRUE;
+			} else if (sub == NULL) {
+				en.tn_path =
+				    dp->td_db.db_ents[ep - dp->td_ents].fd_name;
+				pn.tn_st = en.tn_st = &ep->te_st;
+				(void) memset(&fh, 0, sizeof (fh));
+				fh.fh_fid = ep->te_st.st_ino;
+				if (strcmp(".", en.tn_path) == 0) {
+					fh.fh_fpath = dp->td_path;
+				} else {
+					nlen = strlen(en.tn_path);
+					(void) memcpy(path + dlen + 1,
+					    en.tn_path, nlen + 1);
+					fh.fh_fpath = path;
+				}
+
+				if (CALLBACK(&pn, &en) != 0)
+					error = 1;
+			}
+
+			if (sub != NULL) {
+				sub->td_up = stack;
+				stack = sub;
+			}
+		}
+
+		tw_consumed(&tw, dp);
+	}
+	rv = 0;
+
+	atomic_store(&tw.tw_stop, 1);
+	(void) mutex_lock(&tw.tw_mtx);
+	(void) cond_broadcast(&tw.tw_work_cv);
+	(void) mutex_unlock(&tw.tw_mtx);
+	for (i = 0; i < nstarted; i++)
+		(void) pthread_join(scanners[i].ts_tid, NULL);
+
+teardown:
+	/* drop the deque references left behind */
+	for (i = 0; i <= nthreads; i++) {
+		while ((dp = tw_take(&tw, i, TRUE)) != NULL)
+			tw_dir_rele(dp);
+		(void) mutex_destroy(&tw.tw_deques[i].tq_mtx);
+	}
+
+	(void) cond_destroy(&tw.tw_work_cv);
+	(void) cond_destroy(&tw.tw_done_cv);
+	(void) mutex_destroy(&tw.tw_mtx);
+	free(tw.tw_deques);
+	free(scanners);
+	free(path);
+
+	return (rv);
+}
@@ -41,6 +41,11 @@
 
 #include <tlm_util.h>
 
+#include <fcntl.h>
+#include <pwd.h>
+#include <grp.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <ndmpd_func.h>
 
@@ -642,146 +647,1326 @@ tlm_is_too_long(int checkpointed, char *dir, char *nm)
 
 extern int FORCE_STOP_TRAVEL;
 
-int traverse_level(fs_traverse_t *ftp, bool_t stopOnError)
+/*
+ * Directories waiting to be traversed.  Their paths are stored back
+ * to back in an arena which is used as a stack: popping a directory
+ * gives its bytes back, so after the first few directories the walk
+ * does not allocate anything.
+ */
+typedef struct tl_stack {
+	char	*ts_arena;	/* NUL terminated paths */
+	size_t	ts_used;	/* bytes used in the arena */
+	size_t	ts_size;	/* size of the arena */
+	size_t	*ts_off;	/* offset of each path in the arena */
+	int	ts_top;		/* number of pending directories */
+	int	ts_max;		/* size of ts_off */
+} tl_stack_t;
+
+#define	TL_STACK_INIT_DIRS	256
+#define	TL_STACK_INIT_ARENA	(16 * 1024)
+
+/*
+ * tl_push
+ *
+ * Push the path of a directory to be traversed later.
+ */
+static int
+tl_push(tl_stack_t *sp, const char *path, size_t len)
+{
+	size_t n;
+	void *p;
+
+	if (sp->ts_top == sp->ts_max) {
+		n = sp->ts_max ? sp->ts_max * 2 : TL_STACK_INIT_DIRS;
+		if ((p = realloc(sp->ts_off, n * sizeof (size_t))) == NULL)
+			return (-1);
+		sp->ts_off = p;
+		sp->ts_max = n;
+	}
+
+	if (sp->ts_used + len + 1 > sp->ts_size) {
+		n = sp->ts_size ? sp->ts_size : TL_STACK_INIT_ARENA;
+		while (n < sp->ts_used + len + 1)
+			n *= 2;
+		if ((p = realloc(sp->ts_arena, n)) == NULL)
+			return (-1);
+		sp->ts_arena = p;
+		sp->ts_size = n;
+	}
+
+	sp->ts_off[sp->ts_top++] = sp->ts_used;
+	(void) memcpy(sp->ts_arena + sp->ts_used, path, len);
+	sp->ts_arena[sp->ts_used + len] = '\0';
+	sp->ts_used += len + 1;
+	return (0);
+}
+
+/*
+ * tl_pop
+ *
+ * Pop the most recently pushed directory into 'path', which must be
+ * able to hold PATH_MAX + 1 bytes.  Returns -1 if the stack is empty.
+ */
+static int
+tl_pop(tl_stack_t *sp, char *path)
 {
-    DIR *dp;
-    struct dirent *entry;
-    struct stat statbuf;
-	int done=0;
-	fs_traverse_t *tmpftp;
-	fs_traverse_t *tmpfs;
-	int len;
-	char* path=(char*)calloc(PATH_MAX+1, 1);
-	//char path[PATH_MAX+1];
+	size_t off;
+
+	if (sp->ts_top == 0)
+		return (-1);
+
+	off = sp->ts_off[--sp->ts_top];
+	(void) memcpy(path, sp->ts_arena + off, sp->ts_used - off);
+	sp->ts_used = off;
+	return (0);
+}
 
+/*
+ * tlm_read_dir
+ *
+ * Read all the entries of a directory, "." and ".." included, into
+ * 'db' in readdir order.  The buffer is reused from one directory to
+ * the next.  Returns -1 if it ran out of memory, in which case only
+ * the entries read so far are in 'db'.
+ */
+int
+tlm_read_dir(DIR *dirp, tlm_dirbuf_t *db)
+{
+	struct dirent *entry;
+	fst_dirent_t *ep;
+	char *name;
+	size_t len, n;
+	int i, rv;
+	void *p;
+
+	db->db_nents = 0;
+	db->db_used = 0;
+	rv = 0;
+	while ((entry = readdir(dirp)) != NULL) {
+		if (db->db_nents == db->db_max) {
+			n = db->db_max ? db->db_max * 2 : TLM_DIRBUF_INIT_ENTS;
+			if ((p = realloc(db->db_ents,
+			    n * sizeof (fst_dirent_t))) == NULL) {
+				rv = -1;
+				break;
+			}
+			db->db_ents = p;
+			db->db_max = n;
+		}
+
+		len = strlen(entry->d_name) + 1;
+		if (db->db_used + len > db->db_size) {
+			n = db->db_size ? db->db_size : TLM_DIRBUF_INIT_NAMES;
+			while (n < db->db_used + len)
+				n *= 2;
+			if ((p = realloc(db->db_names, n)) == NULL) {
+				rv = -1;
+				break;
+			}
+			db->db_names = p;
+			db->db_size = n;
+		}
+
+		ep = &db->db_ents[db->db_nents++];
+		ep->fd_ino = entry->d_fileno;
+		ep->fd_type = entry->d_type;
+		(void) memcpy(db->db_names + db->db_used, entry->d_name, len);
+		db->db_used += len;
+	}
+
+	/* the names may have moved while growing, point at them now */
+	name = db->db_names;
+	for (i = 0; i < db->db_nents; i++) {
+		db->db_ents[i].fd_name = name;
+		name += strlen(name) + 1;
+	}
+
+	return (rv);
+}
+
+/*
+ * tlm_free_dirbuf
+ *
+ * Free the memory held by a directory buffer.
+ */
+void
+tlm_free_dirbuf(tlm_dirbuf_t *db)
+{
+	free(db->db_ents);
+	free(db->db_names);
+	(void) memset(db, 0, sizeof (*db));
+}
+
+/*
+ * traverse_level
+ *
+ * Walk the hierarchy under ftp->ft_path without recursion.  For each
+ * directory, the "." entry and the non-directory entries are passed
+ * to the callback in readdir order and the sub-directories are
+ * queued.  The queued directories are then walked, the last one
+ * found first, each one completely before its next sibling.
+ *
+ * A non-zero return from the callback stops reading the current
+ * directory when stopOnError is set; the sub-directories queued so
+ * far are still walked.
+ *
+ * Each directory is read once, before its entries are called back,
+ * and the whole list is handed to the callbacks in pn.tn_ents so
+ * that the file history does not have to read it again.
+ *
+ * One buffer holds the directory path and another the entry path,
+ * so nothing is allocated per entry.  Entries are stat'ed relative
+ * to the directory descriptor, and sub-directories reported as such
+ * by d_type are not stat'ed at all: their "." entry is.
+ */
+int
+traverse_level(fs_traverse_t *ftp, bool_t stopOnError)
+{
+	DIR *dp;
+	fst_dirent_t *entry, *end;
+	struct stat statbuf;
 	fs_fhandle_t fh;
 	struct fst_node pn, en;
-	int rv;
-	int itr;
+	tl_stack_t stack;
+	tlm_dirbuf_t db;
+	char *dir, *path;
+	size_t dlen, nlen;
+	int itr, error, dfd;
+
+	if (FORCE_STOP_TRAVEL)
+		return (-1);
 
-	int error;
+	if (ftp->ft_nthreads > 1)
+		return (traverse_level_mt(ftp, stopOnError, ftp->ft_nthreads));
 
-	if(FORCE_STOP_TRAVEL){
+	if ((dp = opendir(ftp->ft_path)) == NULL) {
+		ndmpd_log(LOG_ERR, "Cannot open directory %s: %m",
+		    ftp->ft_path);
+		return (-1);
+	}
+
+	dir = malloc(PATH_MAX + 1);
+	path = malloc(PATH_MAX + 1);
+	if (dir == NULL || path == NULL) {
+		ndmpd_log(LOG_ERR, "Out of memory.");
+		(void) closedir(dp);
+		free(dir);
 		free(path);
-		return -1;
+		return (-1);
+	}
+	(void) memset(&stack, 0, sizeof (stack));
+	(void) memset(&db, 0, sizeof (db));
+
+	/* trim the trailing '/' */
+	for (itr = strlen(ftp->ft_path) - 1; itr >= 0; itr--)
+		if (ftp->ft_path[itr] == '/')
+			ftp->ft_path[itr] = '\0';
+		else
+			break;
+	(void) strlcpy(dir, ftp->ft_path, PATH_MAX + 1);
+
+	for (;;) {
+		dfd = dirfd(dp);
+		dlen = strlen(dir);
+		(void) memcpy(path, dir, dlen);
+		path[dlen] = '/';
+
+		if (tlm_read_dir(dp, &db) != 0)
+			ndmpd_log(LOG_ERR, "Out of memory, %s is incomplete.",
+			    dir);
+
+		pn.tn_path = dir;
+		pn.tn_fh = &fh;
+		pn.tn_st = &statbuf;
+		pn.tn_ents = db.db_ents;
+		pn.tn_nents = db.db_nents;
+		en.tn_fh = &fh;
+		en.tn_st = &statbuf;
+		en.tn_ents = NULL;
+		en.tn_nents = 0;
+
+		error = 0;
+		end = db.db_ents + db.db_nents;
+		for (entry = db.db_ents; entry < end; entry++) {
+			if (FORCE_STOP_TRAVEL)
+				break;
+			if (stopOnError && error)
+				break;
+
+			if (strcmp("..", entry->fd_name) == 0)
+				continue;
+
+			if (strcmp(".", entry->fd_name) == 0) {
+				if (fstat(dfd, &statbuf) != 0) {
+					ndmpd_log(LOG_DEBUG, "fstat(%s): %m",
+					    dir);
+					continue;
+				}
+				(void) memset(&fh, 0, sizeof (fh));
+				fh.fh_fid = statbuf.st_ino;
+				fh.fh_fpath = dir;
+				en.tn_path = ".";
+
+				if (CALLBACK(&pn, &en) != 0)
+					error = 1;
+				continue;
+			}
+
+			nlen = strlen(entry->fd_name);
+			if (dlen + 1 + nlen > PATH_MAX) {
+				ndmpd_log(LOG_DEBUG, "Path too long %s/%s.",
+				    dir, entry->fd_name);
+				continue;
+			}
+			(void) memcpy(path + dlen + 1, entry->fd_name,
+			    nlen + 1);
+
+			if (entry->fd_type != DT_DIR &&
+			    fstatat(dfd, entry->fd_name, &statbuf,
+			    AT_SYMLINK_NOFOLLOW) != 0) {
+				ndmpd_log(LOG_DEBUG, "lstat(%s): %m", path);
+				continue;
+			}
+
+			if (entry->fd_type == DT_DIR ||
+			    S_ISDIR(statbuf.st_mode)) {
+				if (tl_push(&stack, path, dlen + 1 + nlen)
+				    != 0) {
+					ndmpd_log(LOG_ERR,
+					    "Out of memory, skipping %s.",
+					    path);
+					error = 1;
+				}
+				continue;
+			}
+
+			/* this is a file, do the callback */
+			(void) memset(&fh, 0, sizeof (fh));
+			fh.fh_fid = statbuf.st_ino;
+			fh.fh_fpath = path;
+			en.tn_path = entry->fd_name;
+
+			if (CALLBACK(&pn, &en) != 0)
+				error = 1;
+		}
+		(void) closedir(dp);
+
+		/* go on with the directory queued last */
+		do {
+			if (FORCE_STOP_TRAVEL || tl_pop(&stack, dir) != 0)
+				goto done;
+			if ((dp = opendir(dir)) == NULL)
+				ndmpd_log(LOG_DEBUG,
+				    "Cannot open directory %s: %m", dir);
+		} while (dp == NULL);
+	}
+
+done:
+	tlm_free_dirbuf(&db);
+	free(stack.ts_arena);
+	free(stack.ts_off);
+	free(dir);
+	free(path);
+
+	return (0);
+}
+
+/*
+ * Cache of the user and group names.  The tar headers carry the names
+ * of the owner of each file and a restore maps them back to ids, and
+ * with a network name service every lookup can be a round trip.  The
+ * cache is shared by all the sessions of the process and keeps the
+ * names the name service does not know too, but not the lookups that
+ * failed.  The entries expire after tlm_id_ttl seconds, or never if it
+ * is 0.
+ */
+#define	TLM_ID_SLOTS	512	/* per table, a power of 2 */
+#define	TLM_ID_NAMSIZ	32	/* as th_uname and th_gname */
+#define	TLM_ID_BUFMAX	(1024 * 1024)	/* largest get*_r buffer */
+
+typedef struct tlm_id_ent {
+	char ie_name[TLM_ID_NAMSIZ];
+	u_int ie_id;
+	bool_t ie_valid;	/* slot in use */
+	bool_t ie_found;	/* the name service knows it */
+	time_t ie_time;
+} tlm_id_ent_t;
+
+enum {
+	TLM_ID_UID,		/* uid to user name */
+	TLM_ID_GID,		/* gid to group name */
+	TLM_ID_UNAME,		/* user name to uid */
+	TLM_ID_GNAME,		/* group name to gid */
+	TLM_ID_NTABS
+};
+
+static tlm_id_ent_t tlm_id_tab[TLM_ID_NTABS][TLM_ID_SLOTS];
+static pthread_mutex_t tlm_id_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int tlm_id_ttl = 0;
+
+/*
+ * tlm_id_cache_init
+ *
+ * Set the lifetime of the cached names and forget the cached ones.
+ */
+void
+tlm_id_cache_init(int ttl)
+{
+	(void) pthread_mutex_lock(&tlm_id_mtx);
+	tlm_id_ttl = ttl < 0 ? 0 : ttl;
+	(void) memset(tlm_id_tab, 0, sizeof (tlm_id_tab));
+	(void) pthread_mutex_unlock(&tlm_id_mtx);
+}
+
+static u_int
+tlm_id_hash(u_int id, const char *name)
+{
+	u_int h = id * 2654435761U;
+
+	if (name != NULL)
+		while (*name != '\0')
+			h = h * 31 + (unsigned char)*name++;
+
+	return (h & (TLM_ID_SLOTS - 1));
+}
+
+/*
+ * Look the entry of an id (name is NULL) or of a name up in a table.
+ * Returns the slot holding a fresh entry, or NULL.
+ */
+static tlm_id_ent_t *
+tlm_id_find(int tab, u_int id, const char *name)
+{
+	tlm_id_ent_t *ep;
+
+	ep = &tlm_id_tab[tab][tlm_id_hash(name == NULL ? id : 0, name)];
+	if (!ep->ie_valid)
+		return (NULL);
+	if (name == NULL ? ep->ie_id != id :
+	    strncmp(ep->ie_name, name, TLM_ID_NAMSIZ) != 0)
+		return (NULL);
+	if (tlm_id_ttl > 0 && time(NULL) - ep->ie_time >= tlm_id_ttl)
+		return (NULL);
+
+	return (ep);
+}
+
+static void
+tlm_id_enter(int tab, u_int id, const char *name, bool_t found)
+{
+	tlm_id_ent_t *ep;
+	bool_t byname = (tab == TLM_ID_UNAME || tab == TLM_ID_GNAME);
+
+	ep = &tlm_id_tab[tab][tlm_id_hash(byname ? 0 : id,
+	    byname ? name : NULL)];
+	(void) strlcpy(ep->ie_name, name, TLM_ID_NAMSIZ);
+	ep->ie_id = id;
+	ep->ie_found = found;
+	ep->ie_time = time(NULL);
+	ep->ie_valid = TRUE;
+}
+
+/*
+ * tlm_getpw
+ *
+ * Look a user up by uid, or by name if name is not NULL.  The buffer is
+ * grown for as long as getpw*_r finds it too small.  Returns the error
+ * of getpw*_r; *pwd is NULL if there is no such user.  *bufp is to be
+ * freed by the caller.
+ */
+static int
+tlm_getpw(uid_t uid, const char *name, struct passwd *pwbuf, char **bufp,
+    struct passwd **pwd)
+{
+	long size;
+	int rv;
+
+	if ((size = sysconf(_SC_GETPW_R_SIZE_MAX)) <= 0)
+		size = 1024;
+	for (;;) {
+		*pwd = NULL;
+		if ((*bufp = malloc(size)) == NULL)
+			return (ENOMEM);
+		rv = name != NULL ?
+		    getpwnam_r(name, pwbuf, *bufp, size, pwd) :
+		    getpwuid_r(uid, pwbuf, *bufp, size, pwd);
+		if (rv != ERANGE || size >= TLM_ID_BUFMAX)
+			return (rv);
+		free(*bufp);
+		size *= 2;
+	}
+}
+
+/*
+ * tlm_getgr
+ *
+ * tlm_getpw for groups, which can need a large buffer when they have
+ * many members.
+ */
+static int
+tlm_getgr(gid_t gid, const char *name, struct group *grbuf, char **bufp,
+    struct group **grp)
+{
+	long size;
+	int rv;
+
+	if ((size = sysconf(_SC_GETGR_R_SIZE_MAX)) <= 0)
+		size = 1024;
+	for (;;) {
+		*grp = NULL;
+		if ((*bufp = malloc(size)) == NULL)
+			return (ENOMEM);
+		rv = name != NULL ?
+		    getgrnam_r(name, grbuf, *bufp, size, grp) :
+		    getgrgid_r(gid, grbuf, *bufp, size, grp);
+		if (rv != ERANGE || size >= TLM_ID_BUFMAX)
+			return (rv);
+		free(*bufp);
+		size *= 2;
+	}
+}
+
+/*
+ * tlm_uid_to_name
+ *
+ * Copy the name of a user into buf, or an empty string if there is no
+ * such user.
+ *
+ * Returns:
+ *   0: found
+ *  -1: unknown user
+ */
+int
+tlm_uid_to_name(uid_t uid, char *buf, size_t len)
+{
+	struct passwd pwbuf, *pwd;
+	char *pbuf;
+	tlm_id_ent_t *ep;
+	bool_t found;
+	int rv;
+
+	(void) pthread_mutex_lock(&tlm_id_mtx);
+	if ((ep = tlm_id_find(TLM_ID_UID, (u_int)uid, NULL)) != NULL) {
+		(void) strlcpy(buf, ep->ie_name, len);
+		found = ep->ie_found;
+		(void) pthread_mutex_unlock(&tlm_id_mtx);
+		return (found ? 0 : -1);
+	}
+	(void) pthread_mutex_unlock(&tlm_id_mtx);
+
+	rv = tlm_getpw(uid, NULL, &pwbuf, &pbuf, &pwd);
+	found = rv == 0 && pwd != NULL;
+	(void) strlcpy(buf, found ? pwd->pw_name : "", len);
+	free(pbuf);
+
+	if (rv == 0) {
+		(void) pthread_mutex_lock(&tlm_id_mtx);
+		tlm_id_enter(TLM_ID_UID, (u_int)uid, buf, found);
+		(void) pthread_mutex_unlock(&tlm_id_mtx);
+	}
+
+	return (found ? 0 : -1);
+}
+
+/*
+ * tlm_gid_to_name
+ *
+ * Copy the name of a group into buf, or an empty string if there is
+ * no such group.
+ *
+ * Returns:
+ *   0: found
+ *  -1: unknown group
+ */
+int
+tlm_gid_to_name(gid_t gid, char *buf, size_t len)
+{
+	struct group grbuf, *grp;
+	char *gbuf;
+	tlm_id_ent_t *ep;
+	bool_t found;
+	int rv;
+
+	(void) pthread_mutex_lock(&tlm_id_mtx);
+	if ((ep = tlm_id_find(TLM_ID_GID, (u_int)gid, NULL)) != NULL) {
+		(void) strlcpy(buf, ep->ie_name, len);
+		found = ep->ie_found;
+		(void) pthread_mutex_unlock(&tlm_id_mtx);
+		return (found ? 0 : -1);
+	}
+	(void) pthread_mutex_unlock(&tlm_id_mtx);
+
+	rv = tlm_getgr(gid, NULL, &grbuf, &gbuf, &grp);
+	found = rv == 0 && grp != NULL;
+	(void) strlcpy(buf, found ? grp->gr_name : "", len);
+	free(gbuf);
+
+	if (rv == 0) {
+		(void) pthread_mutex_lock(&tlm_id_mtx);
+		tlm_id_enter(TLM_ID_GID, (u_int)gid, buf, found);
+		(void) pthread_mutex_unlock(&tlm_id_mtx);
+	}
+
+	return (found ? 0 : -1);
+}
+
+/*
+ * tlm_name_to_uid
+ *
+ * Find the uid of a user name.
+ *
+ * Returns:
+ *   0: found, *uidp is set
+ *  -1: unknown user
+ */
+int
+tlm_name_to_uid(const char *name, uid_t *uidp)
+{
+	struct passwd pwbuf, *pwd;
+	char *pbuf;
+	tlm_id_ent_t *ep;
+	bool_t found;
+	uid_t uid = 0;
+	int rv;
+
+	if (name == NULL || *name == '\0')
+		return (-1);
+
+	(void) pthread_mutex_lock(&tlm_id_mtx);
+	if ((ep = tlm_id_find(TLM_ID_UNAME, 0, name)) != NULL) {
+		found = ep->ie_found;
+		if (found)
+			*uidp = (uid_t)ep->ie_id;
+		(void) pthread_mutex_unlock(&tlm_id_mtx);
+		return (found ? 0 : -1);
+	}
+	(void) pthread_mutex_unlock(&tlm_id_mtx);
+
+	rv = tlm_getpw(0, name, &pwbuf, &pbuf, &pwd);
+	found = rv == 0 && pwd != NULL;
+	if (found)
+		*uidp = uid = pwd->pw_uid;
+	free(pbuf);
+
+	if (rv == 0) {
+		(void) pthread_mutex_lock(&tlm_id_mtx);
+		tlm_id_enter(TLM_ID_UNAME, (u_int)uid, name, found);
+		(void) pthread_mutex_unlock(&tlm_id_mtx);
+	}
+
+	return (found ? 0 : -1);
+}
+
+/*
+ * tlm_name_to_gid
+ *
+ * Find the gid of a group name.
+ *
+ * Returns:
+ *   0: found, *gidp is set
+ *  -1: unknown group
+ */
+int
+tlm_name_to_gid(const char *name, gid_t *gidp)
+{
+	struct group grbuf, *grp;
+	char *gbuf;
+	tlm_id_ent_t *ep;
+	bool_t found;
+	gid_t gid = 0;
+	int rv;
+
+	if (name == NULL || *name == '\0')
+		return (-1);
+
+	(void) pthread_mutex_lock(&tlm_id_mtx);
+	if ((ep = tlm_id_find(TLM_ID_GNAME, 0, name)) != NULL) {
+		found = ep->ie_found;
+		if (found)
+			*gidp = (gid_t)ep->ie_id;
+		(void) pthread_mutex_unlock(&tlm_id_mtx);
+		return (found ? 0 : -1);
+	}
+	(void) pthread_mutex_unlock(&tlm_id_mtx);
+
+	rv = tlm_getgr(0, name, &grbuf, &gbuf, &grp);
+	found = rv == 0 && grp != NULL;
+	if (found)
+		*gidp = gid = grp->gr_gid;
+	free(gbuf);
+
+	if (rv == 0) {
+		(void) pthread_mutex_lock(&tlm_id_mtx);
+		tlm_id_enter(TLM_ID_GNAME, (u_int)gid, name, found);
+		(void) pthread_mutex_unlock(&tlm_id_mtx);
 	}
 
-	cstack_t *stack = cstack_new();
+	return (found ? 0 : -1);
+}
 
-    if((dp = opendir(ftp->ft_path)) == NULL) {
-        fprintf(stderr,"cannot open directory: %s\n", ftp->ft_path);
-        return -1;
-    }
+/*
+ * Table of the distinct ACLs of a backup stream.  Most of the files of
+ * a share carry one of a few ACLs; with the table each ACL text goes
+ * out once, in an LF_ACL record of type UFSD_ACL_DEF, and the files
+ * name it by its id in th_aclid.  The ids are given in stream order
+ * from 1 on, and each definition carries its own id in th_aclid, so a
+ * restore that starts past some of them (DAR) still finds the others
+ * under the right id.  The restore keeps each ACL parsed.
+ */
+#define	TLM_ACL_INIT_SLOTS	64	/* a power of 2 */
+#define	TLM_ACL_MAX		65536	/* distinct ACLs kept */
+
+typedef struct tlm_acl_ent {
+	char *ae_text;
+	int ae_len;
+	u_int ae_hash;
+	acl_t ae_acl;		/* parsed on first use */
+} tlm_acl_ent_t;
+
+struct tlm_acl_tab {
+	pthread_mutex_t at_mtx;
+	tlm_acl_ent_t *at_ents;	/* by id - 1, no text if not defined */
+	int at_count;
+	int at_size;
+	int *at_slots;		/* ids, 0 if free */
+	int at_nslots;
+};
+
+struct tlm_acl_tab *
+tlm_acl_tab_new(void)
+{
+	struct tlm_acl_tab *tab;
 
-	(void) memset(&fh, 0, sizeof (fh));
+	if ((tab = ndmp_malloc(sizeof (struct tlm_acl_tab))) == NULL)
+		return (NULL);
 
-    lstat(ftp->ft_path,&statbuf);
+	tab->at_nslots = TLM_ACL_INIT_SLOTS;
+	if ((tab->at_slots = ndmp_malloc(sizeof (int) *
+	    tab->at_nslots)) == NULL) {
+		free(tab);
+		return (NULL);
+	}
+	(void) pthread_mutex_init(&tab->at_mtx, NULL);
 
+	return (tab);
+}
 
-    // trim the tailing '/'
-    len = strlen(ftp->ft_path);
-    for(itr=len-1;itr>=0;itr--)
-    	if(ftp->ft_path[itr]=='/')
-    		ftp->ft_path[itr]='\0';
-    	else
-    		break;
+void
+tlm_acl_tab_free(struct tlm_acl_tab *tab)
+{
+	int i;
 
-	en.tn_path = NULL;
-	en.tn_fh = NULL;
-	en.tn_st = NULL;
-	pn.tn_path = strdup(ftp->ft_path);
-	pn.tn_fh = &fh;
-	pn.tn_st = &statbuf;
+	if (tab == NULL)
+		return;
 
-	error = 0;
-    while((entry = readdir(dp)) != NULL) {
-    	(void)pthread_yield();
-    	if(FORCE_STOP_TRAVEL)
-    		break;
-    	if(stopOnError && error)
-    		break;
+	for (i = 0; i < tab->at_count; i++) {
+		free(tab->at_ents[i].ae_text);
+		if (tab->at_ents[i].ae_acl != NULL)
+			acl_free(tab->at_ents[i].ae_acl);
+	}
+	free(tab->at_ents);
+	free(tab->at_slots);
+	(void) pthread_mutex_destroy(&tab->at_mtx);
+	free(tab);
+}
 
-        sprintf(path, "%s/%s",ftp->ft_path,entry->d_name);
+static u_int
+tlm_acl_hash(const char *text, int len)
+{
+	u_int h = 2166136261U;
 
-        lstat(path,&statbuf);
+	while (len-- > 0)
+		h = (h ^ (unsigned char)*text++) * 16777619U;
 
-        if(strcmp("..",entry->d_name) == 0)
-        	continue;
+	return (h);
+}
 
+/*
+ * Double the hash slots; called with at_mtx held.
+ */
+static int
+tlm_acl_grow(struct tlm_acl_tab *tab)
+{
+	int *slots;
+	int i, j, nslots;
 
-        if(strcmp(".",entry->d_name) == 0){
-           	(void) memset(&fh, 0, sizeof (fh));
+	nslots = tab->at_nslots * 2;
+	if ((slots = ndmp_malloc(sizeof (int) * nslots)) == NULL)
+		return (-1);
 
-           		fh.fh_fid = statbuf.st_ino;
-           		fh.fh_fpath = strdup(ftp->ft_path);
-           		ndmpd_log(LOG_DEBUG, "doing callback in traverse_level %s with '.'",fh.fh_fpath);
+	for (i = 0; i < tab->at_count; i++) {
+		j = tab->at_ents[i].ae_hash & (nslots - 1);
+		while (slots[j] != 0)
+			j = (j + 1) & (nslots - 1);
+		slots[j] = i + 1;
+	}
 
-           		en.tn_path = strdup(".");
-				en.tn_fh = &fh;
-				en.tn_st = &statbuf;
+	free(tab->at_slots);
+	tab->at_slots = slots;
+	tab->at_nslots = nslots;
+	return (0);
+}
 
+/*
+ * tlm_acl_intern
+ *
+ * Find the id of an ACL text, adding it to the table if it is new.
+ *
+ * Parameters:
+ *   tab (input) - ACL table
+ *   text (input) - ACL text, not necessarily terminated
+ *   len (input) - length of the text
+ *   newp (output) - set if the ACL was added
+ *
+ * Returns:
+ *   id of the ACL, or 0 if the table is full
+ */
+int
+tlm_acl_intern(struct tlm_acl_tab *tab, const char *text, int len,
+    bool_t *newp)
+{
+	tlm_acl_ent_t *ep, *ents;
+	u_int h;
+	int i, id, size;
 
-				rv = CALLBACK(&pn, &en);
-				if(rv!=0)
-					error=1;
+	*newp = FALSE;
+	if (tab == NULL || text == NULL || len <= 0)
+		return (0);
 
-				free(fh.fh_fpath);
-				free(en.tn_path);
+	h = tlm_acl_hash(text, len);
 
+	(void) pthread_mutex_lock(&tab->at_mtx);
+	for (i = h & (tab->at_nslots - 1); (id = tab->at_slots[i]) != 0;
+	    i = (i + 1) & (tab->at_nslots - 1)) {
+		ep = &tab->at_ents[id - 1];
+		if (ep->ae_hash == h && ep->ae_len == len &&
+		    memcmp(ep->ae_text, text, len) == 0) {
+			(void) pthread_mutex_unlock(&tab->at_mtx);
+			return (id);
+		}
+	}
 
-        	continue;
-        }
+	if (tab->at_count >= TLM_ACL_MAX) {
+		(void) pthread_mutex_unlock(&tab->at_mtx);
+		return (0);
+	}
 
-		if(S_ISDIR(statbuf.st_mode)) {
-				tmpfs = (fs_traverse_t*)malloc(sizeof(fs_traverse_t));
+	if (tab->at_count == tab->at_size) {
+		size = tab->at_size ? tab->at_size * 2 : 64;
+		if ((ents = realloc(tab->at_ents,
+		    sizeof (tlm_acl_ent_t) * size)) == NULL) {
+			(void) pthread_mutex_unlock(&tab->at_mtx);
+			return (0);
+		}
+		tab->at_ents = ents;
+		tab->at_size = size;
+	}
 
-				tmpfs->ft_path=strdup(path);
-//				tmpfs->ft_lpath=strdup(path);
+	ep = &tab->at_ents[tab->at_count];
+	if ((ep->ae_text = malloc(len + 1)) == NULL) {
+		(void) pthread_mutex_unlock(&tab->at_mtx);
+		return (0);
+	}
+	(void) memcpy(ep->ae_text, text, len);
+	ep->ae_text[len] = '\0';
+	ep->ae_len = len;
+	ep->ae_hash = h;
+	ep->ae_acl = NULL;
+	id = ++tab->at_count;
+	tab->at_slots[i] = id;
+
+	/* keep the slots at most half full */
+	if (tab->at_count * 2 > tab->at_nslots)
+		(void) tlm_acl_grow(tab);
+	(void) pthread_mutex_unlock(&tab->at_mtx);
+
+	*newp = TRUE;
+	return (id);
+}
 
-				tmpfs->ft_flags = ftp->ft_flags;
-				tmpfs->ft_callbk = ftp->ft_callbk;
-				tmpfs->ft_arg = ftp->ft_arg;
+/*
+ * tlm_acl_define
+ *
+ * Add an ACL text under the id its definition record gave it, on
+ * restore.
+ *
+ * Returns:
+ *   0: on success
+ *  -1: bad id or out of memory
+ */
+int
+tlm_acl_define(struct tlm_acl_tab *tab, int id, const char *text, int len)
+{
+	tlm_acl_ent_t *ep, *ents;
+	int size;
 
-                cstack_push(stack,tmpfs,0);
-        }else{
+	if (tab == NULL || text == NULL || len <= 0 || id <= 0 ||
+	    id > TLM_ACL_MAX)
+		return (-1);
+
+	(void) pthread_mutex_lock(&tab->at_mtx);
+	if (id > tab->at_size) {
+		size = tab->at_size ? tab->at_size : 64;
+		while (size < id)
+			size *= 2;
+		if ((ents = realloc(tab->at_ents,
+		    sizeof (tlm_acl_ent_t) * size)) == NULL) {
+			(void) pthread_mutex_unlock(&tab->at_mtx);
+			return (-1);
+		}
+		(void) memset(ents + tab->at_size, 0,
+		    sizeof (tlm_acl_ent_t) * (size - tab->at_size));
+		tab->at_ents = ents;
+		tab->at_size = size;
+	}
+
+	ep = &tab->at_ents[id - 1];
+	free(ep->ae_text);
+	if (ep->ae_acl != NULL)
+		acl_free(ep->ae_acl);
+	ep->ae_acl = NULL;
+	if ((ep->ae_text = malloc(len + 1)) == NULL) {
+		(void) pthread_mutex_unlock(&tab->at_mtx);
+		return (-1);
+	}
+	(void) memcpy(ep->ae_text, text, len);
+	ep->ae_text[len] = '\0';
+	ep->ae_len = len;
+	if (id > tab->at_count)
+		tab->at_count = id;
+	(void) pthread_mutex_unlock(&tab->at_mtx);
+
+	return (0);
+}
+
+/*
+ * tlm_acl_get
+ *
+ * Return a copy of the parsed ACL of an id, to be freed with acl_free.
+ * The text is parsed the first time only.
+ *
+ * Returns:
+ *   the ACL, or NULL if the id is not defined or the text is not an ACL
+ */
+acl_t
+tlm_acl_get(struct tlm_acl_tab *tab, int id)
+{
+	tlm_acl_ent_t *ep;
+	acl_t acl = NULL;
+
+	if (tab == NULL)
+		return (NULL);
+
+	(void) pthread_mutex_lock(&tab->at_mtx);
+	if (id > 0 && id <= tab->at_count) {
+		ep = &tab->at_ents[id - 1];
+		if (ep->ae_acl == NULL && ep->ae_text != NULL)
+			ep->ae_acl = acl_from_text(ep->ae_text);
+		if (ep->ae_acl != NULL)
+			acl = acl_dup(ep->ae_acl);
+	}
+	(void) pthread_mutex_unlock(&tab->at_mtx);
+
+	return (acl);
+}
+
+/*
+ * A set of match() patterns compiled to be tried against a name in one
+ * pass.  The literal names, the "*literal" and the "literal*" patterns
+ * go in a hash table; the names are checked against it once for each
+ * distinct literal length.  The other patterns are run together as
+ * one NFA over the concatenated patterns, with the same rules as
+ * match(): a '*' stands for any string, but a pattern that goes on
+ * after it is only tried while some of the name is left.
+ */
+#define	TM_EXACT	0
+#define	TM_PREFIX	1	/* "literal*" */
+#define	TM_SUFFIX	2	/* "*literal" */
+#define	TM_KINDS	3
+#define	TM_INIT_SLOTS	64	/* a power of 2 */
+
+typedef struct tm_lit {
+	const char *tl_str;
+	int tl_len;
+	int tl_kind;
+	u_int tl_hash;
+} tm_lit_t;
+
+struct tlm_matcher {
+	bool_t tm_all;		/* a "*" pattern, everything matches */
+	tm_lit_t *tm_slots;
+	int tm_nslots;
+	int tm_nlits;
+	int *tm_lens[TM_KINDS];	/* distinct literal lengths */
+	int tm_nlens[TM_KINDS];
+	char *tm_pool;		/* storage of the literals */
+	size_t tm_pool_used;
+	size_t tm_pool_size;
+	char *tm_nfa;		/* NUL terminated patterns, back to back */
+	size_t tm_nfa_len;
+	int *tm_starts;
+	int tm_nstarts;
+	u_int *tm_mark;		/* by NFA position, see tm_add */
+	int *tm_cur;
+	int *tm_next;
+	u_int tm_gen;		/* never 0, see tm_step */
+	pthread_mutex_t tm_mtx;	/* the NFA state */
+};
+
+struct tlm_matcher *
+tlm_matcher_new(void)
+{
+	struct tlm_matcher *tm;
 
-        	/*	this is a file, do the callback*/
+	if ((tm = ndmp_malloc(sizeof (struct tlm_matcher))) == NULL)
+		return (NULL);
 
-        	(void) memset(&fh, 0, sizeof (fh));
+	tm->tm_nslots = TM_INIT_SLOTS;
+	if ((tm->tm_slots = ndmp_malloc(sizeof (tm_lit_t) *
+	    tm->tm_nslots)) == NULL) {
+		free(tm);
+		return (NULL);
+	}
+	(void) pthread_mutex_init(&tm->tm_mtx, NULL);
 
-        	fh.fh_fid = statbuf.st_ino;
-        	fh.fh_fpath = strdup(path);
+	return (tm);
+}
 
-			en.tn_path = strdup(entry->d_name);
-			en.tn_fh = &fh;
-			en.tn_st = &statbuf;
+void
+tlm_matcher_free(struct tlm_matcher *tm)
+{
+	int i;
 
-			ndmpd_log(LOG_DEBUG, "doing callback, parent name=%s, entry=%s",pn.tn_path, en.tn_path);
-			rv = CALLBACK(&pn, &en);
-			if(rv!=0)
-				error=1;
+	if (tm == NULL)
+		return;
 
-			free(fh.fh_fpath);
-			free(en.tn_path);
-        }
+	for (i = 0; i < TM_KINDS; i++)
+		free(tm->tm_lens[i]);
+	free(tm->tm_slots);
+	free(tm->tm_pool);
+	free(tm->tm_nfa);
+	free(tm->tm_starts);
+	free(tm->tm_mark);
+	free(tm->tm_cur);
+	free(tm->tm_next);
+	(void) pthread_mutex_destroy(&tm->tm_mtx);
+	free(tm);
+}
 
-    }
+static u_int
+tm_hash(int kind, const char *str, int len)
+{
+	u_int h = 2166136261U ^ kind;
 
-    closedir(dp);
-    free(pn.tn_path);
-    free(path);
+	while (len-- > 0)
+		h = (h ^ (unsigned char)*str++) * 16777619U;
 
-	while(cstack_pop(stack, (void **)&tmpftp, 0)>=0){
-		(void)pthread_yield();
-		traverse_level(tmpftp, stopOnError);
-		free(tmpftp->ft_path);
-//		free(tmpftp->ft_lpath);
-		free(tmpftp);
+	return (h);
+}
+
+static tm_lit_t *
+tm_lookup(struct tlm_matcher *tm, int kind, const char *str, int len)
+{
+	tm_lit_t *lp;
+	u_int h;
+	int i;
+
+	h = tm_hash(kind, str, len);
+	for (i = h & (tm->tm_nslots - 1); ;
+	    i = (i + 1) & (tm->tm_nslots - 1)) {
+		lp = &tm->tm_slots[i];
+		if (lp->tl_str == NULL ||
+		    (lp->tl_hash == h && lp->tl_kind == kind &&
+		    lp->tl_len == len && memcmp(lp->tl_str, str, len) == 0))
+			return (lp);
 	}
+}
 
+/*
+ * Add a literal to the hash table.  The literals are kept as offsets
+ * in tm_pool while the table is built, see tlm_matcher_add.
+ */
+static int
+tm_add_lit(struct tlm_matcher *tm, int kind, const char *str, int len)
+{
+	tm_lit_t *lp, *slots, *old;
+	int i, n, *lens;
+	size_t size;
+	char *pool;
+
+	/* keep the slots at most half full */
+	if ((tm->tm_nlits + 1) * 2 > tm->tm_nslots) {
+		n = tm->tm_nslots * 2;
+		if ((slots = ndmp_malloc(sizeof (tm_lit_t) * n)) == NULL)
+			return (-1);
+		old = tm->tm_slots;
+		tm->tm_slots = slots;
+		tm->tm_nslots = n;
+		for (i = 0; i < n / 2; i++) {
+			if (old[i].tl_str == NULL)
+				continue;
+			lp = tm_lookup(tm, old[i].tl_kind, old[i].tl_str,
+			    old[i].tl_len);
+			*lp = old[i];
+		}
+		free(old);
+	}
 
-	cstack_delete(stack);
+	lp = tm_lookup(tm, kind, str, len);
+	if (lp->tl_str != NULL)
+		return (0);
+
+	if (tm->tm_pool_used + len + 1 > tm->tm_pool_size) {
+		/* the pool moves, the literals point in it */
+		size = MAX(tm->tm_pool_size * 2, tm->tm_pool_used + len + 1);
+		size = MAX(size, 1024);
+		if ((pool = realloc(tm->tm_pool, size)) == NULL)
+			return (-1);
+		for (i = 0; i < tm->tm_nslots; i++)
+			if (tm->tm_slots[i].tl_str != NULL)
+				tm->tm_slots[i].tl_str = pool +
+				    (tm->tm_slots[i].tl_str - tm->tm_pool);
+		tm->tm_pool = pool;
+		tm->tm_pool_size = size;
+		lp = tm_lookup(tm, kind, str, len);
+	}
+
+	pool = tm->tm_pool + tm->tm_pool_used;
+	(void) memcpy(pool, str, len);
+	pool[len] = '\0';
+	tm->tm_pool_used += len + 1;
+
+	lp->tl_str = pool;
+	lp->tl_len = len;
+	lp->tl_kind = kind;
+	lp->tl_hash = tm_hash(kind, str, len);
+	tm->tm_nlits++;
+
+	for (i = 0; i < tm->tm_nlens[kind]; i++)
+		if (tm->tm_lens[kind][i] == len)
+			return (0);
+	if ((lens = realloc(tm->tm_lens[kind],
+	    sizeof (int) * (tm->tm_nlens[kind] + 1))) == NULL)
+		return (-1);
+	lens[tm->tm_nlens[kind]++] = len;
+	tm->tm_lens[kind] = lens;
+
+	return (0);
+}
+
+/*
+ * Add a pattern to the NFA.
+ */
+static int
+tm_add_nfa(struct tlm_matcher *tm, const char *patn)
+{
+	size_t len = strlen(patn) + 1;
+	char *nfa;
+	int *ip, *cur, *next;
+	u_int *mark;
+	size_t n;
+
+	if ((nfa = realloc(tm->tm_nfa, tm->tm_nfa_len + len)) == NULL)
+		return (-1);
+	tm->tm_nfa = nfa;
+
+	if ((ip = realloc(tm->tm_starts,
+	    sizeof (int) * (tm->tm_nstarts + 1))) == NULL)
+		return (-1);
+	tm->tm_starts = ip;
+
+	n = tm->tm_nfa_len + len;
+	mark = realloc(tm->tm_mark, sizeof (u_int) * n);
+	if (mark != NULL)
+		tm->tm_mark = mark;
+	cur = realloc(tm->tm_cur, sizeof (int) * n);
+	if (cur != NULL)
+		tm->tm_cur = cur;
+	next = realloc(tm->tm_next, sizeof (int) * n);
+	if (next != NULL)
+		tm->tm_next = next;
+	if (mark == NULL || cur == NULL || next == NULL)
+		return (-1);
+	(void) memset(tm->tm_mark + tm->tm_nfa_len, 0, sizeof (u_int) * len);
+
+	(void) memcpy(tm->tm_nfa + tm->tm_nfa_len, patn, len);
+	tm->tm_starts[tm->tm_nstarts++] = tm->tm_nfa_len;
+	tm->tm_nfa_len = n;
+
+	return (0);
+}
+
+/*
+ * tlm_matcher_add
+ *
+ * Add a match() pattern to the matcher.
+ *
+ * Returns:
+ *   0: on success
+ *  -1: out of memory, the matcher should not be used
+ */
+int
+tlm_matcher_add(struct tlm_matcher *tm, const char *patn)
+{
+	int len, i;
+	bool_t special = FALSE;
+
+	len = strlen(patn);
+	for (i = 0; i < len; i++)
+		if (patn[i] == '*' || patn[i] == '?')
+			break;
+
+	if (i == len)
+		return (tm_add_lit(tm, TM_EXACT, patn, len));
+
+	if (strcmp(patn, "*") == 0) {
+		tm->tm_all = TRUE;
+		return (0);
+	}
+
+	/* only a leading or a trailing '*' can go in the table */
+	for (i = 1; i < len - 1; i++)
+		if (patn[i] == '*' || patn[i] == '?')
+			special = TRUE;
+
+	if (!special && patn[0] == '*' && patn[len - 1] != '*' &&
+	    patn[len - 1] != '?')
+		return (tm_add_lit(tm, TM_SUFFIX, patn + 1, len - 1));
+	if (!special && patn[len - 1] == '*' && patn[0] != '*' &&
+	    patn[0] != '?')
+		return (tm_add_lit(tm, TM_PREFIX, patn, len - 1));
+
+	return (tm_add_nfa(tm, patn));
+}
+
+/*
+ * Make the NFA position p active, with left characters of the name
+ * still to come.  Returns TRUE if the name matches whatever is left.
+ */
+static bool_t
+tm_add(struct tlm_matcher *tm, int *set, int *np, int p, int left)
+{
+	while (tm->tm_mark[p] != tm->tm_gen) {
+		tm->tm_mark[p] = tm->tm_gen;
+		set[(*np)++] = p;
+		if (tm->tm_nfa[p] != '*')
+			break;
+		/* a trailing '*' matches the rest */
+		if (tm->tm_nfa[p + 1] == '\0')
+			return (TRUE);
+		/* what follows a '*' is tried only on a non-empty rest */
+		if (left == 0)
+			break;
+		p++;
+	}
+	return (FALSE);
+}
+
+/*
+ * Start a new set of active positions.  The marks left by the old sets
+ * are told apart by their generation; when it wraps they are cleared.
+ */
+static void
+tm_step(struct tlm_matcher *tm)
+{
+	if (++tm->tm_gen == 0) {
+		(void) memset(tm->tm_mark, 0, sizeof (u_int) * tm->tm_nfa_len);
+		tm->tm_gen = 1;
+	}
+}
+
+static bool_t
+tm_run_nfa(struct tlm_matcher *tm, const char *str, int len)
+{
+	int *cur, *next, *tmp;
+	int ncur, nnext, i, j, p;
+	char ch;
+
+	cur = tm->tm_cur;
+	next = tm->tm_next;
+
+	tm_step(tm);
+	ncur = 0;
+	for (i = 0; i < tm->tm_nstarts; i++)
+		if (tm_add(tm, cur, &ncur, tm->tm_starts[i], len))
+			return (TRUE);
+
+	for (i = 0; i < len && ncur > 0; i++) {
+		tm_step(tm);
+		nnext = 0;
+		for (j = 0; j < ncur; j++) {
+			p = cur[j];
+			ch = tm->tm_nfa[p];
+			if (ch == '*') {
+				if (tm_add(tm, next, &nnext, p, len - i - 1))
+					return (TRUE);
+			} else if (ch != '\0' && (ch == '?' || ch == str[i])) {
+				if (tm_add(tm, next, &nnext, p + 1,
+				    len - i - 1))
+					return (TRUE);
+			}
+		}
+		tmp = cur;
+		cur = next;
+		next = tmp;
+		ncur = nnext;
+	}
+
+	if (i < len)
+		return (FALSE);
+	for (j = 0; j < ncur; j++)
+		if (tm->tm_nfa[cur[j]] == '\0')
+			return (TRUE);
+	return (FALSE);
+}
+
+/*
+ * tlm_matcher_match
+ *
+ * Check a name against the patterns of the matcher.
+ *
+ * Returns:
+ *   TRUE: if match() would find one of the patterns matching the name
+ *   FALSE: otherwise, or if there is no matcher
+ */
+bool_t
+tlm_matcher_match(struct tlm_matcher *tm, const char *str)
+{
+	tm_lit_t *lp;
+	int len, i, l;
+	bool_t rv;
+
+	if (tm == NULL || str == NULL)
+		return (FALSE);
+	if (tm->tm_all)
+		return (TRUE);
+
+	len = strlen(str);
+	if (tm->tm_nlits > 0) {
+		lp = tm_lookup(tm, TM_EXACT, str, len);
+		if (lp->tl_str != NULL)
+			return (TRUE);
+		for (i = 0; i < tm->tm_nlens[TM_PREFIX]; i++) {
+			if ((l = tm->tm_lens[TM_PREFIX][i]) > len)
+				continue;
+			if (tm_lookup(tm, TM_PREFIX, str, l)->tl_str != NULL)
+				return (TRUE);
+		}
+		for (i = 0; i < tm->tm_nlens[TM_SUFFIX]; i++) {
+			if ((l = tm->tm_lens[TM_SUFFIX][i]) > len)
+				continue;
+			if (tm_lookup(tm, TM_SUFFIX, str + len - l,
+			    l)->tl_str != NULL)
+				return (TRUE);
+		}
+	}
+
+	if (tm->tm_nstarts == 0)
+		return (FALSE);
 
+	(void) pthread_mutex_lock(&tm->tm_mtx);
+	rv = tm_run_nfa(tm, str, len);
+	(void) pthread_mutex_unlock(&tm->tm_mtx);
 
-    return 0;
+	return (rv);
 }